@@ -0,0 +1,708 @@
+/* archive.c
+ *
+ * Multi-file archives. Rather than compressing each file separately
+ * and combining them with tar, an archive holds many compressed files
+ * (members) followed by a central directory giving the name, sizes,
+ * offset and compression flags of each one. The directory is found
+ * from a fixed size trailer at the end of the file, and hashed by name
+ * when the archive is opened, so a single member can be found and
+ * extracted without reading any of the others.
+ *
+ * In a solid archive the members are Huffman compressed with one
+ * frequency table built from all of them and stored once, rather than
+ * each carrying its own. For small files the table can be a large part
+ * of the compressed size.
+ *
+ * Archive format. Numbers are little endian, [n] is the number of bytes.
+ *
+ * "JLAR" <version [1]> <archive flags [1]>
+ * <shared frequency table, solid archives only>
+ * <member data>...
+ * <member count [4]>
+ * <name length [2]> <name> <original size [8]> <compressed size [8]>
+ *     <offset [8]> <compression flags [1]>     (once per member)
+ * <directory offset [8]> "JLAR"
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "archive.h"
+#include "dataBlocks.h"
+#include "header.h"
+#include "huffmanCompressor.h"
+
+#define ARCHIVE_MAGIC "JLAR"
+#define ARCHIVE_MAGIC_SIZE (4)
+#define ARCHIVE_VERSION (1)
+#define ARCHIVE_HEADER_SIZE (ARCHIVE_MAGIC_SIZE + 2)
+#define ARCHIVE_TRAILER_SIZE (8 + ARCHIVE_MAGIC_SIZE)
+
+/* Archive flags */
+#define ARCHIVE_SOLID (0x1)
+
+struct ArchiveStruct {
+  BlockDescriptor* mapping;
+  unsigned char flags;
+  FrequencyTable sharedTable;
+  unsigned long directoryOffset;
+
+  ArchiveMember* members;
+  size_t memberCount;
+
+  /* Open addressed hash table of member index + 1, 0 when empty */
+  size_t* hashTable;
+  size_t hashTableSize;
+};
+
+
+/* hashName()
+ *
+ * FNV-1a hash of a member name.
+ */
+static unsigned long hashName(const char* name) {
+  unsigned long hash = 2166136261UL;
+  while (*name) {
+    hash ^= (unsigned char)*name++;
+    hash *= 16777619UL;
+  }
+  return hash;
+}
+
+/* writeToArchive()
+ *
+ * Write bytes to the archive file, aborting on failure.
+ */
+static void writeToArchive(FILE* file, const char* filename,
+                           const void* address, size_t size) {
+  if (fwrite(address, 1, size, file) != size) {
+    error(True, "Unable to write to %s", filename);
+  }
+}
+
+/* writeBlockToArchive()
+ *
+ * Write the used part of a block to the archive file.
+ *
+ * Return value:
+ * Number of bytes written
+ */
+static size_t writeBlockToArchive(FILE* file, const char* filename,
+                                  const BlockDescriptor* block) {
+  writeToArchive(file, filename, block->address, block->usedSize);
+  return block->usedSize;
+}
+
+/* loadMember()
+ *
+ * Map a file to be added to the archive. An empty file can't be
+ * mapped, so gets an empty memory block instead.
+ *
+ * Parameters:
+ * filename - file to load
+ *
+ * Return value:
+ * Block holding the file
+ */
+static BlockDescriptor* loadMember(const char* filename) {
+  BlockDescriptor* block = NULL;
+  if (getFileSize(filename) == 0) {
+    block = makeMemoryBlock(1);
+    block->usedSize = 0;
+    return block;
+  }
+  return mapUncompressedFile(filename);
+}
+
+/* writeDirectory()
+ *
+ * Write the central directory and trailer.
+ *
+ * Parameters:
+ * file - archive file
+ * archiveFilename - archive filename, for error messages
+ * members - member entries
+ * memberCount - number of members
+ * directoryOffset - offset in the archive the directory starts at
+ */
+static void writeDirectory(FILE* file, const char* archiveFilename,
+                           const ArchiveMember* members, size_t memberCount,
+                           unsigned long directoryOffset) {
+  BlockDescriptor* directory = makeMemoryBlock(64 + memberCount * 64);
+  size_t index;
+
+  writeNumberToBlock(directory, memberCount, 4);
+  for (index = 0; index < memberCount; index++) {
+    size_t nameLength = strlen(members[index].name);
+    size_t character;
+    if (nameLength > 0xffff) {
+      error(False, "Filename too long for archive - %s", members[index].name);
+    }
+    writeNumberToBlock(directory, nameLength, 2);
+    for (character = 0; character < nameLength; character++) {
+      writeToBlock(directory, members[index].name[character]);
+    }
+    writeNumberToBlock(directory, members[index].originalSize, 8);
+    writeNumberToBlock(directory, members[index].compressedSize, 8);
+    writeNumberToBlock(directory, members[index].offset, 8);
+    writeToBlock(directory, members[index].encoding);
+  }
+  writeNumberToBlock(directory, directoryOffset, 8);
+  for (index = 0; index < ARCHIVE_MAGIC_SIZE; index++) {
+    writeToBlock(directory, ARCHIVE_MAGIC[index]);
+  }
+
+  writeBlockToArchive(file, archiveFilename, directory);
+  freeBlock(directory);
+}
+
+/* isSafeMemberName()
+ *
+ * Whether a member can be extracted under its name without writing
+ * outside the current directory, i.e. the name is not empty or
+ * absolute and has no ".." in its path.
+ *
+ * Parameters:
+ * name - member name
+ *
+ * Return value:
+ * True if the name is safe
+ */
+static Boolean isSafeMemberName(const char* name) {
+  const char* component = name;
+
+  if ((*name == '\0') || (*name == '/')) {
+    return False;
+  }
+  while (component != NULL) {
+    const char* slash = strchr(component, '/');
+    size_t length = slash ? (size_t)(slash - component) : strlen(component);
+    if ((length == 2) && !strncmp(component, "..", 2)) {
+      return False;
+    }
+    component = slash ? slash + 1 : NULL;
+  }
+  return True;
+}
+
+/* storedMemberName()
+ *
+ * The name a file is stored under in an archive. As tar does, any
+ * leading "/", "./" and "../" are removed so that the member is
+ * extracted below the current directory.
+ *
+ * Parameters:
+ * filename - file being added
+ *
+ * Return value:
+ * The end of filename which is stored
+ */
+static char* storedMemberName(char* filename) {
+  char* name = filename;
+
+  for (;;) {
+    if (*name == '/') {
+      name++;
+    }
+    else if (!strncmp(name, "./", 2)) {
+      name += 2;
+    }
+    else if (!strncmp(name, "../", 3)) {
+      name += 3;
+    }
+    else {
+      break;
+    }
+  }
+  if (!isSafeMemberName(name)) {
+    error(False, "%s can't be stored in an archive - its name has .. "
+          "in it or is empty", filename);
+  }
+  return name;
+}
+
+/* createArchive()
+ *
+ * Compress a list of files into an archive.
+ *
+ * Parameters:
+ * flags - command line switches, applied to every member
+ * archiveFilename - archive to create
+ * filenames - files to add, stored under these names
+ * fileCount - number of files
+ * solid - True to share one Huffman table between all the members
+ */
+void createArchive(const struct CompressionFlags* flags,
+                   const char* archiveFilename,
+                   char** filenames,
+                   size_t fileCount,
+                   Boolean solid) {
+  ArchiveMember* members = calloc(fileCount ? fileCount : 1,
+                                  sizeof(ArchiveMember));
+  BlockDescriptor** stagedBlocks = NULL;
+  FrequencyTable sharedTable;
+  struct CompressionFlags stageFlags = *flags;
+  unsigned char header[ARCHIVE_HEADER_SIZE];
+  unsigned long offset = 0;
+  unsigned long bytesIn = 0;
+  size_t index;
+  FILE* file = NULL;
+
+  if (members == NULL) {
+    error(True, "malloc failed for %lu archive members",
+          (unsigned long)fileCount);
+  }
+
+  /* Check the names before anything is written */
+  for (index = 0; index < fileCount; index++) {
+    members[index].name = storedMemberName(filenames[index]);
+  }
+
+  /* Members are already reached through the central directory, so
+   * each is compressed as a single stream. Solid mode does the job of a
+   * dictionary within an archive. Members aren't checksummed.
+   */
+  stageFlags.blockSize = 0;
+  stageFlags.dictionary = NULL;
+  stageFlags.checksum = False;
+
+  /* A shared table only means something if the members are Huffman
+   * compressed.
+   */
+  solid = (solid && flags->huffman) ? True : False;
+
+  if (solid) {
+    unsigned long stagedBytes = 0;
+
+    /* Run the stages before Huffman on every member first, so that
+     * the table can be built from all of their output.
+     */
+    stageFlags.huffman = False;
+    stagedBlocks = calloc(fileCount ? fileCount : 1, sizeof(BlockDescriptor*));
+    if (stagedBlocks == NULL) {
+      error(True, "malloc failed for %lu archive members",
+            (unsigned long)fileCount);
+    }
+    initFrequencyTable(sharedTable);
+    for (index = 0; index < fileCount; index++) {
+      BlockDescriptor* block = loadMember(filenames[index]);
+      members[index].originalSize = block->usedSize;
+      if (block->usedSize) {
+        block = compressBlock(&stageFlags, block);
+        addToFrequencyTable(block, sharedTable);
+        stagedBytes += block->usedSize;
+      }
+      stagedBlocks[index] = block;
+    }
+
+    /* No table can be built if every member is empty, but then none
+     * is needed either.
+     */
+    if (stagedBytes) {
+      makeHuffmanCodes(sharedTable);
+    }
+    else {
+      solid = False;
+    }
+  }
+
+  file = fopen(archiveFilename, "wb");
+  if (file == NULL) {
+    error(True, "Unable to create %s", archiveFilename);
+  }
+
+  memcpy(header, ARCHIVE_MAGIC, ARCHIVE_MAGIC_SIZE);
+  header[ARCHIVE_MAGIC_SIZE] = ARCHIVE_VERSION;
+  header[ARCHIVE_MAGIC_SIZE + 1] = solid ? ARCHIVE_SOLID : 0;
+  writeToArchive(file, archiveFilename, header, ARCHIVE_HEADER_SIZE);
+  offset = ARCHIVE_HEADER_SIZE;
+
+  if (solid) {
+    BlockDescriptor* tableBlock = makeMemoryBlock(1024);
+    writeFrequencyTableToBlock(sharedTable, tableBlock);
+    offset += writeBlockToArchive(file, archiveFilename, tableBlock);
+    freeBlock(tableBlock);
+  }
+
+  for (index = 0; index < fileCount; index++) {
+    BlockDescriptor* block = NULL;
+
+    if (stagedBlocks != NULL) {
+      block = stagedBlocks[index];
+      stagedBlocks[index] = NULL;
+      if (solid && block->usedSize) {
+        BlockDescriptor* outputBlock = huffmanCompressWithTable(block,
+                                                                sharedTable,
+                                                                False);
+        freeBlock(block);
+        block = outputBlock;
+      }
+    }
+    else {
+      block = loadMember(filenames[index]);
+      members[index].originalSize = block->usedSize;
+      if (block->usedSize) {
+        block = compressBlock(&stageFlags, block);
+      }
+    }
+
+    members[index].offset = offset;
+    members[index].encoding = block->encoding;
+    members[index].compressedSize = writeBlockToArchive(file, archiveFilename,
+                                                        block);
+    offset += members[index].compressedSize;
+    bytesIn += members[index].originalSize;
+    freeBlock(block);
+  }
+
+  writeDirectory(file, archiveFilename, members, fileCount, offset);
+  if (fclose(file) == EOF) {
+    error(True, "Unable to close %s", archiveFilename);
+  }
+
+  printf("Archived %lu files%s, before %lu bytes, after %u bytes\n",
+         (unsigned long)fileCount, solid ? " (solid)" : "", bytesIn,
+         getFileSize(archiveFilename));
+
+  free(stagedBlocks);
+  free(members);
+}
+
+/* addToHashTable()
+ *
+ * Add a member to the name hash table. If two members have the same
+ * name the first one is found.
+ */
+static void addToHashTable(Archive* archive, size_t memberIndex) {
+  size_t slot = hashName(archive->members[memberIndex].name) &
+    (archive->hashTableSize - 1);
+  while (archive->hashTable[slot]) {
+    if (!strcmp(archive->members[archive->hashTable[slot] - 1].name,
+                archive->members[memberIndex].name)) {
+      return;
+    }
+    slot = (slot + 1) & (archive->hashTableSize - 1);
+  }
+  archive->hashTable[slot] = memberIndex + 1;
+}
+
+/* openArchive()
+ *
+ * Open an archive and read its central directory.
+ *
+ * Parameters:
+ * archiveFilename - archive to open
+ *
+ * Return value:
+ * Archive, to be closed with closeArchive()
+ */
+Archive* openArchive(const char* archiveFilename) {
+  Archive* archive = calloc(1, sizeof(Archive));
+  BlockDescriptor* view = NULL;
+  unsigned char* address = NULL;
+  size_t size;
+  size_t index;
+
+  if (archive == NULL) {
+    error(True, "malloc failed to open archive");
+  }
+
+  if (getFileSize(archiveFilename) < ARCHIVE_HEADER_SIZE + ARCHIVE_TRAILER_SIZE) {
+    error(False, "%s is too small to be an archive", archiveFilename);
+  }
+  archive->mapping = mapUncompressedFile(archiveFilename);
+  address = archive->mapping->address;
+  size = archive->mapping->usedSize;
+
+  if (memcmp(address, ARCHIVE_MAGIC, ARCHIVE_MAGIC_SIZE) ||
+      memcmp(address + size - ARCHIVE_MAGIC_SIZE, ARCHIVE_MAGIC,
+             ARCHIVE_MAGIC_SIZE)) {
+    error(False, "%s is not an archive", archiveFilename);
+  }
+  if (address[ARCHIVE_MAGIC_SIZE] != ARCHIVE_VERSION) {
+    error(False, "%s is archive version %u, which is not supported",
+          archiveFilename, address[ARCHIVE_MAGIC_SIZE]);
+  }
+  archive->flags = address[ARCHIVE_MAGIC_SIZE + 1];
+
+  /* Find the directory from the trailer */
+  view = makeViewBlock(address + size - ARCHIVE_TRAILER_SIZE,
+                       ARCHIVE_TRAILER_SIZE, 0);
+  archive->directoryOffset = readNumberFromBlock(view, 8);
+  freeBlock(view);
+  if (archive->directoryOffset > size - ARCHIVE_TRAILER_SIZE) {
+    error(False, "Damaged archive - bad directory offset");
+  }
+
+  view = makeViewBlock(address + archive->directoryOffset,
+                       size - ARCHIVE_TRAILER_SIZE - archive->directoryOffset,
+                       0);
+  archive->memberCount = readNumberFromBlock(view, 4);
+  archive->members = calloc(archive->memberCount ? archive->memberCount : 1,
+                            sizeof(ArchiveMember));
+  for (archive->hashTableSize = 1;
+       archive->hashTableSize < archive->memberCount * 2;
+       archive->hashTableSize *= 2) {
+  }
+  archive->hashTable = calloc(archive->hashTableSize, sizeof(size_t));
+  if ((archive->members == NULL) || (archive->hashTable == NULL)) {
+    error(True, "malloc failed for archive directory");
+  }
+
+  for (index = 0; index < archive->memberCount; index++) {
+    ArchiveMember* member = &archive->members[index];
+    size_t nameLength = readNumberFromBlock(view, 2);
+    size_t character;
+
+    member->name = malloc(nameLength + 1);
+    if (member->name == NULL) {
+      error(True, "malloc failed for archive member name");
+    }
+    for (character = 0; character < nameLength; character++) {
+      member->name[character] = readFromBlock(view);
+    }
+    member->name[nameLength] = '\0';
+    member->originalSize = readNumberFromBlock(view, 8);
+    member->compressedSize = readNumberFromBlock(view, 8);
+    member->offset = readNumberFromBlock(view, 8);
+    member->encoding = readFromBlock(view);
+
+    if ((member->offset > archive->directoryOffset) ||
+        (member->compressedSize > archive->directoryOffset - member->offset)) {
+      error(False, "Damaged archive - member %s is out of bounds",
+            member->name);
+    }
+    addToHashTable(archive, index);
+  }
+  freeBlock(view);
+
+  if (archive->flags & ARCHIVE_SOLID) {
+    view = makeViewBlock(address + ARCHIVE_HEADER_SIZE,
+                         archive->directoryOffset - ARCHIVE_HEADER_SIZE, 0);
+    readFrequencyTableFromBlock(view, archive->sharedTable);
+    freeBlock(view);
+  }
+
+  return archive;
+}
+
+/* closeArchive()
+ *
+ * Close an archive opened by openArchive().
+ */
+void closeArchive(Archive* archive) {
+  size_t index;
+  if (archive != NULL) {
+    for (index = 0; index < archive->memberCount; index++) {
+      free(archive->members[index].name);
+    }
+    free(archive->members);
+    free(archive->hashTable);
+    freeBlock(archive->mapping);
+    free(archive);
+  }
+}
+
+/* isArchiveSolid()
+ *
+ * Return value:
+ * True if the members share one Huffman table
+ */
+Boolean isArchiveSolid(const Archive* archive) {
+  return (archive->flags & ARCHIVE_SOLID) ? True : False;
+}
+
+/* getArchiveMemberCount()
+ *
+ * Return value:
+ * Number of members in the archive
+ */
+size_t getArchiveMemberCount(const Archive* archive) {
+  return archive->memberCount;
+}
+
+/* getArchiveMember()
+ *
+ * Return value:
+ * Directory entry of the member at the given index
+ */
+const ArchiveMember* getArchiveMember(const Archive* archive, size_t index) {
+  if (index >= archive->memberCount) {
+    error(False, "Archive member index %lu out of range", (unsigned long)index);
+  }
+  return &archive->members[index];
+}
+
+/* findArchiveMember()
+ *
+ * Look a member up by name.
+ *
+ * Parameters:
+ * archive - archive to search
+ * name - member name
+ *
+ * Return value:
+ * Directory entry, or NULL if there is no member of that name
+ */
+const ArchiveMember* findArchiveMember(const Archive* archive,
+                                       const char* name) {
+  size_t slot = hashName(name) & (archive->hashTableSize - 1);
+  while (archive->hashTable[slot]) {
+    const ArchiveMember* member = &archive->members[archive->hashTable[slot] - 1];
+    if (!strcmp(member->name, name)) {
+      return member;
+    }
+    slot = (slot + 1) & (archive->hashTableSize - 1);
+  }
+  return NULL;
+}
+
+/* extractArchiveMember()
+ *
+ * Decompress one member. Only that member's data is read.
+ *
+ * Parameters:
+ * archive - archive holding the member
+ * member - directory entry of the member
+ *
+ * Return value:
+ * Block holding the original contents of the member
+ */
+BlockDescriptor* extractArchiveMember(Archive* archive,
+                                      const ArchiveMember* member) {
+  BlockDescriptor* block = makeViewBlock(archive->mapping->address +
+                                         member->offset,
+                                         member->compressedSize,
+                                         member->encoding);
+
+  if (member->encoding & ENCODING_SHARED_TABLE) {
+    BlockDescriptor* outputBlock = NULL;
+    if (!isArchiveSolid(archive)) {
+      error(False, "Damaged archive - %s needs a shared table", member->name);
+    }
+    outputBlock = huffmanDecompressWithTable(block, archive->sharedTable);
+    freeBlock(block);
+    block = outputBlock;
+  }
+
+  block = decompressBlock(block);
+  if (block->usedSize != member->originalSize) {
+    error(False, "Damaged archive - %s has the wrong size", member->name);
+  }
+  return block;
+}
+
+/* makeParentDirectories()
+ *
+ * Make any missing directories in the path of a file being extracted.
+ *
+ * Parameters:
+ * filename - path of the file
+ */
+static void makeParentDirectories(const char* filename) {
+  char* path = malloc(strlen(filename) + 1);
+  char* slash = NULL;
+
+  if (path == NULL) {
+    error(True, "unable to malloc space for filename");
+  }
+  strcpy(path, filename);
+  for (slash = strchr(path + 1, '/'); slash != NULL;
+       slash = strchr(slash + 1, '/')) {
+    *slash = '\0';
+    if (mkdir(path, 0777) && (errno != EEXIST)) {
+      error(True, "Unable to make directory %s", path);
+    }
+    *slash = '/';
+  }
+  free(path);
+}
+
+/* checkMemberName()
+ *
+ * Refuse to extract a member whose name would be written outside the
+ * current directory, as the archive may not have been made by
+ * createArchive().
+ *
+ * Parameters:
+ * member - directory entry of the member
+ */
+static void checkMemberName(const ArchiveMember* member) {
+  if (!isSafeMemberName(member->name)) {
+    error(False, "Refusing to extract %s - archive members can't have "
+          "absolute names or .. in their paths", member->name);
+  }
+}
+
+/* extractMemberToFile()
+ *
+ * Extract a member to a file of the same name.
+ */
+static void extractMemberToFile(Archive* archive,
+                                const ArchiveMember* member,
+                                Boolean overwrite) {
+  BlockDescriptor* block = NULL;
+
+  if (!overwrite) {
+    struct stat fileStat;
+    if (!stat(member->name, &fileStat)) {
+      error(False, "output file %s already exists", member->name);
+    }
+  }
+
+  block = extractArchiveMember(archive, member);
+  makeParentDirectories(member->name);
+  createFile(member->name, block, False);
+  freeBlock(block);
+}
+
+/* extractFromArchive()
+ *
+ * Extract members of an archive to files of the same names.
+ *
+ * Parameters:
+ * archiveFilename - archive to extract from
+ * names - names of members to extract, all of them if nameCount is 0
+ * nameCount - number of names
+ * overwrite - True if existing files may be overwritten
+ */
+void extractFromArchive(const char* archiveFilename,
+                        char** names,
+                        size_t nameCount,
+                        Boolean overwrite) {
+  Archive* archive = openArchive(archiveFilename);
+  size_t index;
+  size_t extractedCount = nameCount;
+
+  if (nameCount == 0) {
+    extractedCount = getArchiveMemberCount(archive);
+    /* Every name is checked before any file is written */
+    for (index = 0; index < getArchiveMemberCount(archive); index++) {
+      checkMemberName(getArchiveMember(archive, index));
+    }
+    for (index = 0; index < getArchiveMemberCount(archive); index++) {
+      extractMemberToFile(archive, getArchiveMember(archive, index), overwrite);
+    }
+  }
+  else {
+    for (index = 0; index < nameCount; index++) {
+      const ArchiveMember* member = findArchiveMember(archive, names[index]);
+      if (member == NULL) {
+        error(False, "%s is not in %s", names[index], archiveFilename);
+      }
+      checkMemberName(member);
+    }
+    for (index = 0; index < nameCount; index++) {
+      extractMemberToFile(archive, findArchiveMember(archive, names[index]),
+                          overwrite);
+    }
+  }
+
+  printf("Extracted %lu of %lu files from %s%s\n",
+         (unsigned long)extractedCount,
+         (unsigned long)getArchiveMemberCount(archive), archiveFilename,
+         isArchiveSolid(archive) ? " (solid)" : "");
+  closeArchive(archive);
+}
@@ -0,0 +1,40 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+/* Declarations for multi-file archives, in archive.c */
+
+#include "compression.h"
+
+/* One entry in the central directory of an archive */
+typedef struct {
+  char* name;
+  unsigned long originalSize;
+  unsigned long compressedSize;
+  unsigned long offset;
+  unsigned char encoding;
+} ArchiveMember;
+
+typedef struct ArchiveStruct Archive;
+
+void createArchive(const struct CompressionFlags* flags,
+                   const char* archiveFilename,
+                   char** filenames,
+                   size_t fileCount,
+                   Boolean solid);
+
+Archive* openArchive(const char* archiveFilename);
+void closeArchive(Archive* archive);
+Boolean isArchiveSolid(const Archive* archive);
+size_t getArchiveMemberCount(const Archive* archive);
+const ArchiveMember* getArchiveMember(const Archive* archive, size_t index);
+const ArchiveMember* findArchiveMember(const Archive* archive,
+                                       const char* name);
+BlockDescriptor* extractArchiveMember(Archive* archive,
+                                      const ArchiveMember* member);
+
+void extractFromArchive(const char* archiveFilename,
+                        char** names,
+                        size_t nameCount,
+                        Boolean overwrite);
+
+#endif
@@ -0,0 +1,318 @@
+/* batch.c
+ *
+ * Compresses or decompresses many files in one run. Each file is
+ * compressed if it is uncompressed and decompressed if it is
+ * compressed, just as jlcompress does for a single file.
+ *
+ * The files are handled in batches. While one batch is being
+ * compressed the I/O engine is loading the next one and storing the
+ * results of the previous one, so with io_uring the per-file system
+ * calls overlap the compression rather than adding to it.
+ */
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include "batch.h"
+#include "dataBlocks.h"
+#include "header.h"
+#include "ioEngine.h"
+
+/* Number of files in each batch handed to the I/O engine */
+#define BATCH_SIZE (128)
+
+/* addToFileList()
+ *
+ * Append a copy of a filename to a file list, growing it as needed.
+ *
+ * Parameters:
+ * fileList - pointer to the list
+ * fileCount - pointer to the number of files in the list
+ * allocated - pointer to the number of entries allocated
+ * filename - filename to add
+ */
+static void addToFileList(char*** fileList, size_t* fileCount,
+                          size_t* allocated, const char* filename) {
+  char* copy = malloc(strlen(filename) + 1);
+  if (copy == NULL) {
+    error(True, "unable to malloc space for filename");
+  }
+  strcpy(copy, filename);
+
+  if (*fileCount == *allocated) {
+    *allocated = *allocated ? *allocated * 2 : 64;
+    *fileList = realloc(*fileList, *allocated * sizeof(char*));
+    if (*fileList == NULL) {
+      error(True, "realloc failed for file list of %lu files",
+            (unsigned long)*allocated);
+    }
+  }
+  (*fileList)[(*fileCount)++] = copy;
+}
+
+/* makeFileList()
+ *
+ * Make the list of files to process from the names given on the
+ * command line. A directory stands for the regular files in it,
+ * which saves passing 100,000 names through the shell.
+ *
+ * Parameters:
+ * names - names from the command line
+ * nameCount - number of names
+ * fileCount - set to the number of files in the list
+ *
+ * Return value:
+ * Heap allocated list of heap allocated filenames. Free it with
+ * freeFileList().
+ */
+char** makeFileList(char** names, size_t nameCount, size_t* fileCount) {
+  char** fileList = NULL;
+  size_t allocated = 0;
+  size_t index;
+
+  *fileCount = 0;
+  for (index = 0; index < nameCount; index++) {
+    struct stat fileStat;
+    DIR* directory;
+    struct dirent* entry;
+    char* path = NULL;
+
+    if (stat(names[index], &fileStat)) {
+      error(True, "Unable to find %s", names[index]);
+    }
+    if (!S_ISDIR(fileStat.st_mode)) {
+      addToFileList(&fileList, fileCount, &allocated, names[index]);
+      continue;
+    }
+
+    directory = opendir(names[index]);
+    if (directory == NULL) {
+      error(True, "Unable to open directory %s", names[index]);
+    }
+    while ((entry = readdir(directory)) != NULL) {
+      path = realloc(path, strlen(names[index]) + strlen(entry->d_name) + 2);
+      if (path == NULL) {
+        error(True, "unable to malloc space for filename");
+      }
+      sprintf(path, "%s/%s", names[index], entry->d_name);
+
+      if (entry->d_type == DT_UNKNOWN) {
+        if (stat(path, &fileStat)) {
+          error(True, "Unable to find %s", path);
+        }
+        if (!S_ISREG(fileStat.st_mode)) {
+          continue;
+        }
+      }
+      else if (entry->d_type != DT_REG) {
+        continue;
+      }
+      addToFileList(&fileList, fileCount, &allocated, path);
+    }
+    free(path);
+    if (closedir(directory)) {
+      error(True, "Unable to close directory %s", names[index]);
+    }
+  }
+  return fileList;
+}
+
+/* freeFileList()
+ *
+ * Free a list made by makeFileList().
+ *
+ * Parameters:
+ * fileList - list to free
+ * fileCount - number of files in it
+ */
+void freeFileList(char** fileList, size_t fileCount) {
+  size_t index;
+  for (index = 0; index < fileCount; index++) {
+    free(fileList[index]);
+  }
+  free(fileList);
+}
+
+/* processFile()
+ *
+ * Compress or decompress a single loaded file, and fill in the
+ * description of the output file to store.
+ *
+ * Parameters:
+ * flags - command line switches
+ * input - loaded input file. Its buffer is taken over by this function.
+ * output - output file to fill in
+ * header - buffer for the output file header
+ * overwrite - True if the output file may already exist
+ *
+ * Return value:
+ * Output block, which must be kept until the output file is stored
+ */
+static BlockDescriptor* processFile(const struct CompressionFlags* flags,
+                                    IoFile* input,
+                                    IoFile* output,
+                                    unsigned char* header,
+                                    Boolean overwrite) {
+  BlockDescriptor* outputBlock = NULL;
+  Boolean compressing = !parseHeader(input->address, input->size, False);
+
+  if (compressing) {
+    if (input->size == 0) {
+      error(False, "Cannot compress empty file %s", input->filename);
+    }
+    outputBlock = compressBlock(flags,
+                                adoptUncompressedBuffer(input->address,
+                                                        input->size));
+    fillHeader(header, outputBlock);
+    output->header = header;
+    output->headerSize = getHeaderSize();
+  }
+  else {
+    outputBlock = decompressBlock(adoptCompressedBuffer(input->address,
+                                                        input->size));
+    output->header = NULL;
+    output->headerSize = 0;
+  }
+  input->address = NULL;
+
+  output->filename = makeOutputFilename(input->filename, compressing);
+  output->address = outputBlock->address;
+  output->size = outputBlock->usedSize;
+  output->exclusive = !overwrite;
+  return outputBlock;
+}
+
+/* releaseOutputs()
+ *
+ * Wait for a group of output files to be stored and free their
+ * buffers and filenames.
+ *
+ * Parameters:
+ * engine - I/O engine storing the files
+ * outputs - output files
+ * outputBlocks - blocks holding the data being stored
+ * count - number of files
+ */
+static void releaseOutputs(IoEngine* engine,
+                           IoFile* outputs,
+                           BlockDescriptor** outputBlocks,
+                           size_t count) {
+  size_t index;
+  ioWaitFiles(engine, outputs, count);
+  for (index = 0; index < count; index++) {
+    freeBlock(outputBlocks[index]);
+    outputBlocks[index] = NULL;
+    free((char*)outputs[index].filename);
+    outputs[index].filename = NULL;
+  }
+}
+
+/* getSeconds()
+ *
+ * Return value:
+ * Monotonic clock reading in seconds
+ */
+static double getSeconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* processFiles()
+ *
+ * Compress or decompress each of a list of files, writing the output
+ * alongside the input using the default output filename.
+ *
+ * Parameters:
+ * flags - command line switches
+ * filenames - files to process
+ * fileCount - number of files
+ * overwrite - True if output files may be overwritten
+ * ioMethod - how to do the I/O
+ */
+void processFiles(const struct CompressionFlags* flags,
+                  char** filenames,
+                  size_t fileCount,
+                  Boolean overwrite,
+                  IoMethod ioMethod) {
+  IoEngine* engine = makeIoEngine(ioMethod);
+  IoFile* inputs = calloc(fileCount, sizeof(IoFile));
+  IoFile* outputs = calloc(fileCount, sizeof(IoFile));
+  BlockDescriptor** outputBlocks = calloc(fileCount, sizeof(BlockDescriptor*));
+  unsigned char* headers = malloc(fileCount * getHeaderSize());
+  unsigned long bytesIn = 0;
+  unsigned long bytesOut = 0;
+  double startTime = getSeconds();
+  double elapsed = 0;
+  size_t batchStart;
+  size_t index;
+
+  if ((inputs == NULL) || (outputs == NULL) ||
+      (outputBlocks == NULL) || (headers == NULL)) {
+    error(True, "malloc failed for %lu files", (unsigned long)fileCount);
+  }
+
+  for (index = 0; index < fileCount; index++) {
+    inputs[index].filename = filenames[index];
+  }
+
+  ioLoadFiles(engine, inputs, fileCount < BATCH_SIZE ? fileCount : BATCH_SIZE);
+
+  for (batchStart = 0; batchStart < fileCount; batchStart += BATCH_SIZE) {
+    size_t batchEnd = batchStart + BATCH_SIZE;
+    if (batchEnd > fileCount) {
+      batchEnd = fileCount;
+    }
+
+    /* Start the next batch loading before working on this one */
+    if (batchEnd < fileCount) {
+      size_t nextEnd = batchEnd + BATCH_SIZE;
+      if (nextEnd > fileCount) {
+        nextEnd = fileCount;
+      }
+      ioLoadFiles(engine, inputs + batchEnd, nextEnd - batchEnd);
+    }
+
+    ioWaitFiles(engine, inputs + batchStart, batchEnd - batchStart);
+
+    for (index = batchStart; index < batchEnd; index++) {
+      bytesIn += inputs[index].size;
+      outputBlocks[index] = processFile(flags, &inputs[index],
+                                        &outputs[index],
+                                        headers + index * getHeaderSize(),
+                                        overwrite);
+      bytesOut += outputs[index].headerSize + outputs[index].size;
+      ioStoreFiles(engine, &outputs[index], 1);
+    }
+
+    /* The previous batch has had a whole batch of compression time
+     * to be written, so it should be finished with by now.
+     */
+    if (batchStart) {
+      releaseOutputs(engine, outputs + batchStart - BATCH_SIZE,
+                     outputBlocks + batchStart - BATCH_SIZE, BATCH_SIZE);
+    }
+  }
+
+  if (fileCount) {
+    batchStart = ((fileCount - 1) / BATCH_SIZE) * BATCH_SIZE;
+    releaseOutputs(engine, outputs + batchStart, outputBlocks + batchStart,
+                   fileCount - batchStart);
+  }
+
+  elapsed = getSeconds() - startTime;
+  printf("%lu files, before %lu bytes, after %lu bytes, "
+         "%.2f seconds, %.0f files/s (%s I/O)\n",
+         (unsigned long)fileCount, bytesIn, bytesOut, elapsed,
+         elapsed > 0 ? fileCount / elapsed : 0.0,
+         getIoEngineName(engine));
+
+  freeIoEngine(engine);
+  free(headers);
+  free(outputBlocks);
+  free(outputs);
+  free(inputs);
+}
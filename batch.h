@@ -0,0 +1,18 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+/* Declarations for compressing or decompressing many files in one run */
+
+#include "compression.h"
+#include "ioEngine.h"
+
+char** makeFileList(char** names, size_t nameCount, size_t* fileCount);
+void freeFileList(char** fileList, size_t fileCount);
+
+void processFiles(const struct CompressionFlags* flags,
+                  char** filenames,
+                  size_t fileCount,
+                  Boolean overwrite,
+                  IoMethod ioMethod);
+
+#endif
@@ -0,0 +1,661 @@
+/* bench.c
+ *
+ * Benchmark of the individual compression stages. Generates synthetic
+ * corpora which are the same on every run, then times each stage in
+ * memory on each corpus, at each size and number of threads. With more
+ * than one thread every thread runs the stage on its own copy of the
+ * data at the same time, so the result shows how well the stage scales
+ * when blocks or files are compressed in parallel.
+ *
+ * A table is printed, and the results are written as JSON, one result
+ * per line, so that the files from two versions can be diffed.
+ *
+ * jlbench [--sizes n,...] [--threads n,...] [--time seconds]
+ *         [--corpus name,...] [--json filename]
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "compression.h"
+#include "dataBlocks.h"
+#include "huffmanCompressor.h"
+
+const char* programName_g = "jlbench";
+
+#define MAXIMUM_LIST_SIZE (16)
+#define MAXIMUM_THREADS (256)
+
+/* Generator of a corpus. Fills the buffer from the given seed. */
+typedef void (*CorpusGenerator)(unsigned char* buffer, size_t size,
+                                unsigned long seed);
+
+typedef struct {
+  const char* name;
+  CorpusGenerator generate;
+} Corpus;
+
+/* A stage being timed. Prepared once per corpus and size, then run
+ * repeatedly on a copy of the prepared input.
+ */
+typedef struct {
+  const char* name;
+  /* Make the input the stage runs on from the raw corpus */
+  BlockDescriptor* (*prepare)(BlockDescriptor* corpusBlock);
+  /* Run it once, returning the output size */
+  size_t (*run)(BlockDescriptor* inputBlock);
+  /* True if throughput is given by the size of the original corpus */
+  Boolean perByte;
+} Stage;
+
+typedef struct {
+  double seconds;            /* Wall time of the whole measurement */
+  unsigned long long cycles; /* Cycle counter over the same time */
+  size_t outputSize;
+  unsigned long runs;        /* Total by all the threads */
+} Measurement;
+
+/* Work for one thread */
+typedef struct {
+  const Stage* stage;
+  BlockDescriptor* input;
+  double minimumSeconds;
+  pthread_barrier_t* barrier;
+  size_t outputSize;
+  unsigned long runs;
+} ThreadWork;
+
+
+/* nextRandom()
+ *
+ * xorshift64* pseudo random number generator, so that the corpora are
+ * the same on every machine and every run.
+ *
+ * Parameters:
+ * state - generator state, which must not be 0
+ *
+ * Return value:
+ * Next pseudo random number
+ */
+static unsigned long long nextRandom(unsigned long long* state) {
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return *state * 2685821657736338717ULL;
+}
+
+/* appendText()
+ *
+ * Append as much of a string to the buffer as there is room for.
+ *
+ * Return value:
+ * New offset in the buffer
+ */
+static size_t appendText(unsigned char* buffer, size_t size, size_t offset,
+                         const char* text) {
+  while (*text && (offset < size)) {
+    buffer[offset++] = *text++;
+  }
+  return offset;
+}
+
+/* generateHtml()
+ *
+ * HTML made of paragraphs of words from a small vocabulary, with some
+ * markup, links and indentation.
+ */
+static void generateHtml(unsigned char* buffer, size_t size,
+                         unsigned long seed) {
+  static const char* words[] = {
+    "the", "Huffman", "code", "tree", "of", "a", "symbol", "frequency",
+    "is", "and", "to", "in", "with", "compression", "prefix", "bits",
+    "algorithm", "which", "for", "length", "optimal", "table", "by", "node"
+  };
+  static const char* tags[] = {
+    "<p>", "</p>\n", "<b>", "</b>", "<i>", "</i>", "<li>", "</li>\n",
+    "<a href=\"http://en.wikipedia.org/wiki/Huffman_coding\">", "</a>"
+  };
+  unsigned long long state = seed + 1;
+  size_t offset = appendText(buffer, size, 0,
+                             "<html><head><title>Corpus</title></head><body>\n");
+  while (offset < size) {
+    unsigned long long random = nextRandom(&state);
+    if (random % 11 == 0) {
+      offset = appendText(buffer, size, offset,
+                          tags[(random >> 8) % (sizeof(tags) / sizeof(tags[0]))]);
+    }
+    else if (random % 37 == 0) {
+      offset = appendText(buffer, size, offset, "\n    ");
+    }
+    else {
+      offset = appendText(buffer, size, offset,
+                          words[(random >> 8) % (sizeof(words) / sizeof(words[0]))]);
+      offset = appendText(buffer, size, offset, " ");
+    }
+  }
+}
+
+/* generateLogs()
+ *
+ * Log lines with increasing timestamps, a few levels and components,
+ * and numbers.
+ */
+static void generateLogs(unsigned char* buffer, size_t size,
+                         unsigned long seed) {
+  static const char* levels[] = { "INFO ", "INFO ", "INFO ", "DEBUG", "WARN ",
+                                  "ERROR" };
+  static const char* messages[] = {
+    "request completed", "cache miss for key", "connection opened from",
+    "retrying after timeout", "wrote block", "session expired for user"
+  };
+  unsigned long long state = seed + 2;
+  unsigned long timestamp = 1500000000UL;
+  size_t offset = 0;
+  char line[160];
+
+  while (offset < size) {
+    unsigned long long random = nextRandom(&state);
+    timestamp += random % 3;
+    sprintf(line, "2017-%02lu-%02lu %lu.%03lu [%s] worker-%lu: %s %lu\n",
+            1 + (timestamp / 2600000) % 12, 1 + (timestamp / 86400) % 28,
+            timestamp, (unsigned long)((random >> 8) % 1000),
+            levels[(random >> 20) % 6], (unsigned long)((random >> 24) % 16),
+            messages[(random >> 28) % 6],
+            (unsigned long)((random >> 32) % 100000));
+    offset = appendText(buffer, size, offset, line);
+  }
+}
+
+/* generateRandom()
+ *
+ * Bytes which can't be compressed.
+ */
+static void generateRandom(unsigned char* buffer, size_t size,
+                           unsigned long seed) {
+  unsigned long long state = seed + 3;
+  size_t offset;
+  for (offset = 0; offset < size; offset++) {
+    buffer[offset] = (unsigned char)(nextRandom(&state) >> 56);
+  }
+}
+
+/* generateRuns()
+ *
+ * Long runs of repeated bytes, from a few to a few thousand long.
+ */
+static void generateRuns(unsigned char* buffer, size_t size,
+                         unsigned long seed) {
+  unsigned long long state = seed + 4;
+  size_t offset = 0;
+  while (offset < size) {
+    unsigned long long random = nextRandom(&state);
+    size_t length = 4 + (random >> 8) % 4000;
+    unsigned char value = (unsigned char)(random >> 56) & 0x1f;
+    while (length-- && (offset < size)) {
+      buffer[offset++] = value;
+    }
+  }
+}
+
+/* generateEscapes()
+ *
+ * Binary data in which a third of the bytes are the run length
+ * encoder's repeat and escape symbols, 235 and 236, which it has to
+ * escape, with short runs of them as well.
+ */
+static void generateEscapes(unsigned char* buffer, size_t size,
+                            unsigned long seed) {
+  unsigned long long state = seed + 5;
+  size_t offset = 0;
+  while (offset < size) {
+    unsigned long long random = nextRandom(&state);
+    unsigned choice = (unsigned)(random % 6);
+    if (choice < 2) {
+      size_t length = 1 + (random >> 8) % 6;
+      while (length-- && (offset < size)) {
+        buffer[offset++] = (choice == 0) ? 235 : 236;
+      }
+    }
+    else {
+      buffer[offset++] = (unsigned char)(random >> 56);
+    }
+  }
+}
+
+static const Corpus corpora[] = {
+  { "html", generateHtml },
+  { "logs", generateLogs },
+  { "random", generateRandom },
+  { "runs", generateRuns },
+  { "escapes", generateEscapes }
+};
+#define CORPUS_COUNT (sizeof(corpora) / sizeof(corpora[0]))
+
+
+/* copyBlock()
+ *
+ * Copy a block, keeping its encoding.
+ */
+static BlockDescriptor* copyBlock(const BlockDescriptor* block) {
+  BlockDescriptor* copy = makeMemoryBlock(block->usedSize ?
+                                          block->usedSize : 1);
+  writeBytesToBlock(copy, block->address, block->usedSize);
+  copy->encoding = block->encoding;
+  return copy;
+}
+
+/* Stage functions. prepareX() makes the input from the corpus and
+ * runX() runs the stage once on it.
+ */
+
+static BlockDescriptor* prepareRaw(BlockDescriptor* corpusBlock) {
+  return copyBlock(corpusBlock);
+}
+
+static BlockDescriptor* prepareFlipped(BlockDescriptor* corpusBlock) {
+  BlockDescriptor* block = copyBlock(corpusBlock);
+  BlockDescriptor* flipped = flipBitOrder(block);
+  freeBlock(block);
+  return flipped;
+}
+
+static BlockDescriptor* prepareRunLength(BlockDescriptor* corpusBlock) {
+  return runLengthCompress(corpusBlock, False);
+}
+
+static BlockDescriptor* prepareHuffman(BlockDescriptor* corpusBlock) {
+  return huffmanCompress(corpusBlock);
+}
+
+/* Returns the output size and frees the output */
+static size_t finishRun(BlockDescriptor* outputBlock) {
+  size_t size = outputBlock->usedSize;
+  freeBlock(outputBlock);
+  return size;
+}
+
+static size_t runFlip(BlockDescriptor* inputBlock) {
+  size_t size = inputBlock->usedSize;
+  size_t outputSize = finishRun(flipBitOrder(inputBlock));
+  /* flipBitOrder() sets the input size to the output size */
+  inputBlock->usedSize = size;
+  return outputSize;
+}
+
+static size_t runUnflip(BlockDescriptor* inputBlock) {
+  resetBlockOffsets(inputBlock);
+  return finishRun(unflipBitOrder(inputBlock));
+}
+
+static size_t runRunLengthEncode(BlockDescriptor* inputBlock) {
+  return finishRun(runLengthCompress(inputBlock, False));
+}
+
+static size_t runRunLengthDecode(BlockDescriptor* inputBlock) {
+  return finishRun(runLengthDecompress(inputBlock));
+}
+
+static size_t runHuffmanEncode(BlockDescriptor* inputBlock) {
+  return finishRun(huffmanCompress(inputBlock));
+}
+
+static size_t runHuffmanDecode(BlockDescriptor* inputBlock) {
+  resetBlockOffsets(inputBlock);
+  return finishRun(huffmanDecompress(inputBlock));
+}
+
+/* Builds the tree and codes from the frequencies of the corpus. The
+ * counting isn't timed, as it is part of Huffman encoding.
+ */
+static size_t runTreeBuild(BlockDescriptor* inputBlock) {
+  FrequencyTable frequencyTable;
+  unsigned symbol;
+  initFrequencyTable(frequencyTable);
+  for (symbol = 0; symbol < FREQUENCY_TABLE_SIZE; symbol++) {
+    frequencyTable[symbol].frequency =
+      ((size_t*)inputBlock->address)[symbol];
+  }
+  makeHuffmanCodes(frequencyTable);
+  return 0;
+}
+
+static BlockDescriptor* prepareFrequencies(BlockDescriptor* corpusBlock) {
+  FrequencyTable frequencyTable;
+  BlockDescriptor* block = makeMemoryBlock(sizeof(size_t) *
+                                           FREQUENCY_TABLE_SIZE);
+  unsigned symbol;
+  initFrequencyTable(frequencyTable);
+  addToFrequencyTable(corpusBlock, frequencyTable);
+  for (symbol = 0; symbol < FREQUENCY_TABLE_SIZE; symbol++) {
+    ((size_t*)block->address)[symbol] = frequencyTable[symbol].frequency;
+  }
+  block->usedSize = sizeof(size_t) * FREQUENCY_TABLE_SIZE;
+  return block;
+}
+
+static const Stage stages[] = {
+  { "flip", prepareRaw, runFlip, True },
+  { "unflip", prepareFlipped, runUnflip, True },
+  { "rle-encode", prepareRaw, runRunLengthEncode, True },
+  { "rle-decode", prepareRunLength, runRunLengthDecode, True },
+  { "huffman-encode", prepareRaw, runHuffmanEncode, True },
+  { "huffman-decode", prepareHuffman, runHuffmanDecode, True },
+  { "tree-build", prepareFrequencies, runTreeBuild, False }
+};
+#define STAGE_COUNT (sizeof(stages) / sizeof(stages[0]))
+
+
+/* readCycleCounter()
+ *
+ * Read the time stamp counter where there is one, for cycles per byte.
+ *
+ * Return value:
+ * Counter, or 0 if there isn't one
+ */
+static unsigned long long readCycleCounter(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  return __builtin_ia32_rdtsc();
+#else
+  return 0;
+#endif
+}
+
+/* getTime()
+ *
+ * Monotonic time in seconds.
+ */
+static double getTime(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* runThread()
+ *
+ * Run a stage repeatedly for at least the minimum time. All the threads
+ * start together at the barrier.
+ *
+ * Parameters:
+ * argument - ThreadWork for this thread
+ */
+static void* runThread(void* argument) {
+  ThreadWork* work = argument;
+  double started;
+
+  work->runs = 0;
+  pthread_barrier_wait(work->barrier);
+  started = getTime();
+  do {
+    work->outputSize = work->stage->run(work->input);
+    work->runs++;
+  } while ((getTime() - started < work->minimumSeconds) || (work->runs < 3));
+  return NULL;
+}
+
+/* measureStage()
+ *
+ * Time a stage running on a number of threads at once. The time is
+ * from starting them all to the last one finishing, so with more
+ * threads than processors the result shows the total throughput, not
+ * that of one thread.
+ *
+ * Parameters:
+ * stage - stage to time
+ * input - prepared input, copied for each thread
+ * threadCount - number of threads
+ * minimumSeconds - least time for each thread to run the stage for
+ *
+ * Return value:
+ * Time taken and total number of runs
+ */
+static Measurement measureStage(const Stage* stage,
+                                const BlockDescriptor* input,
+                                unsigned threadCount,
+                                double minimumSeconds) {
+  ThreadWork works[MAXIMUM_THREADS];
+  pthread_t threads[MAXIMUM_THREADS];
+  pthread_barrier_t barrier;
+  Measurement result;
+  double started;
+  unsigned index;
+
+  /* This thread waits at the barrier as well, to start the clock */
+  pthread_barrier_init(&barrier, NULL, threadCount + 1);
+  for (index = 0; index < threadCount; index++) {
+    works[index].stage = stage;
+    works[index].input = copyBlock(input);
+    works[index].minimumSeconds = minimumSeconds;
+    works[index].barrier = &barrier;
+    errno = pthread_create(&threads[index], NULL, runThread, &works[index]);
+    if (errno) {
+      error(True, "Unable to create thread");
+    }
+  }
+
+  memset(&result, 0, sizeof(result));
+  pthread_barrier_wait(&barrier);
+  started = getTime();
+  result.cycles = readCycleCounter();
+  for (index = 0; index < threadCount; index++) {
+    pthread_join(threads[index], NULL);
+  }
+  result.cycles = readCycleCounter() - result.cycles;
+  result.seconds = getTime() - started;
+
+  for (index = 0; index < threadCount; index++) {
+    result.outputSize = works[index].outputSize;
+    result.runs += works[index].runs;
+    freeBlock(works[index].input);
+  }
+  pthread_barrier_destroy(&barrier);
+  return result;
+}
+
+/* parseList()
+ *
+ * Parse a comma separated list of numbers, which may end in K or M.
+ *
+ * Parameters:
+ * text - the list
+ * option - the switch it was given with, for error messages
+ * values - set to the numbers
+ *
+ * Return value:
+ * How many there are
+ */
+static unsigned parseList(const char* text, const char* option,
+                          unsigned long* values) {
+  unsigned count = 0;
+  char* copy = malloc(strlen(text) + 1);
+  char* item = NULL;
+
+  if (copy == NULL) {
+    error(True, "unable to malloc space for %s", option);
+  }
+  strcpy(copy, text);
+  for (item = strtok(copy, ","); item != NULL; item = strtok(NULL, ",")) {
+    if (count == MAXIMUM_LIST_SIZE) {
+      error(False, "Too many values for %s", option);
+    }
+    values[count++] = parseSize(item, option);
+  }
+  free(copy);
+  if (count == 0) {
+    error(False, "%s needs at least one value", option);
+  }
+  return count;
+}
+
+/* isCorpusSelected()
+ *
+ * Check whether a corpus was asked for with --corpus.
+ */
+static Boolean isCorpusSelected(const char* selected, const char* name) {
+  const char* found = NULL;
+  size_t length = strlen(name);
+  if (selected == NULL) {
+    return True;
+  }
+  for (found = strstr(selected, name); found != NULL;
+       found = strstr(found + 1, name)) {
+    if (((found == selected) || (found[-1] == ',')) &&
+        ((found[length] == '\0') || (found[length] == ','))) {
+      return True;
+    }
+  }
+  return False;
+}
+
+int main(int argc, char** argv) {
+  unsigned long sizes[MAXIMUM_LIST_SIZE] = { 64 * 1024, 1024 * 1024 };
+  unsigned long threadCounts[MAXIMUM_LIST_SIZE] = { 1, 2 };
+  unsigned sizeCount = 2;
+  unsigned threadCountCount = 2;
+  double minimumSeconds = 0.2;
+  const char* selectedCorpora = NULL;
+  const char* jsonFilename = NULL;
+  FILE* json = NULL;
+  Boolean firstResult = True;
+  size_t corpusIndex;
+  unsigned sizeIndex;
+  int index;
+
+  for (index = 1; index < argc; index++) {
+    if (!strcmp(argv[index], "-h") || !strcmp(argv[index], "--help")) {
+      printf("\n");
+      printf("%s [switches]\n", programName_g);
+      printf("Switches:\n");
+      printf("          -h or --help    Print this text\n");
+      printf("          --sizes n,...   Corpus sizes, K or M suffix allowed\n");
+      printf("                          (default 64K,1M)\n");
+      printf("          --threads n,... Numbers of threads (default 1,2)\n");
+      printf("          --time seconds  Least time to run each stage for\n");
+      printf("                          (default 0.2)\n");
+      printf("          --corpus name,...\n");
+      printf("                          Corpora to use, from html, logs,\n");
+      printf("                          random, runs and escapes (default all)\n");
+      printf("          --json name     Write the results to a JSON file\n");
+      printf("\n");
+      exit(0);
+    }
+    else if (index + 1 >= argc) {
+      error(False, "Unrecognised parameter %s, or it needs a value",
+            argv[index]);
+    }
+    else if (!strcmp(argv[index], "--sizes")) {
+      sizeCount = parseList(argv[++index], "--sizes", sizes);
+    }
+    else if (!strcmp(argv[index], "--threads")) {
+      threadCountCount = parseList(argv[++index], "--threads", threadCounts);
+    }
+    else if (!strcmp(argv[index], "--time")) {
+      minimumSeconds = atof(argv[++index]);
+    }
+    else if (!strcmp(argv[index], "--corpus")) {
+      selectedCorpora = argv[++index];
+    }
+    else if (!strcmp(argv[index], "--json")) {
+      jsonFilename = argv[++index];
+    }
+    else {
+      error(False, "Unrecognised parameter %s", argv[index]);
+    }
+  }
+  for (index = 0; index < (int)threadCountCount; index++) {
+    if ((threadCounts[index] == 0) || (threadCounts[index] > MAXIMUM_THREADS)) {
+      error(False, "Thread counts must be between 1 and %u", MAXIMUM_THREADS);
+    }
+  }
+
+  if (jsonFilename) {
+    json = fopen(jsonFilename, "w");
+    if (json == NULL) {
+      error(True, "Unable to create %s", jsonFilename);
+    }
+    fprintf(json, "{\"benchmark\": \"jlbench\", \"version\": 1, "
+            "\"cycle_counter\": %s, \"results\": [\n",
+            readCycleCounter() ? "\"tsc\"" : "null");
+  }
+
+  /* The stages print nothing while being timed */
+  enableStatistics(False);
+
+  printf("%-8s %9s %7s %-15s %10s %10s %12s %7s\n", "corpus", "size",
+         "threads", "stage", "out bytes", "MB/s", "cycles/byte", "runs");
+
+  for (corpusIndex = 0; corpusIndex < CORPUS_COUNT; corpusIndex++) {
+    const Corpus* corpus = &corpora[corpusIndex];
+    if (!isCorpusSelected(selectedCorpora, corpus->name)) {
+      continue;
+    }
+
+    for (sizeIndex = 0; sizeIndex < sizeCount; sizeIndex++) {
+      size_t size = sizes[sizeIndex];
+      BlockDescriptor* corpusBlock = makeMemoryBlock(size ? size : 1);
+      size_t stageIndex;
+
+      corpus->generate(corpusBlock->address, size, 1);
+      corpusBlock->usedSize = size;
+
+      for (stageIndex = 0; stageIndex < STAGE_COUNT; stageIndex++) {
+        const Stage* stage = &stages[stageIndex];
+        BlockDescriptor* input = stage->prepare(corpusBlock);
+        unsigned threadIndex;
+
+        for (threadIndex = 0; threadIndex < threadCountCount; threadIndex++) {
+          unsigned threadCount = threadCounts[threadIndex];
+          Measurement result = measureStage(stage, input, threadCount,
+                                            minimumSeconds);
+          /* Time each thread took per run */
+          double secondsPerRun = result.seconds * threadCount / result.runs;
+          double megabytesPerSecond = stage->perByte ?
+            result.runs * (size / 1e6) / result.seconds : 0;
+          double cyclesPerByte = (stage->perByte && result.cycles) ?
+            (double)result.cycles * threadCount / result.runs / size : 0;
+
+          printf("%-8s %9lu %7u %-15s %10lu ", corpus->name,
+                 (unsigned long)size, threadCount, stage->name,
+                 (unsigned long)result.outputSize);
+          if (stage->perByte) {
+            printf("%10.1f %12.2f", megabytesPerSecond, cyclesPerByte);
+          }
+          else {
+            printf("%8.2fus %12s", secondsPerRun * 1e6, "-");
+          }
+          printf(" %7lu\n", result.runs);
+          fflush(stdout);
+
+          if (json) {
+            fprintf(json, "%s{\"corpus\": \"%s\", \"size\": %lu, "
+                    "\"threads\": %u, \"stage\": \"%s\", "
+                    "\"output_size\": %lu, \"seconds_per_run\": %.9f, ",
+                    firstResult ? "  " : ",\n  ", corpus->name,
+                    (unsigned long)size, threadCount, stage->name,
+                    (unsigned long)result.outputSize, secondsPerRun);
+            if (stage->perByte) {
+              fprintf(json, "\"mb_per_s\": %.3f, \"cycles_per_byte\": %.3f}",
+                      megabytesPerSecond, cyclesPerByte);
+            }
+            else {
+              fprintf(json, "\"mb_per_s\": null, \"cycles_per_byte\": null}");
+            }
+            firstResult = False;
+          }
+        }
+        freeBlock(input);
+      }
+      freeBlock(corpusBlock);
+    }
+  }
+
+  if (json) {
+    fprintf(json, "\n]}\n");
+    if (fclose(json)) {
+      error(True, "Unable to write %s", jsonFilename);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,289 @@
+/* benchmark.c
+ *
+ * The --bench mode of jlcompress. Each file is read into memory once
+ * and then compressed and decompressed in memory with every combination
+ * of the stages, repeatedly, so the figures are for the codec rather
+ * than the disk. Every round trip is checked against the original, and
+ * a table of the compression ratio and speeds is printed for each file.
+ *
+ * The combinations are every filter setting (none, --delta,
+ * --xor-delta, --shuffle, and each delta with --shuffle), with or
+ * without --flip, with --rle, --rle2 or neither, with or without
+ * --huffman, and with or without --checksum. The filters use the
+ * element width from the command line, or BENCHMARK_ELEMENT_WIDTH.
+ *
+ * The block size, dictionary and number of threads from the command
+ * line are used for every combination. A dictionary can only be used
+ * with the stages it was trained with, so Huffman coding with one is
+ * skipped for the others. Threads only help blocked files, so with
+ * more than one thread and no --block-size the files are compressed
+ * in blocks of BENCHMARK_BLOCK_SIZE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "benchmark.h"
+#include "dataBlocks.h"
+#include "dictionary.h"
+#include "header.h"
+#include "threadPool.h"
+
+/* Each combination is run at least this many times... */
+#define MINIMUM_RUNS (3)
+/* ...and for at least this many seconds. There are over a hundred
+ * combinations, so this is kept short.
+ */
+#define MINIMUM_SECONDS (0.1)
+
+/* Block size used for several threads if none was given */
+#define BENCHMARK_BLOCK_SIZE (1024 * 1024)
+
+/* Element width for the filters if none was given */
+#define BENCHMARK_ELEMENT_WIDTH (4)
+
+/* Width of the stages column of the table */
+#define NAME_WIDTH (44)
+
+/* The filter settings benchmarked */
+static const unsigned char benchmarkFilters[] = {
+  0,
+  FILTER_DELTA,
+  FILTER_XOR_DELTA,
+  FILTER_SHUFFLE,
+  FILTER_DELTA | FILTER_SHUFFLE,
+  FILTER_XOR_DELTA | FILTER_SHUFFLE
+};
+
+/* getSeconds()
+ *
+ * Return value:
+ * Monotonic clock reading in seconds
+ */
+static double getSeconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* loadFile()
+ *
+ * Read a file into memory, so that timing it does not include paging
+ * it in.
+ *
+ * Parameters:
+ * filename - file to read
+ *
+ * Return value:
+ * Memory block holding the file
+ */
+static BlockDescriptor* loadFile(const char* filename) {
+  BlockDescriptor* mappedBlock = mapUncompressedFile(filename);
+  BlockDescriptor* block = makeMemoryBlock(mappedBlock->usedSize);
+  writeBytesToBlock(block, mappedBlock->address, mappedBlock->usedSize);
+  freeBlock(mappedBlock);
+  return block;
+}
+
+/* hasOneSymbol()
+ *
+ * The Huffman coder needs at least two different symbols, so a file of
+ * one repeated byte cannot be Huffman compressed as a single stream.
+ *
+ * Parameters:
+ * block - data to check
+ *
+ * Return value:
+ * True if every byte of the block is the same
+ */
+static Boolean hasOneSymbol(const BlockDescriptor* block) {
+  size_t index;
+  for (index = 1; index < block->usedSize; index++) {
+    if (block->address[index] != block->address[0]) {
+      return False;
+    }
+  }
+  return True;
+}
+
+/* describeStages()
+ *
+ * Make the name of a combination of stages for the table.
+ *
+ * Parameters:
+ * flags - stages selected
+ * name - filled in with the name
+ * nameSize - size of name
+ */
+static void describeStages(const struct CompressionFlags* flags,
+                           char* name,
+                           size_t nameSize) {
+  char filters[32] = "";
+
+  if (flags->filters) {
+    snprintf(filters, sizeof(filters), "%s%s ",
+             (flags->filters & FILTER_DELTA) ? "delta" :
+             (flags->filters & FILTER_XOR_DELTA) ? "xor-delta" : "",
+             (flags->filters & FILTER_SHUFFLE) ?
+             ((flags->filters & ~FILTER_SHUFFLE) ? "+shuffle" : "shuffle") :
+             "");
+  }
+  snprintf(name, nameSize, "%s%s%s%s%s",
+           filters,
+           flags->flip ? "flip " : "",
+           flags->rle ? (flags->rleVersion2 ? "rle2 " : "rle ") : "",
+           flags->huffman ? (flags->dictionary ? "dictionary " : "huffman ")
+           : "",
+           flags->checksum ? "checksum " : "");
+  name[strlen(name) - 1] = '\0';
+}
+
+/* benchmarkStages()
+ *
+ * Compress and decompress a file with one combination of stages until
+ * both have been run for long enough, check the round trip, and print
+ * a line of the table.
+ *
+ * Parameters:
+ * flags - stages to run
+ * block - file to compress
+ * filename - name of the file, for errors
+ */
+static void benchmarkStages(const struct CompressionFlags* flags,
+                            BlockDescriptor* block,
+                            const char* filename) {
+  BlockDescriptor* compressedBlock = NULL;
+  BlockDescriptor* decompressedBlock = NULL;
+  double megabytes = block->usedSize / 1e6;
+  double start;
+  double compressSeconds;
+  double decompressSeconds;
+  size_t compressedSize = 0;
+  unsigned runs;
+  char name[64];
+
+  describeStages(flags, name, sizeof(name));
+
+  start = getSeconds();
+  for (runs = 0; (runs < MINIMUM_RUNS) ||
+         (getSeconds() - start < MINIMUM_SECONDS); runs++) {
+    freeBlock(compressedBlock);
+    compressedBlock = compressBlock(flags, makeViewBlock(block->address,
+                                                         block->usedSize, 0));
+  }
+  compressSeconds = (getSeconds() - start) / runs;
+  compressedSize = compressedBlock->usedSize;
+
+  start = getSeconds();
+  for (runs = 0; (runs < MINIMUM_RUNS) ||
+         (getSeconds() - start < MINIMUM_SECONDS); runs++) {
+    freeBlock(decompressedBlock);
+    decompressedBlock =
+      decompressBlock(makeViewBlock(compressedBlock->address,
+                                    compressedBlock->usedSize,
+                                    compressedBlock->encoding));
+  }
+  decompressSeconds = (getSeconds() - start) / runs;
+
+  if ((decompressedBlock->usedSize != block->usedSize) ||
+      memcmp(decompressedBlock->address, block->address, block->usedSize)) {
+    error(False, "%s does not round trip with %s", filename, name);
+  }
+  freeBlock(decompressedBlock);
+  freeBlock(compressedBlock);
+
+  printf("%-*s %7.3f %12lu %14.1f %16.1f\n", NAME_WIDTH, name,
+         (double)block->usedSize / (compressedSize ? compressedSize : 1),
+         (unsigned long)compressedSize,
+         megabytes / compressSeconds, megabytes / decompressSeconds);
+}
+
+/* benchmarkFiles()
+ *
+ * Benchmark every combination of the stages on each file, and print a
+ * table of the results for each.
+ *
+ * Parameters:
+ * flags - command line switches. The stages are ignored, but the block
+ *         size, element width and dictionary are used.
+ * filenames - files to benchmark
+ * fileCount - number of files
+ */
+void benchmarkFiles(const struct CompressionFlags* flags,
+                    char** filenames,
+                    size_t fileCount) {
+  struct CompressionFlags stageFlags = *flags;
+  Boolean statistics = enableStatistics(False);
+  size_t index;
+
+  if ((stageFlags.blockSize == 0) && (getThreadCount() > 1)) {
+    stageFlags.blockSize = BENCHMARK_BLOCK_SIZE;
+  }
+  if (stageFlags.elementWidth == 0) {
+    stageFlags.elementWidth = BENCHMARK_ELEMENT_WIDTH;
+  }
+
+  for (index = 0; index < fileCount; index++) {
+    BlockDescriptor* block = NULL;
+    Boolean singleStreamHuffman;
+    size_t filter;
+    unsigned stages;
+
+    if (getFileSize(filenames[index]) == 0) {
+      printf("%s: empty, skipped\n", filenames[index]);
+      continue;
+    }
+    if (getCompressionFlags(filenames[index], False)) {
+      error(False, "%s is already compressed", filenames[index]);
+    }
+    block = loadFile(filenames[index]);
+    singleStreamHuffman = (stageFlags.blockSize == 0) &&
+      (stageFlags.dictionary == NULL) && hasOneSymbol(block);
+
+    printf("%s: %lu bytes, %u thread%s", filenames[index],
+           (unsigned long)block->usedSize, getThreadCount(),
+           (getThreadCount() > 1) ? "s" : "");
+    if (stageFlags.blockSize) {
+      printf(", %lu byte blocks", (unsigned long)stageFlags.blockSize);
+    }
+    printf(", %u byte elements", (unsigned)stageFlags.elementWidth);
+    printf("\n%-*s %7s %12s %14s %16s\n", NAME_WIDTH, "Stages", "Ratio",
+           "Compressed", "Compress MB/s", "Decompress MB/s");
+
+    /* Every combination of the filters, flip, rle or rle2, huffman and
+     * checksum except none at all. Bit 0 of stages is checksum, bit 1
+     * huffman, bits 2 and 3 no rle, rle or rle2 and bit 4 flip.
+     */
+    for (filter = 0; filter < sizeof(benchmarkFilters); filter++) {
+      for (stages = 0; stages < 32; stages++) {
+        unsigned char encoding;
+        if ((((stages >> 2) & 3) == 3) ||
+            ((benchmarkFilters[filter] == 0) && (stages == 0))) {
+          continue;
+        }
+        stageFlags.filters = benchmarkFilters[filter];
+        stageFlags.flip = (stages & 16) ? True : False;
+        stageFlags.rle = (stages & 12) ? True : False;
+        stageFlags.rleVersion2 = (((stages >> 2) & 3) == 2) ? True : False;
+        stageFlags.huffman = (stages & 2) ? True : False;
+        stageFlags.checksum = (stages & 1) ? True : False;
+        if (stageFlags.huffman && singleStreamHuffman) {
+          continue;
+        }
+        encoding = (stageFlags.filters ? ENCODING_FILTERED : 0) |
+          (stageFlags.flip ? ENCODING_FLIPPED : 0) |
+          (stageFlags.rle ? ENCODING_RUN_LENGTH : 0) |
+          (stageFlags.rleVersion2 ? ENCODING_RLE_V2 : 0);
+        if (stageFlags.huffman && stageFlags.dictionary &&
+            (encoding != getDictionaryStages(stageFlags.dictionary))) {
+          continue;
+        }
+        benchmarkStages(&stageFlags, block, filenames[index]);
+      }
+    }
+    printf("\n");
+    freeBlock(block);
+  }
+
+  enableStatistics(statistics);
+}
@@ -0,0 +1,14 @@
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+/* Declarations for benchmarking the stages on the user's own files, in
+ * benchmark.c
+ */
+
+#include "compression.h"
+
+void benchmarkFiles(const struct CompressionFlags* flags,
+                    char** filenames,
+                    size_t fileCount);
+
+#endif
@@ -0,0 +1,645 @@
+/* blockedFile.c
+ *
+ * The blocked compressed file format. Rather than compressing the whole
+ * file as one stream, the data is split into blocks of a fixed size
+ * which are each compressed on their own, with their own Huffman table,
+ * and a seek index recording where each block is in the original and
+ * compressed data is written after them. Any range of the original
+ * data can then be recovered by decompressing only the blocks which
+ * cover it, and the blocks can be compressed and decompressed on several
+ * threads at once.
+ *
+ * A blocked file has ENCODING_BLOCKED set in its header, along with the
+ * flags of the stages applied to the blocks. After the header it has
+ * the following format. Numbers are little endian, [n] is the number of
+ * bytes, and offsets are from the end of the header.
+ *
+ * <format version [1]> <block size [4]>
+ * <compressed block>...
+ * <block count [4]>
+ * <uncompressed offset [8]> <uncompressed size [4]>
+ *     <compressed offset [8]> <compressed size [4]>
+ *     <compression flags [2]>                       (once per block)
+ * <file checksum [4]>                     (with ENCODING_CHECKSUM only)
+ * <seek index offset [8]> <original size [8]>
+ *
+ * With ENCODING_CHECKSUM set each index entry also ends with the
+ * CRC32C of the block's original data, <block checksum [4]>, and the
+ * file checksum is the CRC32C of all of the original data. Each block
+ * is checked as it is decompressed, on whichever thread decompresses
+ * it, and the file checksum is checked against the block checksums
+ * when the index is read.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "blockedFile.h"
+#include "crc32c.h"
+#include "dataBlocks.h"
+#include "dictionary.h"
+#include "header.h"
+#include "probes.h"
+#include "segmentedBuffer.h"
+#include "statistics.h"
+#include "threadPool.h"
+
+#define BLOCKED_FORMAT_VERSION (1)
+#define BLOCKED_PREAMBLE_SIZE (5)
+#define SEEK_INDEX_ENTRY_SIZE (26)
+#define BLOCKED_TRAILER_SIZE (16)
+
+/* Largest block size which fits in the index */
+#define MAXIMUM_BLOCK_SIZE (0xffffffffUL)
+
+/* hasSeveralSymbols()
+ *
+ * Check whether a block contains at least two different byte values.
+ *
+ * Parameters:
+ * block - block to check
+ *
+ * Return value:
+ * True if it does
+ */
+Boolean hasSeveralSymbols(const BlockDescriptor* block) {
+  size_t index;
+  for (index = 1; index < block->usedSize; index++) {
+    if (block->address[index] != block->address[0]) {
+      return True;
+    }
+  }
+  return False;
+}
+
+/* writeBlockedPreamble()
+ *
+ * Write the start of a blocked file, which comes before the first
+ * block.
+ *
+ * Parameters:
+ * outputBlock - block to write to
+ * blockSize - size of the blocks
+ */
+void writeBlockedPreamble(BlockDescriptor* outputBlock,
+                          unsigned long blockSize) {
+  writeToBlock(outputBlock, BLOCKED_FORMAT_VERSION);
+  writeNumberToBlock(outputBlock, blockSize, 4);
+}
+
+/* writeSeekIndex()
+ *
+ * Append the seek index and trailer to the compressed data.
+ *
+ * Parameters:
+ * outputBlock - block to write to, usually the compressed data
+ * indexOffset - offset of the index from the end of the header
+ * entries - index entries
+ * blockCount - number of entries
+ * originalSize - size of the uncompressed data
+ * checksums - True to write the block and file checksums
+ */
+void writeSeekIndex(BlockDescriptor* outputBlock,
+                    unsigned long indexOffset,
+                    const SeekIndexEntry* entries,
+                    size_t blockCount,
+                    unsigned long originalSize,
+                    Boolean checksums) {
+  unsigned long fileChecksum = 0;
+  size_t index;
+
+  writeNumberToBlock(outputBlock, blockCount, 4);
+  for (index = 0; index < blockCount; index++) {
+    writeNumberToBlock(outputBlock, entries[index].uncompressedOffset, 8);
+    writeNumberToBlock(outputBlock, entries[index].uncompressedSize, 4);
+    writeNumberToBlock(outputBlock, entries[index].compressedOffset, 8);
+    writeNumberToBlock(outputBlock, entries[index].compressedSize, 4);
+    writeNumberToBlock(outputBlock, entries[index].encoding, 2);
+    if (checksums) {
+      writeNumberToBlock(outputBlock, entries[index].checksum, CHECKSUM_SIZE);
+      fileChecksum = crc32cCombine(fileChecksum, entries[index].checksum,
+                                   entries[index].uncompressedSize);
+    }
+  }
+  if (checksums) {
+    writeNumberToBlock(outputBlock, fileChecksum, CHECKSUM_SIZE);
+  }
+  writeNumberToBlock(outputBlock, indexOffset, 8);
+  writeNumberToBlock(outputBlock, originalSize, 8);
+}
+
+/* Shared by the tasks compressing the blocks of one file */
+typedef struct {
+  const struct CompressionFlags* flags;
+  struct CompressionFlags blockFlags;
+  BlockDescriptor* inputBlock;
+  unsigned long blockSize;
+  BlockDescriptor** compressedBlocks;
+  unsigned long* checksums;
+} CompressionTasks;
+
+/* compressOneBlock()
+ *
+ * Compress one block of the file. Run by runTasks(), so blocks may be
+ * compressed at the same time.
+ *
+ * Parameters:
+ * context - the CompressionTasks
+ * index - number of the block
+ */
+static void compressOneBlock(void* context, size_t index) {
+  CompressionTasks* tasks = context;
+  const struct CompressionFlags* flags = tasks->flags;
+  unsigned long offset = index * tasks->blockSize;
+  unsigned long size = tasks->inputBlock->usedSize - offset;
+  BlockDescriptor* compressedBlock = NULL;
+  StageTimer blockTimer;
+  StageTimer timer;
+
+  if (size > tasks->blockSize) {
+    size = tasks->blockSize;
+  }
+  setStatisticsBlock(index);
+  startStage(&blockTimer, "compress-block", size);
+  /* Checksum the block while it is in this processor's cache */
+  if (flags->checksum) {
+    startStage(&timer, "checksum", size);
+    tasks->checksums[index] = crc32c(0, tasks->inputBlock->address + offset,
+                                     size);
+    finishStage(&timer, size);
+  }
+  compressedBlock = compressBlock(&tasks->blockFlags,
+                                  makeViewBlock(tasks->inputBlock->address +
+                                                offset, size, 0));
+  /* The Huffman coder needs at least two different symbols, and a
+   * block of a single repeated byte may not have them. A dictionary
+   * has codes for every symbol.
+   */
+  if (flags->huffman &&
+      (flags->dictionary || hasSeveralSymbols(compressedBlock))) {
+    BlockDescriptor* huffmanBlock = NULL;
+    startStage(&timer, "huffman-encode", compressedBlock->usedSize);
+    huffmanBlock = flags->dictionary ?
+      compressWithDictionary(compressedBlock, flags->dictionary) :
+      huffmanCompress(compressedBlock);
+    finishStage(&timer, huffmanBlock->usedSize);
+    freeBlock(compressedBlock);
+    compressedBlock = huffmanBlock;
+  }
+  /* Store blocks which the stages made bigger as they are */
+  if (compressedBlock->usedSize >= size) {
+    freeBlock(compressedBlock);
+    compressedBlock = makeViewBlock(tasks->inputBlock->address + offset,
+                                    size, 0);
+  }
+  tasks->compressedBlocks[index] = compressedBlock;
+  PROBE4(block__compressed, index, size, compressedBlock->usedSize,
+         compressedBlock->encoding);
+  finishStage(&blockTimer, compressedBlock->usedSize);
+  setStatisticsBlock(-1);
+}
+
+/* compressBlockedToSegments()
+ *
+ * Compress a block in the blocked format, splitting it into blocks of
+ * flags->blockSize bytes which are each put through the selected
+ * stages. The blocks are compressed on as many threads as
+ * setThreadCount() gave, and are attached to the output where they
+ * are rather than copied together.
+ *
+ * Parameters:
+ * flags - command line switches
+ * inputBlock - block to compress. It is not freed, and must be kept
+ *              until the output is freed, since blocks which are stored
+ *              uncompressed are views of it.
+ *
+ * Return value:
+ * Compressed data, with ENCODING_BLOCKED set
+ */
+SegmentedBuffer* compressBlockedToSegments(const struct CompressionFlags* flags,
+                                           BlockDescriptor* inputBlock) {
+  unsigned long blockSize = flags->blockSize;
+  size_t blockCount = (inputBlock->usedSize + blockSize - 1) / blockSize;
+  SeekIndexEntry* entries = calloc(blockCount ? blockCount : 1,
+                                   sizeof(SeekIndexEntry));
+  SegmentedBuffer* segments = makeSegmentedBuffer(0);
+  BlockDescriptor* outputBlock = NULL;
+  CompressionTasks tasks;
+  unsigned char stageFlags = 0;
+  Boolean statistics;
+  size_t index;
+
+  if ((blockSize == 0) || (blockSize > MAXIMUM_BLOCK_SIZE)) {
+    error(False, "Block size must be between 1 and %lu bytes",
+          MAXIMUM_BLOCK_SIZE);
+  }
+  tasks.compressedBlocks = calloc(blockCount ? blockCount : 1,
+                                  sizeof(BlockDescriptor*));
+  tasks.checksums = calloc(blockCount ? blockCount : 1, sizeof(unsigned long));
+  if ((entries == NULL) || (tasks.compressedBlocks == NULL) ||
+      (tasks.checksums == NULL)) {
+    error(True, "malloc failed for seek index of %lu blocks",
+          (unsigned long)blockCount);
+  }
+  if (inputBlock->encoding) {
+    error(False, "File already compressed");
+  }
+
+  /* The blocks themselves are single streams, and Huffman compression
+   * is applied to them separately
+   */
+  tasks.flags = flags;
+  tasks.blockFlags = *flags;
+  tasks.blockFlags.blockSize = 0;
+  tasks.blockFlags.huffman = False;
+  tasks.blockFlags.checksum = False;
+  tasks.inputBlock = inputBlock;
+  tasks.blockSize = blockSize;
+
+  /* A line per stage per block would be too much */
+  statistics = enableStatistics(False);
+  runTasks(blockCount, compressOneBlock, &tasks);
+  enableStatistics(statistics);
+
+  outputBlock = makeMemoryBlock(BLOCKED_PREAMBLE_SIZE);
+  writeBlockedPreamble(outputBlock, blockSize);
+  attachBlockToSegments(segments, outputBlock);
+  for (index = 0; index < blockCount; index++) {
+    BlockDescriptor* compressedBlock = tasks.compressedBlocks[index];
+    entries[index].uncompressedOffset = index * blockSize;
+    entries[index].uncompressedSize = (index + 1 < blockCount) ? blockSize :
+      inputBlock->usedSize - index * blockSize;
+    entries[index].compressedOffset = segments->usedSize;
+    entries[index].compressedSize = compressedBlock->usedSize;
+    entries[index].encoding = compressedBlock->encoding;
+    entries[index].checksum = tasks.checksums[index];
+    stageFlags |= compressedBlock->encoding;
+    attachBlockToSegments(segments, compressedBlock);
+  }
+
+  outputBlock = makeMemoryBlock(4 + blockCount * (SEEK_INDEX_ENTRY_SIZE +
+                                                  CHECKSUM_SIZE) +
+                                CHECKSUM_SIZE + BLOCKED_TRAILER_SIZE);
+  writeSeekIndex(outputBlock, segments->usedSize, entries, blockCount,
+                 inputBlock->usedSize, flags->checksum);
+  attachBlockToSegments(segments, outputBlock);
+  segments->encoding = stageFlags | ENCODING_BLOCKED |
+    (flags->checksum ? ENCODING_CHECKSUM : 0);
+  free(tasks.compressedBlocks);
+  free(tasks.checksums);
+  free(entries);
+
+  if (statistics) {
+    printf("- %lu blocks of up to %lu bytes\n",
+           (unsigned long)blockCount, blockSize);
+  }
+  displaySizeStatistics("Blocked compressing", inputBlock->usedSize,
+                        segments->usedSize);
+  return segments;
+}
+
+/* compressBlocked()
+ *
+ * As compressBlockedToSegments(), with the output in one block.
+ *
+ * Parameters:
+ * flags - command line switches
+ * inputBlock - block to compress. It is not freed.
+ *
+ * Return value:
+ * Compressed data, with ENCODING_BLOCKED set
+ */
+BlockDescriptor* compressBlocked(const struct CompressionFlags* flags,
+                                 BlockDescriptor* inputBlock) {
+  return flattenSegments(compressBlockedToSegments(flags, inputBlock));
+}
+
+/* readSeekIndex()
+ *
+ * Read the seek index of a blocked file. Only the trailer and the
+ * index are touched.
+ *
+ * Parameters:
+ * inputBlock - compressed data, with ENCODING_BLOCKED set
+ *
+ * Return value:
+ * Seek index, to be freed with freeSeekIndex()
+ */
+SeekIndex* readSeekIndex(BlockDescriptor* inputBlock) {
+  SeekIndex* seekIndex = malloc(sizeof(SeekIndex));
+  BlockDescriptor* view = NULL;
+  unsigned long indexOffset;
+  unsigned long expectedOffset = 0;
+  unsigned long fileChecksum = 0;
+  size_t entrySize = SEEK_INDEX_ENTRY_SIZE;
+  size_t checksumSize = 0;
+  size_t index;
+
+  if (seekIndex == NULL) {
+    error(True, "malloc failed for seek index");
+  }
+  seekIndex->hasChecksums = (inputBlock->encoding & ENCODING_CHECKSUM) ?
+    True : False;
+  if (seekIndex->hasChecksums) {
+    entrySize += CHECKSUM_SIZE;
+    checksumSize = CHECKSUM_SIZE;
+  }
+  if (!(inputBlock->encoding & ENCODING_BLOCKED)) {
+    error(False, "File is not in the blocked format");
+  }
+  if (inputBlock->usedSize < BLOCKED_PREAMBLE_SIZE + BLOCKED_TRAILER_SIZE + 4) {
+    error(False, "Damaged input file - too small for a blocked file");
+  }
+  if (inputBlock->address[0] != BLOCKED_FORMAT_VERSION) {
+    error(False, "Blocked format version %u is not supported",
+          inputBlock->address[0]);
+  }
+
+  view = makeViewBlock(inputBlock->address + 1, 4, 0);
+  seekIndex->blockSize = readNumberFromBlock(view, 4);
+  freeBlock(view);
+
+  view = makeViewBlock(inputBlock->address + inputBlock->usedSize -
+                       BLOCKED_TRAILER_SIZE, BLOCKED_TRAILER_SIZE, 0);
+  indexOffset = readNumberFromBlock(view, 8);
+  seekIndex->originalSize = readNumberFromBlock(view, 8);
+  freeBlock(view);
+
+  if ((indexOffset < BLOCKED_PREAMBLE_SIZE) ||
+      (indexOffset > inputBlock->usedSize - BLOCKED_TRAILER_SIZE - 4)) {
+    error(False, "Damaged input file - bad seek index offset");
+  }
+
+  view = makeViewBlock(inputBlock->address + indexOffset,
+                       inputBlock->usedSize - BLOCKED_TRAILER_SIZE - indexOffset,
+                       0);
+  seekIndex->blockCount = readNumberFromBlock(view, 4);
+  if (seekIndex->blockCount * entrySize + 4 + checksumSize != view->usedSize) {
+    error(False, "Damaged input file - bad seek index size");
+  }
+  seekIndex->entries = calloc(seekIndex->blockCount ? seekIndex->blockCount : 1,
+                              sizeof(SeekIndexEntry));
+  if (seekIndex->entries == NULL) {
+    error(True, "malloc failed for seek index of %lu blocks",
+          (unsigned long)seekIndex->blockCount);
+  }
+
+  for (index = 0; index < seekIndex->blockCount; index++) {
+    SeekIndexEntry* entry = &seekIndex->entries[index];
+    entry->uncompressedOffset = readNumberFromBlock(view, 8);
+    entry->uncompressedSize = readNumberFromBlock(view, 4);
+    entry->compressedOffset = readNumberFromBlock(view, 8);
+    entry->compressedSize = readNumberFromBlock(view, 4);
+    entry->encoding = readNumberFromBlock(view, 2);
+    if (seekIndex->hasChecksums) {
+      entry->checksum = readNumberFromBlock(view, CHECKSUM_SIZE);
+      fileChecksum = crc32cCombine(fileChecksum, entry->checksum,
+                                   entry->uncompressedSize);
+    }
+
+    if ((entry->uncompressedOffset != expectedOffset) ||
+        (entry->compressedOffset < BLOCKED_PREAMBLE_SIZE) ||
+        (entry->compressedOffset > indexOffset) ||
+        (entry->compressedSize > indexOffset - entry->compressedOffset)) {
+      error(False, "Damaged input file - bad seek index entry %lu",
+            (unsigned long)index);
+    }
+    expectedOffset += entry->uncompressedSize;
+  }
+  if (seekIndex->hasChecksums) {
+    seekIndex->checksum = readNumberFromBlock(view, CHECKSUM_SIZE);
+    if (seekIndex->checksum != fileChecksum) {
+      error(False, "Damaged input file - block checksums don't match the file checksum");
+    }
+  }
+  freeBlock(view);
+
+  if (expectedOffset != seekIndex->originalSize) {
+    error(False, "Damaged input file - blocks don't add up to the file size");
+  }
+  return seekIndex;
+}
+
+/* freeSeekIndex()
+ *
+ * Free a seek index read by readSeekIndex().
+ */
+void freeSeekIndex(SeekIndex* seekIndex) {
+  if (seekIndex != NULL) {
+    free(seekIndex->entries);
+    free(seekIndex);
+  }
+}
+
+/* findSeekIndexEntry()
+ *
+ * Binary search the seek index for the block holding an offset in the
+ * original data.
+ *
+ * Parameters:
+ * seekIndex - seek index
+ * offset - offset in the original data, less than the original size
+ *
+ * Return value:
+ * Index of the entry for the block
+ */
+size_t findSeekIndexEntry(const SeekIndex* seekIndex, unsigned long offset) {
+  size_t low = 0;
+  size_t high = seekIndex->blockCount;
+  while (high - low > 1) {
+    size_t middle = low + (high - low) / 2;
+    if (seekIndex->entries[middle].uncompressedOffset <= offset) {
+      low = middle;
+    }
+    else {
+      high = middle;
+    }
+  }
+  return low;
+}
+
+/* decompressIndexedBlock()
+ *
+ * Decompress one block of a blocked file, and check its checksum if
+ * the file has them.
+ *
+ * Parameters:
+ * inputBlock - compressed data
+ * seekIndex - seek index of the file
+ * index - number of the block
+ *
+ * Return value:
+ * Decompressed block
+ */
+BlockDescriptor* decompressIndexedBlock(BlockDescriptor* inputBlock,
+                                        const SeekIndex* seekIndex,
+                                        size_t index) {
+  const SeekIndexEntry* entry = &seekIndex->entries[index];
+  BlockDescriptor* outputBlock =
+    decompressBlock(makeViewBlock(inputBlock->address + entry->compressedOffset,
+                                  entry->compressedSize, entry->encoding));
+  StageTimer timer;
+
+  if (outputBlock->usedSize != entry->uncompressedSize) {
+    error(False, "Damaged input file - block at %lu has the wrong size",
+          entry->uncompressedOffset);
+  }
+  if (seekIndex->hasChecksums) {
+    startStage(&timer, "verify-checksum", outputBlock->usedSize);
+    if (crc32c(0, outputBlock->address, outputBlock->usedSize) !=
+        entry->checksum) {
+      error(False, "Damaged input file - checksum of block %lu doesn't match the data",
+            (unsigned long)index);
+    }
+    finishStage(&timer, outputBlock->usedSize);
+  }
+  return outputBlock;
+}
+
+/* Shared by the tasks decompressing the blocks of one file */
+typedef struct {
+  BlockDescriptor* inputBlock;
+  const SeekIndex* seekIndex;
+  BlockDescriptor* outputBlock;
+} DecompressionTasks;
+
+/* decompressOneBlock()
+ *
+ * Decompress one block straight into its place in the output. Run by
+ * runTasks(), so blocks may be decompressed at the same time.
+ *
+ * Parameters:
+ * context - the DecompressionTasks
+ * index - number of the block
+ */
+static void decompressOneBlock(void* context, size_t index) {
+  DecompressionTasks* tasks = context;
+  const SeekIndexEntry* entry = &tasks->seekIndex->entries[index];
+  BlockDescriptor* block = NULL;
+  StageTimer timer;
+
+  setStatisticsBlock(index);
+  startStage(&timer, "decompress-block", entry->compressedSize);
+  block = decompressIndexedBlock(tasks->inputBlock, tasks->seekIndex, index);
+  memcpy(tasks->outputBlock->address + entry->uncompressedOffset,
+         block->address, block->usedSize);
+  countCopy(block->usedSize);
+  freeBlock(block);
+  PROBE4(block__decompressed, index, entry->compressedSize,
+         entry->uncompressedSize, entry->encoding);
+  finishStage(&timer, entry->uncompressedSize);
+  setStatisticsBlock(-1);
+}
+
+/* decompressBlocked()
+ *
+ * Decompress the whole of a blocked file, on as many threads as
+ * setThreadCount() gave.
+ *
+ * Parameters:
+ * inputBlock - compressed data, with ENCODING_BLOCKED set. It is not freed.
+ *
+ * Return value:
+ * Decompressed data
+ */
+BlockDescriptor* decompressBlocked(BlockDescriptor* inputBlock) {
+  SeekIndex* seekIndex = readSeekIndex(inputBlock);
+  DecompressionTasks tasks;
+  Boolean statistics = enableStatistics(False);
+
+  tasks.inputBlock = inputBlock;
+  tasks.seekIndex = seekIndex;
+  tasks.outputBlock = makeMemoryBlock(seekIndex->originalSize ?
+                                      seekIndex->originalSize : 1);
+  runTasks(seekIndex->blockCount, decompressOneBlock, &tasks);
+  tasks.outputBlock->usedSize = seekIndex->originalSize;
+  tasks.outputBlock->nextFreeByte = seekIndex->originalSize;
+
+  freeSeekIndex(seekIndex);
+  enableStatistics(statistics);
+  displayStatistics("Blocked decompressing", inputBlock, tasks.outputBlock);
+  return tasks.outputBlock;
+}
+
+/* decompressRange()
+ *
+ * Decompress a range of the original data. For a blocked file only the
+ * blocks covering the range are read and decompressed. A single stream
+ * file has to be decompressed in full and the range cut out of it.
+ *
+ * Parameters:
+ * inputBlock - compressed data. It is not freed.
+ * offset - offset of the start of the range in the original data
+ * length - length of the range. It is cut short at the end of the data.
+ *
+ * Return value:
+ * Block holding the range
+ */
+BlockDescriptor* decompressRange(BlockDescriptor* inputBlock,
+                                 unsigned long offset,
+                                 unsigned long length) {
+  BlockDescriptor* outputBlock = NULL;
+  Boolean statistics = enableStatistics(False);
+
+  if (inputBlock->encoding & ENCODING_BLOCKED) {
+    SeekIndex* seekIndex = readSeekIndex(inputBlock);
+    size_t first;
+    size_t index;
+
+    if (offset > seekIndex->originalSize) {
+      error(False, "Range starts after the end of the %lu byte file",
+            seekIndex->originalSize);
+    }
+    if (length > seekIndex->originalSize - offset) {
+      length = seekIndex->originalSize - offset;
+    }
+
+    outputBlock = makeMemoryBlock(length ? length : 1);
+    first = findSeekIndexEntry(seekIndex, offset);
+    for (index = first;
+         (index < seekIndex->blockCount) &&
+           (seekIndex->entries[index].uncompressedOffset < offset + length);
+         index++) {
+      const SeekIndexEntry* entry = &seekIndex->entries[index];
+      BlockDescriptor* block = decompressIndexedBlock(inputBlock, seekIndex,
+                                                      index);
+      unsigned long start = offset > entry->uncompressedOffset ?
+        offset - entry->uncompressedOffset : 0;
+      unsigned long end = entry->uncompressedSize;
+      if (entry->uncompressedOffset + end > offset + length) {
+        end = offset + length - entry->uncompressedOffset;
+      }
+      writeBytesToBlock(outputBlock, block->address + start, end - start);
+      freeBlock(block);
+    }
+
+    if (statistics) {
+      printf("- Range %lu:%lu - decompressed %lu of %lu blocks\n",
+             offset, length, (unsigned long)(index - first),
+             (unsigned long)seekIndex->blockCount);
+    }
+    freeSeekIndex(seekIndex);
+  }
+  else {
+    BlockDescriptor* wholeBlock =
+      decompressBlock(makeViewBlock(inputBlock->address, inputBlock->usedSize,
+                                    inputBlock->encoding));
+    if (offset > wholeBlock->usedSize) {
+      error(False, "Range starts after the end of the %lu byte file",
+            (unsigned long)wholeBlock->usedSize);
+    }
+    if (length > wholeBlock->usedSize - offset) {
+      length = wholeBlock->usedSize - offset;
+    }
+    outputBlock = makeMemoryBlock(length ? length : 1);
+    writeBytesToBlock(outputBlock, wholeBlock->address + offset, length);
+    freeBlock(wholeBlock);
+
+    if (statistics) {
+      printf("- Range %lu:%lu - file is a single stream, so decompressed all of it\n",
+             offset, length);
+    }
+  }
+
+  enableStatistics(statistics);
+  return outputBlock;
+}
@@ -0,0 +1,59 @@
+#ifndef BLOCKED_FILE_H
+#define BLOCKED_FILE_H
+
+/*
+ * Declarations for the blocked compressed file format, in which the
+ * data is split into independently compressed blocks with a seek
+ * index at the end. See blockedFile.c.
+ */
+
+#include "compression.h"
+
+/* Where one block is, in the original data and in the compressed data */
+typedef struct {
+  unsigned long uncompressedOffset;
+  unsigned long uncompressedSize;
+  unsigned long compressedOffset;
+  unsigned long compressedSize;
+  unsigned char encoding;
+  /* CRC32C of the block's original data, if the file has checksums */
+  unsigned long checksum;
+} SeekIndexEntry;
+
+typedef struct {
+  unsigned long blockSize;
+  unsigned long originalSize;
+  size_t blockCount;
+  SeekIndexEntry* entries;
+  /* True if the file has checksums, and the CRC32C of the whole file */
+  Boolean hasChecksums;
+  unsigned long checksum;
+} SeekIndex;
+
+BlockDescriptor* compressBlocked(const struct CompressionFlags* flags,
+                                 BlockDescriptor* inputBlock);
+SegmentedBuffer* compressBlockedToSegments(const struct CompressionFlags* flags,
+                                           BlockDescriptor* inputBlock);
+Boolean hasSeveralSymbols(const BlockDescriptor* block);
+void writeBlockedPreamble(BlockDescriptor* outputBlock,
+                          unsigned long blockSize);
+void writeSeekIndex(BlockDescriptor* outputBlock,
+                    unsigned long indexOffset,
+                    const SeekIndexEntry* entries,
+                    size_t blockCount,
+                    unsigned long originalSize,
+                    Boolean checksums);
+BlockDescriptor* decompressBlocked(BlockDescriptor* inputBlock);
+
+SeekIndex* readSeekIndex(BlockDescriptor* inputBlock);
+void freeSeekIndex(SeekIndex* seekIndex);
+size_t findSeekIndexEntry(const SeekIndex* seekIndex, unsigned long offset);
+BlockDescriptor* decompressIndexedBlock(BlockDescriptor* inputBlock,
+                                        const SeekIndex* seekIndex,
+                                        size_t index);
+
+BlockDescriptor* decompressRange(BlockDescriptor* inputBlock,
+                                 unsigned long offset,
+                                 unsigned long length);
+
+#endif
@@ -0,0 +1,285 @@
+/* bufferPool.c
+ *
+ * A pool of the buffers which hold the data of memory blocks. Every
+ * stage of compression makes a new block for its output and frees its
+ * input, so without the pool each stage of each file or block would map
+ * fresh memory from the kernel, which has to zero it and take a page
+ * fault on every page as it is first written. Instead large buffers are
+ * kept when they are freed and handed out again to the next stage, the
+ * next block or the next file that needs one of the same size, already
+ * mapped and faulted in.
+ *
+ * Buffers of POOL_MINIMUM_SIZE or more are rounded up to a power of two
+ * so that buffers of similar sizes can be reused for each other, and
+ * are mapped directly rather than with malloc(), so rounding up only
+ * costs address space until the memory is used. Buffers of
+ * HUGE_PAGE_SIZE or more are mapped with MAP_HUGETLB if the system has
+ * huge pages reserved, and otherwise aligned to a huge page and marked
+ * with MADV_HUGEPAGE so that the kernel can back them with transparent
+ * huge pages. Either way the loops over them need fewer TLB entries.
+ * Smaller buffers are left to malloc(), which already reuses them.
+ *
+ * Only a few buffers of each size, and a limited total, are kept, so a
+ * large file doesn't leave the program holding its memory for the rest
+ * of a batch.
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "bufferPool.h"
+#include "compression.h"
+#include "statistics.h"
+
+/* Number of sizes of buffer, each twice the one before */
+#define POOL_SIZE_CLASSES (40)
+
+/* Free buffers kept of each size */
+#define POOL_BUFFERS_PER_CLASS (4)
+
+/* Total size of the free buffers kept */
+#define POOL_CACHE_LIMIT (512UL * 1024 * 1024)
+
+static pthread_mutex_t poolMutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned char* freeBuffers[POOL_SIZE_CLASSES][POOL_BUFFERS_PER_CLASS];
+static unsigned freeBufferCounts[POOL_SIZE_CLASSES];
+static BufferPoolCounts poolCounts;
+
+/* Set once a MAP_HUGETLB mapping has failed, so it isn't tried again */
+static Boolean hugeTlbUnavailable = False;
+
+/* getSizeClass()
+ *
+ * Find the size class a buffer belongs to.
+ *
+ * Parameters:
+ * size - size of the buffer, at least POOL_MINIMUM_SIZE
+ * capacity - set to the size of the buffers in the class
+ *
+ * Return value:
+ * Number of the class, which may be POOL_SIZE_CLASSES or more for
+ * buffers too big to keep
+ */
+static unsigned getSizeClass(size_t size, size_t* capacity) {
+  unsigned sizeClass = 0;
+  size_t classSize = POOL_MINIMUM_SIZE;
+
+  while ((classSize < size) && (classSize <= SIZE_MAX / 2)) {
+    classSize *= 2;
+    sizeClass++;
+  }
+  *capacity = (classSize < size) ? size : classSize;
+  return sizeClass;
+}
+
+/* mapBuffer()
+ *
+ * Get memory for a new buffer from the kernel.
+ *
+ * Parameters:
+ * capacity - size of the buffer
+ *
+ * Return value:
+ * Address of the buffer
+ */
+static unsigned char* mapBuffer(size_t capacity) {
+  unsigned char* mapping = NULL;
+  unsigned char* address = NULL;
+  size_t head = 0;
+
+#ifdef MAP_HUGETLB
+  if ((capacity >= HUGE_PAGE_SIZE) && (capacity % HUGE_PAGE_SIZE == 0) &&
+      !__atomic_load_n(&hugeTlbUnavailable, __ATOMIC_RELAXED)) {
+    address = mmap(NULL, capacity, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (address != MAP_FAILED) {
+      pthread_mutex_lock(&poolMutex);
+      poolCounts.hugeTlbBuffers++;
+      pthread_mutex_unlock(&poolMutex);
+      return address;
+    }
+    __atomic_store_n(&hugeTlbUnavailable, True, __ATOMIC_RELAXED);
+  }
+#endif
+
+  if (capacity < HUGE_PAGE_SIZE) {
+    address = mmap(NULL, capacity, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (address == MAP_FAILED) {
+      error(True, "Unable to map a buffer of %lu bytes",
+            (unsigned long)capacity);
+    }
+    return address;
+  }
+
+  /* Transparent huge pages have to start on a huge page boundary, so
+   * map an extra huge page and trim the mapping to a boundary
+   */
+  mapping = mmap(NULL, capacity + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mapping == MAP_FAILED) {
+    error(True, "Unable to map a buffer of %lu bytes",
+          (unsigned long)capacity);
+  }
+  head = (HUGE_PAGE_SIZE - ((uintptr_t)mapping % HUGE_PAGE_SIZE)) %
+    HUGE_PAGE_SIZE;
+  address = mapping + head;
+  if (head) {
+    munmap(mapping, head);
+  }
+  munmap(address + capacity, HUGE_PAGE_SIZE - head);
+#ifdef MADV_HUGEPAGE
+  if (madvise(address, capacity, MADV_HUGEPAGE) == 0) {
+    pthread_mutex_lock(&poolMutex);
+    poolCounts.transparentHugeBuffers++;
+    pthread_mutex_unlock(&poolMutex);
+  }
+#endif
+  return address;
+}
+
+/* allocateBuffer()
+ *
+ * Get a buffer for a memory block, from the pool if one of the right
+ * size is free. Its contents are undefined, as with malloc().
+ *
+ * Parameters:
+ * size - number of bytes needed
+ * capacity - if not NULL, set to the number of bytes in the buffer,
+ *            which may be more than size
+ *
+ * Return value:
+ * Address of the buffer, which must be freed with releaseBuffer()
+ */
+unsigned char* allocateBuffer(size_t size, size_t* capacity) {
+  unsigned char* address = NULL;
+  size_t classSize = 0;
+  unsigned sizeClass;
+
+  if (size == 0) {
+    size = 1;
+  }
+  if (size < POOL_MINIMUM_SIZE) {
+    address = malloc(size);
+    if (address == NULL) {
+      error(True, "malloc failed for a buffer of %lu bytes",
+            (unsigned long)size);
+    }
+    if (capacity) {
+      *capacity = size;
+    }
+    return address;
+  }
+
+  sizeClass = getSizeClass(size, &classSize);
+  pthread_mutex_lock(&poolMutex);
+  if ((sizeClass < POOL_SIZE_CLASSES) && freeBufferCounts[sizeClass]) {
+    address = freeBuffers[sizeClass][--freeBufferCounts[sizeClass]];
+    poolCounts.cachedBytes -= classSize;
+    poolCounts.hits++;
+  }
+  else {
+    poolCounts.misses++;
+  }
+  pthread_mutex_unlock(&poolMutex);
+  countPoolAllocation(address ? True : False);
+
+  if (address == NULL) {
+    address = mapBuffer(classSize);
+  }
+  if (capacity) {
+    *capacity = classSize;
+  }
+  return address;
+}
+
+/* resizeBuffer()
+ *
+ * Make a buffer bigger or smaller, keeping its contents, as realloc()
+ * does.
+ *
+ * Parameters:
+ * address - the buffer, from allocateBuffer() or resizeBuffer()
+ * oldSize - its size, as given to or returned by the function which
+ *           allocated it
+ * newSize - number of bytes needed
+ * capacity - if not NULL, set to the number of bytes in the new buffer
+ *
+ * Return value:
+ * Address of the new buffer
+ */
+unsigned char* resizeBuffer(unsigned char* address, size_t oldSize,
+                            size_t newSize, size_t* capacity) {
+  unsigned char* newAddress = NULL;
+
+  if ((oldSize < POOL_MINIMUM_SIZE) && (newSize < POOL_MINIMUM_SIZE)) {
+    newAddress = realloc(address, newSize ? newSize : 1);
+    if (newAddress == NULL) {
+      error(True, "realloc failed for new size %lu",
+            (unsigned long)newSize);
+    }
+    if (capacity) {
+      *capacity = newSize ? newSize : 1;
+    }
+    return newAddress;
+  }
+
+  newAddress = allocateBuffer(newSize, capacity);
+  memcpy(newAddress, address, (oldSize < newSize) ? oldSize : newSize);
+  releaseBuffer(address, oldSize);
+  return newAddress;
+}
+
+/* releaseBuffer()
+ *
+ * Free a buffer, keeping it in the pool if there is room.
+ *
+ * Parameters:
+ * address - the buffer, from allocateBuffer() or resizeBuffer(), or NULL
+ * size - its size, as given to or returned by the function which
+ *        allocated it
+ */
+void releaseBuffer(unsigned char* address, size_t size) {
+  size_t classSize = 0;
+  unsigned sizeClass;
+
+  if (address == NULL) {
+    return;
+  }
+  if (size < POOL_MINIMUM_SIZE) {
+    free(address);
+    return;
+  }
+
+  sizeClass = getSizeClass(size, &classSize);
+  pthread_mutex_lock(&poolMutex);
+  if ((sizeClass < POOL_SIZE_CLASSES) &&
+      (freeBufferCounts[sizeClass] < POOL_BUFFERS_PER_CLASS) &&
+      (poolCounts.cachedBytes + classSize <= POOL_CACHE_LIMIT)) {
+    freeBuffers[sizeClass][freeBufferCounts[sizeClass]++] = address;
+    poolCounts.cachedBytes += classSize;
+    address = NULL;
+  }
+  else {
+    poolCounts.releasedBuffers++;
+  }
+  pthread_mutex_unlock(&poolMutex);
+
+  if (address && munmap(address, classSize)) {
+    error(True, "Unable to unmap a buffer of %lu bytes",
+          (unsigned long)classSize);
+  }
+}
+
+/* getBufferPoolCounts()
+ *
+ * Parameters:
+ * counts - filled in with what the pool has done so far
+ */
+void getBufferPoolCounts(BufferPoolCounts* counts) {
+  pthread_mutex_lock(&poolMutex);
+  *counts = poolCounts;
+  pthread_mutex_unlock(&poolMutex);
+}
@@ -0,0 +1,30 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+/* Declarations for the pool of data block buffers, in bufferPool.c */
+
+#include <stdlib.h>
+
+/* Buffers smaller than this come straight from malloc() */
+#define POOL_MINIMUM_SIZE (256 * 1024)
+
+/* Buffers at least this big are backed by huge pages where possible */
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+/* What the pool has done since the program started */
+typedef struct {
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long hugeTlbBuffers;
+  unsigned long transparentHugeBuffers;
+  unsigned long releasedBuffers;
+  size_t cachedBytes;
+} BufferPoolCounts;
+
+unsigned char* allocateBuffer(size_t size, size_t* capacity);
+unsigned char* resizeBuffer(unsigned char* address, size_t oldSize,
+                            size_t newSize, size_t* capacity);
+void releaseBuffer(unsigned char* address, size_t size);
+void getBufferPoolCounts(BufferPoolCounts* counts);
+
+#endif
@@ -1,11 +1,21 @@
+#include <errno.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include "blockedFile.h"
 #include "compression.h"
+#include "crc32c.h"
 #include "dataBlocks.h"
+#include "dictionary.h"
 #include "header.h"
+#include "probes.h"
+#include "segmentedBuffer.h"
+#include "sidecarIndex.h"
+#include "statistics.h"
+#include "threadPool.h"
 
 extern const char* programName_g;
 
@@ -60,6 +70,135 @@ char* makeOutputFilename(const char* inputFilename,
 
 
 
+/* appendChecksum()
+ *
+ * Add the checksum of the original data to the end of a compressed
+ * block, copying the block into memory if it is a view or a mapped
+ * file.
+ *
+ * Parameters:
+ * block - compressed block. It is freed if it has to be copied.
+ * checksum - CRC32C of the original data
+ *
+ * Return value:
+ * Block with the checksum and ENCODING_CHECKSUM set
+ */
+static BlockDescriptor* appendChecksum(BlockDescriptor* block,
+                                       unsigned long checksum) {
+  if (block->type != MEMORY_TYPE) {
+    BlockDescriptor* copy = makeMemoryBlock(block->usedSize + CHECKSUM_SIZE);
+    writeBytesToBlock(copy, block->address, block->usedSize);
+    copy->encoding = block->encoding;
+    freeBlock(block);
+    block = copy;
+  }
+  /* The Huffman coder may have left a partly written byte */
+  block->nextFreeByte = block->usedSize;
+  block->nextFreeBit = 0;
+  writeNumberToBlock(block, checksum, CHECKSUM_SIZE);
+  block->encoding |= ENCODING_CHECKSUM;
+  return block;
+}
+
+/* removeChecksum()
+ *
+ * Take the checksum off the end of a compressed block.
+ *
+ * Parameters:
+ * block - compressed block with ENCODING_CHECKSUM set. Its size and
+ *         encoding are changed to leave only the compressed data.
+ *
+ * Return value:
+ * CRC32C of the original data
+ */
+static unsigned long removeChecksum(BlockDescriptor* block) {
+  BlockDescriptor* view = NULL;
+  unsigned long checksum;
+
+  if (block->usedSize < CHECKSUM_SIZE) {
+    error(False, "Damaged input file - too small to hold its checksum");
+  }
+  block->usedSize -= CHECKSUM_SIZE;
+  view = makeViewBlock(block->address + block->usedSize, CHECKSUM_SIZE, 0);
+  checksum = readNumberFromBlock(view, CHECKSUM_SIZE);
+  freeBlock(view);
+  block->encoding &= ~ENCODING_CHECKSUM;
+  return checksum;
+}
+
+/* compressBlock()
+ *
+ * Run the selected compression stages over a block in memory.
+ *
+ * Parameters:
+ * flags - command line switches
+ * inputBlock - block to compress. It is freed by this function.
+ *
+ * Return value:
+ * Compressed block, or inputBlock itself if no stages were selected.
+ * With flags->checksum the CRC32C of the input follows the compressed
+ * data.
+ */
+BlockDescriptor* compressBlock(const struct CompressionFlags* flags,
+                               BlockDescriptor* inputBlock) {
+  BlockDescriptor* outputBlock = NULL;
+  unsigned long checksum = 0;
+  StageTimer timer;
+
+  if (flags->blockSize) {
+    outputBlock = compressBlocked(flags, inputBlock);
+    freeBlock(inputBlock);
+    return outputBlock;
+  }
+
+  if (flags->checksum) {
+    startStage(&timer, "checksum", inputBlock->usedSize);
+    checksum = crc32c(0, inputBlock->address, inputBlock->usedSize);
+    finishStage(&timer, inputBlock->usedSize);
+  }
+
+  if (flags->filters) {
+    startStage(&timer, "filter", inputBlock->usedSize);
+    outputBlock = filterBlock(inputBlock, flags->filters, flags->elementWidth);
+    finishStage(&timer, outputBlock->usedSize);
+    freeBlock(inputBlock);
+    inputBlock = outputBlock;
+  }
+
+  if (flags->flip) {
+    startStage(&timer, "flip", inputBlock->usedSize);
+    outputBlock = flipBitOrder(inputBlock);
+    finishStage(&timer, outputBlock->usedSize);
+    freeBlock(inputBlock);
+    inputBlock = outputBlock;
+  }
+
+
+  if (flags->rle) {
+    startStage(&timer, "rle-encode", inputBlock->usedSize);
+    outputBlock = runLengthCompress(inputBlock, flags->rleVersion2);
+    finishStage(&timer, outputBlock->usedSize);
+    freeBlock(inputBlock);
+    inputBlock = outputBlock;
+  }
+
+  if (flags->huffman) {
+    startStage(&timer, "huffman-encode", inputBlock->usedSize);
+    outputBlock = flags->dictionary ?
+      compressWithDictionary(inputBlock, flags->dictionary) :
+      huffmanCompress(inputBlock);
+    finishStage(&timer, outputBlock->usedSize);
+    freeBlock(inputBlock);
+    inputBlock = outputBlock;
+  }
+
+  if (flags->checksum) {
+    inputBlock = appendChecksum(inputBlock, checksum);
+  }
+  return inputBlock;
+}
+
+
 /* compress()
  *
  * Compress the file.
@@ -72,38 +211,166 @@ char* makeOutputFilename(const char* inputFilename,
 void compress(const struct CompressionFlags* flags,
               const char* inputFilename,
               const char* outputFilename) {
-
   BlockDescriptor* inputBlock = mapUncompressedFile(inputFilename);
+  SegmentedBuffer* segments = NULL;
+  StageTimer timer;
+
+  startStage(&timer, "compress-file", inputBlock->usedSize);
+  PROBE2(compress__start, inputFilename, inputBlock->usedSize);
+  if (flags->blockSize) {
+    /* The compressed blocks are written where they are, so the input
+     * has to be kept until then for any stored uncompressed
+     */
+    segments = compressBlockedToSegments(flags, inputBlock);
+  }
+  else {
+    segments = makeSegmentedBuffer(0);
+    attachBlockToSegments(segments, compressBlock(flags, inputBlock));
+    segments->encoding = segments->last->block->encoding;
+    inputBlock = NULL;
+  }
+
+  createSegmentedFile(outputFilename, segments, True);
+
+  PROBE4(compress__done, inputFilename, timer.bytesIn,
+         segments->usedSize, segments->encoding);
+  finishStage(&timer, segments->usedSize);
+  freeSegmentedBuffer(segments);
+  freeBlock(inputBlock);
+}
+
+
+/* decompressToSegments()
+ *
+ * Undo the compression stages recorded in the encoding of a block,
+ * and check the checksum if it has one. If run length decoding is the
+ * last stage its output, whose size isn't known in advance, is left in
+ * the chunks it was decoded into; otherwise the buffer holds the
+ * output block.
+ *
+ * Parameters:
+ * inputBlock - block to decompress. It is freed by this function.
+ *
+ * Return value:
+ * Segmented buffer holding the decompressed data. If no stages were
+ * applied it holds inputBlock itself.
+ */
+static SegmentedBuffer* decompressToSegments(BlockDescriptor* inputBlock) {
+  SegmentedBuffer* segments = NULL;
   BlockDescriptor* outputBlock = NULL;
-  
-  if (flags->flip) {
-    outputBlock = flipBitOrder(inputBlock);
+  Boolean hasChecksum = False;
+  unsigned long checksum = 0;
+  StageTimer timer;
+
+  if (inputBlock->encoding & ENCODING_BLOCKED) {
+    outputBlock = decompressBlocked(inputBlock);
+    freeBlock(inputBlock);
+    segments = makeSegmentedBuffer(0);
+    attachBlockToSegments(segments, outputBlock);
+    segments->encoding = outputBlock->encoding;
+    return segments;
+  }
+
+  if (inputBlock->encoding & ENCODING_CHECKSUM) {
+    checksum = removeChecksum(inputBlock);
+    hasChecksum = True;
+  }
+
+  /* Replace inputBlock with outputBlock for each phase which was
+   * applied
+   */
+  if (isHuffmanCompressed(inputBlock)) {
+    startStage(&timer, "huffman-decode", inputBlock->usedSize);
+    outputBlock = (inputBlock->encoding & ENCODING_SHARED_TABLE) ?
+      decompressWithDictionary(inputBlock) : huffmanDecompress(inputBlock);
+    finishStage(&timer, outputBlock->usedSize);
     freeBlock(inputBlock);
     inputBlock = outputBlock;
   }
 
+  if (isRleCompressed(inputBlock)) {
+    startStage(&timer, "rle-decode", inputBlock->usedSize);
+    segments = runLengthDecompressToSegments(inputBlock);
+    finishStage(&timer, segments->usedSize);
+    freeBlock(inputBlock);
+    inputBlock = NULL;
+  }
 
-  if (flags->rle) {
-    outputBlock = runLengthCompress(inputBlock);
+  if (segments ? (segments->encoding & ENCODING_FLIPPED) :
+      isFlipped(inputBlock)) {
+    /* Unflipping needs the data in one piece */
+    if (segments) {
+      inputBlock = flattenSegments(segments);
+      segments = NULL;
+    }
+    startStage(&timer, "unflip", inputBlock->usedSize);
+    outputBlock = unflipBitOrder(inputBlock);
+    finishStage(&timer, outputBlock->usedSize);
     freeBlock(inputBlock);
     inputBlock = outputBlock;
   }
 
-  if (flags->huffman) {
-    outputBlock = huffmanCompress(inputBlock);
+  if (segments ? (segments->encoding & ENCODING_FILTERED) :
+      (inputBlock->encoding & ENCODING_FILTERED)) {
+    /* So does unfiltering */
+    if (segments) {
+      inputBlock = flattenSegments(segments);
+      segments = NULL;
+    }
+    startStage(&timer, "unfilter", inputBlock->usedSize);
+    outputBlock = unfilterBlock(inputBlock);
+    finishStage(&timer, outputBlock->usedSize);
     freeBlock(inputBlock);
     inputBlock = outputBlock;
   }
 
-  createFile(outputFilename, inputBlock, True);
+  if (segments == NULL) {
+    segments = makeSegmentedBuffer(0);
+    attachBlockToSegments(segments, inputBlock);
+    segments->encoding = inputBlock->encoding;
+  }
 
-  freeBlock(inputBlock);
+  if (hasChecksum) {
+    SegmentIterator iterator;
+    const unsigned char* address = NULL;
+    size_t size = 0;
+    unsigned long dataChecksum = 0;
+
+    startStage(&timer, "verify-checksum", segments->usedSize);
+    startSegmentIterator(segments, &iterator);
+    while (nextSegment(&iterator, &address, &size)) {
+      dataChecksum = crc32c(dataChecksum, address, size);
+    }
+    if (dataChecksum != checksum) {
+      error(False, "Damaged input file - checksum doesn't match the data");
+    }
+    finishStage(&timer, segments->usedSize);
+  }
+  return segments;
+}
+
+
+/* decompressBlock()
+ *
+ * Undo the compression stages recorded in the encoding of a block,
+ * and check the checksum if it has one.
+ *
+ * Parameters:
+ * inputBlock - block to decompress. It is freed by this function.
+ *
+ * Return value:
+ * Decompressed block, or inputBlock itself if it had no stages applied
+ */
+BlockDescriptor* decompressBlock(BlockDescriptor* inputBlock) {
+  return flattenSegments(decompressToSegments(inputBlock));
 }
 
 
 /* decompress()
  *
- * Decompress the file.
+ * Decompress the file. The output is written straight from the pieces
+ * the last stage left it in. A single stream file with an index beside
+ * it is decoded on several threads if there are several.
  *
  * Parameters:
  * inputFilename - file to decompress
@@ -112,41 +379,161 @@ void compress(const struct CompressionFlags* flags,
 void decompress(const char* inputFilename,
                 const char* outputFilename) {
   BlockDescriptor* inputBlock = mapCompressedFile(inputFilename);
-  BlockDescriptor* outputBlock = NULL;
+  SegmentedBuffer* segments = NULL;
+  SidecarIndex* index = NULL;
+  StageTimer timer;
 
-  /* Will return NULL if block not Huffman compressed */
-  outputBlock = huffmanDecompress(inputBlock);
-  /* Replace inputBlock with outputBlock for next phase */
-  if (outputBlock != NULL) {
-    freeBlock(inputBlock);
-    inputBlock = outputBlock;
-    outputBlock = NULL;
+  startStage(&timer, "decompress-file", inputBlock->usedSize);
+  PROBE3(decompress__start, inputFilename, inputBlock->usedSize,
+         inputBlock->encoding);
+  if ((getThreadCount() > 1) &&
+      !(inputBlock->encoding & (ENCODING_BLOCKED | ENCODING_SHARED_TABLE))) {
+    index = loadSidecarIndex(inputFilename, inputBlock);
   }
-
-  /* Will return NULL if block not run length encoded */
-  outputBlock = runLengthDecompress(inputBlock);
-  /* Replace inputBlock with outputBlock for next phase */
-  if (outputBlock != NULL) {
+  if (index) {
+    segments = makeSegmentedBuffer(0);
+    attachBlockToSegments(segments, decompressWithSidecar(inputBlock, index));
+    segments->encoding = segments->last->block->encoding;
+    freeSidecarIndex(index);
     freeBlock(inputBlock);
-    inputBlock = outputBlock;
-    outputBlock = NULL;
+  }
+  else {
+    segments = decompressToSegments(inputBlock);
   }
 
-  /* Will return NULL if block not had bit order flipped */
-  outputBlock = unflipBitOrder(inputBlock);
-  /* Replace inputBlock with outputBlock for next phase */
-  if (outputBlock != NULL) {
-    freeBlock(inputBlock);
-    inputBlock = outputBlock;
-    outputBlock = NULL;
+  createSegmentedFile(outputFilename, segments, False);
+
+  PROBE3(decompress__done, inputFilename, timer.bytesIn,
+         segments->usedSize);
+  finishStage(&timer, segments->usedSize);
+  freeSegmentedBuffer(segments);
+}
+
+
+/* extractRange()
+ *
+ * Decompress part of a file. Only the blocks which cover the range are
+ * decompressed if the file is in the blocked format, and a single
+ * stream file with an index beside it is decoded from the entry before
+ * the range.
+ *
+ * Parameters:
+ * inputFilename - file to decompress
+ * outputFilename - file to write the range to, or "-" for stdout
+ * offset - offset of the range in the original file
+ * length - length of the range
+ */
+void extractRange(const char* inputFilename,
+                  const char* outputFilename,
+                  unsigned long offset,
+                  unsigned long length) {
+  BlockDescriptor* inputBlock = mapCompressedFile(inputFilename);
+  BlockDescriptor* outputBlock = NULL;
+  SidecarIndex* index = NULL;
+
+  if (!(inputBlock->encoding & (ENCODING_BLOCKED | ENCODING_SHARED_TABLE))) {
+    index = loadSidecarIndex(inputFilename, inputBlock);
+  }
+  if (index) {
+    outputBlock = decompressRangeWithSidecar(inputBlock, index, offset, length);
+    if (enableStatistics(False)) {
+      printf("- Range %lu:%lu - decoded from the index in %s%s\n",
+             offset, (unsigned long)outputBlock->usedSize, inputFilename,
+             SIDECAR_SUFFIX);
+      enableStatistics(True);
+    }
+    freeSidecarIndex(index);
+  }
+  else {
+    outputBlock = decompressRange(inputBlock, offset, length);
   }
 
-  createFile(outputFilename, inputBlock, False);
+  createFile(outputFilename, outputBlock, False);
 
+  freeBlock(outputBlock);
   freeBlock(inputBlock);
 }
 
 
+/* parseSize()
+ *
+ * Parse a size given on the command line, which may end in K or M for
+ * kilobytes or megabytes. Negative sizes and sizes too big for an
+ * unsigned long are errors, rather than being wrapped round by strtoul.
+ *
+ * Parameters:
+ * text - the size
+ * option - the switch it was given with, for the error message
+ *
+ * Return value:
+ * Size in bytes
+ */
+unsigned long parseSize(const char* text, const char* option) {
+  /* strtoul() skips white space before a sign */
+  const char* digits = text + strspn(text, " \t\n\v\f\r");
+  char* end = NULL;
+  unsigned long multiplier = 1;
+  unsigned long size;
+
+  if (*digits == '-') {
+    error(False, "%s can't be negative, not %s", option, text);
+  }
+  errno = 0;
+  size = strtoul(digits, &end, 10);
+  if (end == digits) {
+    error(False, "%s needs a number, not %s", option, text);
+  }
+  if ((*end == 'K') || (*end == 'k')) {
+    multiplier = 1024;
+    end++;
+  }
+  else if ((*end == 'M') || (*end == 'm')) {
+    multiplier = 1024 * 1024;
+    end++;
+  }
+  if ((errno == ERANGE) || (size > ULONG_MAX / multiplier)) {
+    error(False, "%s %s is too big", option, text);
+  }
+  size *= multiplier;
+  if (*end != '\0') {
+    error(False, "%s needs a number, not %s", option, text);
+  }
+  return size;
+}
+
+
+/* parseRange()
+ *
+ * Parse a range given on the command line as offset:length. Both may
+ * end in K or M.
+ *
+ * Parameters:
+ * text - the range
+ * offset - set to the offset
+ * length - set to the length
+ */
+void parseRange(const char* text,
+                unsigned long* offset,
+                unsigned long* length) {
+  const char* colon = strchr(text, ':');
+  char* offsetText = NULL;
+
+  if (colon == NULL) {
+    error(False, "--range needs offset:length, not %s", text);
+  }
+  offsetText = malloc(colon - text + 1);
+  if (offsetText == NULL) {
+    error(True, "unable to malloc space for range");
+  }
+  memcpy(offsetText, text, colon - text);
+  offsetText[colon - text] = '\0';
+
+  *offset = parseSize(offsetText, "--range");
+  *length = parseSize(colon + 1, "--range");
+  free(offsetText);
+}
+
+
 /* getFileSize()
  *
  * Return file size in bytes.
@@ -166,6 +553,21 @@ unsigned getFileSize(const char* filename) {
 }
 
 
+/* File being worked on by the calling thread, for error messages */
+static __thread const char* errorFilename = NULL;
+
+/* setErrorFilename()
+ *
+ * Name the file the calling thread is working on in its error messages,
+ * for when several files are handled at once.
+ *
+ * Parameters:
+ * filename - name of the file, or NULL for none
+ */
+void setErrorFilename(const char* filename) {
+  errorFilename = filename;
+}
+
 /* error()
  *
  * Print error message on stderr and terminate program.
@@ -184,6 +586,9 @@ void error(Boolean displayErrno, char* format, ...) {
   else {
     fprintf(stderr, "Error: %s - ", programName_g);
   }
+  if (errorFilename != NULL) {
+    fprintf(stderr, "%s: ", errorFilename);
+  }
   vfprintf(stderr, format, args);
   va_end (args);
   fprintf(stderr, "\n");
@@ -22,17 +22,50 @@ typedef struct {
   enum { UNDEFINED_TYPE = 0,
          MEMORY_TYPE,
          COMPRESSED_FILE_TYPE,
-         UNCOMPRESSED_FILE_TYPE } type;
+         UNCOMPRESSED_FILE_TYPE,
+         COMPRESSED_MEMORY_TYPE,
+         VIEW_TYPE } type;
   unsigned char encoding;
 } BlockDescriptor;
 
 
+/* A trained Huffman table, see dictionary.c */
+typedef struct DictionaryStruct Dictionary;
+
+/* Data held in a chain of pieces, see segmentedBuffer.c */
+typedef struct SegmentedBufferStruct SegmentedBuffer;
+
 struct CompressionFlags {
   Boolean flip;
   Boolean rle;
   Boolean huffman;
+  /* Compress in independent blocks of this many bytes, or as a
+   * single stream if 0
+   */
+  size_t blockSize;
+  /* Huffman compress with this trained table instead of one built
+   * from the data, or NULL
+   */
+  Dictionary* dictionary;
+  /* Store CRC32C checksums of the original data, to be checked when
+   * it is decompressed
+   */
+  Boolean checksum;
+  /* Run length encode with symbols chosen for each block and run
+   * lengths of any size, rather than the fixed symbols
+   */
+  Boolean rleVersion2;
+  /* Delta and byte shuffle filters, FILTER_* below, to apply to
+   * elements of elementWidth bytes before everything but the checksum
+   */
+  unsigned char filters;
+  unsigned char elementWidth;
 };
 
+BlockDescriptor* compressBlock(const struct CompressionFlags* flags,
+                               BlockDescriptor* inputBlock);
+BlockDescriptor* decompressBlock(BlockDescriptor* inputBlock);
+
 void compress(const struct CompressionFlags* flags,
               const char* inputFilename,
               const char* outputFilename);
@@ -40,6 +73,16 @@ void compress(const struct CompressionFlags* flags,
 void decompress(const char* inputFilename,
                 const char* outputFilename);
 
+void extractRange(const char* inputFilename,
+                  const char* outputFilename,
+                  unsigned long offset,
+                  unsigned long length);
+
+unsigned long parseSize(const char* text, const char* option);
+void parseRange(const char* text,
+                unsigned long* offset,
+                unsigned long* length);
+
 void displayFinalStatistics(const char* inputFilename,
                             const char* outputFilename);
 
@@ -51,10 +94,34 @@ char* makeOutputFilename(const char* inputFilename,
 Boolean isCompressedFile(const char* filename);
 
 void error(Boolean displayErrno, char* format, ...);
+void setErrorFilename(const char* filename);
+
 
+/* Run length encoding uses characters which don't often appear in text
+ * files, so that they don't need to be escaped often.
+ */
+#define REPEAT_SYMBOL (235)
+#define ESCAPE_SYMBOL (236)
 
-BlockDescriptor* runLengthCompress(BlockDescriptor* inputBlock);
+BlockDescriptor* runLengthCompress(BlockDescriptor* inputBlock,
+                                   Boolean version2);
 BlockDescriptor* runLengthDecompress(BlockDescriptor* inputBlock);
+SegmentedBuffer* runLengthDecompressToSegments(BlockDescriptor* inputBlock);
+
+/* Filters for arrays of numbers. The filtered data starts with a byte
+ * holding the filters in the low bits and log2 of the element width in
+ * the high bits.
+ */
+#define FILTER_DELTA (0x1)
+#define FILTER_XOR_DELTA (0x2)
+#define FILTER_SHUFFLE (0x4)
+#define KNOWN_FILTERS (FILTER_DELTA | FILTER_XOR_DELTA | FILTER_SHUFFLE)
+#define FILTER_WIDTH_SHIFT (4)
+
+BlockDescriptor* filterBlock(BlockDescriptor* inputBlock,
+                             unsigned char filters,
+                             unsigned elementWidth);
+BlockDescriptor* unfilterBlock(BlockDescriptor* inputBlock);
 
 BlockDescriptor* flipBitOrder(BlockDescriptor* inputBlock);
 BlockDescriptor* unflipBitOrder(BlockDescriptor* inputBlock);
@@ -0,0 +1,242 @@
+/* crc32c.c
+ *
+ * CRC32C (the Castagnoli polynomial, as used by iSCSI, ext4 and btrfs)
+ * for the checksums of compressed files. On x86-64 processors with
+ * SSE4.2 the crc32 instruction is used, eight bytes at a time, which
+ * checksums several gigabytes a second and so costs little next to the
+ * compression stages. Elsewhere a slicing by eight table lookup is
+ * used, which gives the same values more slowly. Which one is used is
+ * decided with the other processor specific kernels, in kernels.c.
+ *
+ * The checksums of two pieces of data can be combined into the checksum
+ * of the two joined together, without the data, so the blocks of a
+ * blocked file can be checksummed on their own threads and the checksum
+ * of the whole file worked out from theirs.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include "crc32c.h"
+#include "kernels.h"
+
+/* The polynomial, bit reversed */
+#define CRC32C_POLYNOMIAL (0x82f63b78UL)
+
+/* crc32cTable[0] is the usual byte at a time table. crc32cTable[n] gives
+ * the effect of a byte followed by n zero bytes.
+ */
+static uint32_t crc32cTable[8][256];
+static pthread_once_t crc32cOnce = PTHREAD_ONCE_INIT;
+
+/* initialiseCrc32c()
+ *
+ * Fill in the tables. Run once.
+ */
+static void initialiseCrc32c(void) {
+  unsigned byte;
+  unsigned slice;
+
+  for (byte = 0; byte < 256; byte++) {
+    uint32_t crc = byte;
+    unsigned bit;
+    for (bit = 0; bit < 8; bit++) {
+      crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLYNOMIAL : crc >> 1;
+    }
+    crc32cTable[0][byte] = crc;
+  }
+  for (byte = 0; byte < 256; byte++) {
+    for (slice = 1; slice < 8; slice++) {
+      uint32_t previous = crc32cTable[slice - 1][byte];
+      crc32cTable[slice][byte] = (previous >> 8) ^
+        crc32cTable[0][previous & 0xff];
+    }
+  }
+}
+
+/* crc32cSoftware()
+ *
+ * Update a CRC with the table, eight bytes at a time. This is the
+ * scalar version of the CRC32C kernel.
+ *
+ * Parameters:
+ * crc - CRC so far, not inverted
+ * data - data to add
+ * size - number of bytes of data
+ *
+ * Return value:
+ * Updated CRC, not inverted
+ */
+uint32_t crc32cSoftware(uint32_t crc, const unsigned char* data,
+                        size_t size) {
+  pthread_once(&crc32cOnce, initialiseCrc32c);
+  while (size >= 8) {
+    crc ^= data[0] | (data[1] << 8) | (data[2] << 16) |
+      ((uint32_t)data[3] << 24);
+    crc = crc32cTable[7][crc & 0xff] ^ crc32cTable[6][(crc >> 8) & 0xff] ^
+      crc32cTable[5][(crc >> 16) & 0xff] ^ crc32cTable[4][crc >> 24] ^
+      crc32cTable[3][data[4]] ^ crc32cTable[2][data[5]] ^
+      crc32cTable[1][data[6]] ^ crc32cTable[0][data[7]];
+    data += 8;
+    size -= 8;
+  }
+  while (size--) {
+    crc = crc32cTable[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+  }
+  return crc;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+
+/* crc32cHardware()
+ *
+ * Update a CRC with the SSE4.2 crc32 instruction. Only called if the
+ * processor has it.
+ *
+ * Parameters:
+ * crc - CRC so far, not inverted
+ * data - data to add
+ * size - number of bytes of data
+ *
+ * Return value:
+ * Updated CRC, not inverted
+ */
+__attribute__((target("sse4.2")))
+uint32_t crc32cHardware(uint32_t crc, const unsigned char* data,
+                        size_t size) {
+  uint64_t crc64 = crc;
+
+  while (size && ((uintptr_t)data & 7)) {
+    crc64 = _mm_crc32_u8(crc64, *data++);
+    size--;
+  }
+  while (size >= 8) {
+    uint64_t word;
+    memcpy(&word, data, 8);
+    crc64 = _mm_crc32_u64(crc64, word);
+    data += 8;
+    size -= 8;
+  }
+  while (size--) {
+    crc64 = _mm_crc32_u8(crc64, *data++);
+  }
+  return (uint32_t)crc64;
+}
+#endif
+
+/* crc32c()
+ *
+ * Add data to a CRC32C checksum.
+ *
+ * Parameters:
+ * crc - checksum of the data before, or 0 to start a new one
+ * data - data to add
+ * size - number of bytes of data
+ *
+ * Return value:
+ * Checksum including the data
+ */
+unsigned long crc32c(unsigned long crc, const unsigned char* data,
+                     size_t size) {
+  return getKernels()->crc32c(crc ^ 0xffffffffUL, data, size) ^
+    0xffffffffUL;
+}
+
+/* gf2MatrixTimes()
+ *
+ * Multiply a vector by a 32 by 32 matrix over GF(2).
+ *
+ * Parameters:
+ * matrix - the matrix, a column per element
+ * vector - the vector
+ *
+ * Return value:
+ * The product
+ */
+static uint32_t gf2MatrixTimes(const uint32_t* matrix, uint32_t vector) {
+  uint32_t sum = 0;
+  while (vector) {
+    if (vector & 1) {
+      sum ^= *matrix;
+    }
+    vector >>= 1;
+    matrix++;
+  }
+  return sum;
+}
+
+/* gf2MatrixSquare()
+ *
+ * Square a 32 by 32 matrix over GF(2).
+ *
+ * Parameters:
+ * square - set to the square
+ * matrix - matrix to square
+ */
+static void gf2MatrixSquare(uint32_t* square, const uint32_t* matrix) {
+  unsigned column;
+  for (column = 0; column < 32; column++) {
+    square[column] = gf2MatrixTimes(matrix, matrix[column]);
+  }
+}
+
+/* crc32cCombine()
+ *
+ * Work out the checksum of two pieces of data joined together from the
+ * checksums of each. The first checksum is moved on past as many zero
+ * bytes as are in the second piece, by repeatedly squaring the
+ * operator for one zero bit, which takes time in proportion to the
+ * logarithm of the size.
+ *
+ * Parameters:
+ * crc1 - checksum of the first piece
+ * crc2 - checksum of the second piece
+ * size2 - number of bytes in the second piece
+ *
+ * Return value:
+ * Checksum of the first piece followed by the second
+ */
+unsigned long crc32cCombine(unsigned long crc1, unsigned long crc2,
+                            unsigned long size2) {
+  uint32_t even[32];
+  uint32_t odd[32];
+  uint32_t row = 1;
+  uint32_t crc = crc1;
+  unsigned column;
+
+  if (size2 == 0) {
+    return crc1;
+  }
+
+  /* Operator for one zero bit */
+  odd[0] = CRC32C_POLYNOMIAL;
+  for (column = 1; column < 32; column++) {
+    odd[column] = row;
+    row <<= 1;
+  }
+  /* Two zero bits, then four */
+  gf2MatrixSquare(even, odd);
+  gf2MatrixSquare(odd, even);
+
+  /* Apply the operator for each set bit of the size in bytes, squaring
+   * it each time to go from one power of two bytes to the next
+   */
+  do {
+    gf2MatrixSquare(even, odd);
+    if (size2 & 1) {
+      crc = gf2MatrixTimes(even, crc);
+    }
+    size2 >>= 1;
+    if (size2 == 0) {
+      break;
+    }
+    gf2MatrixSquare(odd, even);
+    if (size2 & 1) {
+      crc = gf2MatrixTimes(odd, crc);
+    }
+    size2 >>= 1;
+  } while (size2);
+
+  return crc ^ crc2;
+}
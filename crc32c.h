@@ -0,0 +1,27 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+/* Declarations for the CRC32C checksums of compressed files, in
+ * crc32c.c
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/* Size of a checksum in a compressed file */
+#define CHECKSUM_SIZE (4)
+
+unsigned long crc32c(unsigned long crc, const unsigned char* data,
+                     size_t size);
+unsigned long crc32cCombine(unsigned long crc1, unsigned long crc2,
+                            unsigned long size2);
+
+/* The versions of the CRC32C kernel, chosen between in kernels.c */
+uint32_t crc32cSoftware(uint32_t crc, const unsigned char* data,
+                        size_t size);
+#if defined(__x86_64__) && defined(__GNUC__)
+uint32_t crc32cHardware(uint32_t crc, const unsigned char* data,
+                        size_t size);
+#endif
+
+#endif
@@ -10,18 +10,28 @@
  * accesses the blocks.  If it all went through functions like the ones here
  * the structure of the block descriptors could bemore easily improved.
  *
- * Input files are mapped rather than read into memory.
+ * Input files are mapped rather than read into memory. Memory blocks get
+ * their buffers from the buffer pool, so that large buffers freed by one
+ * stage are reused by the next.
  */
 #include <fcntl.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include "bufferPool.h"
 #include "dataBlocks.h"
 #include "header.h"
+#include "segmentedBuffer.h"
 #include "compression.h"
+#include "statistics.h"
+#include "trace.h"
+
+/* False if the per-stage statistics lines are not to be printed */
+static Boolean statisticsEnabled = True;
 
 /* makeBlockDescriptor()
  *
@@ -73,7 +83,7 @@ BlockDescriptor* mapUncompressedFile(const char* filename) {
   blockDescriptor->allocatedSize = getFileSize(filename);
 
   blockDescriptor->fileDescriptor =  open(filename, O_RDONLY, 0);
-  if (!blockDescriptor->fileDescriptor) {
+  if (blockDescriptor->fileDescriptor < 0) {
     error(True, "Unable to open file %s", filename); 
   }
 
@@ -120,12 +130,9 @@ BlockDescriptor* mapCompressedFile(const char* filename) {
   if (fileSize < getHeaderSize()) {
       error(False, "File too small to be a compressed file");
   }
-  else {
-    blockDescriptor->encoding = getCompressionFlags(filename, False);
-  }
 
   blockDescriptor->fileDescriptor =  open(filename, O_RDONLY, 0);
-  if (!blockDescriptor->fileDescriptor) {
+  if (blockDescriptor->fileDescriptor < 0) {
     error(True, "Unable to open file %s", filename); 
   }
 
@@ -138,10 +145,15 @@ BlockDescriptor* mapCompressedFile(const char* filename) {
                  MAP_PRIVATE,
                  blockDescriptor->fileDescriptor,
                  0);
-  if (blockDescriptor->address == MAP_FAILED) {
+  if (address == MAP_FAILED) {
     error(True, "Unable to map file %s", filename); 
   }
 
+  /* The header is in the mapping, so there is no need to open the
+   * file a second time just to read the compression flags.
+   */
+  blockDescriptor->encoding = parseHeader(address, fileSize, False);
+
 /* Adjust the block descriptor to point to the data in the file
  * skipping the header. In principle we could use the last parameter
  * of mmap() to do this but that seems to need to operate on page
@@ -160,6 +172,85 @@ BlockDescriptor* mapCompressedFile(const char* filename) {
   return blockDescriptor;
 }
 
+/* adoptUncompressedBuffer()
+ *
+ * Constructs a descriptor for the contents of an uncompressed file
+ * which has already been read into a buffer from allocateBuffer(), e.g.
+ * by the I/O engine.  The block takes ownership of the buffer and frees
+ * it in freeBlock().
+ *
+ * Parameters:
+ * address - buffer holding the file contents
+ * size - number of bytes in the buffer
+ *
+ * Return value:
+ * Block descriptor describing the buffer
+ */
+BlockDescriptor* adoptUncompressedBuffer(unsigned char* address,
+                                         size_t size) {
+  BlockDescriptor* blockDescriptor = makeBlockDescriptor();
+  blockDescriptor->address = address;
+  blockDescriptor->allocatedSize = size;
+  blockDescriptor->usedSize = size;
+  blockDescriptor->type = MEMORY_TYPE;
+  return blockDescriptor;
+}
+
+/* adoptCompressedBuffer()
+ *
+ * As adoptUncompressedBuffer(), but for the contents of a compressed
+ * file.  As with mapCompressedFile() the header is hidden from the
+ * user of the block.
+ *
+ * Parameters:
+ * address - buffer holding the file contents, including the header
+ * size - number of bytes in the buffer
+ *
+ * Return value:
+ * Block descriptor describing the data following the header
+ */
+BlockDescriptor* adoptCompressedBuffer(unsigned char* address,
+                                       size_t size) {
+  BlockDescriptor* blockDescriptor = makeBlockDescriptor();
+
+  if (size < getHeaderSize()) {
+      error(False, "File too small to be a compressed file");
+  }
+
+  blockDescriptor->encoding = parseHeader(address, size, False);
+  blockDescriptor->address = address + getHeaderSize();
+  blockDescriptor->allocatedSize = size - getHeaderSize();
+  blockDescriptor->usedSize = blockDescriptor->allocatedSize;
+  blockDescriptor->type = COMPRESSED_MEMORY_TYPE;
+  return blockDescriptor;
+}
+
+/* makeViewBlock()
+ *
+ * Constructs a descriptor for part of another block or mapping, e.g. one
+ * member of an archive. The data is not copied and is not freed by
+ * freeBlock(), so the block it is part of must outlive the view.
+ *
+ * Parameters:
+ * address - start of the data
+ * size - number of bytes of data
+ * encoding - compression flags of the data
+ *
+ * Return value:
+ * Block descriptor describing the data
+ */
+BlockDescriptor* makeViewBlock(unsigned char* address,
+                               size_t size,
+                               unsigned char encoding) {
+  BlockDescriptor* blockDescriptor = makeBlockDescriptor();
+  blockDescriptor->address = address;
+  blockDescriptor->allocatedSize = size;
+  blockDescriptor->usedSize = size;
+  blockDescriptor->encoding = encoding;
+  blockDescriptor->type = VIEW_TYPE;
+  return blockDescriptor;
+}
+
 /* makeMemoryBlock()
  *
  * This allocates a memory block of the specified size and creates a
@@ -173,12 +264,8 @@ BlockDescriptor* mapCompressedFile(const char* filename) {
  */
 extern BlockDescriptor* makeMemoryBlock(size_t size) {
   BlockDescriptor* blockDescriptor = makeBlockDescriptor();
-  blockDescriptor->address = malloc(size);
-  if (blockDescriptor == NULL) {
-    error(True, "malloc failed in makeMemoryBlock");
-  }
-
-  blockDescriptor->allocatedSize = size;
+  blockDescriptor->address = allocateBuffer(size,
+                                            &blockDescriptor->allocatedSize);
   blockDescriptor->type = MEMORY_TYPE;
   blockDescriptor->encoding = 0;
   return blockDescriptor;
@@ -201,8 +288,19 @@ extern void freeBlock(BlockDescriptor* blockDescriptor) {
 
   if (blockDescriptor != NULL) {
   switch (blockDescriptor->type) {
+  case COMPRESSED_MEMORY_TYPE:
+    /* Adjust address and size to add back in header */
+    blockDescriptor->address -= getHeaderSize();
+    blockDescriptor->allocatedSize += getHeaderSize();
+    /* DELIBERATELY RUN ONTO NEXT CASE STATEMENT */
+    __attribute__ ((fallthrough));
+
   case MEMORY_TYPE:
-    free(blockDescriptor->address);
+    releaseBuffer(blockDescriptor->address, blockDescriptor->allocatedSize);
+    break;
+
+  case VIEW_TYPE:
+    /* The data belongs to someone else */
     break;
 
   case COMPRESSED_FILE_TYPE:
@@ -233,6 +331,38 @@ extern void freeBlock(BlockDescriptor* blockDescriptor) {
 
 /***** Reading and writing data ******/
 
+/* growBlock()
+ *
+ * Make a memory block bigger, keeping its contents.
+ *
+ * Parameters:
+ * blockDescriptor - block descriptor describing block to be enlarged
+ * newSize - number of bytes it must hold
+ */
+static void growBlock(BlockDescriptor* blockDescriptor, size_t newSize) {
+  blockDescriptor->address = resizeBuffer(blockDescriptor->address,
+                                          blockDescriptor->allocatedSize,
+                                          newSize,
+                                          &blockDescriptor->allocatedSize);
+  countRealloc();
+}
+
+/* reserveBlockSpace()
+ *
+ * Make sure a memory block can hold a number of bytes without being
+ * enlarged, for code which fills it in directly rather than with the
+ * write functions.
+ *
+ * Parameters:
+ * blockDescriptor - block descriptor describing block to be enlarged
+ * size - number of bytes it must hold
+ */
+void reserveBlockSpace(BlockDescriptor* blockDescriptor, size_t size) {
+  if (blockDescriptor->allocatedSize < size) {
+    growBlock(blockDescriptor, size);
+  }
+}
+
 /* writeToBlock()
  *
  * This writes a byte to a block, recording in the block descriptor the
@@ -250,12 +380,8 @@ extern void freeBlock(BlockDescriptor* blockDescriptor) {
 size_t writeToBlock(BlockDescriptor* blockDescriptor, unsigned char character) {
   size_t returnIndex = 0;
   if (blockDescriptor->nextFreeByte >= blockDescriptor->allocatedSize) {
-    size_t newSize = blockDescriptor->allocatedSize + ((blockDescriptor->allocatedSize + 1) / 2);
-    blockDescriptor->address = realloc(blockDescriptor->address, newSize);
-    if (blockDescriptor == NULL) {
-      error(True, "realloc failed for new size %lu", (size_t)newSize);
-    }
-    blockDescriptor->allocatedSize = newSize;
+    growBlock(blockDescriptor, blockDescriptor->allocatedSize +
+              ((blockDescriptor->allocatedSize + 1) / 2));
   }
   returnIndex = blockDescriptor->nextFreeByte;
   blockDescriptor->address[blockDescriptor->nextFreeByte++] = character;
@@ -263,6 +389,33 @@ size_t writeToBlock(BlockDescriptor* blockDescriptor, unsigned char character) {
   return returnIndex;
 }
 
+/* writeBytesToBlock()
+ *
+ * This appends a run of bytes to a block, resizing the block if
+ * necessary. It is the same as calling writeToBlock() for each byte,
+ * but quicker.
+ *
+ * Parameters:
+ * blockDescriptor - block descriptor describing block to be written to
+ * address - bytes to write
+ * size - number of bytes
+ */
+void writeBytesToBlock(BlockDescriptor* blockDescriptor,
+                       const unsigned char* address,
+                       size_t size) {
+  if (blockDescriptor->nextFreeByte + size > blockDescriptor->allocatedSize) {
+    size_t newSize = blockDescriptor->allocatedSize + ((blockDescriptor->allocatedSize + 1) / 2);
+    if (newSize < blockDescriptor->nextFreeByte + size) {
+      newSize = blockDescriptor->nextFreeByte + size;
+    }
+    growBlock(blockDescriptor, newSize);
+  }
+  memcpy(blockDescriptor->address + blockDescriptor->nextFreeByte, address, size);
+  countCopy(size);
+  blockDescriptor->nextFreeByte += size;
+  blockDescriptor->usedSize = blockDescriptor->nextFreeByte;
+}
+
 /* writeBitToBlock()
  *
  * This appends a bit to a block.
@@ -279,13 +432,13 @@ void writeBitToBlock(BlockDescriptor* blockDescriptor, Boolean value) {
   if (blockDescriptor->nextFreeBit == 0) {
     blockDescriptor->usedSize = blockDescriptor->nextFreeByte + 1;
     if (blockDescriptor->nextFreeByte >= blockDescriptor->allocatedSize) {
-      size_t newSize = blockDescriptor->allocatedSize + ((blockDescriptor->allocatedSize + 1) / 2);
-      blockDescriptor->address = realloc(blockDescriptor->address, newSize);
-      if (blockDescriptor == NULL) {
-	error(True, "realloc failed for new size %lu", (size_t)newSize);
-      }
-      blockDescriptor->allocatedSize = newSize;
+      growBlock(blockDescriptor, blockDescriptor->allocatedSize +
+                ((blockDescriptor->allocatedSize + 1) / 2));
     }
+    /* Clear the byte so that the padding after the last bit doesn't
+     * depend on what the memory held before
+     */
+    *(blockDescriptor->address + blockDescriptor->nextFreeByte) = 0;
   }
 
   /* Set the next bit to the desired value */
@@ -302,6 +455,19 @@ void writeBitToBlock(BlockDescriptor* blockDescriptor, Boolean value) {
   }
 }
 
+/* resetBlockOffsets()
+ *
+ * Go back to reading from the start of a block, e.g. to decompress the
+ * same block again.
+ *
+ * Parameters:
+ * blockDescriptor - descriptor of block
+ */
+void resetBlockOffsets(BlockDescriptor* blockDescriptor) {
+  blockDescriptor->nextByteToRead = 0;
+  blockDescriptor->nextBitToRead = 0;
+}
+
 /* readBitFromBlock()
  *
  * This reads the next bit from the block.
@@ -346,12 +512,53 @@ unsigned char readFromBlock(BlockDescriptor* inputBlock) {
   return *(inputBlock->address + inputBlock->nextByteToRead++);
 }
 
+/* writeNumberToBlock()
+ *
+ * Append an unsigned number to a block as a fixed number of bytes,
+ * least significant first, so that the result is the same whatever
+ * the architecture.
+ *
+ * Parameters:
+ * blockDescriptor - descriptor of block to write to
+ * value - number to write
+ * byteCount - number of bytes to use
+ */
+void writeNumberToBlock(BlockDescriptor* blockDescriptor,
+                        unsigned long value,
+                        unsigned byteCount) {
+  while (byteCount--) {
+    writeToBlock(blockDescriptor, (unsigned char)(value & 0xff));
+    value >>= 8;
+  }
+}
+
+/* readNumberFromBlock()
+ *
+ * Read a number written by writeNumberToBlock().
+ *
+ * Parameters:
+ * blockDescriptor - descriptor of block to read from
+ * byteCount - number of bytes used
+ *
+ * Return value:
+ * Number read
+ */
+unsigned long readNumberFromBlock(BlockDescriptor* blockDescriptor,
+                                  unsigned byteCount) {
+  unsigned long value = 0;
+  unsigned byteNumber;
+  for (byteNumber = 0; byteNumber < byteCount; byteNumber++) {
+    value |= (unsigned long)readFromBlock(blockDescriptor) << (byteNumber * 8);
+  }
+  return value;
+}
+
 /* createFile()
  *
  * This creates a file and writes the data block to it.
  *
  * Parameters:
- * filename - output filename
+ * filename - output filename, or "-" for standard output
  * blockDescriptor - descriptor of block to write
  * outputHeader - True if the magic number and header are to be
  *   written - i.e. this is a compressed file. False for uncompressed
@@ -361,24 +568,16 @@ unsigned char readFromBlock(BlockDescriptor* inputBlock) {
 void createFile(const char* filename,
                 BlockDescriptor* blockDescriptor,
                 Boolean outputHeader) {
-  FILE* outputFile = fopen(filename, "wb");
-
-  if (outputFile == NULL) {
-    error(True, "Unable to create %s", filename);
-  }
-
-  if (outputHeader) {
-    writeHeader(outputFile, blockDescriptor);
-  }
-
-  if (fwrite(blockDescriptor->address, 1,
-             blockDescriptor->usedSize, outputFile) !=
-      blockDescriptor->usedSize) {
-    error(True, "Unable to write to %s", filename);
-  }
-  if (fclose(outputFile) == EOF) {
-    error(True, "Unable to close %s", filename);
-  }
+  SegmentedBuffer* segments = makeSegmentedBuffer(0);
+
+  /* A view, so that freeing the buffer leaves the block alone */
+  attachBlockToSegments(segments,
+                        makeViewBlock(blockDescriptor->address,
+                                      blockDescriptor->usedSize,
+                                      blockDescriptor->encoding));
+  segments->encoding = blockDescriptor->encoding;
+  createSegmentedFile(filename, segments, outputHeader);
+  freeSegmentedBuffer(segments);
 }
 
 /* displayStatistics()
@@ -393,10 +592,29 @@ void createFile(const char* filename,
 void displayStatistics(const char* operation,
 		       const BlockDescriptor* originalBlock,
 		       const BlockDescriptor* finalBlock) {
-  size_t originalSize = originalBlock->usedSize;
-  size_t finalSize = finalBlock->usedSize;
+  displaySizeStatistics(operation, originalBlock->usedSize,
+                        finalBlock->usedSize);
+}
 
-  float percentage = (100-(100.*(float)finalSize/(float)originalSize));
+/* displaySizeStatistics()
+ *
+ * As displayStatistics(), for data which isn't held in blocks.
+ *
+ * Parameters:
+ * operation - Brief description of the operation performed
+ * originalSize - size before the operation
+ * finalSize - size after it
+ */
+void displaySizeStatistics(const char* operation,
+                           size_t originalSize,
+                           size_t finalSize) {
+  float percentage;
+
+  if (!statisticsEnabled) {
+    return;
+  }
+
+  percentage = (100-(100.*(float)finalSize/(float)originalSize));
   printf("- %s - in %lu bytes, out %lu bytes - %s %4.1f%%\n",
 	 operation, (unsigned long)originalSize,
          (unsigned long)finalSize, 
@@ -404,6 +622,24 @@ void displayStatistics(const char* operation,
 	 fabs(percentage));
 }
 
+/* enableStatistics()
+ *
+ * Turn the per-stage lines printed by displayStatistics() on or off.
+ * They are useful for a single file, but just noise when processing
+ * thousands of them.
+ *
+ * Parameters:
+ * enable - True to print statistics, False to suppress them
+ *
+ * Return value:
+ * The previous setting, so that it can be restored
+ */
+Boolean enableStatistics(Boolean enable) {
+  Boolean previous = statisticsEnabled;
+  statisticsEnabled = enable;
+  return previous;
+}
+
 /* getBit()
  *
  * Get a bit from a byte
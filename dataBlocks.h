@@ -10,14 +10,30 @@
 
 BlockDescriptor* mapCompressedFile(const char* filename);
 BlockDescriptor* mapUncompressedFile(const char* filename);
+BlockDescriptor* adoptUncompressedBuffer(unsigned char* address,
+                                         size_t size);
+BlockDescriptor* adoptCompressedBuffer(unsigned char* address,
+                                       size_t size);
+BlockDescriptor* makeViewBlock(unsigned char* address,
+                               size_t size,
+                               unsigned char encoding);
 BlockDescriptor* makeMemoryBlock(size_t size);
 void freeBlock(BlockDescriptor* blockDescriptor);
 
+void reserveBlockSpace(BlockDescriptor* blockDescriptor, size_t size);
 size_t writeToBlock(BlockDescriptor* outputBlock,
 		    unsigned char character);
+void writeBytesToBlock(BlockDescriptor* blockDescriptor,
+                       const unsigned char* address,
+                       size_t size);
 void writeBitToBlock(BlockDescriptor* outputBlock, Boolean value);
 Boolean readBitFromBlock(BlockDescriptor* inputBlock);
 unsigned char readFromBlock(BlockDescriptor* inputBlock);
+void writeNumberToBlock(BlockDescriptor* blockDescriptor,
+                        unsigned long value,
+                        unsigned byteCount);
+unsigned long readNumberFromBlock(BlockDescriptor* blockDescriptor,
+                                  unsigned byteCount);
 void resetBlockOffsets(BlockDescriptor* blockDescriptor);
 void createFile(const char* filename,
                 BlockDescriptor* blockDescriptor,
@@ -26,6 +42,10 @@ void createFile(const char* filename,
 void displayStatistics(const char* operation,
 		       const BlockDescriptor* originalBlock,
 		       const BlockDescriptor* finalBlock);
+void displaySizeStatistics(const char* operation,
+                           size_t originalSize,
+                           size_t finalSize);
+Boolean enableStatistics(Boolean enable);
 
 Boolean getBit(unsigned char bitNumber,
                unsigned char byte);
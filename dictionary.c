@@ -0,0 +1,374 @@
+/* dictionary.c
+ *
+ * Trained dictionaries. For a file of a few hundred bytes the frequency
+ * table stored in it can be bigger than the saving from Huffman coding,
+ * and building the tree takes longer than encoding. A dictionary is a
+ * frequency table trained from a corpus of similar files and saved
+ * once. Files compressed against it store only its ID, and the encoding
+ * patterns and decoding tree are built once when it is loaded and kept
+ * for every file compressed or decompressed with it.
+ *
+ * Every symbol is given a frequency of at least one when training, so
+ * that files containing bytes which never appeared in the corpus can
+ * still be compressed.
+ *
+ * Dictionary file format. Numbers are little endian, [n] is the number
+ * of bytes.
+ *
+ * "JLDT" <version [1]> <compression flags trained with [1]> <ID [4]>
+ * <frequency table, in the format used by huffmanCompressor.c>
+ *
+ * The ID is an FNV-1a hash of the flags and the table. A compressed
+ * file using a dictionary has ENCODING_SHARED_TABLE set in its header,
+ * and its data starts with the four byte ID.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "dataBlocks.h"
+#include "dictionary.h"
+#include "header.h"
+#include "huffmanCompressor.h"
+
+#define DICTIONARY_MAGIC "JLDT"
+#define DICTIONARY_MAGIC_SIZE (4)
+#define DICTIONARY_VERSION (1)
+#define DICTIONARY_ID_SIZE (4)
+#define FNV_OFFSET_BASIS (2166136261UL)
+
+/* The stages before Huffman coding, whose output a dictionary is
+ * trained on
+ */
+#define DICTIONARY_STAGES (ENCODING_FILTERED | ENCODING_FLIPPED | \
+                           ENCODING_RUN_LENGTH | ENCODING_RLE_V2)
+
+/* Keep the total frequency well inside the unsigned node frequencies
+ * used when building the tree
+ */
+#define MAXIMUM_TOTAL_FREQUENCY (0x7fffffffUL)
+
+struct DictionaryStruct {
+  unsigned long id;
+  unsigned char flags;
+  FrequencyTable frequencyTable;
+  HuffmanTree tree;
+  HuffmanNode* decodingTree;
+};
+
+/* The dictionary files are decompressed with */
+static Dictionary* loadedDictionary = NULL;
+
+/* hashBytes()
+ *
+ * Continue an FNV-1a hash over some bytes. Used for the dictionary ID.
+ *
+ * Parameters:
+ * hash - hash so far, or FNV_OFFSET_BASIS to start
+ * address - bytes to hash
+ * size - number of bytes
+ *
+ * Return value:
+ * Updated hash
+ */
+static unsigned long hashBytes(unsigned long hash,
+                               const unsigned char* address,
+                               size_t size) {
+  size_t index;
+  for (index = 0; index < size; index++) {
+    hash ^= address[index];
+    hash = (hash * 16777619UL) & 0xffffffffUL;
+  }
+  return hash;
+}
+
+/* scaleFrequencyTable()
+ *
+ * Give every symbol a frequency of at least one, and halve the
+ * frequencies until their total fits in a node of the tree.
+ *
+ * Parameters:
+ * frequencyTable - table counted from the corpus
+ */
+static void scaleFrequencyTable(FrequencyTable frequencyTable) {
+  unsigned long total;
+  unsigned symbol;
+  do {
+    total = 0;
+    for (symbol = 0; symbol < FREQUENCY_TABLE_SIZE; symbol++) {
+      if (frequencyTable[symbol].frequency == 0) {
+        frequencyTable[symbol].frequency = 1;
+      }
+      total += frequencyTable[symbol].frequency;
+    }
+    if (total > MAXIMUM_TOTAL_FREQUENCY) {
+      for (symbol = 0; symbol < FREQUENCY_TABLE_SIZE; symbol++) {
+        frequencyTable[symbol].frequency /= 2;
+      }
+    }
+  } while (total > MAXIMUM_TOTAL_FREQUENCY);
+}
+
+/* trainDictionary()
+ *
+ * Build a dictionary from a corpus of files and write it out. The
+ * stages before Huffman coding selected in the flags are run on each
+ * file, and the frequency table counted from their output.
+ *
+ * Parameters:
+ * flags - command line switches
+ * dictionaryFilename - file to write the dictionary to
+ * filenames - files in the corpus
+ * fileCount - number of files
+ */
+void trainDictionary(const struct CompressionFlags* flags,
+                     const char* dictionaryFilename,
+                     char** filenames,
+                     size_t fileCount) {
+  struct CompressionFlags stageFlags = *flags;
+  FrequencyTable frequencyTable;
+  BlockDescriptor* outputBlock = makeMemoryBlock(1024);
+  unsigned long bytesIn = 0;
+  size_t filesUsed = 0;
+  Boolean statistics = enableStatistics(False);
+  size_t index;
+
+  stageFlags.huffman = False;
+  stageFlags.blockSize = 0;
+  stageFlags.dictionary = NULL;
+  stageFlags.checksum = False;
+
+  initFrequencyTable(frequencyTable);
+  for (index = 0; index < fileCount; index++) {
+    BlockDescriptor* block = NULL;
+    if (getFileSize(filenames[index]) == 0) {
+      continue;
+    }
+    block = mapUncompressedFile(filenames[index]);
+    if (block->encoding) {
+      error(False, "%s is already compressed", filenames[index]);
+    }
+    bytesIn += block->usedSize;
+    block = compressBlock(&stageFlags, block);
+    addToFrequencyTable(block, frequencyTable);
+    freeBlock(block);
+    filesUsed++;
+  }
+  enableStatistics(statistics);
+
+  if (filesUsed == 0) {
+    error(False, "No data to train the dictionary with");
+  }
+  scaleFrequencyTable(frequencyTable);
+
+  writeBytesToBlock(outputBlock, (const unsigned char*)DICTIONARY_MAGIC,
+                    DICTIONARY_MAGIC_SIZE);
+  writeToBlock(outputBlock, DICTIONARY_VERSION);
+  writeToBlock(outputBlock, (stageFlags.filters ? ENCODING_FILTERED : 0) |
+               (stageFlags.flip ? ENCODING_FLIPPED : 0) |
+               (stageFlags.rle ? ENCODING_RUN_LENGTH : 0) |
+               (stageFlags.rleVersion2 ? ENCODING_RLE_V2 : 0));
+  writeNumberToBlock(outputBlock, 0, DICTIONARY_ID_SIZE);
+  writeFrequencyTableToBlock(frequencyTable, outputBlock);
+
+  /* Fill in the ID now that the table is there to hash */
+  {
+    size_t idOffset = DICTIONARY_MAGIC_SIZE + 2;
+    unsigned long id =
+      hashBytes(hashBytes(FNV_OFFSET_BASIS,
+                          outputBlock->address + idOffset - 1, 1),
+                outputBlock->address + idOffset + DICTIONARY_ID_SIZE,
+                outputBlock->usedSize - idOffset - DICTIONARY_ID_SIZE);
+    for (index = 0; index < DICTIONARY_ID_SIZE; index++) {
+      outputBlock->address[idOffset + index] = (id >> (index * 8)) & 0xff;
+    }
+    printf("Trained dictionary %s, ID %08lx, from %lu files, %lu bytes\n",
+           dictionaryFilename, id, (unsigned long)filesUsed, bytesIn);
+  }
+
+  createFile(dictionaryFilename, outputBlock, False);
+  freeBlock(outputBlock);
+}
+
+/* loadDictionary()
+ *
+ * Read a dictionary, build its encoding patterns and decoding tree,
+ * and make it the one used to decompress files which need one.
+ *
+ * Parameters:
+ * dictionaryFilename - dictionary file written by trainDictionary()
+ *
+ * Return value:
+ * The dictionary, to be freed with freeDictionary()
+ */
+Dictionary* loadDictionary(const char* dictionaryFilename) {
+  Dictionary* dictionary = malloc(sizeof(Dictionary));
+  BlockDescriptor* block = NULL;
+
+  if (dictionary == NULL) {
+    error(True, "malloc failed for dictionary");
+  }
+  if (getFileSize(dictionaryFilename) < DICTIONARY_MAGIC_SIZE + 2 +
+      DICTIONARY_ID_SIZE) {
+    error(False, "%s is not a dictionary", dictionaryFilename);
+  }
+  block = mapUncompressedFile(dictionaryFilename);
+
+  if (memcmp(block->address, DICTIONARY_MAGIC, DICTIONARY_MAGIC_SIZE)) {
+    error(False, "%s is not a dictionary", dictionaryFilename);
+  }
+  block->nextByteToRead = DICTIONARY_MAGIC_SIZE;
+  if (readFromBlock(block) != DICTIONARY_VERSION) {
+    error(False, "Dictionary %s has an unsupported version",
+          dictionaryFilename);
+  }
+  dictionary->flags = readFromBlock(block);
+  dictionary->id = readNumberFromBlock(block, DICTIONARY_ID_SIZE);
+  readFrequencyTableFromBlock(block, dictionary->frequencyTable);
+  freeBlock(block);
+
+  makeHuffmanCodes(dictionary->frequencyTable);
+  dictionary->decodingTree = buildHuffmanTree(dictionary->frequencyTable,
+                                              &dictionary->tree);
+
+  if (loadedDictionary == NULL) {
+    loadedDictionary = dictionary;
+  }
+  return dictionary;
+}
+
+/* freeDictionary()
+ *
+ * Free a dictionary read by loadDictionary().
+ */
+void freeDictionary(Dictionary* dictionary) {
+  if (dictionary != NULL) {
+    if (loadedDictionary == dictionary) {
+      loadedDictionary = NULL;
+    }
+    free(dictionary);
+  }
+}
+
+/* getDictionaryId()
+ *
+ * Return the ID stored in files compressed with a dictionary.
+ */
+unsigned long getDictionaryId(const Dictionary* dictionary) {
+  return dictionary->id;
+}
+
+/* describeStages()
+ *
+ * Name the stages before Huffman coding in a set of compression flags,
+ * for error messages.
+ *
+ * Parameters:
+ * flags - compression flags
+ * description - filled in with the names
+ * size - size of description
+ */
+static void describeStages(unsigned char flags, char* description,
+                           size_t size) {
+  snprintf(description, size, "%s%s%s",
+           (flags & ENCODING_FILTERED) ? "filter " : "",
+           (flags & ENCODING_FLIPPED) ? "flip " : "",
+           (flags & ENCODING_RUN_LENGTH) ?
+           ((flags & ENCODING_RLE_V2) ? "rle2 " : "rle ") : "");
+  if (description[0] == '\0') {
+    snprintf(description, size, "none");
+  }
+  else {
+    description[strlen(description) - 1] = '\0';
+  }
+}
+
+/* checkStages()
+ *
+ * Make sure that data reached Huffman coding through the stages the
+ * dictionary was trained with. With different ones its table doesn't
+ * describe the data.
+ *
+ * Parameters:
+ * dictionary - dictionary being used
+ * encoding - compression flags of the data
+ */
+static void checkStages(const Dictionary* dictionary, unsigned char encoding) {
+  char trained[32];
+  char used[32];
+
+  if ((encoding & DICTIONARY_STAGES) != (dictionary->flags & DICTIONARY_STAGES)) {
+    describeStages(dictionary->flags, trained, sizeof(trained));
+    describeStages(encoding, used, sizeof(used));
+    error(False, "Dictionary %08lx was trained with stages %s, "
+          "not %s - use the switches it was trained with",
+          dictionary->id, trained, used);
+  }
+}
+
+/* getDictionaryStages()
+ *
+ * Return the ENCODING_* flags of the stages before Huffman coding which
+ * the dictionary was trained with, and so has to be used with.
+ */
+unsigned char getDictionaryStages(const Dictionary* dictionary) {
+  return dictionary->flags & DICTIONARY_STAGES;
+}
+
+/* compressWithDictionary()
+ *
+ * Huffman compress a block with a dictionary's table, storing the
+ * dictionary ID in place of the table. Blocked files call this on
+ * several threads at once.
+ *
+ * Parameters:
+ * inputBlock - block to compress
+ * dictionary - dictionary to compress with
+ *
+ * Return value:
+ * Compressed block
+ */
+BlockDescriptor* compressWithDictionary(BlockDescriptor* inputBlock,
+                                        Dictionary* dictionary) {
+  BlockDescriptor* encodedBlock = NULL;
+  BlockDescriptor* outputBlock = NULL;
+
+  checkStages(dictionary, inputBlock->encoding);
+  encodedBlock = huffmanCompressWithTable(inputBlock,
+                                          dictionary->frequencyTable, True);
+
+  outputBlock = makeMemoryBlock(encodedBlock->usedSize + DICTIONARY_ID_SIZE);
+  writeNumberToBlock(outputBlock, dictionary->id, DICTIONARY_ID_SIZE);
+  writeBytesToBlock(outputBlock, encodedBlock->address, encodedBlock->usedSize);
+  outputBlock->encoding = encodedBlock->encoding;
+  freeBlock(encodedBlock);
+
+  displayStatistics("Huffman compressing with dictionary",
+                    inputBlock, outputBlock);
+  return outputBlock;
+}
+
+/* decompressWithDictionary()
+ *
+ * Reverse compressWithDictionary() using the dictionary loaded by
+ * loadDictionary(), which must have the ID stored in the block.
+ *
+ * Parameters:
+ * inputBlock - block to decompress
+ *
+ * Return value:
+ * Decompressed block
+ */
+BlockDescriptor* decompressWithDictionary(BlockDescriptor* inputBlock) {
+  unsigned long id = readNumberFromBlock(inputBlock, DICTIONARY_ID_SIZE);
+
+  if (loadedDictionary == NULL) {
+    error(False, "File was compressed with dictionary %08lx, "
+          "which must be given with --dictionary", id);
+  }
+  if (loadedDictionary->id != id) {
+    error(False, "File was compressed with dictionary %08lx, not %08lx",
+          id, loadedDictionary->id);
+  }
+  checkStages(loadedDictionary, inputBlock->encoding);
+  return huffmanDecompressWithTree(inputBlock, loadedDictionary->decodingTree);
+}
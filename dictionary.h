@@ -0,0 +1,22 @@
+#ifndef DICTIONARY_H
+#define DICTIONARY_H
+
+/* Declarations for trained Huffman dictionaries, in dictionary.c */
+
+#include "compression.h"
+
+void trainDictionary(const struct CompressionFlags* flags,
+                     const char* dictionaryFilename,
+                     char** filenames,
+                     size_t fileCount);
+
+Dictionary* loadDictionary(const char* dictionaryFilename);
+void freeDictionary(Dictionary* dictionary);
+unsigned long getDictionaryId(const Dictionary* dictionary);
+unsigned char getDictionaryStages(const Dictionary* dictionary);
+
+BlockDescriptor* compressWithDictionary(BlockDescriptor* inputBlock,
+                                        Dictionary* dictionary);
+BlockDescriptor* decompressWithDictionary(BlockDescriptor* inputBlock);
+
+#endif
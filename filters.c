@@ -0,0 +1,177 @@
+#include <stdio.h>
+#include <string.h>
+#include "dataBlocks.h"
+#include "compression.h"
+#include "header.h"
+#include "kernels.h"
+
+/* filters.c
+ *
+ * Filters for arrays of fixed width numbers, which make them easier for
+ * the later stages to compress. The delta filter replaces each byte with
+ * its difference from the same byte of the element before, so that
+ * slowly changing values become mostly small numbers, and the exclusive
+ * or delta does the same without carries, which suits floating point.
+ * The byte shuffle filter puts byte 0 of every element together, then
+ * byte 1 and so on, so that the bytes which hardly change end up in long
+ * runs. The delta is done first, then the shuffle.
+ *
+ * The filtered data starts with a byte holding the filters in the low
+ * bits and log2 of the element width from FILTER_WIDTH_SHIFT up. Any
+ * bytes after the last whole element are left where they are.
+ */
+
+
+/* widthCode()
+ *
+ * Parameters:
+ * elementWidth - element width in bytes, 2, 4, 8 or 16
+ *
+ * Return value:
+ * log2 of the width
+ */
+static unsigned widthCode(unsigned elementWidth) {
+  unsigned code = 0;
+
+  while ((1U << code) < elementWidth) {
+    code++;
+  }
+  return code;
+}
+
+
+/* filterBlock()
+ *
+ * Filter a block and set ENCODING_FILTERED. The result is one byte
+ * longer than the input.
+ *
+ * Parameters:
+ * inputBlock - block to be filtered
+ * filters - FILTER_* flags to apply
+ * elementWidth - element width in bytes, 2, 4, 8 or 16
+ *
+ * Return value:
+ * resulting filtered block
+ */
+BlockDescriptor* filterBlock(BlockDescriptor* inputBlock,
+                             unsigned char filters,
+                             unsigned elementWidth) {
+  const Kernels* kernels = getKernels();
+  BlockDescriptor* outputBlock;
+  BlockDescriptor* deltaBlock = NULL;
+  const unsigned char* source = inputBlock->address;
+  unsigned char* destination;
+  size_t size = inputBlock->usedSize;
+
+  if (inputBlock->encoding & ENCODING_FILTERED) {
+    error(False, "File is already filtered");
+  }
+
+  outputBlock = makeMemoryBlock(size + 1);
+  outputBlock->address[0] = filters |
+    (widthCode(elementWidth) << FILTER_WIDTH_SHIFT);
+  destination = outputBlock->address + 1;
+
+  if (filters & (FILTER_DELTA | FILTER_XOR_DELTA)) {
+    int exclusiveOr = (filters & FILTER_XOR_DELTA) ? 1 : 0;
+    if (filters & FILTER_SHUFFLE) {
+      deltaBlock = makeMemoryBlock(size);
+      kernels->delta(source, size, elementWidth, exclusiveOr,
+                     deltaBlock->address);
+      source = deltaBlock->address;
+    }
+    else {
+      kernels->delta(source, size, elementWidth, exclusiveOr, destination);
+    }
+  }
+
+  if (filters & FILTER_SHUFFLE) {
+    size_t count = size / elementWidth;
+    kernels->shuffleBytes(source, count, elementWidth, destination);
+    memcpy(destination + count * elementWidth,
+           source + count * elementWidth, size - count * elementWidth);
+  }
+
+  if (deltaBlock) {
+    freeBlock(deltaBlock);
+  }
+  outputBlock->usedSize = size + 1;
+  outputBlock->nextFreeByte = size + 1;
+  outputBlock->nextFreeBit = 0;
+  outputBlock->encoding = inputBlock->encoding | ENCODING_FILTERED;
+
+  displayStatistics("Filtering", inputBlock, outputBlock);
+  return outputBlock;
+}
+
+
+/* unfilterBlock()
+ *
+ * Reverse the effect of filterBlock() and clear ENCODING_FILTERED.
+ *
+ * Parameters:
+ * inputBlock - block to be unfiltered
+ *
+ * Return value:
+ * resulting unfiltered block, or NULL if the block isn't filtered
+ */
+BlockDescriptor* unfilterBlock(BlockDescriptor* inputBlock) {
+  const Kernels* kernels = getKernels();
+  BlockDescriptor* outputBlock;
+  BlockDescriptor* shuffleBlock = NULL;
+  const unsigned char* source;
+  unsigned char* destination;
+  unsigned char filters;
+  unsigned code;
+  size_t elementWidth;
+  size_t size;
+
+  if (!(inputBlock->encoding & ENCODING_FILTERED)) {
+    return NULL;
+  }
+  if (inputBlock->usedSize < 1) {
+    error(False, "Damaged input file - filtered data is empty");
+  }
+
+  filters = inputBlock->address[0] & ((1 << FILTER_WIDTH_SHIFT) - 1);
+  code = inputBlock->address[0] >> FILTER_WIDTH_SHIFT;
+  if ((filters == 0) || (filters & ~KNOWN_FILTERS) ||
+      ((filters & FILTER_DELTA) && (filters & FILTER_XOR_DELTA)) ||
+      (code < 1) || (code > 4)) {
+    error(False, "Damaged input file - unknown filter 0x%x",
+          inputBlock->address[0]);
+  }
+  elementWidth = (size_t)1 << code;
+  source = inputBlock->address + 1;
+  size = inputBlock->usedSize - 1;
+
+  outputBlock = makeMemoryBlock(size ? size : 1);
+  destination = outputBlock->address;
+
+  if (filters & FILTER_SHUFFLE) {
+    size_t count = size / elementWidth;
+    if (filters & (FILTER_DELTA | FILTER_XOR_DELTA)) {
+      shuffleBlock = makeMemoryBlock(size ? size : 1);
+      destination = shuffleBlock->address;
+    }
+    kernels->unshuffleBytes(source, count, elementWidth, destination);
+    memcpy(destination + count * elementWidth,
+           source + count * elementWidth, size - count * elementWidth);
+    source = destination;
+    destination = outputBlock->address;
+  }
+
+  if (filters & (FILTER_DELTA | FILTER_XOR_DELTA)) {
+    kernels->undelta(source, size, elementWidth,
+                     (filters & FILTER_XOR_DELTA) ? 1 : 0, destination);
+  }
+
+  if (shuffleBlock) {
+    freeBlock(shuffleBlock);
+  }
+  outputBlock->usedSize = size;
+  outputBlock->encoding = inputBlock->encoding & (~ENCODING_FILTERED);
+
+  displayStatistics("Unfiltering", inputBlock, outputBlock);
+  return outputBlock;
+}
@@ -1,13 +1,79 @@
 #include <stdio.h>
+#include <string.h>
 #include "dataBlocks.h"
 #include "compression.h"
 #include "header.h"
+#include "kernels.h"
+
+/* orBitsInto()
+ *
+ * OR bits into a byte array starting part way through a byte, for a
+ * bit plane which doesn't start on a byte boundary.
+ *
+ * Parameters:
+ * destination - array to OR into
+ * destinationSize - size of the array in bytes
+ * firstBit - bit of the array to start at
+ * source - bits to OR in, starting at bit 0 of the first byte. Any
+ *          bits after the last are 0
+ * bitCount - number of bits
+ */
+static void orBitsInto(unsigned char* destination,
+                       size_t destinationSize,
+                       unsigned long firstBit,
+                       const unsigned char* source,
+                       unsigned long bitCount) {
+  size_t byteIndex = firstBit / 8;
+  unsigned shift = firstBit % 8;
+  size_t offset;
+
+  for (offset = 0; offset < (bitCount + 7) / 8; offset++) {
+    if (byteIndex + offset < destinationSize) {
+      destination[byteIndex + offset] |= source[offset] << shift;
+    }
+    if (shift && (byteIndex + offset + 1 < destinationSize)) {
+      destination[byteIndex + offset + 1] |= source[offset] >> (8 - shift);
+    }
+  }
+}
+
+/* copyBitsFrom()
+ *
+ * The reverse of orBitsInto(), copying a bit plane which doesn't start
+ * on a byte boundary to one which does.
+ *
+ * Parameters:
+ * destination - array to copy to
+ * source - array to copy from
+ * sourceSize - size of the array in bytes
+ * firstBit - bit of the array to start at
+ * bitCount - number of bits
+ */
+static void copyBitsFrom(unsigned char* destination,
+                         const unsigned char* source,
+                         size_t sourceSize,
+                         unsigned long firstBit,
+                         unsigned long bitCount) {
+  size_t byteIndex = firstBit / 8;
+  unsigned shift = firstBit % 8;
+  size_t offset;
+
+  for (offset = 0; offset < (bitCount + 7) / 8; offset++) {
+    unsigned char byte = source[byteIndex + offset] >> shift;
+    if (shift && (byteIndex + offset + 1 < sourceSize)) {
+      byte |= source[byteIndex + offset + 1] << (8 - shift);
+    }
+    destination[offset] = byte;
+  }
+}
 
 /* flipBlock
  *
  * Flip the data in the block so that the block starts with all the
  * most significant bits concatenated together, then the next most
- * significant bits etc.
+ * significant bits etc. The flip kernel does 8 bytes at a time. If the
+ * size isn't a multiple of 8 the planes don't start on byte
+ * boundaries, so they are made separately and then shifted into place.
  *
  * Parameters:
  * inputBlock - descriptor of block to be flipped
@@ -16,17 +82,43 @@
  * Output block descriptor for new block with bit order flipped
  */
 static BlockDescriptor* flipBlock(BlockDescriptor* inputBlock) {
+  const Kernels* kernels = getKernels();
   BlockDescriptor* outputBlock;
-  unsigned long offset;
-  unsigned bitNumber = 8;
-  outputBlock = makeMemoryBlock(inputBlock->usedSize);
-  while (bitNumber-- != 0) {
-    for (offset = 0; offset < inputBlock->usedSize; offset++) {
-      writeBitToBlock(outputBlock,
-                      getBit(bitNumber, *(inputBlock->address + offset)));
+  size_t size = inputBlock->usedSize;
+  size_t groupCount = size / 8;
+
+  outputBlock = makeMemoryBlock(size);
+  if ((size % 8) == 0) {
+    kernels->flipBits(inputBlock->address, groupCount, outputBlock->address,
+                      groupCount);
+  }
+  else {
+    size_t planeSize = groupCount + 1;
+    BlockDescriptor* planes = makeMemoryBlock(8 * planeSize);
+    unsigned long offset;
+    unsigned plane;
+
+    memset(planes->address, 0, 8 * planeSize);
+    kernels->flipBits(inputBlock->address, groupCount, planes->address,
+                      planeSize);
+    for (offset = groupCount * 8; offset < size; offset++) {
+      for (plane = 0; plane < 8; plane++) {
+        if (getBit(7 - plane, *(inputBlock->address + offset))) {
+          setBit(offset % 8, planes->address + plane * planeSize + groupCount,
+                 True);
+        }
+      }
+    }
+    memset(outputBlock->address, 0, size);
+    for (plane = 0; plane < 8; plane++) {
+      orBitsInto(outputBlock->address, size, (unsigned long)plane * size,
+                 planes->address + plane * planeSize, size);
     }
+    freeBlock(planes);
   }
-  inputBlock->usedSize = outputBlock->usedSize;
+  outputBlock->usedSize = size;
+  outputBlock->nextFreeByte = size;
+  outputBlock->nextFreeBit = 0;
 
   displayStatistics("Flipping bit order", inputBlock, outputBlock);
   return outputBlock;
@@ -45,18 +137,40 @@ static BlockDescriptor* flipBlock(BlockDescriptor* inputBlock) {
  * returned to original state
  */
 static BlockDescriptor* unflipBlock(BlockDescriptor* inputBlock) {
+  const Kernels* kernels = getKernels();
   BlockDescriptor* outputBlock;
-  unsigned long offset;
-  unsigned bitNumber = 8;
-
-  outputBlock = makeMemoryBlock(inputBlock->usedSize);
-  while (bitNumber-- != 0) {
-    for (offset = 0; offset < inputBlock->usedSize; offset++) {
-      Boolean bit = readBitFromBlock(inputBlock);
-      setBit(bitNumber, outputBlock->address + offset, bit);
+  size_t size = inputBlock->usedSize;
+  size_t groupCount = size / 8;
+
+  outputBlock = makeMemoryBlock(size);
+  if ((size % 8) == 0) {
+    kernels->unflipBits(inputBlock->address, groupCount, groupCount,
+                        outputBlock->address);
+  }
+  else {
+    size_t planeSize = groupCount + 1;
+    BlockDescriptor* planes = makeMemoryBlock(8 * planeSize);
+    unsigned long offset;
+    unsigned plane;
+
+    for (plane = 0; plane < 8; plane++) {
+      copyBitsFrom(planes->address + plane * planeSize, inputBlock->address,
+                   size, (unsigned long)plane * size, size);
+    }
+    kernels->unflipBits(planes->address, planeSize, groupCount,
+                        outputBlock->address);
+    for (offset = groupCount * 8; offset < size; offset++) {
+      unsigned char byte = 0;
+      for (plane = 0; plane < 8; plane++) {
+        setBit(7 - plane, &byte,
+               getBit(offset % 8,
+                      *(planes->address + plane * planeSize + groupCount)));
+      }
+      *(outputBlock->address + offset) = byte;
     }
+    freeBlock(planes);
   }
-  outputBlock->usedSize = inputBlock->usedSize;
+  outputBlock->usedSize = size;
   
   displayStatistics("Unflipping bit order", inputBlock, outputBlock);
   return outputBlock;
@@ -2,6 +2,7 @@
 use strict;
 use warnings;
 use Carp;
+use JSON::PP;
 
 # printAndUnderline
 # 
@@ -79,6 +80,641 @@ foreach my $decompress ("./jlcompress", "./jldecompress") {
     }
 }
 
+# Batch mode, with each kind of I/O. Compress a directory of copies of
+# the page, then decompress the compressed files.
+foreach my $switches ("--blocking-io", "--io-uring", "") {
+    line();
+    printAndUnderline(length($switches) ? "Batch mode with switches $switches" :
+                      "Batch mode with default switches");
+
+    system("rm -rf batchTest") == 0 or croak("rm failed");
+    mkdir("batchTest") or croak($!);
+    foreach my $copy (1..3) {
+        system("cp Huffman_coding.html batchTest/copy$copy.html") == 0 or croak("cp failed");
+    }
+    system("./jlcompress --batch $switches batchTest");
+    system("./jlcompress --batch $switches " .
+           join(" ", map { "batchTest/copy$_.html.compressed" } (1..3)));
+    foreach my $copy (1..3) {
+        if (system("diff -s Huffman_coding.html batchTest/copy$copy.html.decompressed") != 0) {
+            print("*** Error: original file and file after batch compression/decompression differ\n");
+            exit(-1);
+        }
+    }
+    system("rm -rf batchTest") == 0 or croak("rm failed");
+}
+
+# Archives, with and without a shared table. Extract everything into
+# a separate directory, then a single member over the top of it.
+foreach my $switches ("", "--solid", "--flip --rle --huffman --solid") {
+    line();
+    printAndUnderline("Archive with switches $switches");
+
+    system("rm -rf archiveTest") == 0 or croak("rm failed");
+    mkdir("archiveTest") or croak($!);
+    system("./jlcompress --archive archiveTest/test.jla $switches Huffman_coding.html generalTests.pl rleTests.pl");
+    chdir("archiveTest") or croak($!);
+    system("../jlcompress --extract test.jla");
+    system("../jlcompress -f --extract test.jla rleTests.pl");
+    chdir("..") or croak($!);
+    foreach my $member ("Huffman_coding.html", "generalTests.pl", "rleTests.pl") {
+        if (system("diff -s $member archiveTest/$member") != 0) {
+            print("*** Error: original file and file extracted from archive differ\n");
+            exit(-1);
+        }
+    }
+    system("rm -rf archiveTest") == 0 or croak("rm failed");
+}
+
+# Names outside the current directory. Leading ../ is dropped when an
+# archive is made, and an archive made elsewhere with a ../ member is
+# refused, rather than writing outside the extraction directory.
+line();
+printAndUnderline("Archive member names with ..");
+system("rm -rf archiveTest") == 0 or croak("rm failed");
+mkdir("archiveTest") or croak($!);
+mkdir("archiveTest/inner") or croak($!);
+mkdir("archiveTest/xx") or croak($!);
+system("cp rleTests.pl archiveTest/xx/victim.txt") == 0 or croak("cp failed");
+chdir("archiveTest/inner") or croak($!);
+system("../../jlcompress --archive ../relative.jla ../../rleTests.pl");
+system("../../jlcompress --extract ../relative.jla");
+chdir("../..") or croak($!);
+if ((-e "archiveTest/rleTests.pl") ||
+    (system("cmp rleTests.pl archiveTest/inner/rleTests.pl") != 0)) {
+    print("*** Error: ../ wasn't removed from an archive member name\n");
+    exit(-1);
+}
+chdir("archiveTest") or croak($!);
+system("../jlcompress --archive traversal.jla xx/victim.txt");
+{
+    local $/;
+    open(my $archive, "<", "traversal.jla") or croak("Can't read traversal.jla");
+    binmode($archive);
+    my $contents = <$archive>;
+    close($archive);
+    $contents =~ s/xx\/victim\.txt/..\/victim.txt/ or croak("Member name not found");
+    open($archive, ">", "traversal.jla") or croak("Can't write traversal.jla");
+    binmode($archive);
+    print $archive ($contents);
+    close($archive);
+}
+chdir("inner") or croak($!);
+my $refused = system("../../jlcompress --extract ../traversal.jla 2> /dev/null") != 0;
+chdir("../..") or croak($!);
+if (!$refused || (-e "archiveTest/victim.txt")) {
+    print("*** Error: an archive member named ../victim.txt was extracted\n");
+    exit(-1);
+}
+system("rm -rf archiveTest") == 0 or croak("rm failed");
+print("Member names outside the directory are refused\n");
+
+# Blocked files, then ranges from them which start and end part way
+# through a block, and from a single stream file for comparison.
+open PAGE, "<Huffman_coding.html" or croak($!);
+binmode PAGE;
+my $page = do { local $/; <PAGE> };
+close PAGE;
+foreach my $switches ("--block-size 4K", "--block-size 4K --flip --rle --huffman",
+                      "--block-size 1M", "") {
+    line();
+    printAndUnderline(length($switches) ? "Blocked file with switches $switches" :
+                      "Ranges from a single stream file");
+
+    deleteFile("Huffman_coding.html.compressed");
+    deleteFile("Huffman_coding.html.decompressed");
+    system("./jlcompress $switches Huffman_coding.html Huffman_coding.html.compressed");
+    system("./jldecompress Huffman_coding.html.compressed Huffman_coding.html.decompressed");
+    if (system("diff -s Huffman_coding.html Huffman_coding.html.decompressed") != 0) {
+        print("*** Error: original file and file after blocked compression/decompression differ\n");
+        exit(-1);
+    }
+
+    foreach my $range ([0, 10], [4000, 5000], [12345, 100000], [length($page), 10]) {
+        my ($offset, $length) = @$range;
+        my $expected = substr($page, $offset, $length);
+        my $got = `./jldecompress --range $offset:$length Huffman_coding.html.compressed -`;
+        if ($got ne $expected) {
+            print("*** Error: range $offset:$length differs from the original file\n");
+            exit(-1);
+        }
+        print("Range $offset:$length is correct\n");
+    }
+}
+
+# Sizes which strtoul() would wrap round, refused with their own
+# errors rather than the misleading ones the wrapped sizes gave
+foreach my $test (["./jldecompress --range -1:4 Huffman_coding.html.compressed -",
+                   "can't be negative"],
+                  ["./jlcompress -f --block-size 18014398509481984K Huffman_coding.html Huffman_coding.html.compressed",
+                   "too big"]) {
+    my ($command, $message) = @$test;
+    my $output = `$command 2>&1`;
+    if (($? == 0) || ($output !~ /\Q$message\E/)) {
+        print("*** Error: $command should have been refused as $message, got: $output\n");
+        exit(-1);
+    }
+    print("$command is refused as $message\n");
+}
+
+# Dictionaries. Train one from 500 byte pieces of the page, then
+# compress some other small files with it, singly and in batch mode.
+line();
+printAndUnderline("Dictionary trained from pieces of the HTML page");
+system("rm -rf dictionaryTest") == 0 or croak("rm failed");
+mkdir("dictionaryTest") or croak($!);
+mkdir("dictionaryTest/corpus") or croak($!);
+mkdir("dictionaryTest/small") or croak($!);
+for (my $offset = 0; $offset < length($page); $offset += 500) {
+    my $directory = ($offset / 500) % 10 ? "corpus" : "small";
+    open PIECE, ">dictionaryTest/$directory/piece$offset" or croak($!);
+    print PIECE substr($page, $offset, 500);
+    close PIECE;
+}
+system("./jlcompress --train dictionaryTest/test.jld dictionaryTest/corpus");
+system("./jlcompress dictionaryTest/small/piece0 dictionaryTest/plain.compressed");
+foreach my $decompress ("./jlcompress", "./jldecompress") {
+    system("./jlcompress -f --dictionary dictionaryTest/test.jld dictionaryTest/small/piece0 dictionaryTest/piece0.compressed");
+    system("$decompress -f --dictionary dictionaryTest/test.jld dictionaryTest/piece0.compressed dictionaryTest/piece0.decompressed");
+    if (system("diff -s dictionaryTest/small/piece0 dictionaryTest/piece0.decompressed") != 0) {
+        print("*** Error: original file and file after compression/decompression with a dictionary differ\n");
+        exit(-1);
+    }
+}
+if (-s "dictionaryTest/piece0.compressed" >= -s "dictionaryTest/plain.compressed") {
+    print("*** Error: dictionary didn't make a small file compress better\n");
+    exit(-1);
+}
+system("./jlcompress --dictionary dictionaryTest/test.jld --batch dictionaryTest/small");
+system("./jlcompress --dictionary dictionaryTest/test.jld --batch dictionaryTest/small/*.compressed");
+foreach my $piece (glob("dictionaryTest/small/piece*[0-9]")) {
+    if (system("diff -s $piece $piece.decompressed") != 0) {
+        print("*** Error: original file and file after batch compression/decompression with a dictionary differ\n");
+        exit(-1);
+    }
+}
+# The dictionary was trained with the default stages, so it can't be
+# used with others
+foreach my $switches ("--flip --rle --huffman", "--huffman", "--rle2 --huffman") {
+    if (system("./jlcompress -f $switches --dictionary dictionaryTest/test.jld dictionaryTest/small/piece0 dictionaryTest/other.compressed > /dev/null 2>&1") == 0) {
+        print("*** Error: a dictionary was used with different stages, $switches\n");
+        exit(-1);
+    }
+}
+# A blocked file compressed with a dictionary on several threads must be
+# the same as one compressed on one thread, and the statistics must
+# still be printed afterwards
+system("./jlcompress -f --block-size 1K --dictionary dictionaryTest/test.jld Huffman_coding.html dictionaryTest/blocked.compressed");
+my $threadedOutput = `./jlcompress -f --threads 4 --block-size 1K --dictionary dictionaryTest/test.jld Huffman_coding.html dictionaryTest/threaded.compressed`;
+if ($threadedOutput !~ /Blocked compressing/) {
+    print("*** Error: statistics missing after compressing with a dictionary on several threads\n");
+    exit(-1);
+}
+if (system("cmp dictionaryTest/blocked.compressed dictionaryTest/threaded.compressed") != 0) {
+    print("*** Error: blocked file compressed with a dictionary differs on several threads\n");
+    exit(-1);
+}
+system("./jldecompress -f --threads 4 --dictionary dictionaryTest/test.jld dictionaryTest/threaded.compressed dictionaryTest/threaded.decompressed");
+if (system("diff -s Huffman_coding.html dictionaryTest/threaded.decompressed") != 0) {
+    print("*** Error: original file and threaded blocked file with a dictionary differ\n");
+    exit(-1);
+}
+system("rm -rf dictionaryTest") == 0 or croak("rm failed");
+
+# Blocked files compressed on several threads must be the same as those
+# compressed on one, and decompress on several threads too.
+line();
+printAndUnderline("Blocked file compressed and decompressed on two threads");
+deleteFile("Huffman_coding.html.compressed");
+system("./jlcompress --block-size 16K Huffman_coding.html Huffman_coding.html.compressed");
+system("./jlcompress --threads 2 --block-size 16K Huffman_coding.html Huffman_coding.html.threaded");
+if (system("cmp Huffman_coding.html.compressed Huffman_coding.html.threaded") != 0) {
+    print("*** Error: blocked file differs when compressed on two threads\n");
+    exit(-1);
+}
+unlink("Huffman_coding.html.threaded");
+deleteFile("Huffman_coding.html.decompressed");
+system("./jldecompress --threads 2 Huffman_coding.html.compressed Huffman_coding.html.decompressed");
+if (system("diff -s Huffman_coding.html Huffman_coding.html.decompressed") != 0) {
+    print("*** Error: original file and file decompressed on two threads differ\n");
+    exit(-1);
+}
+
+# Benchmark mode checks every round trip itself
+line();
+printAndUnderline("Benchmark mode");
+if (system("./jlcompress --bench Huffman_coding.html") != 0 ||
+    system("./jlcompress --threads 2 --block-size 16K --bench Huffman_coding.html") != 0) {
+    print("*** Error: benchmark mode failed\n");
+    exit(-1);
+}
+
+# The JSON statistics report must parse, and have a record for each
+# stage and each block
+line();
+printAndUnderline("Statistics report");
+foreach my $switches ("", "--block-size 16K --threads 2", "--perf-counters") {
+    my $report = `./jlcompress -f $switches --stats=json Huffman_coding.html Huffman_coding.html.compressed 2>&1 >/dev/null`;
+    my $statistics = eval { decode_json($report) };
+    if (!$statistics) {
+        print("*** Error: statistics report with switches $switches is not JSON\n");
+        exit(-1);
+    }
+    my %stages = map { $_->{stage} => $_ } @{$statistics->{stages}};
+    my $blocks = grep { $_->{stage} eq "compress-block" } @{$statistics->{stages}};
+    if (!$stages{"rle-encode"} || !$stages{"huffman-encode"} ||
+        $stages{"compress-file"}{bytes_in} != length($page) ||
+        !exists($statistics->{total}{buffer_pool}{hit_rate}) ||
+        (($switches =~ /block-size/) && $blocks != 7) ||
+        (($switches =~ /perf-counters/) && !exists($stages{"rle-encode"}{counters}{ipc}))) {
+        print("*** Error: statistics report with switches $switches is missing stages\n");
+        exit(-1);
+    }
+    print("Statistics report with switches \"$switches\" is correct\n");
+}
+
+# The trace must parse, and show the blocks being compressed and the
+# worker thread which was started to help
+line();
+printAndUnderline("Timeline trace");
+system("./jlcompress -f --trace Huffman_coding.html.trace --threads 2 --block-size 16K Huffman_coding.html Huffman_coding.html.compressed");
+open TRACE, "<Huffman_coding.html.trace" or croak($!);
+my $trace = eval { decode_json(do { local $/; <TRACE> }) };
+close TRACE;
+unlink("Huffman_coding.html.trace");
+if (!$trace) {
+    print("*** Error: trace is not JSON\n");
+    exit(-1);
+}
+my %events = map { $_->{name} => 1 } @{$trace->{traceEvents}};
+if (!$events{"compress-block"} || !$events{"worker"} || !$events{"write-file"}) {
+    print("*** Error: trace is missing events\n");
+    exit(-1);
+}
+print("Trace is correct\n");
+
+# Files with checksums must decompress, and must be rejected once a
+# byte of the compressed data has been changed
+line();
+printAndUnderline("Checksums");
+foreach my $switches ("--checksum", "--checksum --flip",
+                      "--checksum --block-size 16K --threads 2") {
+    system("./jlcompress -f $switches Huffman_coding.html Huffman_coding.html.compressed");
+    deleteFile("Huffman_coding.html.decompressed");
+    system("./jldecompress --threads 2 Huffman_coding.html.compressed Huffman_coding.html.decompressed");
+    if (system("diff -s Huffman_coding.html Huffman_coding.html.decompressed") != 0) {
+        print("*** Error: file with switches $switches did not decompress\n");
+        exit(-1);
+    }
+
+    open DAMAGE, "+<Huffman_coding.html.compressed" or croak($!);
+    binmode DAMAGE;
+    seek(DAMAGE, 1000, 0) or croak($!);
+    read(DAMAGE, my $byte, 1) == 1 or croak($!);
+    seek(DAMAGE, 1000, 0) or croak($!);
+    print DAMAGE chr(ord($byte) ^ 0x55);
+    close DAMAGE or croak($!);
+    if (system("./jldecompress -f Huffman_coding.html.compressed Huffman_coding.html.decompressed > /dev/null 2>&1") == 0) {
+        print("*** Error: damaged file with switches $switches was not rejected\n");
+        exit(-1);
+    }
+    print("Damaged file with switches \"$switches\" was rejected\n");
+}
+
+# --test must pass good files, single stream and blocked, and reject
+# a damaged one. --list must read the sizes and blocks from the index.
+line();
+printAndUnderline("Testing and listing files");
+system("rm -rf testSet") == 0 or croak("rm failed");
+mkdir("testSet") or croak($!);
+system("./jlcompress Huffman_coding.html testSet/single.compressed");
+system("./jlcompress --checksum --block-size 16K Huffman_coding.html testSet/blocked.compressed");
+if (system("./jldecompress --threads 2 --test testSet") != 0) {
+    print("*** Error: --test rejected good files\n");
+    exit(-1);
+}
+my $listing = `./jldecompress --list testSet/blocked.compressed`;
+if ($listing !~ /^\s*@{[length($page)]}\s+\d+\s+[\d.]+\s+7\s+rle\+huffman\+checksum\s/m) {
+    print("*** Error: --list output is wrong:\n$listing");
+    exit(-1);
+}
+open DAMAGE, "+<testSet/blocked.compressed" or croak($!);
+binmode DAMAGE;
+seek(DAMAGE, 1000, 0) or croak($!);
+print DAMAGE "damage";
+close DAMAGE or croak($!);
+if (system("./jldecompress --test testSet > /dev/null 2>&1") == 0) {
+    print("*** Error: --test passed a damaged file\n");
+    exit(-1);
+}
+system("rm -rf testSet") == 0 or croak("rm failed");
+print("--test and --list are correct\n");
+
+printAndUnderline("Pipeline");
+system("./jlcompress -f --block-size 16K Huffman_coding.html blocked.compressed");
+system("./jlcompress -f --pipeline --block-size 16K Huffman_coding.html pipelined.compressed");
+if (system("cmp blocked.compressed pipelined.compressed") != 0) {
+    print("*** Error: --pipeline output differs from --block-size\n");
+    exit(-1);
+}
+system("./jlcompress -f --checksum --block-size 16K Huffman_coding.html blocked.compressed");
+system("cat Huffman_coding.html | ./jlcompress --checksum --block-size 16K - > pipelined.compressed");
+if (system("cmp blocked.compressed pipelined.compressed") != 0) {
+    print("*** Error: compressing standard input gives different output\n");
+    exit(-1);
+}
+my $piped = `./jldecompress pipelined.compressed -`;
+if ($piped ne $page) {
+    print("*** Error: data from standard input didn't round trip\n");
+    exit(-1);
+}
+unlink("blocked.compressed", "pipelined.compressed");
+print("--pipeline is correct\n");
+
+printAndUnderline("Sidecar index");
+foreach my $options ("--rle --huffman --checksum", "--flip --rle") {
+    system("./jlcompress -f $options Huffman_coding.html indexed.compressed");
+    system("./jldecompress --index-interval 4K --index indexed.compressed") == 0
+        or croak("--index failed for $options");
+    -f "indexed.compressed.jlindex" or croak("No index written for $options");
+    foreach my $range ([0, 100], [5000, 3000], [length($page) - 50, 100]) {
+        my ($offset, $length) = @$range;
+        my $part = `./jldecompress --range $offset:$length indexed.compressed -`;
+        if ($part ne substr($page, $offset, $length)) {
+            print("*** Error: wrong data for range $offset:$length with $options\n");
+            exit(-1);
+        }
+    }
+    my $whole = `./jldecompress --threads 2 indexed.compressed -`;
+    if ($whole ne $page) {
+        print("*** Error: indexed decompression is wrong with $options\n");
+        exit(-1);
+    }
+}
+system("./jlcompress -f --rle indexed.compressed.jlindex indexed.compressed");
+if (system("./jldecompress --threads 2 indexed.compressed - > /dev/null 2>&1") == 0) {
+    print("*** Error: index of a different file was used\n");
+    exit(-1);
+}
+unlink("indexed.compressed", "indexed.compressed.jlindex");
+print("--index is correct\n");
+
+printAndUnderline("Parallel Huffman coding");
+open(my $large, ">", "large.html") or croak("Can't create large.html");
+print $large ($page x 12);
+close($large);
+foreach my $options ("--huffman", "--flip --rle --huffman") {
+    system("./jlcompress -f $options large.html large.compressed");
+    system("./jlcompress -f --threads 3 $options large.html threaded.compressed");
+    if (system("cmp large.compressed threaded.compressed") != 0) {
+        print("*** Error: Huffman encoding on 3 threads differs with $options\n");
+        exit(-1);
+    }
+    my $whole = `./jldecompress --threads 3 large.compressed -`;
+    if ($whole ne ($page x 12)) {
+        print("*** Error: Huffman decoding on 3 threads is wrong with $options\n");
+        exit(-1);
+    }
+}
+print("Parallel Huffman coding is correct\n");
+
+printAndUnderline("Parallel run length coding");
+open($large, ">", "large.html") or croak("Can't create large.html");
+# Text, which is still over 1 MB run length encoded, with long runs,
+# which cross where the file would be split, and the repeat and escape
+# symbols themselves
+for (my $count = 0; $count < 12; $count++) {
+    print $large ($page);
+    for (my $run = 0; $run < 250; $run++) {
+        print $large (chr($run) x ($run * $count % 700));
+        print $large (chr(235) x ($run % 5), chr(236) x ($run % 3));
+    }
+}
+close($large);
+my $expected = do {
+    open(my $in, "<", "large.html") or croak("Can't open large.html");
+    binmode($in);
+    local $/;
+    <$in>;
+};
+foreach my $options ("--rle", "--flip --rle", "--rle2", "--flip --rle2") {
+    system("./jlcompress -f $options large.html large.compressed");
+    system("./jlcompress -f --threads 3 $options large.html threaded.compressed");
+    if (system("cmp large.compressed threaded.compressed") != 0) {
+        print("*** Error: run length encoding on 3 threads differs with $options\n");
+        exit(-1);
+    }
+    my $whole = `./jldecompress --threads 3 large.compressed -`;
+    if ($whole ne $expected) {
+        print("*** Error: run length decoding on 3 threads is wrong with $options\n");
+        exit(-1);
+    }
+}
+unlink("large.html", "large.compressed", "threaded.compressed");
+print("Parallel run length coding is correct\n");
+
+printAndUnderline("Run length encoding version 2");
+# A megabyte of zeros is one run, and text full of the version 1
+# symbols needs none of them escaped
+open(my $zeros, ">", "zeros.bin") or croak("Can't create zeros.bin");
+print $zeros ("\0" x (1024 * 1024));
+close($zeros);
+open(my $symbols, ">", "symbols.html") or croak("Can't create symbols.html");
+print $symbols (join(chr(235), split(/ /, $page)), chr(236) x 3);
+close($symbols);
+system("./jlcompress -f --rle2 zeros.bin zeros.compressed");
+if (-s "zeros.compressed" > 32) {
+    print("*** Error: a megabyte of zeros takes " . (-s "zeros.compressed") .
+          " bytes with --rle2\n");
+    exit(-1);
+}
+system("./jlcompress -f --rle symbols.html symbols.compressed");
+my $versionOneSize = -s "symbols.compressed";
+system("./jlcompress -f --rle2 symbols.html symbols.compressed");
+if (-s "symbols.compressed" >= $versionOneSize) {
+    print("*** Error: --rle2 doesn't avoid escaping the version 1 symbols\n");
+    exit(-1);
+}
+foreach my $file ("zeros.bin", "symbols.html") {
+    foreach my $options ("--rle2", "--flip --rle2 --huffman",
+                         "--rle2 --huffman --checksum",
+                         "--rle2 --huffman --block-size 4K",
+                         "--rle2 --huffman --block-size 4K --pipeline") {
+        system("./jlcompress -f $options $file version2.compressed");
+        system("./jldecompress -f version2.compressed version2.decompressed");
+        if (system("cmp $file version2.decompressed") != 0) {
+            print("*** Error: $file isn't the same after $options\n");
+            exit(-1);
+        }
+    }
+}
+if (system("./jldecompress -f --index zeros.compressed 2>/dev/null") == 0) {
+    print("*** Error: a file encoded with --rle2 was indexed\n");
+    exit(-1);
+}
+unlink("zeros.bin", "zeros.compressed", "symbols.html", "symbols.compressed",
+       "version2.compressed", "version2.decompressed", "zeros.compressed.jlindex");
+print("Run length encoding version 2 is correct\n");
+
+printAndUnderline("Repeated patterns");
+# Binary records with fill patterns of 2, 4 and 8 bytes between them,
+# over 1 MB so that it is split between threads
+open(my $records, ">", "records.bin") or croak("Can't create records.bin");
+binmode($records);
+for (my $record = 0; $record < 6000; $record++) {
+    print $records (pack("VvC", $record * 2654435761 % 4294967296,
+                         $record % 7, $record % 251),
+                    "\x00\x00\xff\xff" x ($record % 50),
+                    "\xde\xad\xbe\xef\xca\xfe\xba\xbe" x ($record % 13),
+                    "\x01\x00" x ($record % 37),
+                    "\x00" x ($record % 20));
+}
+close($records);
+system("./jlcompress -f --rle records.bin records.compressed");
+$versionOneSize = -s "records.compressed";
+system("./jlcompress -f --rle2 records.bin records.compressed");
+if ((-s "records.compressed") * 4 > $versionOneSize) {
+    print("*** Error: --rle2 doesn't find the patterns, " .
+          (-s "records.compressed") . " bytes against $versionOneSize\n");
+    exit(-1);
+}
+system("./jlcompress -f --threads 3 --rle2 records.bin threaded.compressed");
+if (system("cmp records.compressed threaded.compressed") != 0) {
+    print("*** Error: patterns are encoded differently on 3 threads\n");
+    exit(-1);
+}
+foreach my $options ("--rle2", "--flip --rle2 --huffman",
+                     "--rle2 --huffman --block-size 64K") {
+    system("./jlcompress -f $options records.bin records.compressed");
+    foreach my $threads (1, 3) {
+        system("./jldecompress -f --threads $threads records.compressed records.decompressed");
+        if (system("cmp records.bin records.decompressed") != 0) {
+            print("*** Error: records.bin isn't the same after $options on $threads threads\n");
+            exit(-1);
+        }
+    }
+}
+unlink("records.bin", "records.compressed", "threaded.compressed",
+       "records.decompressed");
+print("Repeated patterns are correct\n");
+
+printAndUnderline("Numeric filters");
+# Slowly rising 32 bit counters, and the same values as doubles, with a
+# few bytes over so that the last element isn't whole
+open(my $numbers, ">", "numbers.bin") or croak("Can't create numbers.bin");
+binmode($numbers);
+for (my $element = 0; $element < 100000; $element++) {
+    print $numbers (pack("V", 1000000 + $element * 3 + $element % 5));
+}
+for (my $element = 0; $element < 20000; $element++) {
+    print $numbers (pack("d<", 1000.5 + $element / 64));
+}
+print $numbers ("abc");
+close($numbers);
+system("./jlcompress -f numbers.bin numbers.compressed");
+my $unfilteredSize = -s "numbers.compressed";
+system("./jlcompress -f --delta 4 --shuffle 4 numbers.bin numbers.compressed");
+if ((-s "numbers.compressed") * 2 > $unfilteredSize) {
+    print("*** Error: --delta 4 --shuffle 4 doesn't help, " .
+          (-s "numbers.compressed") . " bytes against $unfilteredSize\n");
+    exit(-1);
+}
+foreach my $width (2, 4, 8, 16) {
+    foreach my $options ("--delta $width", "--xor-delta $width",
+                         "--shuffle $width", "--delta $width --shuffle $width",
+                         "--xor-delta $width --shuffle $width --flip --rle2 --huffman",
+                         "--shuffle $width --checksum --block-size 64K",
+                         "--delta $width --pipeline") {
+        system("./jlcompress -f $options numbers.bin numbers.compressed");
+        system("./jldecompress -f numbers.compressed numbers.decompressed");
+        if (system("cmp numbers.bin numbers.decompressed") != 0) {
+            print("*** Error: numbers.bin isn't the same after $options\n");
+            exit(-1);
+        }
+    }
+}
+foreach my $options ("--delta 3", "--delta 4 --xor-delta 4", "--delta 4 --shuffle 8") {
+    if (system("./jlcompress -f $options numbers.bin numbers.compressed 2> /dev/null") == 0) {
+        print("*** Error: $options was accepted\n");
+        exit(-1);
+    }
+}
+unlink("numbers.bin", "numbers.compressed", "numbers.decompressed");
+print("Numeric filters are correct\n");
+
+printAndUnderline("Processor specific kernels");
+my @kernelLines = `./jlcompress --kernels`;
+if ($? != 0) {
+    print("*** Error: a kernel version differs from the scalar version\n");
+    exit(-1);
+}
+print(@kernelLines);
+# Every version of every kernel must give the same file, with a size
+# which isn't a multiple of 8 so that the flipped planes are unaligned
+open(my $odd, ">", "kernels.html") or croak("Can't create kernels.html");
+print $odd ($page x 3, chr(235) x 1000, "x");
+close($odd);
+# And binary data with patterns, for version 2 run length encoding
+open(my $patterns, ">", "kernels.bin") or croak("Can't create kernels.bin");
+binmode($patterns);
+for (my $record = 0; $record < 500; $record++) {
+    print $patterns (pack("V", $record * 2654435761 % 4294967296),
+                     "\x00\x00\xff\xff" x ($record % 30), "\x07\x00" x ($record % 9));
+}
+close($patterns);
+system("./jlcompress -f --flip --rle --huffman --checksum kernels.html kernels.compressed");
+system("./jlcompress -f --rle2 --huffman kernels.bin kernelsBin.compressed");
+system("./jlcompress -f --delta 4 --shuffle 4 --huffman kernels.bin kernelsDelta.compressed");
+system("./jlcompress -f --xor-delta 16 --shuffle 16 --huffman kernels.bin kernelsXor.compressed");
+foreach my $kernelLine (@kernelLines) {
+    next unless $kernelLine =~ /^([a-z0-9-]+)\s+(.*\*.*)$/;
+    my ($kernel, $versions) = ($1, $2);
+    my $variable = "JLCOMPRESS_KERNEL_" . uc($kernel);
+    $variable =~ s/-/_/g;
+    foreach my $version (split(" ", $versions)) {
+        $version =~ s/\*$//;
+        local $ENV{$variable} = $version;
+        system("./jlcompress -f --flip --rle --huffman --checksum kernels.html kernel.compressed > /dev/null");
+        if (system("cmp kernels.compressed kernel.compressed") != 0) {
+            print("*** Error: compressing with $variable=$version differs\n");
+            exit(-1);
+        }
+        if (system("./jldecompress -f kernels.compressed kernels.decompressed > /dev/null") != 0 ||
+            system("cmp kernels.html kernels.decompressed") != 0) {
+            print("*** Error: decompressing with $variable=$version is wrong\n");
+            exit(-1);
+        }
+        system("./jlcompress -f --rle2 --huffman kernels.bin kernel.compressed > /dev/null");
+        if (system("cmp kernelsBin.compressed kernel.compressed") != 0) {
+            print("*** Error: compressing with $variable=$version and --rle2 differs\n");
+            exit(-1);
+        }
+        if (system("./jldecompress -f kernelsBin.compressed kernels.decompressed > /dev/null") != 0 ||
+            system("cmp kernels.bin kernels.decompressed") != 0) {
+            print("*** Error: decompressing with $variable=$version and --rle2 is wrong\n");
+            exit(-1);
+        }
+        foreach my $filtered (["kernelsDelta.compressed", "--delta 4 --shuffle 4"],
+                              ["kernelsXor.compressed", "--xor-delta 16 --shuffle 16"]) {
+            my ($file, $options) = @$filtered;
+            system("./jlcompress -f $options --huffman kernels.bin kernel.compressed > /dev/null");
+            if (system("cmp $file kernel.compressed") != 0) {
+                print("*** Error: compressing with $variable=$version and $options differs\n");
+                exit(-1);
+            }
+            if (system("./jldecompress -f $file kernels.decompressed > /dev/null") != 0 ||
+                system("cmp kernels.bin kernels.decompressed") != 0) {
+                print("*** Error: decompressing with $variable=$version and $options is wrong\n");
+                exit(-1);
+            }
+        }
+    }
+}
+unlink("kernels.html", "kernels.compressed", "kernel.compressed", "kernels.decompressed",
+       "kernels.bin", "kernelsBin.compressed", "kernelsDelta.compressed",
+       "kernelsXor.compressed");
+print("Every kernel version gives the same files\n");
+
 print "\n\nAll tests passed\n\n";
 
 
@@ -13,11 +13,26 @@ size_t getHeaderSize(void) {
   return HEADER_SIZE;
 }
 
+/* fillHeader
+ *
+ * Fill in a header for a compressed file in memory, for callers which
+ * write the file themselves rather than through writeHeader().
+ *
+ * Parameters:
+ * header - buffer of at least getHeaderSize() bytes
+ * blockDescriptor - descriptor of the block whose encoding is recorded
+ */
+void fillHeader(unsigned char* header,
+                const BlockDescriptor* blockDescriptor) {
+  memcpy(header, "JLCM", HEADER_SIZE - 1);
+  header[HEADER_SIZE - 1] = blockDescriptor->encoding;
+}
+
 void writeHeader(FILE* file,
                  BlockDescriptor* blockDescriptor) {
 
-  char header[HEADER_SIZE] = { 'J', 'L', 'C', 'M', 0 };
-  header[HEADER_SIZE - 1] = blockDescriptor->encoding;
+  unsigned char header[HEADER_SIZE];
+  fillHeader(header, blockDescriptor);
 
   if (fwrite(header, 1, HEADER_SIZE, file) != HEADER_SIZE) {
     error(True, "Unable to write header to output file");
@@ -37,14 +52,55 @@ static unsigned describeCompressionFlags(unsigned char flags) {
     printf("* File is not compressed\n");
   }
   else {
+    if (flags & ENCODING_FILTERED) printf("* File is delta or byte shuffle filtered\n");
     if (flags & ENCODING_FLIPPED) printf("* File is flipped\n");
     if (flags & ENCODING_RUN_LENGTH) printf("* File is run length encoded\n");
+    if (flags & ENCODING_RLE_V2) printf("* Run length encoding is version 2\n");
     if (flags & ENCODING_HUFFMAN) printf("* File is Huffman encoded\n");
+    if (flags & ENCODING_SHARED_TABLE) printf("* Huffman table is stored separately\n");
+    if (flags & ENCODING_BLOCKED) printf("* File is split into blocks with a seek index\n");
+    if (flags & ENCODING_CHECKSUM) printf("* File has CRC32C checksums\n");
   }
   return flags;
 }
 
 
+/* parseHeader
+ *
+ * Return the compression flags from the start of a file which is
+ * already in memory.
+ *
+ * Parameters:
+ * buffer - start of the file contents
+ * size - number of bytes available in buffer
+ * outputDescription - True if a description of the flags is to be printed
+ *
+ * Return:
+ * Compression flags mask, 0 if the buffer does not hold a compressed file
+ */
+unsigned char parseHeader(const unsigned char* buffer,
+                          size_t size,
+                          Boolean outputDescription) {
+  const char* expectedHeader = "JLCM";
+
+  if (size < HEADER_SIZE) {
+    return 0;
+  }
+
+  if (memcmp(buffer, expectedHeader, strlen(expectedHeader))) {
+    return 0;
+  }
+  
+  if (buffer[HEADER_SIZE-1] & ~KNOWN_ENCODINGS) {
+    error(False,"Looks like a compressed file, but cannot understand encoding");
+  }
+
+
+  return outputDescription ? describeCompressionFlags(buffer[HEADER_SIZE-1]) :
+    buffer[HEADER_SIZE-1];
+}
+
+
 /* getCompressionFlags
  *
  * Return the compression flags of a file
@@ -61,7 +117,6 @@ unsigned char getCompressionFlags(const char* filename,
   unsigned char buffer[HEADER_SIZE];
   FILE* file = fopen(filename, "rb");
   int bytesRead = 0;
-  const char* expectedHeader = "JLCM";
 
   if (file == NULL) {
     error(True, "Unable to open file %s", filename); 
@@ -76,21 +131,7 @@ unsigned char getCompressionFlags(const char* filename,
     error(True, "Unable to close file %s", filename); 
   }
 
-  if (bytesRead < HEADER_SIZE) {
-    return 0;
-  }
-
-  if (memcmp(buffer, expectedHeader, strlen(expectedHeader))) {
-    return 0;
-  }
-  
-  if (buffer[HEADER_SIZE-1] & (!ENCODING_RUN_LENGTH)) {
-    error(False,"Looks like a compressed file, but cannot understand encoding\n");
-  }
-
-
-  return outputDescription ? describeCompressionFlags(buffer[HEADER_SIZE-1]) :
-    buffer[HEADER_SIZE-1];
+  return parseHeader(buffer, bytesRead, outputDescription);
 }
 
 /* isFlipped
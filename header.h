@@ -10,9 +10,36 @@
 #define ENCODING_RUN_LENGTH (0x1)
 #define ENCODING_FLIPPED (0x2)
 #define ENCODING_HUFFMAN (0x4)
+/* Huffman compressed without the frequency table, which is stored
+ * elsewhere, e.g. once for all the members of a solid archive
+ */
+#define ENCODING_SHARED_TABLE (0x8)
+/* Split into independently compressed blocks with a seek index, see
+ * blockedFile.c
+ */
+#define ENCODING_BLOCKED (0x10)
+/* Has CRC32C checksums of the original data, see crc32c.c */
+#define ENCODING_CHECKSUM (0x20)
+/* Run length encoded with symbols chosen for each block and run lengths
+ * of any size, see runLengthCompressor.c. Set with ENCODING_RUN_LENGTH.
+ */
+#define ENCODING_RLE_V2 (0x40)
+/* Delta and/or byte shuffle filtered, with a byte at the start of the
+ * filtered data saying how, see filters.c
+ */
+#define ENCODING_FILTERED (0x80)
+
+/* Every flag this version understands */
+#define KNOWN_ENCODINGS (ENCODING_RUN_LENGTH | ENCODING_FLIPPED | \
+                         ENCODING_HUFFMAN | ENCODING_SHARED_TABLE | \
+                         ENCODING_BLOCKED | ENCODING_CHECKSUM | \
+                         ENCODING_RLE_V2 | ENCODING_FILTERED)
 
 size_t getHeaderSize();
 
+void fillHeader(unsigned char* header,
+                const BlockDescriptor* blockDescriptor);
+
 void writeHeader(FILE* file,
                  BlockDescriptor* blockDescriptor);
 
@@ -20,6 +47,10 @@ Boolean isFlipped(BlockDescriptor* blockDescriptor);
 Boolean isRleCompressed(BlockDescriptor* blockDescriptor);
 Boolean isHuffmanCompressed(BlockDescriptor* blockDescriptor);
 
+unsigned char parseHeader(const unsigned char* buffer,
+                          size_t size,
+                          Boolean outputDescription);
+
 unsigned char getCompressionFlags(const char* filename,
                                   Boolean printDescription);
 
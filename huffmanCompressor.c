@@ -4,10 +4,13 @@
  */
 
 #include <stdio.h>
+#include <string.h>
 #include "compression.h"
 #include "dataBlocks.h"
 #include "header.h"
 #include "huffmanCompressor.h"
+#include "kernels.h"
+#include "parallelHuffman.h"
 
 /* initFrequencyTable()
  *
@@ -16,7 +19,7 @@
  * Parameters:
  * frequencyTable - Frequency table array
  */
-static void initFrequencyTable(FrequencyTable frequencyTable) {
+void initFrequencyTable(FrequencyTable frequencyTable) {
   unsigned symbol;
   for (symbol = 0; symbol < FREQUENCY_TABLE_SIZE; symbol++) {
     frequencyTable[symbol].symbol = symbol;
@@ -27,10 +30,32 @@ static void initFrequencyTable(FrequencyTable frequencyTable) {
 
 }
 
+/* addToFrequencyTable()
+ *
+ * Add the number of times each character occurs in the input block to
+ * the frequency table. Used directly when one table is shared by
+ * several blocks.
+ *
+ * Parameters:
+ * inputBlock - Descriptor of input block to scan
+ * frequencyTable - Frequency table array to add to.
+ */
+void addToFrequencyTable(BlockDescriptor* inputBlock,
+			 FrequencyTable frequencyTable) {
+  unsigned long counts[FREQUENCY_TABLE_SIZE];
+  unsigned symbol;
+
+  memset(counts, 0, sizeof(counts));
+  getKernels()->countBytes(inputBlock->address, inputBlock->usedSize, counts);
+  for (symbol = 0; symbol < FREQUENCY_TABLE_SIZE; symbol++) {
+    frequencyTable[symbol].frequency += counts[symbol];
+  }
+}
+
 /* populateFrequencyTable()
  *
  * Populate the frequency table by counting how many of each character
- * occurs in the input block.
+ * occurs in the input block, on several threads for a large block.
  *
  * Parameters:
  * inputBlock - Descriptor of input block to scan
@@ -38,10 +63,12 @@ static void initFrequencyTable(FrequencyTable frequencyTable) {
  */
 static void populateFrequencyTable(BlockDescriptor* inputBlock,
 				   FrequencyTable frequencyTable) {
-  size_t offset;
   initFrequencyTable(frequencyTable);
-  for (offset = 0; offset < inputBlock->usedSize; offset++) {
-    frequencyTable[*(inputBlock->address + offset)].frequency++;
+  if (canEncodeInParallel(inputBlock->usedSize)) {
+    countInParallel(inputBlock, frequencyTable);
+  }
+  else {
+    addToFrequencyTable(inputBlock, frequencyTable);
   }
 }
 
@@ -73,8 +100,8 @@ static void populateFrequencyTable(BlockDescriptor* inputBlock,
  * inputBlock - Descriptor for input block to read
  * frequencyTable - Frequency table array to populate.
  */
-static void readFrequencyTableFromBlock(BlockDescriptor* inputBlock,
-				    FrequencyTable frequencyTable) {
+void readFrequencyTableFromBlock(BlockDescriptor* inputBlock,
+				 FrequencyTable frequencyTable) {
   unsigned index;
   unsigned symbolCount = readFromBlock(inputBlock);
   symbolCount++;
@@ -84,16 +111,20 @@ static void readFrequencyTableFromBlock(BlockDescriptor* inputBlock,
    */
   initFrequencyTable(frequencyTable);
 
+  /* The entries are stored in symbol order, so putting each one in
+   * its symbol's slot builds the same tree as the compressor did, and
+   * leaves the table usable for encoding as well.
+   */
   for (index = 0; index < symbolCount; index++) {
     unsigned byteCount;
     unsigned byteNumber;
-    frequencyTable[index].symbol = readFromBlock(inputBlock);
+    unsigned char symbol = readFromBlock(inputBlock);
     byteCount = readFromBlock(inputBlock);
-    frequencyTable[index].frequency = 0;
+    frequencyTable[symbol].frequency = 0;
 
     for (byteNumber = 0; byteNumber < byteCount; byteNumber++) {
-      frequencyTable[index].frequency |= 
-	(readFromBlock(inputBlock) << (byteNumber * 8));
+      frequencyTable[symbol].frequency |= 
+	((size_t)readFromBlock(inputBlock) << (byteNumber * 8));
     }
   }
 }
@@ -109,8 +140,8 @@ static void readFrequencyTableFromBlock(BlockDescriptor* inputBlock,
  * frequencyTable - Frequency table array to write
  * outputBlock - Output block descriptor.
  */
-static void writeFrequencyTableToBlock(FrequencyTable frequencyTable,
-			      BlockDescriptor* outputBlock) {
+void writeFrequencyTableToBlock(FrequencyTable frequencyTable,
+				BlockDescriptor* outputBlock) {
   unsigned numberOfEntries = 0;
   size_t symbolCountOffset = 0;
   size_t index = 0;
@@ -157,34 +188,26 @@ static void writeFrequencyTableToBlock(FrequencyTable frequencyTable,
 
 }
 
-BlockDescriptor* huffmanCompress(BlockDescriptor* inputBlock) {
-  
+/* makeHuffmanCodes()
+ *
+ * Build the Huffman tree for a populated frequency table and fill in
+ * the bit pattern of every character which has a non-zero frequency.
+ *
+ * Parameters:
+ * frequencyTable - Frequency table array
+ */
+void makeHuffmanCodes(FrequencyTable frequencyTable) {
   size_t offset;
-  FrequencyTable frequencyTable;
-  BlockDescriptor* outputBlock = makeMemoryBlock(inputBlock->usedSize);
-  HuffmanNode* huffmanNode;
+  HuffmanTree tree;
 
-  union {
-    unsigned long bytesInFile;
-    char ch[sizeof(unsigned long)];
-  } bytesInFile;
-
-
-  if (isHuffmanCompressed(inputBlock)) {
-    error(False, "File already Huffman encoded");
+  for (offset = 0; offset < FREQUENCY_TABLE_SIZE; offset++) {
+    frequencyTable[offset].huffmanBits = 0;
+    frequencyTable[offset].huffmanBitCount = 0;
   }
 
-  /* Get the frequency table */
-  populateFrequencyTable(inputBlock, frequencyTable);
-  
-  /* Generate the Huffman table */
-  huffmanNode = buildHuffmanTree(frequencyTable);
-  
-  /* Walk the tree and fill in the bit patterns into the
-   * frequency table. This also deletes the tree
-   */
-  walkHuffmanTree(huffmanNode, frequencyTable, 0, 0);
-  huffmanNode = NULL;
+  /* Generate the Huffman tree and fill in the bit patterns from it */
+  buildHuffmanTree(frequencyTable, &tree);
+  makeHuffmanPatterns(&tree, frequencyTable);
   
   /* Check that the frequency table is filled in properly */
   for (offset = 0; offset < FREQUENCY_TABLE_SIZE; offset++) {
@@ -197,7 +220,105 @@ BlockDescriptor* huffmanCompress(BlockDescriptor* inputBlock) {
       error(False, "Unused characters in file have patterns");
     }
   }
-  
+}
+
+/* makeReversedPatterns()
+ *
+ * Patterns are written from their most significant bit, so reverse
+ * them to write them from the bottom of a word.
+ *
+ * Parameters:
+ * frequencyTable - Frequency table with bit patterns filled in
+ * patterns - set to the reversed pattern of each symbol
+ * lengths - set to the length of each pattern
+ */
+void makeReversedPatterns(FrequencyTable frequencyTable,
+                          unsigned long* patterns,
+                          unsigned char* lengths) {
+  unsigned symbol;
+
+  for (symbol = 0; symbol < FREQUENCY_TABLE_SIZE; symbol++) {
+    unsigned length = frequencyTable[symbol].huffmanBitCount;
+    unsigned bitNumber;
+    lengths[symbol] = length;
+    patterns[symbol] = 0;
+    for (bitNumber = 0; bitNumber < length; bitNumber++) {
+      if (frequencyTable[symbol].huffmanBits &
+          (1UL << (length - 1 - bitNumber))) {
+        patterns[symbol] |= 1UL << bitNumber;
+      }
+    }
+  }
+}
+
+/* packBlock()
+ *
+ * Append the Huffman bit patterns of a block to the output block with
+ * the pack codes kernel. The block is counted first to find how much
+ * space the patterns need.
+ *
+ * Parameters:
+ * inputBlock - Descriptor of block to encode
+ * frequencyTable - Frequency table with bit patterns filled in
+ * outputBlock - Block to append to
+ */
+static void packBlock(BlockDescriptor* inputBlock,
+                      FrequencyTable frequencyTable,
+                      BlockDescriptor* outputBlock) {
+  const Kernels* kernels = getKernels();
+  unsigned long patterns[FREQUENCY_TABLE_SIZE];
+  unsigned char lengths[FREQUENCY_TABLE_SIZE];
+  unsigned long counts[FREQUENCY_TABLE_SIZE];
+  unsigned long bit = outputBlock->nextFreeByte * 8 + outputBlock->nextFreeBit;
+  unsigned long bitCount = 0;
+  unsigned symbol;
+
+  makeReversedPatterns(frequencyTable, patterns, lengths);
+  memset(counts, 0, sizeof(counts));
+  kernels->countBytes(inputBlock->address, inputBlock->usedSize, counts);
+  for (symbol = 0; symbol < FREQUENCY_TABLE_SIZE; symbol++) {
+    if (counts[symbol] && (lengths[symbol] == 0)) {
+      error(False, "Character %u has no Huffman code in the table", symbol);
+    }
+    bitCount += counts[symbol] * lengths[symbol];
+  }
+
+  /* The kernel always touches the byte the patterns start in */
+  reserveBlockSpace(outputBlock, (bit + bitCount) / 8 + 1);
+  bit += kernels->packCodes(inputBlock->address, inputBlock->usedSize,
+                            patterns, lengths,
+                            outputBlock->address + bit / 8, bit % 8);
+
+  outputBlock->nextFreeByte = bit / 8;
+  outputBlock->nextFreeBit = bit % 8;
+  outputBlock->usedSize = (bit + 7) / 8;
+}
+
+/* encodeBlock()
+ *
+ * Write the number of bytes in the input block, followed by the
+ * Huffman bit patterns of its bytes, to the output block. Used by
+ * both huffmanCompress() and huffmanCompressWithTable().
+ *
+ * Parameters:
+ * inputBlock - Descriptor of block to encode
+ * frequencyTable - Frequency table with bit patterns filled in
+ * outputBlock - Block to append to
+ * tableWriter - writes the frequency table after the byte count,
+ *               or NULL if it is stored elsewhere
+ */
+static void encodeBlock(BlockDescriptor* inputBlock,
+			FrequencyTable frequencyTable,
+			BlockDescriptor* outputBlock,
+			void (*tableWriter)(FrequencyTable, BlockDescriptor*)) {
+  size_t offset;
+  size_t countOffset = outputBlock->nextFreeByte;
+
+  union {
+    unsigned long bytesInFile;
+    char ch[sizeof(unsigned long)];
+  } bytesInFile;
+
   /* Make space for the number of bytes written. We could just
    * write the padding bits in the last byte, but this is easier
    */
@@ -206,69 +327,285 @@ BlockDescriptor* huffmanCompress(BlockDescriptor* inputBlock) {
   }
 
   /* Write the frequency table to the output block */
- writeFrequencyTableToBlock(frequencyTable, outputBlock);
+  if (tableWriter != NULL) {
+    tableWriter(frequencyTable, outputBlock);
+  }
   
-  /* Encode */
-  for (offset = 0; offset < inputBlock->usedSize; offset++) {
-    unsigned char symbol = *(inputBlock->address + offset);
-    unsigned patternLength = frequencyTable[symbol].huffmanBitCount;
-
-     while (patternLength) {
-       writeBitToBlock(outputBlock, ((1 << (patternLength-1)) & 
-				     frequencyTable[symbol].huffmanBits) ?
-		       True : False);
-       patternLength--;
-     }
+  /* Encode, on several threads for a large block, which gives exactly
+   * the same bits
+   */
+  if (canEncodeInParallel(inputBlock->usedSize)) {
+    encodeInParallel(inputBlock, frequencyTable, outputBlock);
+  }
+  else {
+    packBlock(inputBlock, frequencyTable, outputBlock);
   }
 
   bytesInFile.bytesInFile = inputBlock->usedSize;  
   for (offset = 0; offset < sizeof(unsigned long); offset++) {
-    *(outputBlock->address + offset) = bytesInFile.ch[offset];
+    *(outputBlock->address + countOffset + offset) = bytesInFile.ch[offset];
+  }
+}
+
+BlockDescriptor* huffmanCompress(BlockDescriptor* inputBlock) {
+  
+  FrequencyTable frequencyTable;
+  BlockDescriptor* outputBlock = makeMemoryBlock(inputBlock->usedSize);
+
+  if (isHuffmanCompressed(inputBlock)) {
+    error(False, "File already Huffman encoded");
   }
+
+  /* Get the frequency table */
+  populateFrequencyTable(inputBlock, frequencyTable);
+  makeHuffmanCodes(frequencyTable);
+
+  encodeBlock(inputBlock, frequencyTable, outputBlock,
+	      writeFrequencyTableToBlock);
   outputBlock->encoding = inputBlock->encoding | ENCODING_HUFFMAN;
   
   displayStatistics("Huffman compressing", inputBlock, outputBlock);
   return outputBlock;
 }
 
+/* huffmanCompressWithTable()
+ *
+ * Huffman compress the input block using a table which is stored
+ * somewhere other than in the compressed data, e.g. one shared by all
+ * the members of a solid archive. The output is marked with
+ * ENCODING_SHARED_TABLE so that huffmanDecompress() won't look for a
+ * table in it.
+ *
+ * Parameters:
+ * inputBlock - Descriptor of block to compress
+ * frequencyTable - Table with the bit patterns filled in by
+ *                  makeHuffmanCodes(). Every character in the block must
+ *                  have a pattern.
+ * quiet - True not to print the statistics line, for callers which
+ *         print their own. This is a parameter rather than a call to
+ *         enableStatistics() as the callers can be on several threads.
+ *
+ * Return value:
+ * Compressed block
+ */
+BlockDescriptor* huffmanCompressWithTable(BlockDescriptor* inputBlock,
+					  FrequencyTable frequencyTable,
+					  Boolean quiet) {
+  BlockDescriptor* outputBlock = makeMemoryBlock(inputBlock->usedSize + 
+						 sizeof(unsigned long));
+
+  if (isHuffmanCompressed(inputBlock)) {
+    error(False, "File already Huffman encoded");
+  }
 
-BlockDescriptor* huffmanDecompress(BlockDescriptor* inputBlock) {
-  FrequencyTable frequencyTable;
-  HuffmanNode* huffmanNode;
+  encodeBlock(inputBlock, frequencyTable, outputBlock, NULL);
+  outputBlock->encoding = inputBlock->encoding | ENCODING_HUFFMAN |
+    ENCODING_SHARED_TABLE;
+
+  if (!quiet) {
+    displayStatistics("Huffman compressing with shared table",
+		      inputBlock, outputBlock);
+  }
+  return outputBlock;
+}
+
+/* decodeWithTree()
+ *
+ * Decode the Huffman bit patterns following the byte count by walking
+ * a tree which has already been built. Large streams are decoded on
+ * several threads if there are several, see parallelHuffman.c.
+ *
+ * Parameters:
+ * inputBlock - Descriptor of block to decode, positioned at the first
+ *              bit pattern
+ * huffmanNode - Root of the tree
+ * bytesInFile - number of bytes to decode
+ *
+ * Return value:
+ * Decoded block
+ */
+static BlockDescriptor* decodeWithTree(BlockDescriptor* inputBlock,
+				       HuffmanNode* huffmanNode,
+				       unsigned long bytesInFile) {
   BlockDescriptor* outputBlock = NULL;
+  HuffmanNode* state = NULL;
+
+  if (canDecodeInParallel(huffmanNode, bytesInFile)) {
+    return decodeInParallel(inputBlock, huffmanNode, bytesInFile);
+  }
 
+  outputBlock = makeMemoryBlock(bytesInFile ? bytesInFile : 1);
+
+  while (bytesInFile) { 
+    unsigned char character;
+    Boolean bitRead = readBitFromBlock(inputBlock);
+    if (getHuffmanChar(bitRead, huffmanNode, &state, &character)) {
+      bytesInFile--;
+      writeToBlock(outputBlock, character);
+    }
+  }
+  return outputBlock;
+}
+
+/* decodeBlock()
+ *
+ * Decode the Huffman bit patterns following the byte count, using the
+ * tree built from the frequency table.
+ *
+ * Parameters:
+ * inputBlock - Descriptor of block to decode, positioned after the
+ *              frequency table if there is one
+ * frequencyTable - Frequency table to build the tree from
+ * bytesInFile - number of bytes to decode
+ *
+ * Return value:
+ * Decoded block
+ */
+static BlockDescriptor* decodeBlock(BlockDescriptor* inputBlock,
+				    FrequencyTable frequencyTable,
+				    unsigned long bytesInFile) {
+  HuffmanTree tree;
+  return decodeWithTree(inputBlock, buildHuffmanTree(frequencyTable, &tree),
+			bytesInFile);
+}
+
+/* readByteCount()
+ *
+ * Read the number of bytes in the original input from the start of
+ * Huffman compressed data.
+ *
+ * Parameters:
+ * inputBlock - Descriptor of block to read
+ *
+ * Return value:
+ * Number of bytes
+ */
+static unsigned long readByteCount(BlockDescriptor* inputBlock) {
+  size_t offset;
   union {
     unsigned long bytesInFile;
     char ch[sizeof(unsigned long)];
   } bytesInFile;
 
-  size_t offset;
+  for (offset = 0; offset < sizeof(unsigned long); offset++) {
+    bytesInFile.ch[offset] = readFromBlock(inputBlock);
+  }
+  return bytesInFile.bytesInFile;
+}
+
+/* getHuffmanByteCount()
+ *
+ * Read the number of bytes Huffman compressed data decodes to, without
+ * decoding it.
+ *
+ * Parameters:
+ * inputBlock - Descriptor of the compressed data. It isn't read from,
+ *              so its read position is unchanged.
+ *
+ * Return value:
+ * Number of bytes
+ */
+unsigned long getHuffmanByteCount(const BlockDescriptor* inputBlock) {
+  BlockDescriptor* view = NULL;
+  unsigned long bytesInFile;
+
+  if (inputBlock->usedSize < sizeof(unsigned long)) {
+    error(False, "Damaged input file - too small to be Huffman compressed");
+  }
+  view = makeViewBlock(inputBlock->address, sizeof(unsigned long), 0);
+  bytesInFile = readByteCount(view);
+  freeBlock(view);
+  return bytesInFile;
+}
+
+
+BlockDescriptor* huffmanDecompress(BlockDescriptor* inputBlock) {
+  FrequencyTable frequencyTable;
+  BlockDescriptor* outputBlock = NULL;
+  unsigned long bytesInFile;
+
   if (!isHuffmanCompressed(inputBlock)) {
     return NULL;
   }
 
-  /* Read the number of bytes in the original input file */
-  for (offset = 0; offset < sizeof(unsigned long); offset++) {
-    bytesInFile.ch[offset] = readFromBlock(inputBlock);
+  if (inputBlock->encoding & ENCODING_SHARED_TABLE) {
+    error(False, "Huffman table is not stored in the compressed data");
   }
 
-  outputBlock = makeMemoryBlock(bytesInFile.bytesInFile);
+  /* Read the number of bytes in the original input file */
+  bytesInFile = readByteCount(inputBlock);
 
   readFrequencyTableFromBlock(inputBlock, frequencyTable);
-  
-  huffmanNode = buildHuffmanTree(frequencyTable);
-
-  while (bytesInFile.bytesInFile) { 
-    unsigned char character;
-    Boolean bitRead = readBitFromBlock(inputBlock);
-    if (getHuffmanChar(bitRead, huffmanNode, &character)) {
-      bytesInFile.bytesInFile--;
-      writeToBlock(outputBlock, character);
-    }
-  }
 
+  outputBlock = decodeBlock(inputBlock, frequencyTable, bytesInFile);
   outputBlock->encoding = inputBlock->encoding & (~ENCODING_HUFFMAN);
 
   displayStatistics("Huffman decompressing", inputBlock, outputBlock);
   return outputBlock;
 }
+
+/* huffmanDecompressWithTable()
+ *
+ * Reverse huffmanCompressWithTable().
+ *
+ * Parameters:
+ * inputBlock - Descriptor of block to decompress
+ * frequencyTable - The table it was compressed with
+ *
+ * Return value:
+ * Decompressed block
+ */
+BlockDescriptor* huffmanDecompressWithTable(BlockDescriptor* inputBlock,
+					    FrequencyTable frequencyTable) {
+  BlockDescriptor* outputBlock = NULL;
+  unsigned long bytesInFile;
+
+  if (!isHuffmanCompressed(inputBlock) ||
+      !(inputBlock->encoding & ENCODING_SHARED_TABLE)) {
+    error(False, "Block is not Huffman compressed with a shared table");
+  }
+
+  bytesInFile = readByteCount(inputBlock);
+  outputBlock = decodeBlock(inputBlock, frequencyTable, bytesInFile);
+  outputBlock->encoding = inputBlock->encoding &
+    ~(ENCODING_HUFFMAN | ENCODING_SHARED_TABLE);
+
+  displayStatistics("Huffman decompressing with shared table",
+		    inputBlock, outputBlock);
+  return outputBlock;
+}
+
+/* huffmanDecompressWithTree()
+ *
+ * Reverse huffmanCompressWithTable(), using a decoding tree which has
+ * already been built from the table, so that it can be built once and
+ * used for many blocks.
+ *
+ * Parameters:
+ * inputBlock - Descriptor of block to decompress, positioned at the
+ *              byte count
+ * huffmanNode - Root of the tree built from the table it was
+ *               compressed with
+ *
+ * Return value:
+ * Decompressed block
+ */
+BlockDescriptor* huffmanDecompressWithTree(BlockDescriptor* inputBlock,
+					   HuffmanNode* huffmanNode) {
+  BlockDescriptor* outputBlock = NULL;
+  unsigned long bytesInFile;
+
+  if (!isHuffmanCompressed(inputBlock) ||
+      !(inputBlock->encoding & ENCODING_SHARED_TABLE)) {
+    error(False, "Block is not Huffman compressed with a shared table");
+  }
+
+  bytesInFile = readByteCount(inputBlock);
+  outputBlock = decodeWithTree(inputBlock, huffmanNode, bytesInFile);
+  outputBlock->encoding = inputBlock->encoding &
+    ~(ENCODING_HUFFMAN | ENCODING_SHARED_TABLE);
+
+  displayStatistics("Huffman decompressing with dictionary",
+		    inputBlock, outputBlock);
+  return outputBlock;
+}
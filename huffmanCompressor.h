@@ -7,6 +7,7 @@
 
 #include <stdlib.h>
 #include "boolean.h"
+#include "compression.h"
 
 typedef struct HuffmanNodeStruct {
   struct HuffmanNodeStruct* left;
@@ -29,14 +30,44 @@ typedef struct FreqEntryStruct {
 #define FREQUENCY_TABLE_SIZE (256)
 typedef FrequencyTableEntry FrequencyTable[FREQUENCY_TABLE_SIZE];
 
-HuffmanNode* buildHuffmanTree(FrequencyTable frequencyTable);
+/* A tree with a leaf for every symbol has 511 nodes. The nodes are
+ * stored in the order they are made, leaves first, so the root is the
+ * last one.
+ */
+#define HUFFMAN_TREE_SIZE (2 * FREQUENCY_TABLE_SIZE - 1)
+typedef struct {
+  HuffmanNode nodes[HUFFMAN_TREE_SIZE];
+  size_t nodeCount;
+} HuffmanTree;
+
+void initFrequencyTable(FrequencyTable frequencyTable);
+void addToFrequencyTable(BlockDescriptor* inputBlock,
+			 FrequencyTable frequencyTable);
+void readFrequencyTableFromBlock(BlockDescriptor* inputBlock,
+				 FrequencyTable frequencyTable);
+void writeFrequencyTableToBlock(FrequencyTable frequencyTable,
+				BlockDescriptor* outputBlock);
+void makeHuffmanCodes(FrequencyTable frequencyTable);
+void makeReversedPatterns(FrequencyTable frequencyTable,
+                          unsigned long* patterns,
+                          unsigned char* lengths);
 
-void walkHuffmanTree(HuffmanNode* tree, FrequencyTable frequencytable,
-		     unsigned pattern, unsigned patternLength);
+BlockDescriptor* huffmanCompressWithTable(BlockDescriptor* inputBlock,
+					  FrequencyTable frequencyTable,
+					  Boolean quiet);
+BlockDescriptor* huffmanDecompressWithTable(BlockDescriptor* inputBlock,
+					    FrequencyTable frequencyTable);
+BlockDescriptor* huffmanDecompressWithTree(BlockDescriptor* inputBlock,
+					   HuffmanNode* huffmanNode);
+unsigned long getHuffmanByteCount(const BlockDescriptor* inputBlock);
 
+HuffmanNode* buildHuffmanTree(FrequencyTable frequencyTable,
+			      HuffmanTree* tree);
+void makeHuffmanPatterns(HuffmanTree* tree, FrequencyTable frequencyTable);
 
 Boolean getHuffmanChar(Boolean bitRead,
-		       HuffmanNode* huffmanNode,
+		       HuffmanNode* rootNode,
+		       HuffmanNode** state,
 		       unsigned char* character);
 
 #endif
@@ -1,228 +1,304 @@
-/* huffmanTree.c
- *
- * Code for constructing and manipulating the Huffman tree.
- */
-
-#include <stdio.h>
-#include "huffmanCompressor.h"
-#include "compression.h"
-
-/* A priority ordered queue is used to build the tree.
- * This is the code used for that. The queue is ordered
- * by descending frequency.
- */
-
-/* Each priority order queue node looks like this */
-typedef struct PQueue {
-  struct PQueue* next;
-  HuffmanNode* node;
-} PriorityQueueNode;
-
-/* Pointer to the head of the queue */
-static PriorityQueueNode* head = NULL;
-
-/* pqueueAdd()
- *
- * Adds a node to the tree.
- *
- * Parameters:
- * node - pointer to node to add.
- */
-static void pqueueAdd(HuffmanNode* node) {
-  if (head == NULL) {
-    head = malloc(sizeof(PriorityQueueNode));
-    head->next = NULL;
-    head->node = node;
-  }
-  else {
-    /* Zip down through list looking for where to stick it */
-
-    PriorityQueueNode* newPriorityQueueNode = NULL; 
-    PriorityQueueNode* thisPQueueEntry = head;
-    PriorityQueueNode* previousPQEntry = NULL;
-    while (thisPQueueEntry->node->frequency < node->frequency) {
-      previousPQEntry = thisPQueueEntry;
-      thisPQueueEntry = thisPQueueEntry->next;
-
-      /* Hit end of queue */
-      if (thisPQueueEntry == NULL) {
-	break;
-      }
-    }
-
-    newPriorityQueueNode = malloc(sizeof(PriorityQueueNode));
-    if (newPriorityQueueNode == NULL) {
-      error(True, "unable to malloc new priority queue node");
-    }
-
-    newPriorityQueueNode->node = node;
-    if (previousPQEntry == NULL) {
-      /* Insert at head */
-      newPriorityQueueNode->next = head;
-      head = newPriorityQueueNode;
-    }
-    else {
-      newPriorityQueueNode->next = thisPQueueEntry;
-      previousPQEntry->next = newPriorityQueueNode;
-    }
-  }
-}
-
-/* pqueuePop()
- *
- * Pops the entry at the front of the queue off of the queue.
- *
- * Return value:
- * Node from front of queue
- */
-static HuffmanNode* pqueuePop(void) {
-  PriorityQueueNode* thisPQueueEntry;
-  HuffmanNode* node;
-  if (head == NULL) {
-    error(False, "Popping from empty queue");
-    return NULL;
-  }
-  thisPQueueEntry = head;
-  head = head->next;
-  node = thisPQueueEntry->node;
-  free(thisPQueueEntry);
-  thisPQueueEntry = 0;
-  return node;
-}
-
-/* buildHuffmanTree()
- *
- * Constructs Huffman coding tree from frequency table.
- *
- * Parameters:
- * frequencyTable - Frequency table array to build tree from
- *
- * Return value:
- * Root node of tree
- */
-
-HuffmanNode* buildHuffmanTree(FrequencyTable frequencyTable) {
-  HuffmanNode* returnNode;
-  unsigned index;
-
-  for (index = 0; index < FREQUENCY_TABLE_SIZE; index++) {
-    if (frequencyTable[index].frequency) {
-
-      HuffmanNode* node = malloc(sizeof(HuffmanNode));
-      if (node == NULL) {
-	error(True, "unable to malloc new huffman node");
-      }
-
-      node->left = NULL;
-      node->right = NULL;
-      node->symbol = frequencyTable[index].symbol;
-      node->frequency = frequencyTable[index].frequency;
-      pqueueAdd(node);
-    }
-  }
-
-  /* While there is more than one node in the tree pull the
-   * front two nodes off and replace them with a new node which
-   * has them as children
-   */
-  while (head->next != NULL) {
-    HuffmanNode* newNode = malloc(sizeof(HuffmanNode));
-    newNode->right = pqueuePop();
-    newNode->left = pqueuePop();
-    newNode->frequency = newNode->left->frequency + newNode->right->frequency;
-    pqueueAdd(newNode);
-  }
-
-  /* Now have a single node in the queue, and it is the root of the
-   * whole tree
-   */
-  returnNode = head->node;
-  free(head);
-  head = NULL;
-
-  return returnNode;
-}
-
-/* walkHuffmanTree
- *
- * Recursively walks the tree filling in the bit pattern and bit pattern
- * length fields in the frequency table. It deletes the table as it walks
- * it.  When it returns the frequency tabole will be fully populated with
- * the bit patterns needed to do the compression.
- *
- * Parameters:
- * node - root node of tree (and when called recursively the root node of
- *        the subtree to walk.
- * frequencyTable - Frequency table array
- * pattern - bit pattern accumulated so far (ignored by initial call since
- *           any value in it will be shifted into irrelevence, but
- *           specify as 0)
- * patternLength - bit pattern length accumulated so far (set to 0 for
- *           initial call).  Corresponds to current tree depth.
- */
-void walkHuffmanTree(HuffmanNode* node, FrequencyTable frequencyTable,
-		     unsigned pattern, unsigned patternLength) {
-
-  if (node->left == NULL) {
-    unsigned char symbol = node->symbol;
-
-    if (frequencyTable[symbol].symbol  != symbol) {
-      error(False, "Frequency table bad order");
-    }
-    if (frequencyTable[symbol].huffmanBits || 
-	frequencyTable[symbol].huffmanBitCount) {      
-      error(False, "Been here already");
-    }
-    if (sizeof(frequencyTable[symbol].huffmanBits) < 
-	frequencyTable[symbol].huffmanBitCount) {
-      error(False, "Huffman bit count field overflow");
-    }
-    frequencyTable[symbol].huffmanBits = pattern;
-    frequencyTable[symbol].huffmanBitCount = patternLength;
-    
-  }
-  else {
-    /* It's just a jump to the left. */
-    walkHuffmanTree(node->left, frequencyTable,
-		    (pattern << 1) | 0, patternLength + 1);
-    /* And then a step to the right. */
-    walkHuffmanTree(node->right, frequencyTable,
-		    (pattern << 1) | 1, patternLength + 1);
-  }
-  free(node);
-}
-
-/* getHuffmanChar()
- *
- * Use the next bit read from the file to walk one level of the
- * Huffman tree. If it reaches a leaf then it returns the character
- * at that leaf. It maintains an internal state recording where it has
- * reached in the tree, and resets the state when it reaches a leaf.
- *
- * Parameters:
- * bitRead - Bit read from file
- * huffmanNode - root node of Huffman tree (used in initial call
- *               and when resetting state)
- * character - Character at leaf - valid if return value is True.
- *
- * Return:
- * True if reached a leaf, False if still traversing tree
- */
-Boolean getHuffmanChar(Boolean bitRead,
-		       HuffmanNode* rootNode,
-		       unsigned char* character) {
-  static HuffmanNode* state = NULL;
-  if (state == NULL) {
-    state = rootNode;
-  }
-
-  state = bitRead ? state->right : state->left;
-
-  if ((state->left == NULL) &&
-      (state->right == NULL)) {
-    *character = state->symbol;
-    state = NULL;
-    return True;
-  }
-  return False;
-}
+/* huffmanTree.c
+ *
+ * Code for constructing and manipulating the Huffman tree.
+ *
+ * The tree is built in a HuffmanTree, which has room for the 511 nodes
+ * of a tree with a leaf for every symbol, so building one needs no
+ * memory to be allocated and no state outside it. The leaves are
+ * sorted by frequency, and each internal node is made from the two
+ * lightest nodes at the front of the sorted leaves and of the internal
+ * nodes made so far, which are made in order of weight, so the merge
+ * is linear.
+ *
+ * The tree has to be exactly the one the decompressor builds from the
+ * stored frequency table, including which of several nodes of the same
+ * weight is taken first. The order is the one the original builder's
+ * priority queue gave: leaves of equal frequency are taken highest
+ * symbol first, an internal node is taken before a leaf of the same
+ * weight, and of several internal nodes of the same weight the one made
+ * last is taken first. The first node taken becomes the right child.
+ */
+
+#include <stdio.h>
+#include "huffmanCompressor.h"
+#include "compression.h"
+
+/* isTakenBefore()
+ *
+ * Compare two leaves for the order they are merged in.
+ *
+ * Parameters:
+ * first, second - leaves to compare
+ *
+ * Return value:
+ * True if first is taken before second
+ */
+static Boolean isTakenBefore(const HuffmanNode* first,
+                             const HuffmanNode* second) {
+  if (first->frequency != second->frequency) {
+    return (first->frequency < second->frequency) ? True : False;
+  }
+  return (first->symbol > second->symbol) ? True : False;
+}
+
+/* sortLeaves()
+ *
+ * Sort the leaves into the order they are merged in. There are at most
+ * 256 of them and they arrive in symbol order, so an insertion sort is
+ * quick enough and needs no extra memory.
+ *
+ * Parameters:
+ * leaves - leaves to sort
+ * leafCount - number of leaves
+ */
+static void sortLeaves(HuffmanNode** leaves, size_t leafCount) {
+  size_t index;
+  for (index = 1; index < leafCount; index++) {
+    HuffmanNode* leaf = leaves[index];
+    size_t position = index;
+    while ((position > 0) && isTakenBefore(leaf, leaves[position - 1])) {
+      leaves[position] = leaves[position - 1];
+      position--;
+    }
+    leaves[position] = leaf;
+  }
+}
+
+/* The queue of internal nodes waiting to be merged. Nodes are added in
+ * order of weight. Those of the least weight are a run at the front,
+ * taken from its end, so the taken ones leave a gap between the part
+ * of the run still to be taken and any heavier nodes after it.
+ */
+typedef struct {
+  HuffmanNode** nodes;
+  size_t head;      /* Start of the run of least weight */
+  size_t runTop;    /* End of the part of the run still to be taken */
+  size_t runEnd;    /* End of the run, and start of any heavier nodes */
+  size_t tail;      /* End of the queue */
+} InternalQueue;
+
+/* isInternalQueueEmpty()
+ */
+static Boolean isInternalQueueEmpty(const InternalQueue* queue) {
+  return ((queue->runTop == queue->head) && (queue->runEnd == queue->tail)) ?
+    True : False;
+}
+
+/* startNextRun()
+ *
+ * If the run of least weight has all been taken, find the next one.
+ *
+ * Parameters:
+ * queue - queue of internal nodes, which must not be empty
+ */
+static void startNextRun(InternalQueue* queue) {
+  if (queue->runTop == queue->head) {
+    unsigned frequency = queue->nodes[queue->runEnd]->frequency;
+    queue->head = queue->runEnd;
+    while ((queue->runEnd < queue->tail) &&
+           (queue->nodes[queue->runEnd]->frequency == frequency)) {
+      queue->runEnd++;
+    }
+    queue->runTop = queue->runEnd;
+  }
+}
+
+/* addToInternalQueue()
+ *
+ * Add a newly made internal node, which is at least as heavy as every
+ * node in the queue.
+ *
+ * Parameters:
+ * queue - queue of internal nodes
+ * node - node to add
+ */
+static void addToInternalQueue(InternalQueue* queue, HuffmanNode* node) {
+  if ((queue->runEnd == queue->tail) && (queue->runTop != queue->head) &&
+      (queue->nodes[queue->head]->frequency == node->frequency)) {
+    /* Joins the run, and is the next to be taken. Put it over the gap
+     * left by those already taken.
+     */
+    queue->nodes[queue->runTop++] = node;
+    queue->runEnd = queue->runTop;
+    queue->tail = queue->runTop;
+  }
+  else {
+    queue->nodes[queue->tail++] = node;
+  }
+}
+
+/* takeNode()
+ *
+ * Take the next node to merge from the front of the sorted leaves or
+ * of the internal nodes.
+ *
+ * Parameters:
+ * leaves - sorted leaves
+ * nextLeaf - index of the next leaf not taken, updated
+ * leafCount - number of leaves
+ * queue - queue of internal nodes
+ *
+ * Return value:
+ * Node taken
+ */
+static HuffmanNode* takeNode(HuffmanNode** leaves,
+                             size_t* nextLeaf,
+                             size_t leafCount,
+                             InternalQueue* queue) {
+  if (!isInternalQueueEmpty(queue)) {
+    startNextRun(queue);
+    if ((*nextLeaf == leafCount) ||
+        (queue->nodes[queue->head]->frequency <=
+         leaves[*nextLeaf]->frequency)) {
+      return queue->nodes[--queue->runTop];
+    }
+  }
+  if (*nextLeaf == leafCount) {
+    error(False, "Popping from empty queue");
+  }
+  return leaves[(*nextLeaf)++];
+}
+
+/* buildHuffmanTree()
+ *
+ * Constructs Huffman coding tree from frequency table.
+ *
+ * Parameters:
+ * frequencyTable - Frequency table array to build tree from
+ * tree - Storage for the nodes of the tree
+ *
+ * Return value:
+ * Root node of tree
+ */
+HuffmanNode* buildHuffmanTree(FrequencyTable frequencyTable,
+                              HuffmanTree* tree) {
+  HuffmanNode* leaves[FREQUENCY_TABLE_SIZE];
+  HuffmanNode* internalNodes[FREQUENCY_TABLE_SIZE];
+  InternalQueue queue;
+  size_t leafCount = 0;
+  size_t nextLeaf = 0;
+  unsigned index;
+
+  tree->nodeCount = 0;
+  for (index = 0; index < FREQUENCY_TABLE_SIZE; index++) {
+    if (frequencyTable[index].frequency) {
+      HuffmanNode* node = &tree->nodes[tree->nodeCount++];
+      node->left = NULL;
+      node->right = NULL;
+      node->symbol = frequencyTable[index].symbol;
+      node->frequency = frequencyTable[index].frequency;
+      leaves[leafCount++] = node;
+    }
+  }
+  if (leafCount == 0) {
+    error(False, "Popping from empty queue");
+  }
+  sortLeaves(leaves, leafCount);
+
+  queue.nodes = internalNodes;
+  queue.head = queue.runTop = queue.runEnd = queue.tail = 0;
+
+  /* While there is more than one node left pull the front two nodes
+   * off and replace them with a new node which has them as children
+   */
+  while ((leafCount - nextLeaf) + (queue.runTop - queue.head) +
+         (queue.tail - queue.runEnd) > 1) {
+    HuffmanNode* newNode = &tree->nodes[tree->nodeCount++];
+    newNode->right = takeNode(leaves, &nextLeaf, leafCount, &queue);
+    newNode->left = takeNode(leaves, &nextLeaf, leafCount, &queue);
+    newNode->symbol = 0;
+    newNode->frequency = newNode->left->frequency + newNode->right->frequency;
+    addToInternalQueue(&queue, newNode);
+  }
+
+  /* The last node made is the root of the whole tree */
+  return &tree->nodes[tree->nodeCount - 1];
+}
+
+/* makeHuffmanPatterns()
+ *
+ * Fill in the bit pattern and bit pattern length fields in the
+ * frequency table from the tree. Every node is made after its
+ * children, so going through the nodes from the root backwards reaches
+ * each node after its parent, and the patterns can be built without
+ * recursion.
+ *
+ * Parameters:
+ * tree - tree built by buildHuffmanTree()
+ * frequencyTable - Frequency table array
+ */
+void makeHuffmanPatterns(HuffmanTree* tree, FrequencyTable frequencyTable) {
+  unsigned long patterns[HUFFMAN_TREE_SIZE];
+  unsigned char patternLengths[HUFFMAN_TREE_SIZE];
+  size_t index = tree->nodeCount;
+
+  patterns[index - 1] = 0;
+  patternLengths[index - 1] = 0;
+
+  while (index--) {
+    HuffmanNode* node = &tree->nodes[index];
+
+    if (node->left == NULL) {
+      unsigned char symbol = node->symbol;
+
+      if (frequencyTable[symbol].symbol != symbol) {
+        error(False, "Frequency table bad order");
+      }
+      if (frequencyTable[symbol].huffmanBits ||
+          frequencyTable[symbol].huffmanBitCount) {
+        error(False, "Been here already");
+      }
+      frequencyTable[symbol].huffmanBits = patterns[index];
+      frequencyTable[symbol].huffmanBitCount = patternLengths[index];
+    }
+    else {
+      size_t left = node->left - tree->nodes;
+      size_t right = node->right - tree->nodes;
+
+      if (patternLengths[index] >= sizeof(patterns[0]) * 8) {
+        error(False, "Huffman bit count field overflow");
+      }
+      /* It's just a jump to the left. */
+      patterns[left] = patterns[index] << 1;
+      patternLengths[left] = patternLengths[index] + 1;
+      /* And then a step to the right. */
+      patterns[right] = (patterns[index] << 1) | 1;
+      patternLengths[right] = patternLengths[index] + 1;
+    }
+  }
+}
+
+/* getHuffmanChar()
+ *
+ * Use the next bit read from the file to walk one level of the
+ * Huffman tree. If it reaches a leaf then it returns the character
+ * at that leaf. Where it has reached in the tree is kept in the
+ * caller's state, which is reset when it reaches a leaf.
+ *
+ * Parameters:
+ * bitRead - Bit read from file
+ * rootNode - root node of Huffman tree (used in initial call
+ *            and when resetting state)
+ * state - Node reached so far. Set it to NULL before the first call.
+ * character - Character at leaf - valid if return value is True.
+ *
+ * Return:
+ * True if reached a leaf, False if still traversing tree
+ */
+Boolean getHuffmanChar(Boolean bitRead,
+		       HuffmanNode* rootNode,
+		       HuffmanNode** state,
+		       unsigned char* character) {
+  HuffmanNode* node = (*state == NULL) ? rootNode : *state;
+
+  node = bitRead ? node->right : node->left;
+
+  if ((node->left == NULL) &&
+      (node->right == NULL)) {
+    *character = node->symbol;
+    *state = NULL;
+    return True;
+  }
+  *state = node;
+  return False;
+}
@@ -0,0 +1,324 @@
+/* inspect.c
+ *
+ * The --test and --list modes of jldecompress, for checking a set of
+ * compressed files, e.g. a backup, without writing anything.
+ *
+ * --test decompresses each file and throws the data away, keeping only
+ * its size and CRC32C. Each block of a blocked file, and each single
+ * stream file, is a separate task for the thread pool, so the blocks
+ * of a large file and many small files are all tested in parallel, and
+ * no more than one block per thread is held in memory at once. The
+ * stored checksums are checked as the data is decompressed, as they
+ * always are, and the checksums of the blocks are combined into the
+ * checksum of the whole file, which is printed so that files without
+ * stored checksums can be compared with the originals. Files are
+ * mapped and tested in batches so that a large set doesn't run out of
+ * file descriptors. A damaged file stops the run with an error naming
+ * the file.
+ *
+ * --list prints what the header and the seek index say about each
+ * file, without decoding any data.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "batch.h"
+#include "blockedFile.h"
+#include "crc32c.h"
+#include "dataBlocks.h"
+#include "header.h"
+#include "huffmanCompressor.h"
+#include "inspect.h"
+#include "statistics.h"
+#include "threadPool.h"
+
+/* Number of files mapped at once by --test */
+#define TEST_BATCH_SIZE (64)
+
+/* A compressed file being tested */
+typedef struct {
+  const char* filename;
+  BlockDescriptor* inputBlock;
+  /* Seek index of a blocked file, NULL for a single stream */
+  SeekIndex* seekIndex;
+  size_t firstPiece;
+  size_t pieceCount;
+} TestedFile;
+
+/* One task for the thread pool: a block of a blocked file, or the
+ * whole of a single stream file
+ */
+typedef struct {
+  const TestedFile* file;
+  size_t block;
+  unsigned long size;
+  unsigned long checksum;
+} TestPiece;
+
+/* testOnePiece()
+ *
+ * Decompress one piece of a file, checksum the output and free it. Run
+ * by runTasks(), so pieces may be tested at the same time.
+ *
+ * Parameters:
+ * context - the array of TestPieces
+ * index - number of the piece
+ */
+static void testOnePiece(void* context, size_t index) {
+  TestPiece* piece = &((TestPiece*)context)[index];
+  const TestedFile* file = piece->file;
+  BlockDescriptor* block = NULL;
+
+  setErrorFilename(file->filename);
+  if (file->seekIndex) {
+    setStatisticsBlock(piece->block);
+    block = decompressIndexedBlock(file->inputBlock, file->seekIndex,
+                                   piece->block);
+  }
+  else {
+    block = decompressBlock(makeViewBlock(file->inputBlock->address,
+                                          file->inputBlock->usedSize,
+                                          file->inputBlock->encoding));
+  }
+  piece->size = block->usedSize;
+  piece->checksum = crc32c(0, block->address, block->usedSize);
+  freeBlock(block);
+  setStatisticsBlock(-1);
+  setErrorFilename(NULL);
+}
+
+/* testBatch()
+ *
+ * Test a batch of files together.
+ *
+ * Parameters:
+ * filenames - files to test
+ * fileCount - number of files, no more than TEST_BATCH_SIZE
+ * testedCount - incremented for each compressed file tested
+ */
+static void testBatch(char** filenames, size_t fileCount,
+                      size_t* testedCount) {
+  TestedFile files[TEST_BATCH_SIZE];
+  TestPiece* pieces = NULL;
+  size_t pieceCount = 0;
+  size_t index;
+
+  /* Map the files and read their indexes to find the pieces */
+  for (index = 0; index < fileCount; index++) {
+    TestedFile* file = &files[index];
+    memset(file, 0, sizeof(TestedFile));
+    file->filename = filenames[index];
+    if (!getCompressionFlags(file->filename, False)) {
+      continue;
+    }
+    setErrorFilename(file->filename);
+    file->inputBlock = mapCompressedFile(file->filename);
+    if (file->inputBlock->encoding & ENCODING_BLOCKED) {
+      file->seekIndex = readSeekIndex(file->inputBlock);
+    }
+    setErrorFilename(NULL);
+    file->firstPiece = pieceCount;
+    file->pieceCount = file->seekIndex ? file->seekIndex->blockCount : 1;
+    pieceCount += file->pieceCount;
+  }
+
+  pieces = calloc(pieceCount ? pieceCount : 1, sizeof(TestPiece));
+  if (pieces == NULL) {
+    error(True, "malloc failed for %lu pieces to test",
+          (unsigned long)pieceCount);
+  }
+  for (index = 0; index < fileCount; index++) {
+    size_t piece;
+    for (piece = 0; piece < files[index].pieceCount; piece++) {
+      pieces[files[index].firstPiece + piece].file = &files[index];
+      pieces[files[index].firstPiece + piece].block = piece;
+    }
+  }
+
+  runTasks(pieceCount, testOnePiece, pieces);
+
+  for (index = 0; index < fileCount; index++) {
+    const TestedFile* file = &files[index];
+    unsigned long size = 0;
+    unsigned long checksum = 0;
+    size_t piece;
+
+    if (file->inputBlock == NULL) {
+      printf("%s: not compressed, skipped\n", file->filename);
+      continue;
+    }
+    for (piece = file->firstPiece;
+         piece < file->firstPiece + file->pieceCount; piece++) {
+      checksum = crc32cCombine(checksum, pieces[piece].checksum,
+                               pieces[piece].size);
+      size += pieces[piece].size;
+    }
+    printf("%s: OK - %lu bytes in %lu block%s, CRC32C %08lx%s\n",
+           file->filename, size, (unsigned long)file->pieceCount,
+           (file->pieceCount == 1) ? "" : "s", checksum,
+           (file->inputBlock->encoding & ENCODING_CHECKSUM) ?
+           " matches the stored checksum" : "");
+    (*testedCount)++;
+    freeSeekIndex(file->seekIndex);
+    freeBlock(file->inputBlock);
+  }
+  free(pieces);
+}
+
+/* testFiles()
+ *
+ * Decompress files without writing the output, to check that they are
+ * undamaged. Files which aren't compressed are skipped.
+ *
+ * Parameters:
+ * names - files, or directories standing for the files in them
+ * nameCount - number of names
+ */
+void testFiles(char** names, size_t nameCount) {
+  size_t fileCount = 0;
+  char** filenames = makeFileList(names, nameCount, &fileCount);
+  Boolean statistics = enableStatistics(False);
+  size_t testedCount = 0;
+  size_t index;
+
+  for (index = 0; index < fileCount; index += TEST_BATCH_SIZE) {
+    size_t batchCount = fileCount - index;
+    if (batchCount > TEST_BATCH_SIZE) {
+      batchCount = TEST_BATCH_SIZE;
+    }
+    testBatch(filenames + index, batchCount, &testedCount);
+  }
+
+  enableStatistics(statistics);
+  printf("%lu of %lu files tested, no errors\n",
+         (unsigned long)testedCount, (unsigned long)fileCount);
+  freeFileList(filenames, fileCount);
+}
+
+/* getOriginalSize()
+ *
+ * Find the size of the original data from the header and index. A
+ * single stream file which was run length encoded doesn't record it.
+ *
+ * Parameters:
+ * inputBlock - compressed file
+ * seekIndex - its seek index, or NULL for a single stream
+ * size - set to the size
+ *
+ * Return value:
+ * True if the size is known
+ */
+static Boolean getOriginalSize(BlockDescriptor* inputBlock,
+                               const SeekIndex* seekIndex,
+                               unsigned long* size) {
+  BlockDescriptor* view = NULL;
+
+  if (seekIndex) {
+    *size = seekIndex->originalSize;
+    return True;
+  }
+  if (inputBlock->encoding & (ENCODING_RUN_LENGTH | ENCODING_SHARED_TABLE)) {
+    return False;
+  }
+  *size = inputBlock->usedSize;
+  if (inputBlock->encoding & ENCODING_CHECKSUM) {
+    *size -= (*size < CHECKSUM_SIZE) ? *size : CHECKSUM_SIZE;
+  }
+  if (inputBlock->encoding & ENCODING_HUFFMAN) {
+    view = makeViewBlock(inputBlock->address, *size, inputBlock->encoding);
+    *size = getHuffmanByteCount(view);
+    freeBlock(view);
+  }
+  return True;
+}
+
+/* describeStages()
+ *
+ * Name the stages in a set of compression flags.
+ *
+ * Parameters:
+ * encoding - the flags
+ * description - set to the names, separated by "+"
+ * size - size of description, which must hold all of them
+ */
+static void describeStages(unsigned char encoding, char* description,
+                           size_t size) {
+  static const struct {
+    unsigned char flag;
+    const char* name;
+  } stages[] = {
+    { ENCODING_FILTERED, "filter" },
+    { ENCODING_FLIPPED, "flip" },
+    { ENCODING_RUN_LENGTH, "rle" },
+    { ENCODING_RLE_V2, "rle2" },
+    { ENCODING_HUFFMAN, "huffman" },
+    { ENCODING_SHARED_TABLE, "dictionary" },
+    { ENCODING_CHECKSUM, "checksum" }
+  };
+  size_t index;
+
+  description[0] = '\0';
+  for (index = 0; index < sizeof(stages) / sizeof(stages[0]); index++) {
+    if (encoding & stages[index].flag) {
+      if (description[0]) {
+        strncat(description, "+", size - strlen(description) - 1);
+      }
+      strncat(description, stages[index].name,
+              size - strlen(description) - 1);
+    }
+  }
+}
+
+/* listFiles()
+ *
+ * Print the original and compressed size, ratio, number of blocks and
+ * stages of each file, from its header and seek index only.
+ *
+ * Parameters:
+ * names - files, or directories standing for the files in them
+ * nameCount - number of names
+ */
+void listFiles(char** names, size_t nameCount) {
+  size_t fileCount = 0;
+  char** filenames = makeFileList(names, nameCount, &fileCount);
+  size_t index;
+
+  printf("%12s %12s %7s %7s  %-30s %s\n", "Original", "Compressed",
+         "Ratio", "Blocks", "Stages", "Name");
+  for (index = 0; index < fileCount; index++) {
+    BlockDescriptor* inputBlock = NULL;
+    SeekIndex* seekIndex = NULL;
+    unsigned long compressedSize;
+    unsigned long originalSize = 0;
+    char stages[64];
+
+    if (!getCompressionFlags(filenames[index], False)) {
+      printf("%12s %12s %7s %7s  %-30s %s\n", "-", "-", "-", "-",
+             "not compressed", filenames[index]);
+      continue;
+    }
+    setErrorFilename(filenames[index]);
+    inputBlock = mapCompressedFile(filenames[index]);
+    if (inputBlock->encoding & ENCODING_BLOCKED) {
+      seekIndex = readSeekIndex(inputBlock);
+    }
+    compressedSize = inputBlock->usedSize + getHeaderSize();
+
+    if (getOriginalSize(inputBlock, seekIndex, &originalSize)) {
+      printf("%12lu %12lu %7.2f ", originalSize, compressedSize,
+             (double)originalSize / compressedSize);
+    }
+    else {
+      printf("%12s %12lu %7s ", "?", compressedSize, "?");
+    }
+    describeStages(inputBlock->encoding, stages, sizeof(stages));
+    printf("%7lu  %-30s %s\n",
+           seekIndex ? (unsigned long)seekIndex->blockCount : 1UL,
+           stages, filenames[index]);
+
+    freeSeekIndex(seekIndex);
+    freeBlock(inputBlock);
+    setErrorFilename(NULL);
+  }
+  freeFileList(filenames, fileCount);
+}
@@ -0,0 +1,13 @@
+#ifndef INSPECT_H
+#define INSPECT_H
+
+/* Declarations for checking and listing compressed files without
+ * writing anything, in inspect.c
+ */
+
+#include <stdlib.h>
+
+void testFiles(char** names, size_t nameCount);
+void listFiles(char** names, size_t nameCount);
+
+#endif
@@ -0,0 +1,794 @@
+/* ioEngine.c
+ *
+ * Batched file I/O, used when many files are processed in one run.
+ * Loading a file means opening it, finding its size, reading it into a
+ * heap buffer and closing it again.  Storing a file means creating it,
+ * writing a header and a data buffer to it and closing it.  With
+ * blocking system calls that is at least four kernel round trips per
+ * file, which dominates the run time when the files are small.
+ *
+ * When built with HAVE_IO_URING, and the kernel supports it, the
+ * operations for a whole batch of files are queued on an io_uring
+ * submission ring and handed to the kernel together.  Each file then
+ * moves through its sequence of operations as the completions come
+ * back, so I/O for one batch carries on while the caller compresses
+ * another.  The ring is driven with the raw system calls so that no
+ * extra library is needed.
+ *
+ * Otherwise the engine falls back to ordinary blocking calls, in which
+ * case every file is complete by the time ioLoadFiles() or
+ * ioStoreFiles() returns. It does the same by default on a single
+ * processor, where there is nothing for the I/O to overlap with and
+ * io_uring measured no faster than the blocking calls.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "bufferPool.h"
+#include "compression.h"
+#include "ioEngine.h"
+#include "probes.h"
+#include "trace.h"
+
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/* Number of submission queue entries, and the number of completion
+ * queue entries asked for. The completion queue is made large enough
+ * for every operation of two batches to be in flight at once.
+ */
+#define SUBMISSION_ENTRIES (256)
+#define COMPLETION_ENTRIES (4096)
+
+/* The operation a completion belongs to is kept in the bottom bits of
+ * the user data, the rest is the address of the IoFile.
+ */
+#define OPERATION_MASK (0x7)
+enum { OPERATION_OPEN = 0,
+       OPERATION_STATX,
+       OPERATION_READ,
+       OPERATION_WRITE,
+       OPERATION_CLOSE };
+
+/* Per-file data which has to stay put while the kernel uses it */
+typedef struct {
+  struct statx fileStatus;
+  struct iovec vectors[2];
+} UringFileData;
+
+typedef struct {
+  int ringDescriptor;
+
+  void* submissionRing;
+  size_t submissionRingSize;
+  unsigned* submissionHead;
+  unsigned* submissionTail;
+  unsigned submissionMask;
+  unsigned submissionEntries;
+  unsigned* submissionArray;
+  struct io_uring_sqe* entries;
+  size_t entriesSize;
+
+  void* completionRing;
+  size_t completionRingSize;
+  unsigned* completionHead;
+  unsigned* completionTail;
+  unsigned completionMask;
+  struct io_uring_cqe* completions;
+
+  /* Entries queued but not yet handed to the kernel */
+  unsigned toSubmit;
+  /* Operations handed to the kernel with no completion yet */
+  unsigned inFlight;
+} Uring;
+#endif
+
+struct IoEngineStruct {
+  Boolean useUring;
+#ifdef HAVE_IO_URING
+  Uring ring;
+#endif
+};
+
+
+/***** Blocking implementation *****/
+
+/* loadFileBlocking()
+ *
+ * Read a whole file into a buffer with ordinary system calls.
+ *
+ * Parameters:
+ * file - file to load
+ */
+static void loadFileBlocking(IoFile* file) {
+  struct stat fileStatus;
+  double start = traceClock();
+
+  file->fileDescriptor = open(file->filename, O_RDONLY, 0);
+  if (file->fileDescriptor < 0) {
+    error(True, "Unable to open file %s", file->filename);
+  }
+  if (fstat(file->fileDescriptor, &fileStatus)) {
+    error(True, "Unable to get file length for %s", file->filename);
+  }
+
+  file->size = fileStatus.st_size;
+  file->address = allocateBuffer(file->size, NULL);
+
+  for (file->bytesTransferred = 0;
+       file->bytesTransferred < file->size; ) {
+    ssize_t bytesRead = read(file->fileDescriptor,
+                             file->address + file->bytesTransferred,
+                             file->size - file->bytesTransferred);
+    if (bytesRead < 0) {
+      error(True, "Unable to read file %s", file->filename);
+    }
+    if (bytesRead == 0) {
+      error(False, "Unexpected end of file %s", file->filename);
+    }
+    file->bytesTransferred += bytesRead;
+  }
+
+  if (close(file->fileDescriptor)) {
+    error(True, "Unable to close file %s", file->filename);
+  }
+  file->state = IO_DONE;
+  PROBE3(io__done, file->filename, file->size, 0);
+  traceEvent("load-file", "io", start);
+}
+
+/* storeFileBlocking()
+ *
+ * Create a file and write the header and data to it with ordinary
+ * system calls.
+ *
+ * Parameters:
+ * file - file to store
+ */
+static void storeFileBlocking(IoFile* file) {
+  size_t totalSize = file->headerSize + file->size;
+  double start = traceClock();
+
+  file->fileDescriptor = open(file->filename,
+                              O_WRONLY | O_CREAT |
+                              (file->exclusive ? O_EXCL : O_TRUNC),
+                              0666);
+  if (file->fileDescriptor < 0) {
+    error(True, "Unable to create %s", file->filename);
+  }
+
+  for (file->bytesTransferred = 0;
+       file->bytesTransferred < totalSize; ) {
+    struct iovec vectors[2];
+    int vectorCount = 0;
+    ssize_t bytesWritten;
+
+    if (file->bytesTransferred < file->headerSize) {
+      vectors[vectorCount].iov_base =
+        (void*)(file->header + file->bytesTransferred);
+      vectors[vectorCount++].iov_len =
+        file->headerSize - file->bytesTransferred;
+      vectors[vectorCount].iov_base = file->address;
+      vectors[vectorCount++].iov_len = file->size;
+    }
+    else {
+      size_t dataOffset = file->bytesTransferred - file->headerSize;
+      vectors[vectorCount].iov_base = file->address + dataOffset;
+      vectors[vectorCount++].iov_len = file->size - dataOffset;
+    }
+
+    bytesWritten = writev(file->fileDescriptor, vectors, vectorCount);
+    if (bytesWritten <= 0) {
+      error(True, "Unable to write to %s", file->filename);
+    }
+    file->bytesTransferred += bytesWritten;
+  }
+
+  if (close(file->fileDescriptor)) {
+    error(True, "Unable to close %s", file->filename);
+  }
+  file->state = IO_DONE;
+  PROBE3(io__done, file->filename, file->headerSize + file->size, 1);
+  traceEvent("store-file", "io", start);
+}
+
+
+#ifdef HAVE_IO_URING
+/***** io_uring implementation *****/
+
+/* setupRing()
+ *
+ * Create the ring and map its queues into our address space.
+ *
+ * Parameters:
+ * ring - ring to set up
+ *
+ * Return value:
+ * True if the ring is usable, False if the kernel can't provide one
+ * with the operations we need.
+ */
+static Boolean setupRing(Uring* ring) {
+  static const unsigned char requiredOperations[] = {
+    IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ,
+    IORING_OP_WRITEV, IORING_OP_CLOSE
+  };
+  struct io_uring_params parameters;
+  struct io_uring_probe* probe = NULL;
+  size_t probeSize = sizeof(struct io_uring_probe) +
+    256 * sizeof(struct io_uring_probe_op);
+  unsigned maximumWorkers[2];
+  unsigned index;
+  Boolean supported = True;
+
+  memset(ring, 0, sizeof(*ring));
+  memset(&parameters, 0, sizeof(parameters));
+  parameters.flags = IORING_SETUP_CQSIZE;
+  parameters.cq_entries = COMPLETION_ENTRIES;
+
+  ring->ringDescriptor = syscall(__NR_io_uring_setup,
+                                 SUBMISSION_ENTRIES, &parameters);
+  if (ring->ringDescriptor < 0) {
+    return False;
+  }
+
+  /* Check that all the operations are there - openat, statx and
+   * read only arrived in 5.6.
+   */
+  probe = calloc(1, probeSize);
+  if (probe == NULL) {
+    error(True, "calloc failed for io_uring probe");
+  }
+  if (syscall(__NR_io_uring_register, ring->ringDescriptor,
+              IORING_REGISTER_PROBE, probe, 256) < 0) {
+    supported = False;
+  }
+  for (index = 0; supported && index < sizeof(requiredOperations); index++) {
+    unsigned char operation = requiredOperations[index];
+    if ((operation > probe->last_op) ||
+        !(probe->ops[operation].flags & IO_URING_OP_SUPPORTED)) {
+      supported = False;
+    }
+  }
+  free(probe);
+
+  if (!supported || !(parameters.features & IORING_FEAT_NODROP)) {
+    close(ring->ringDescriptor);
+    return False;
+  }
+
+  /* Creating files and buffered writes are handed to kernel worker
+   * threads. Left to itself the kernel starts one per operation, and
+   * they then spend their time contending for the directory lock, so
+   * limit them to one per CPU. Older kernels don't have this, which
+   * doesn't matter.
+   */
+  maximumWorkers[0] = maximumWorkers[1] = sysconf(_SC_NPROCESSORS_ONLN);
+  syscall(__NR_io_uring_register, ring->ringDescriptor,
+          IORING_REGISTER_IOWQ_MAX_WORKERS, maximumWorkers, 2);
+
+  ring->submissionRingSize = parameters.sq_off.array +
+    parameters.sq_entries * sizeof(unsigned);
+  ring->completionRingSize = parameters.cq_off.cqes +
+    parameters.cq_entries * sizeof(struct io_uring_cqe);
+  ring->entriesSize = parameters.sq_entries * sizeof(struct io_uring_sqe);
+
+  ring->submissionRing = mmap(NULL, ring->submissionRingSize,
+                              PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_POPULATE,
+                              ring->ringDescriptor, IORING_OFF_SQ_RING);
+  ring->completionRing = mmap(NULL, ring->completionRingSize,
+                              PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_POPULATE,
+                              ring->ringDescriptor, IORING_OFF_CQ_RING);
+  ring->entries = mmap(NULL, ring->entriesSize,
+                       PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE,
+                       ring->ringDescriptor, IORING_OFF_SQES);
+  if ((ring->submissionRing == MAP_FAILED) ||
+      (ring->completionRing == MAP_FAILED) ||
+      (ring->entries == MAP_FAILED)) {
+    error(True, "Unable to map io_uring queues");
+  }
+
+  ring->submissionHead = (unsigned*)((char*)ring->submissionRing +
+                                     parameters.sq_off.head);
+  ring->submissionTail = (unsigned*)((char*)ring->submissionRing +
+                                     parameters.sq_off.tail);
+  ring->submissionMask = *(unsigned*)((char*)ring->submissionRing +
+                                      parameters.sq_off.ring_mask);
+  ring->submissionEntries = parameters.sq_entries;
+  ring->submissionArray = (unsigned*)((char*)ring->submissionRing +
+                                      parameters.sq_off.array);
+
+  ring->completionHead = (unsigned*)((char*)ring->completionRing +
+                                     parameters.cq_off.head);
+  ring->completionTail = (unsigned*)((char*)ring->completionRing +
+                                     parameters.cq_off.tail);
+  ring->completionMask = *(unsigned*)((char*)ring->completionRing +
+                                      parameters.cq_off.ring_mask);
+  ring->completions = (struct io_uring_cqe*)((char*)ring->completionRing +
+                                             parameters.cq_off.cqes);
+  return True;
+}
+
+/* closeRing()
+ *
+ * Unmap the queues and close the ring.
+ *
+ * Parameters:
+ * ring - ring to close
+ */
+static void closeRing(Uring* ring) {
+  munmap(ring->entries, ring->entriesSize);
+  munmap(ring->completionRing, ring->completionRingSize);
+  munmap(ring->submissionRing, ring->submissionRingSize);
+  if (close(ring->ringDescriptor)) {
+    error(True, "Unable to close io_uring");
+  }
+}
+
+/* enterRing()
+ *
+ * Hand any queued entries to the kernel, optionally waiting for at
+ * least one completion.
+ *
+ * Parameters:
+ * ring - ring to submit
+ * wait - True to wait for a completion
+ */
+static void enterRing(Uring* ring, Boolean wait) {
+  do {
+    int submitted = syscall(__NR_io_uring_enter, ring->ringDescriptor,
+                            ring->toSubmit, wait ? 1 : 0,
+                            wait ? IORING_ENTER_GETEVENTS : 0,
+                            NULL, 0);
+    if (submitted < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      error(True, "io_uring_enter failed");
+    }
+    ring->toSubmit -= submitted;
+    wait = False;
+  } while (ring->toSubmit);
+}
+
+/* getEntry()
+ *
+ * Get the next free submission queue entry, cleared and ready to fill
+ * in. The entry is handed to the kernel on the next enterRing().
+ *
+ * Parameters:
+ * ring - ring to get the entry from
+ * file - file the operation is for
+ * operation - OPERATION_* value, returned with the completion
+ *
+ * Return value:
+ * Submission queue entry
+ */
+static struct io_uring_sqe* getEntry(Uring* ring, IoFile* file,
+                                     unsigned operation) {
+  unsigned tail = *ring->submissionTail;
+  unsigned index;
+  struct io_uring_sqe* entry;
+
+  if (tail - __atomic_load_n(ring->submissionHead, __ATOMIC_ACQUIRE) >=
+      ring->submissionEntries) {
+    /* Queue is full, so pass what we have to the kernel */
+    enterRing(ring, False);
+  }
+
+  index = tail & ring->submissionMask;
+  entry = &ring->entries[index];
+  memset(entry, 0, sizeof(*entry));
+  entry->user_data = (unsigned long)file | operation;
+  ring->submissionArray[index] = index;
+
+  /* The kernel only looks at the tail during io_uring_enter(), so it
+   * is safe to publish it before the caller fills the entry in.
+   */
+  __atomic_store_n(ring->submissionTail, tail + 1, __ATOMIC_RELEASE);
+  ring->toSubmit++;
+  ring->inFlight++;
+  file->pendingOperations++;
+  return entry;
+}
+
+/* queueOpen()
+ *
+ * Queue an openat of a file being loaded or stored.
+ */
+static void queueOpen(Uring* ring, IoFile* file, int flags) {
+  struct io_uring_sqe* entry = getEntry(ring, file, OPERATION_OPEN);
+  entry->opcode = IORING_OP_OPENAT;
+  entry->fd = AT_FDCWD;
+  entry->addr = (unsigned long)file->filename;
+  entry->open_flags = flags;
+  entry->len = 0666;
+}
+
+/* queueStatx()
+ *
+ * Queue a statx to find the size of a file being loaded. It runs
+ * alongside the open rather than after it.
+ */
+static void queueStatx(Uring* ring, IoFile* file) {
+  UringFileData* data = file->engineData;
+  struct io_uring_sqe* entry = getEntry(ring, file, OPERATION_STATX);
+  entry->opcode = IORING_OP_STATX;
+  entry->fd = AT_FDCWD;
+  entry->addr = (unsigned long)file->filename;
+  entry->len = STATX_SIZE;
+  entry->off = (unsigned long)&data->fileStatus;
+}
+
+/* queueRead()
+ *
+ * Queue a read of the rest of a file being loaded.
+ */
+static void queueRead(Uring* ring, IoFile* file) {
+  struct io_uring_sqe* entry = getEntry(ring, file, OPERATION_READ);
+  entry->opcode = IORING_OP_READ;
+  entry->fd = file->fileDescriptor;
+  entry->addr = (unsigned long)(file->address + file->bytesTransferred);
+  entry->len = file->size - file->bytesTransferred;
+  entry->off = file->bytesTransferred;
+}
+
+/* queueWrite()
+ *
+ * Queue a write of whatever remains of the header and data of a file
+ * being stored.
+ */
+static void queueWrite(Uring* ring, IoFile* file) {
+  UringFileData* data = file->engineData;
+  struct io_uring_sqe* entry = getEntry(ring, file, OPERATION_WRITE);
+  unsigned vectorCount = 0;
+
+  if (file->bytesTransferred < file->headerSize) {
+    data->vectors[vectorCount].iov_base =
+      (void*)(file->header + file->bytesTransferred);
+    data->vectors[vectorCount++].iov_len =
+      file->headerSize - file->bytesTransferred;
+    data->vectors[vectorCount].iov_base = file->address;
+    data->vectors[vectorCount++].iov_len = file->size;
+  }
+  else {
+    size_t dataOffset = file->bytesTransferred - file->headerSize;
+    data->vectors[vectorCount].iov_base = file->address + dataOffset;
+    data->vectors[vectorCount++].iov_len = file->size - dataOffset;
+  }
+
+  entry->opcode = IORING_OP_WRITEV;
+  entry->fd = file->fileDescriptor;
+  entry->addr = (unsigned long)data->vectors;
+  entry->len = vectorCount;
+  entry->off = file->bytesTransferred;
+}
+
+/* queueClose()
+ *
+ * Queue the close of a file which has been loaded or stored.
+ */
+static void queueClose(Uring* ring, IoFile* file) {
+  struct io_uring_sqe* entry = getEntry(ring, file, OPERATION_CLOSE);
+  entry->opcode = IORING_OP_CLOSE;
+  entry->fd = file->fileDescriptor;
+}
+
+/* handleCompletion()
+ *
+ * Move a file on to its next operation when one completes.
+ *
+ * Parameters:
+ * ring - ring the operation ran on
+ * file - file the operation was for
+ * operation - OPERATION_* value
+ * result - result of the operation, negative errno on failure
+ */
+static void handleCompletion(Uring* ring, IoFile* file,
+                             unsigned operation, int result) {
+  static const char* operationNames[] = {
+    "open", "get file length for", "read", "write to", "close"
+  };
+
+  ring->inFlight--;
+  file->pendingOperations--;
+
+  if (result < 0) {
+    errno = -result;
+    error(True, "Unable to %s %s",
+          ((operation == OPERATION_OPEN) && (file->state == IO_STORING)) ?
+          "create" : operationNames[operation],
+          file->filename);
+  }
+
+  switch (operation) {
+  case OPERATION_OPEN:
+    file->fileDescriptor = result;
+    if (file->state == IO_STORING) {
+      queueWrite(ring, file);
+      break;
+    }
+    /* DELIBERATELY RUN ONTO NEXT CASE STATEMENT */
+    __attribute__ ((fallthrough));
+
+  case OPERATION_STATX:
+    if (operation == OPERATION_STATX) {
+      UringFileData* data = file->engineData;
+      file->size = data->fileStatus.stx_size;
+    }
+    /* Reading has to wait for both the open and the statx */
+    if (file->pendingOperations == 0) {
+      file->address = allocateBuffer(file->size, NULL);
+      if (file->size) {
+        queueRead(ring, file);
+      }
+      else {
+        queueClose(ring, file);
+      }
+    }
+    break;
+
+  case OPERATION_READ:
+    if (result == 0) {
+      error(False, "Unexpected end of file %s", file->filename);
+    }
+    file->bytesTransferred += result;
+    if (file->bytesTransferred < file->size) {
+      queueRead(ring, file);
+    }
+    else {
+      queueClose(ring, file);
+    }
+    break;
+
+  case OPERATION_WRITE:
+    file->bytesTransferred += result;
+    if (file->bytesTransferred < file->headerSize + file->size) {
+      queueWrite(ring, file);
+    }
+    else {
+      queueClose(ring, file);
+    }
+    break;
+
+  case OPERATION_CLOSE:
+    free(file->engineData);
+    file->engineData = NULL;
+    PROBE3(io__done, file->filename, file->bytesTransferred,
+           (file->state == IO_STORING) ? 1 : 0);
+    file->state = IO_DONE;
+    break;
+
+  default:
+    error(False, "Illegal operation in handleCompletion() - %u", operation);
+    break;
+  }
+}
+
+/* reapCompletions()
+ *
+ * Submit anything queued and process whatever completions are ready.
+ *
+ * Parameters:
+ * ring - ring to reap
+ * wait - True to wait until there is at least one completion
+ */
+static void reapCompletions(Uring* ring, Boolean wait) {
+  unsigned head = *ring->completionHead;
+
+  if (wait && (head == __atomic_load_n(ring->completionTail,
+                                       __ATOMIC_ACQUIRE))) {
+    enterRing(ring, True);
+  }
+  else if (ring->toSubmit) {
+    enterRing(ring, False);
+  }
+
+  while (head != __atomic_load_n(ring->completionTail, __ATOMIC_ACQUIRE)) {
+    struct io_uring_cqe* completion =
+      &ring->completions[head & ring->completionMask];
+    unsigned long userData = completion->user_data;
+    int result = completion->res;
+
+    /* Give the slot back before handling it, since handling may
+     * queue further operations.
+     */
+    head++;
+    __atomic_store_n(ring->completionHead, head, __ATOMIC_RELEASE);
+
+    handleCompletion(ring, (IoFile*)(userData & ~(unsigned long)OPERATION_MASK),
+                     userData & OPERATION_MASK, result);
+  }
+}
+
+/* makeFileData()
+ *
+ * Allocate the per-file data the kernel needs to see.
+ */
+static UringFileData* makeFileData(void) {
+  UringFileData* data = malloc(sizeof(UringFileData));
+  if (data == NULL) {
+    error(True, "malloc failed for I/O engine file data");
+  }
+  return data;
+}
+#endif
+
+
+/***** Engine interface *****/
+
+/* makeIoEngine()
+ *
+ * Construct an I/O engine.
+ *
+ * Parameters:
+ * method - IO_METHOD_BLOCKING or IO_METHOD_URING to choose one, e.g.
+ *          for comparing the two, or IO_METHOD_AUTOMATIC
+ *
+ * Return value:
+ * New engine, using io_uring if chosen and available.
+ */
+IoEngine* makeIoEngine(IoMethod method) {
+  IoEngine* engine = malloc(sizeof(IoEngine));
+  if (engine == NULL) {
+    error(True, "malloc failed to make I/O engine");
+  }
+  engine->useUring = False;
+#ifdef HAVE_IO_URING
+  if ((method == IO_METHOD_URING) ||
+      ((method == IO_METHOD_AUTOMATIC) &&
+       (sysconf(_SC_NPROCESSORS_ONLN) > 1))) {
+    engine->useUring = setupRing(&engine->ring);
+  }
+#else
+  (void)method;
+#endif
+  return engine;
+}
+
+/* freeIoEngine()
+ *
+ * Release an engine. There must be no operations outstanding.
+ *
+ * Parameters:
+ * engine - engine to release
+ */
+void freeIoEngine(IoEngine* engine) {
+  if (engine != NULL) {
+#ifdef HAVE_IO_URING
+    if (engine->useUring) {
+      if (engine->ring.inFlight || engine->ring.toSubmit) {
+        error(False, "I/O engine freed with operations outstanding");
+      }
+      closeRing(&engine->ring);
+    }
+#endif
+    free(engine);
+  }
+}
+
+/* getIoEngineName()
+ *
+ * Return value:
+ * Name of the I/O method the engine is using, for reports
+ */
+const char* getIoEngineName(const IoEngine* engine) {
+  return engine->useUring ? "io_uring" : "blocking";
+}
+
+/* ioLoadFiles()
+ *
+ * Start loading a group of files. Each one ends up with its contents in
+ * a pooled buffer at file->address and its state set to IO_DONE. Use
+ * ioWaitFiles() to make sure that has happened.
+ *
+ * Parameters:
+ * engine - engine to use
+ * files - files to load, with filename filled in
+ * count - number of files
+ */
+void ioLoadFiles(IoEngine* engine, IoFile* files, size_t count) {
+  size_t index;
+  for (index = 0; index < count; index++) {
+    IoFile* file = &files[index];
+    file->state = IO_LOADING;
+    file->address = NULL;
+    file->size = 0;
+    file->bytesTransferred = 0;
+    file->pendingOperations = 0;
+#ifdef HAVE_IO_URING
+    if (engine->useUring) {
+      file->engineData = makeFileData();
+      queueOpen(&engine->ring, file, O_RDONLY);
+      queueStatx(&engine->ring, file);
+      continue;
+    }
+#endif
+    loadFileBlocking(file);
+  }
+  ioPoll(engine);
+}
+
+/* ioStoreFiles()
+ *
+ * Start storing a group of files. The header and data buffers must
+ * stay valid until the file state is IO_DONE.
+ *
+ * Parameters:
+ * engine - engine to use
+ * files - files to store, with the caller's fields filled in
+ * count - number of files
+ */
+void ioStoreFiles(IoEngine* engine, IoFile* files, size_t count) {
+  size_t index;
+  for (index = 0; index < count; index++) {
+    IoFile* file = &files[index];
+    file->state = IO_STORING;
+    file->bytesTransferred = 0;
+    file->pendingOperations = 0;
+#ifdef HAVE_IO_URING
+    if (engine->useUring) {
+      file->engineData = makeFileData();
+      queueOpen(&engine->ring, file,
+                O_WRONLY | O_CREAT | (file->exclusive ? O_EXCL : O_TRUNC));
+      continue;
+    }
+#endif
+    storeFileBlocking(file);
+  }
+  ioPoll(engine);
+}
+
+/* ioPoll()
+ *
+ * Let outstanding operations make progress without waiting. Call this
+ * now and again while doing other work.
+ *
+ * Parameters:
+ * engine - engine to poll
+ */
+void ioPoll(IoEngine* engine) {
+#ifdef HAVE_IO_URING
+  if (engine->useUring) {
+    reapCompletions(&engine->ring, False);
+  }
+#else
+  (void)engine;
+#endif
+}
+
+/* ioWaitFiles()
+ *
+ * Wait until a group of files has finished loading or storing.
+ *
+ * Parameters:
+ * engine - engine the files were passed to
+ * files - files to wait for
+ * count - number of files
+ */
+void ioWaitFiles(IoEngine* engine, IoFile* files, size_t count) {
+  double start = traceClock();
+  size_t index;
+  for (index = 0; index < count; index++) {
+    while (files[index].state != IO_DONE) {
+#ifdef HAVE_IO_URING
+      if (engine->useUring) {
+        reapCompletions(&engine->ring, True);
+        continue;
+      }
+#endif
+      error(False, "I/O engine waiting for a file it isn't handling");
+    }
+  }
+  traceEvent("io-wait", "io", start);
+}
@@ -0,0 +1,61 @@
+#ifndef IO_ENGINE_H
+#define IO_ENGINE_H
+
+/*
+ * Declarations for the batched file I/O engine in ioEngine.c
+ */
+
+#include <stdlib.h>
+#include "boolean.h"
+
+typedef enum { IO_IDLE = 0,
+               IO_LOADING,
+               IO_STORING,
+               IO_DONE } IoFileState;
+
+/* One file being loaded or stored by the engine. The caller fills in
+ * the first group of fields, the engine owns the rest.
+ */
+typedef struct {
+  const char* filename;
+
+  /* Loading: filled in by the engine with a buffer from
+   *          allocateBuffer() which the caller must release.
+   * Storing: data to write after the header.
+   */
+  unsigned char* address;
+  size_t size;
+
+  /* Storing only: bytes written before the data, may be NULL */
+  const unsigned char* header;
+  size_t headerSize;
+
+  /* Storing only: True if the file must not already exist */
+  Boolean exclusive;
+
+  IoFileState state;
+  int fileDescriptor;
+  unsigned pendingOperations;
+  size_t bytesTransferred;
+  void* engineData;
+} IoFile;
+
+/* How an engine does its I/O. Automatic means io_uring if there is
+ * more than one processor to overlap it with.
+ */
+typedef enum { IO_METHOD_AUTOMATIC = 0,
+               IO_METHOD_BLOCKING,
+               IO_METHOD_URING } IoMethod;
+
+typedef struct IoEngineStruct IoEngine;
+
+IoEngine* makeIoEngine(IoMethod method);
+void freeIoEngine(IoEngine* engine);
+const char* getIoEngineName(const IoEngine* engine);
+
+void ioLoadFiles(IoEngine* engine, IoFile* files, size_t count);
+void ioStoreFiles(IoEngine* engine, IoFile* files, size_t count);
+void ioPoll(IoEngine* engine);
+void ioWaitFiles(IoEngine* engine, IoFile* files, size_t count);
+
+#endif
@@ -3,20 +3,51 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <unistd.h>
+#include "archive.h"
+#include "batch.h"
+#include "benchmark.h"
 #include "dataBlocks.h"
+#include "dictionary.h"
 #include "header.h"
 #include "compression.h"
+#include "kernels.h"
+#include "perfCounters.h"
+#include "pipeline.h"
+#include "statistics.h"
+#include "threadPool.h"
+#include "trace.h"
 
 
 const char* programName_g = "jlcompress";
 
 int main(int argc, char** argv) {
-  struct CompressionFlags defaultCompressionFlags = { False, True, True };
-  struct CompressionFlags explicitCompressionFlags = { False, False, False };
+  struct CompressionFlags defaultCompressionFlags = { False, True, True, 0, NULL, False, False, 0, 0 };
+  struct CompressionFlags explicitCompressionFlags = { False, False, False, 0, NULL, False, False, 0, 0 };
   struct CompressionFlags* compressionFlags = &defaultCompressionFlags;
   Boolean overwrite = False;
   Boolean compressing = True;
+  Boolean batch = False;
+  IoMethod ioMethod = IO_METHOD_AUTOMATIC;
+  Boolean solid = False;
+  Boolean extracting = False;
+  Boolean range = False;
+  Boolean toStdout = False;
+  Boolean jsonStatistics = False;
+  int statisticsFileDescriptor = -1;
+  Boolean bench = False;
+  Boolean pipeline = False;
+  Boolean fromStdin = False;
+  unsigned long rangeOffset = 0;
+  unsigned long rangeLength = 0;
   const char* inputFilename = NULL;
+  const char* archiveFilename = NULL;
+  const char* trainFilename = NULL;
+  Dictionary* dictionary = NULL;
+
+  /* Names given on the command line in batch and archive modes */
+  char** batchNames = NULL;
+  size_t batchNameCount = 0;
 
   /* True if the output filename is stored in the heap and needs to be
    * freed before the program exits.
@@ -41,9 +72,70 @@ int main(int argc, char** argv) {
       printf("          --flip          Flip bit ordering only\n");
       printf("          --huffman       Huffman compression only\n");
       printf("          --rle           Run length encode only\n");
+      printf("          --rle2          Run length encode only, with symbols\n");
+      printf("                          chosen for each block and long runs\n");
+      printf("          --batch         Every filename is an input file, and a\n");
+      printf("                          directory means every file in it\n");
+      printf("          --blocking-io   Don't use io_uring in batch mode\n");
+      printf("          --io-uring      Use io_uring in batch mode even with\n");
+      printf("                          only one processor\n");
+      printf("          --archive name  Compress the files into one archive\n");
+      printf("          --solid         Share one Huffman table between all the\n");
+      printf("                          files in the archive\n");
+      printf("          --extract name  Extract the named files, or all of them,\n");
+      printf("                          from an archive\n");
+      printf("          --train name    Train a dictionary from the files\n");
+      printf("          --dictionary name\n");
+      printf("                          Huffman compress with a trained\n");
+      printf("                          dictionary, or decompress a file\n");
+      printf("                          compressed with one\n");
+      printf("          --block-size n  Compress in independent blocks of n bytes\n");
+      printf("                          (K or M suffix allowed) so that ranges\n");
+      printf("                          can be decompressed on their own\n");
+      printf("          --checksum      Store CRC32C checksums, checked when the\n");
+      printf("                          file is decompressed\n");
+      printf("          --delta n       Replace each byte of an array of n byte\n");
+      printf("                          numbers with its difference from the\n");
+      printf("                          same byte of the number before first\n");
+      printf("          --xor-delta n   The same with exclusive or, for floating\n");
+      printf("                          point numbers\n");
+      printf("          --shuffle n     Put byte 0 of every n byte number first,\n");
+      printf("                          then byte 1 and so on. n is 2, 4, 8 or 16\n");
+      printf("          --range o:l     Decompress l bytes from offset o only.\n");
+      printf("                          An output filename of - means stdout\n");
+      printf("          --stats=json    Write the time, memory use and sizes of\n");
+      printf("                          each stage to stderr as JSON\n");
+      printf("          --stats-fd n    Write them to file descriptor n instead\n");
+      printf("          --perf-counters Add hardware performance counters for\n");
+      printf("                          each stage to the JSON statistics\n");
+      printf("          --trace file    Write a timeline of the stages, blocks,\n");
+      printf("                          threads and I/O in Chrome trace format\n");
+      printf("          --threads n     Compress or decompress the blocks of a\n");
+      printf("                          blocked file on n threads, or Huffman\n");
+      printf("                          code a large single stream on them\n");
+      printf("          --pipeline      Run each stage on its own thread, on\n");
+      printf("                          blocks of the file as they are read.\n");
+      printf("                          An input filename of - means stdin\n");
+      printf("          --bench         Time every combination of the stages,\n");
+      printf("                          filters and checksums\n");
+      printf("                          on the files in memory\n");
+      printf("          --kernels       Check and list the versions of the inner\n");
+      printf("                          loops this processor has. Set\n");
+      printf("                          %sNAME=version to choose one\n",
+             KERNEL_ENVIRONMENT_PREFIX);
       printf("Operations can be combined - e.g. --flip --rle\n");
       printf("Default is --rle --huffman\n");
       printf("\n");
+      printf("%s [switches] --batch filename...\n", programName_g);
+      printf("%s [switches] --archive archive [--solid] filename...\n",
+             programName_g);
+      printf("%s [switches] --extract archive [member...]\n", programName_g);
+      printf("%s --range offset:length compressedFile [outputFilename|-]\n",
+             programName_g);
+      printf("%s [switches] --train dictionary filename...\n", programName_g);
+      printf("%s [--threads n] [--block-size n] --bench filename...\n",
+             programName_g);
+      printf("\n");
       exit(0);
     }
     else if (!strcmp(argv[index], "-f") ||
@@ -62,8 +154,149 @@ int main(int argc, char** argv) {
       compressionFlags = &explicitCompressionFlags;
       explicitCompressionFlags.rle = True;
     }
-    else if (*argv[index] != '-') {
-      if (outputFilename) {
+    else if (!strcmp(argv[index], "--rle2")) {
+      compressionFlags = &explicitCompressionFlags;
+      explicitCompressionFlags.rle = True;
+      explicitCompressionFlags.rleVersion2 = True;
+    }
+    else if (!strcmp(argv[index], "--batch")) {
+      batch = True;
+    }
+    else if (!strcmp(argv[index], "--blocking-io")) {
+      ioMethod = IO_METHOD_BLOCKING;
+    }
+    else if (!strcmp(argv[index], "--io-uring")) {
+      ioMethod = IO_METHOD_URING;
+    }
+    else if (!strcmp(argv[index], "--archive") ||
+             !strcmp(argv[index], "--extract")) {
+      if (archiveFilename) {
+        error(False, "Only one archive can be given");
+      }
+      if (index + 1 >= argc) {
+        error(False, "%s needs an archive filename", argv[index]);
+      }
+      extracting = !strcmp(argv[index], "--extract") ? True : False;
+      archiveFilename = argv[++index];
+    }
+    else if (!strcmp(argv[index], "--solid")) {
+      solid = True;
+    }
+    else if (!strcmp(argv[index], "--train")) {
+      if (index + 1 >= argc) {
+        error(False, "--train needs a dictionary filename");
+      }
+      trainFilename = argv[++index];
+    }
+    else if (!strcmp(argv[index], "--dictionary")) {
+      if (index + 1 >= argc) {
+        error(False, "--dictionary needs a dictionary filename");
+      }
+      if (dictionary) {
+        error(False, "Only one dictionary can be given");
+      }
+      dictionary = loadDictionary(argv[++index]);
+      defaultCompressionFlags.dictionary = dictionary;
+      explicitCompressionFlags.dictionary = dictionary;
+    }
+    else if (!strcmp(argv[index], "--block-size")) {
+      if (index + 1 >= argc) {
+        error(False, "--block-size needs a size");
+      }
+      defaultCompressionFlags.blockSize = parseSize(argv[++index],
+                                                    "--block-size");
+      explicitCompressionFlags.blockSize = defaultCompressionFlags.blockSize;
+      if (defaultCompressionFlags.blockSize == 0) {
+        error(False, "--block-size cannot be 0");
+      }
+    }
+    else if (!strcmp(argv[index], "--checksum")) {
+      defaultCompressionFlags.checksum = True;
+      explicitCompressionFlags.checksum = True;
+    }
+    else if (!strcmp(argv[index], "--delta") ||
+             !strcmp(argv[index], "--xor-delta") ||
+             !strcmp(argv[index], "--shuffle")) {
+      unsigned char filter = !strcmp(argv[index], "--delta") ? FILTER_DELTA :
+        !strcmp(argv[index], "--xor-delta") ? FILTER_XOR_DELTA :
+        FILTER_SHUFFLE;
+      unsigned long width;
+      if (index + 1 >= argc) {
+        error(False, "%s needs an element width", argv[index]);
+      }
+      width = parseSize(argv[index + 1], argv[index]);
+      if ((width != 2) && (width != 4) && (width != 8) && (width != 16)) {
+        error(False, "%s element width must be 2, 4, 8 or 16", argv[index]);
+      }
+      if (defaultCompressionFlags.filters &&
+          (width != defaultCompressionFlags.elementWidth)) {
+        error(False, "The filters must have the same element width");
+      }
+      if ((filter != FILTER_SHUFFLE) &&
+          (defaultCompressionFlags.filters &
+           (FILTER_DELTA | FILTER_XOR_DELTA))) {
+        error(False, "Only one of --delta and --xor-delta can be given");
+      }
+      index++;
+      defaultCompressionFlags.filters |= filter;
+      defaultCompressionFlags.elementWidth = width;
+      explicitCompressionFlags.filters = defaultCompressionFlags.filters;
+      explicitCompressionFlags.elementWidth = width;
+    }
+    else if (!strcmp(argv[index], "--stats=json")) {
+      jsonStatistics = True;
+    }
+    else if (!strcmp(argv[index], "--perf-counters")) {
+      jsonStatistics = True;
+      enablePerfCounters();
+    }
+    else if (!strcmp(argv[index], "--stats-fd")) {
+      if (index + 1 >= argc) {
+        error(False, "--stats-fd needs a file descriptor");
+      }
+      statisticsFileDescriptor = parseSize(argv[++index], "--stats-fd");
+    }
+    else if (!strcmp(argv[index], "--trace")) {
+      if (index + 1 >= argc) {
+        error(False, "--trace needs a filename");
+      }
+      openTrace(argv[++index]);
+      traceThreadName("main");
+    }
+    else if (!strcmp(argv[index], "--threads")) {
+      if (index + 1 >= argc) {
+        error(False, "--threads needs a number of threads");
+      }
+      setThreadCount(parseSize(argv[++index], "--threads"));
+    }
+    else if (!strcmp(argv[index], "--pipeline")) {
+      pipeline = True;
+    }
+    else if (!strcmp(argv[index], "--kernels")) {
+      checkKernels();
+      exit(0);
+    }
+    else if (!strcmp(argv[index], "--bench")) {
+      bench = True;
+    }
+    else if (!strcmp(argv[index], "--range")) {
+      if (index + 1 >= argc) {
+        error(False, "--range needs offset:length");
+      }
+      parseRange(argv[++index], &rangeOffset, &rangeLength);
+      range = True;
+    }
+    else if ((*argv[index] != '-') || !strcmp(argv[index], "-")) {
+      if (batch || bench || archiveFilename || trainFilename) {
+        if (batchNames == NULL) {
+          batchNames = malloc(argc * sizeof(char*));
+          if (batchNames == NULL) {
+            error(True, "unable to malloc space for filenames");
+          }
+        }
+        batchNames[batchNameCount++] = argv[index];
+      }
+      else if (outputFilename) {
 	error(False, "Too many filenames");
       }
       else if (inputFilename) {
@@ -78,8 +311,122 @@ int main(int argc, char** argv) {
     }
   }
 
+  if (jsonStatistics || (statisticsFileDescriptor >= 0)) {
+    openStatisticsReport((statisticsFileDescriptor >= 0) ?
+                         statisticsFileDescriptor : STDERR_FILENO);
+  }
+
+  if (trainFilename) {
+    size_t fileCount = 0;
+    char** fileList = NULL;
+    if (inputFilename != NULL) {
+      error(False, "--train must come before the filenames");
+    }
+    if (!overwrite) {
+      struct stat fileStat;
+      if (!stat(trainFilename, &fileStat)) {
+        error(False, "output file %s already exists", trainFilename);
+      }
+    }
+    fileList = makeFileList(batchNames, batchNameCount, &fileCount);
+    trainDictionary(compressionFlags, trainFilename, fileList, fileCount);
+    freeFileList(fileList, fileCount);
+    free(batchNames);
+    writeStatisticsReport(programName_g);
+    writeTrace();
+    return 0;
+  }
+
+  if (bench) {
+    size_t fileCount = 0;
+    char** fileList = NULL;
+    if (inputFilename != NULL) {
+      error(False, "--bench must come before the filenames");
+    }
+    fileList = makeFileList(batchNames, batchNameCount, &fileCount);
+    benchmarkFiles(compressionFlags, fileList, fileCount);
+    freeFileList(fileList, fileCount);
+    free(batchNames);
+    freeDictionary(dictionary);
+    writeStatisticsReport(programName_g);
+    writeTrace();
+    return 0;
+  }
+
+  if (archiveFilename) {
+    if (inputFilename != NULL) {
+      error(False, "--archive or --extract must come before the filenames");
+    }
+    enableStatistics(False);
+    if (extracting) {
+      extractFromArchive(archiveFilename, batchNames, batchNameCount, overwrite);
+    }
+    else {
+      size_t fileCount = 0;
+      char** fileList = makeFileList(batchNames, batchNameCount, &fileCount);
+      if (!overwrite) {
+        struct stat fileStat;
+        if (!stat(archiveFilename, &fileStat)) {
+          error(False, "output file %s already exists", archiveFilename);
+        }
+      }
+      createArchive(compressionFlags, archiveFilename, fileList, fileCount,
+                    solid);
+      freeFileList(fileList, fileCount);
+    }
+    free(batchNames);
+    writeStatisticsReport(programName_g);
+    writeTrace();
+    return 0;
+  }
+
+  if (batch) {
+    size_t fileCount = 0;
+    char** fileList = NULL;
+    if (inputFilename != NULL) {
+      error(False, "--batch must come before the filenames");
+    }
+    fileList = makeFileList(batchNames, batchNameCount, &fileCount);
+    enableStatistics(False);
+    processFiles(compressionFlags, fileList, fileCount, overwrite, ioMethod);
+    freeFileList(fileList, fileCount);
+    free(batchNames);
+    writeStatisticsReport(programName_g);
+    writeTrace();
+    return 0;
+  }
+
+  if (inputFilename == NULL) {
+    error(False, "No input filename");
+  }
+
+  /* Standard input can only be compressed as a stream, and the output
+   * goes to standard output unless a file is given
+   */
+  fromStdin = !strcmp(inputFilename, "-") ? True : False;
+  if (fromStdin) {
+    pipeline = True;
+    if (outputFilename == NULL) {
+      outputFilename = (char*)"-";
+    }
+  }
+
+  /* Writing to stdout, so only the data may go there */
+  toStdout = (outputFilename && !strcmp(outputFilename, "-")) ? True : False;
+  if (toStdout) {
+    enableStatistics(False);
+  }
+
   /* Find out if the file is compressed or not */
-  compressing = !getCompressionFlags(inputFilename, True);
+  compressing = fromStdin ? True :
+    !getCompressionFlags(inputFilename, !toStdout);
+
+  if (range && compressing) {
+    error(False, "--range needs a compressed file");
+  }
+  if (pipeline && (range || !compressing)) {
+    error(False, "--pipeline needs a file to compress");
+  }
 
   /* If no output filename provided, then generate one. */
   if (outputFilename == NULL) {
@@ -88,12 +435,12 @@ int main(int argc, char** argv) {
   }
 
   /* Ensure output filename is not the same as the input filename */
-  if (!strcmp(inputFilename, outputFilename)) {
+  if (!fromStdin && !strcmp(inputFilename, outputFilename)) {
     error(False, "cannot have same file for input and output");
   }
 
   /* Ensure the output file does not already exist */
-  if (!overwrite) {
+  if (!overwrite && !toStdout) {
     struct stat fileStat;
     if (!stat(outputFilename, &fileStat)) {
       error(False, "output file %s already exists", outputFilename);
@@ -101,21 +448,33 @@ int main(int argc, char** argv) {
   }
 
   /* Compress or decompress file */
-  if (compressing) {
+  if (range) {
+    extractRange(inputFilename, outputFilename, rangeOffset, rangeLength);
+  }
+  else if (pipeline) {
+    compressPipelined(compressionFlags, inputFilename, outputFilename);
+  }
+  else if (compressing) {
     compress(compressionFlags, inputFilename, outputFilename);
   }
   else {
     decompress(inputFilename, outputFilename);
   }
 
-  displayFinalStatistics(inputFilename, outputFilename);
+  if (!toStdout && !fromStdin) {
+    displayFinalStatistics(inputFilename, outputFilename);
+  }
  
   /* Free heap storage */
+  freeDictionary(dictionary);
   if (freeOutputFilename) {
     free(outputFilename);
     freeOutputFilename = False;
   }
  
+  writeStatisticsReport(programName_g);
+  writeTrace();
+
   /* Always return success because program is aborted on error */
   return 0;
 }
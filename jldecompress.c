@@ -8,7 +8,15 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <unistd.h>
 #include "dataBlocks.h"
+#include "dictionary.h"
+#include "inspect.h"
+#include "perfCounters.h"
+#include "sidecarIndex.h"
+#include "statistics.h"
+#include "threadPool.h"
+#include "trace.h"
 #include "header.h"
 #include "compression.h"
 
@@ -16,7 +24,22 @@ const char* programName_g = "jldecompress";
 
 int main(int argc, char** argv) {
   Boolean overwrite = False;
+  Boolean range = False;
+  Boolean toStdout = False;
+  Boolean jsonStatistics = False;
+  int statisticsFileDescriptor = -1;
+  Boolean testing = False;
+  Boolean listing = False;
+  Boolean indexing = False;
+  unsigned long indexInterval = 0;
+  unsigned long rangeOffset = 0;
+  unsigned long rangeLength = 0;
   const char* inputFilename = NULL;
+  Dictionary* dictionary = NULL;
+
+  /* Names given on the command line with --test, --list or --index */
+  char** names = NULL;
+  size_t nameCount = 0;
 
   /* True if the output filename is stored in the heap and needs to be
    * freed before the program exits.
@@ -38,6 +61,34 @@ int main(int argc, char** argv) {
       printf("Switches:\n");
       printf("          -f or --force   Overwrite output file if it exists\n");
       printf("          -h or --help    Print this text\n");
+      printf("          --dictionary name\n");
+      printf("                          Dictionary the file was compressed with\n");
+      printf("          --range o:l     Decompress l bytes from offset o only.\n");
+      printf("                          An output filename of - means stdout\n");
+      printf("          --stats=json    Write the time, memory use and sizes of\n");
+      printf("                          each stage to stderr as JSON\n");
+      printf("          --stats-fd n    Write them to file descriptor n instead\n");
+      printf("          --perf-counters Add hardware performance counters for\n");
+      printf("                          each stage to the JSON statistics\n");
+      printf("          --trace file    Write a timeline of the stages, blocks,\n");
+      printf("                          threads and I/O in Chrome trace format\n");
+      printf("          --threads n     Decompress the blocks of a blocked\n");
+      printf("                          file, or an indexed single stream\n");
+      printf("                          file, on n threads\n");
+      printf("          --test          Decompress the files without writing\n");
+      printf("                          the output, to check them\n");
+      printf("          --list          List the sizes, blocks and stages of\n");
+      printf("                          the files without decompressing them\n");
+      printf("          --index         Write a seek index beside each single\n");
+      printf("                          stream file, so that it can be\n");
+      printf("                          decompressed on several threads and\n");
+      printf("                          ranges read without decoding it all\n");
+      printf("          --index-interval n\n");
+      printf("                          Bytes between index entries (1M)\n");
+      printf("\n");
+      printf("%s [switches] --test filename...\n", programName_g);
+      printf("%s --list filename...\n", programName_g);
+      printf("%s [--index-interval n] --index filename...\n", programName_g);
       printf("\n");
       exit(0);
     }
@@ -45,8 +96,77 @@ int main(int argc, char** argv) {
 	     !strcmp(argv[index], "--force")) {
       overwrite = True;
     }
-    else if (*argv[index] != '-') {
-      if (outputFilename) {
+    else if (!strcmp(argv[index], "--dictionary")) {
+      if (index + 1 >= argc) {
+        error(False, "--dictionary needs a dictionary filename");
+      }
+      if (dictionary) {
+        error(False, "Only one dictionary can be given");
+      }
+      dictionary = loadDictionary(argv[++index]);
+    }
+    else if (!strcmp(argv[index], "--stats=json")) {
+      jsonStatistics = True;
+    }
+    else if (!strcmp(argv[index], "--perf-counters")) {
+      jsonStatistics = True;
+      enablePerfCounters();
+    }
+    else if (!strcmp(argv[index], "--stats-fd")) {
+      if (index + 1 >= argc) {
+        error(False, "--stats-fd needs a file descriptor");
+      }
+      statisticsFileDescriptor = parseSize(argv[++index], "--stats-fd");
+    }
+    else if (!strcmp(argv[index], "--trace")) {
+      if (index + 1 >= argc) {
+        error(False, "--trace needs a filename");
+      }
+      openTrace(argv[++index]);
+      traceThreadName("main");
+    }
+    else if (!strcmp(argv[index], "--threads")) {
+      if (index + 1 >= argc) {
+        error(False, "--threads needs a number of threads");
+      }
+      setThreadCount(parseSize(argv[++index], "--threads"));
+    }
+    else if (!strcmp(argv[index], "--test")) {
+      testing = True;
+    }
+    else if (!strcmp(argv[index], "--list")) {
+      listing = True;
+    }
+    else if (!strcmp(argv[index], "--index")) {
+      indexing = True;
+    }
+    else if (!strcmp(argv[index], "--index-interval")) {
+      if (index + 1 >= argc) {
+        error(False, "--index-interval needs a number of bytes");
+      }
+      indexInterval = parseSize(argv[++index], "--index-interval");
+      if (indexInterval == 0) {
+        error(False, "--index-interval can't be 0");
+      }
+    }
+    else if (!strcmp(argv[index], "--range")) {
+      if (index + 1 >= argc) {
+        error(False, "--range needs offset:length");
+      }
+      parseRange(argv[++index], &rangeOffset, &rangeLength);
+      range = True;
+    }
+    else if ((*argv[index] != '-') || !strcmp(argv[index], "-")) {
+      if (testing || listing || indexing) {
+        if (names == NULL) {
+          names = malloc(argc * sizeof(char*));
+          if (names == NULL) {
+            error(True, "unable to malloc space for filenames");
+          }
+        }
+        names[nameCount++] = argv[index];
+      }
+      else if (outputFilename) {
 	error(False, "Too many filenames");
       }
       else if (inputFilename) {
@@ -61,8 +181,50 @@ int main(int argc, char** argv) {
     }
   }
 
+  if (jsonStatistics || (statisticsFileDescriptor >= 0)) {
+    openStatisticsReport((statisticsFileDescriptor >= 0) ?
+                         statisticsFileDescriptor : STDERR_FILENO);
+  }
+
+  if (testing || listing || indexing) {
+    if (testing + listing + indexing > 1) {
+      error(False, "Only one of --test, --list and --index can be used");
+    }
+    if (range) {
+      error(False, "--range can't be used with %s",
+            testing ? "--test" : (listing ? "--list" : "--index"));
+    }
+    if (nameCount == 0) {
+      error(False, "No input filenames");
+    }
+    if (testing) {
+      testFiles(names, nameCount);
+    }
+    else if (listing) {
+      listFiles(names, nameCount);
+    }
+    else {
+      makeSidecarIndexes(names, nameCount, indexInterval);
+    }
+    free(names);
+    freeDictionary(dictionary);
+    writeStatisticsReport(programName_g);
+    writeTrace();
+    return 0;
+  }
+
+  if (inputFilename == NULL) {
+    error(False, "No input filename");
+  }
+
+  /* Writing to stdout, so only the data may go there */
+  toStdout = (outputFilename && !strcmp(outputFilename, "-")) ? True : False;
+  if (toStdout) {
+    enableStatistics(False);
+  }
+
   /* Find out if the file is compressed or not */
-  if (!getCompressionFlags(inputFilename, True)) {
+  if (!getCompressionFlags(inputFilename, !toStdout)) {
     printf("File %s is not compressed\n", inputFilename);
     exit(0);
   }
@@ -79,23 +241,34 @@ int main(int argc, char** argv) {
   }
 
   /* Ensure the output file does not already exist */
-  if (!overwrite) {
+  if (!overwrite && !toStdout) {
     struct stat fileStat;
     if (!stat(outputFilename, &fileStat)) {
       error(False, "output file %s already exists", outputFilename);
     }
   }
 
-  decompress(inputFilename, outputFilename);
+  if (range) {
+    extractRange(inputFilename, outputFilename, rangeOffset, rangeLength);
+  }
+  else {
+    decompress(inputFilename, outputFilename);
+  }
 
-  displayFinalStatistics(inputFilename, outputFilename);
+  if (!toStdout) {
+    displayFinalStatistics(inputFilename, outputFilename);
+  }
  
   /* Free heap storage */
+  freeDictionary(dictionary);
   if (freeOutputFilename) {
     free(outputFilename);
     freeOutputFilename = False;
   }
  
+  writeStatisticsReport(programName_g);
+  writeTrace();
+
   /* Always return success because program is aborted on error */
   return 0;
 }
@@ -0,0 +1,1941 @@
+/* kernels.c
+ *
+ * The inner loops which gain most from the wider instructions of newer
+ * processors have several versions, and the first one in each kernel's
+ * table which the processor running the program can run is chosen the
+ * first time any of them is used. The tables are in a fixed order of
+ * preference, so the same processor always gets the same versions;
+ * usually widest first, but a wide version which loses on the data the
+ * programs actually give it comes after the one which beats it.
+ * Everything is still built without -march, so the same binary runs on
+ * any x86-64 processor; the versions which need more than that
+ * are compiled for their instructions with the target attribute and
+ * only called if the processor has them. Every kernel has a plain C
+ * scalar version, which is the reference the others must agree with
+ * exactly, and which is all there is on other processors.
+ *
+ * The version of each kernel can be chosen by name with an environment
+ * variable, JLCOMPRESS_KERNEL_ followed by the kernel's name in capitals
+ * with _ for -, e.g.
+ *
+ *   JLCOMPRESS_KERNEL_FLIP=scalar ./jlcompress --flip file
+ *
+ * to compare them. jlcompress --kernels lists the versions this
+ * processor has, after checking each of them against the scalar one,
+ * and times each of them for comparison.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "compression.h"
+#include "crc32c.h"
+#include "kernels.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define X86_KERNELS
+#include <immintrin.h>
+#endif
+
+/* Processor features which a version of a kernel needs */
+#define FEATURE_SSE2 (1 << 0)
+#define FEATURE_SSE42 (1 << 1)
+#define FEATURE_AVX2 (1 << 2)
+/* AVX-512 F and BW */
+#define FEATURE_AVX512 (1 << 3)
+#define FEATURE_BMI2 (1 << 4)
+/* BMI2 with pdep and pext done in hardware rather than microcode */
+#define FEATURE_FAST_PDEP (1 << 5)
+
+/* Any kernel function, cast back to its own type when it is chosen */
+typedef void (*KernelFunction)(void);
+
+typedef struct {
+  const char* name;
+  unsigned features;
+  KernelFunction function;
+} KernelVariant;
+
+typedef struct {
+  const char* name;
+  /* Versions in order of preference, ending with the scalar one */
+  const KernelVariant* variants;
+  size_t variantCount;
+} KernelDescription;
+
+/* countBytesScalar()
+ *
+ * Count the bytes one at a time into one table.
+ *
+ * Parameters:
+ * data - bytes to count
+ * size - number of bytes
+ * counts - table to add to
+ */
+static void countBytesScalar(const unsigned char* data, size_t size,
+                             unsigned long* counts) {
+  size_t offset;
+  for (offset = 0; offset < size; offset++) {
+    counts[data[offset]]++;
+  }
+}
+
+/* countBytesGeneric()
+ *
+ * Count the bytes into four tables in turn, which are added up at the
+ * end, so that a run of one byte value doesn't make every increment
+ * wait for the one before. Any processor gains from this.
+ *
+ * Parameters:
+ * data - bytes to count
+ * size - number of bytes
+ * counts - table to add to
+ */
+static void countBytesGeneric(const unsigned char* data, size_t size,
+                              unsigned long* counts) {
+  unsigned long tables[4][256];
+  size_t offset = 0;
+  unsigned symbol;
+
+  memset(tables, 0, sizeof(tables));
+  for (; offset + 4 <= size; offset += 4) {
+    tables[0][data[offset]]++;
+    tables[1][data[offset + 1]]++;
+    tables[2][data[offset + 2]]++;
+    tables[3][data[offset + 3]]++;
+  }
+  for (; offset < size; offset++) {
+    tables[0][data[offset]]++;
+  }
+  for (symbol = 0; symbol < 256; symbol++) {
+    counts[symbol] += tables[0][symbol] + tables[1][symbol] +
+      tables[2][symbol] + tables[3][symbol];
+  }
+}
+
+/* runLengthScalar()
+ *
+ * Parameters:
+ * data - bytes to look at
+ * size - number of bytes
+ *
+ * Return value:
+ * Number of bytes at the start the same as the first
+ */
+static size_t runLengthScalar(const unsigned char* data, size_t size) {
+  size_t offset = 1;
+  if (size == 0) {
+    return 0;
+  }
+  while ((offset < size) && (data[offset] == data[0])) {
+    offset++;
+  }
+  return offset;
+}
+
+/* literalLengthScalar()
+ *
+ * Parameters:
+ * data - bytes to look at
+ * size - number of bytes
+ * repeatSymbol - run length encoding repeat symbol
+ * escapeSymbol - run length encoding escape symbol
+ *
+ * Return value:
+ * Number of bytes at the start which aren't either symbol
+ */
+static size_t literalLengthScalar(const unsigned char* data, size_t size,
+                                  unsigned char repeatSymbol,
+                                  unsigned char escapeSymbol) {
+  size_t offset = 0;
+  while ((offset < size) && (data[offset] != repeatSymbol) &&
+         (data[offset] != escapeSymbol)) {
+    offset++;
+  }
+  return offset;
+}
+
+/* periodLengthScalar()
+ *
+ * Parameters:
+ * data - bytes to look at
+ * size - number of bytes
+ * period - distance to compare bytes at
+ *
+ * Return value:
+ * Number of bytes at the start which repeat the first period bytes
+ */
+static size_t periodLengthScalar(const unsigned char* data, size_t size,
+                                 size_t period) {
+  size_t offset = period;
+  if (size <= period) {
+    return size;
+  }
+  while ((offset < size) && (data[offset] == data[offset - period])) {
+    offset++;
+  }
+  return offset;
+}
+
+/* periodLengthGeneric()
+ *
+ * Compare 8 bytes at a time with the 8 bytes period before. Any
+ * processor gains from this.
+ *
+ * Parameters:
+ * data - bytes to look at
+ * size - number of bytes
+ * period - distance to compare bytes at
+ *
+ * Return value:
+ * Number of bytes at the start which repeat the first period bytes
+ */
+static size_t periodLengthGeneric(const unsigned char* data, size_t size,
+                                  size_t period) {
+  size_t offset = period;
+  if (size <= period) {
+    return size;
+  }
+  for (; offset + 8 <= size; offset += 8) {
+    uint64_t bytes;
+    uint64_t earlier;
+    memcpy(&bytes, data + offset, 8);
+    memcpy(&earlier, data + offset - period, 8);
+    if (bytes != earlier) {
+      break;
+    }
+  }
+  while ((offset < size) && (data[offset] == data[offset - period])) {
+    offset++;
+  }
+  return offset;
+}
+
+/* flipGroupScalar()
+ *
+ * Split one group of 8 bytes into bit planes, a bit at a time.
+ *
+ * Parameters:
+ * input - the 8 bytes
+ * output - first plane's byte for the group
+ * planeSize - distance between planes
+ */
+static void flipGroupScalar(const unsigned char* input,
+                            unsigned char* output,
+                            size_t planeSize) {
+  unsigned plane;
+  for (plane = 0; plane < 8; plane++) {
+    unsigned char byte = 0;
+    unsigned bit;
+    for (bit = 0; bit < 8; bit++) {
+      byte |= ((input[bit] >> (7 - plane)) & 1) << bit;
+    }
+    output[plane * planeSize] = byte;
+  }
+}
+
+/* flipBitsScalar()
+ *
+ * Split groups of bytes into bit planes a bit at a time. See
+ * FlipBitsFunction in kernels.h.
+ */
+static void flipBitsScalar(const unsigned char* input,
+                           size_t groupCount,
+                           unsigned char* output,
+                           size_t planeSize) {
+  size_t group;
+  for (group = 0; group < groupCount; group++) {
+    flipGroupScalar(input + group * 8, output + group, planeSize);
+  }
+}
+
+/* unflipBitsScalar()
+ *
+ * Put bit planes back together a bit at a time. See UnflipBitsFunction
+ * in kernels.h.
+ */
+static void unflipBitsScalar(const unsigned char* input,
+                             size_t planeSize,
+                             size_t groupCount,
+                             unsigned char* output) {
+  size_t group;
+  for (group = 0; group < groupCount; group++) {
+    unsigned bit;
+    for (bit = 0; bit < 8; bit++) {
+      unsigned char byte = 0;
+      unsigned plane;
+      for (plane = 0; plane < 8; plane++) {
+        byte |= ((input[plane * planeSize + group] >> bit) & 1) <<
+          (7 - plane);
+      }
+      output[group * 8 + bit] = byte;
+    }
+  }
+}
+
+/* transposeBits()
+ *
+ * Transpose an 8 by 8 matrix of bits, where bit c of byte r is the
+ * element in row r and column c, in three rounds of swaps.
+ *
+ * Parameters:
+ * matrix - the matrix
+ *
+ * Return value:
+ * The transposed matrix
+ */
+static uint64_t transposeBits(uint64_t matrix) {
+  uint64_t swap;
+  swap = (matrix ^ (matrix >> 7)) & 0x00aa00aa00aa00aaULL;
+  matrix ^= swap ^ (swap << 7);
+  swap = (matrix ^ (matrix >> 14)) & 0x0000cccc0000ccccULL;
+  matrix ^= swap ^ (swap << 14);
+  swap = (matrix ^ (matrix >> 28)) & 0x00000000f0f0f0f0ULL;
+  matrix ^= swap ^ (swap << 28);
+  return matrix;
+}
+
+/* flipBitsGeneric()
+ *
+ * Split groups of bytes into bit planes by transposing each group as an
+ * 8 by 8 bit matrix in a 64 bit word, which any processor can do.
+ */
+static void flipBitsGeneric(const unsigned char* input,
+                            size_t groupCount,
+                            unsigned char* output,
+                            size_t planeSize) {
+  size_t group;
+  for (group = 0; group < groupCount; group++) {
+    uint64_t matrix = 0;
+    unsigned byte;
+    for (byte = 0; byte < 8; byte++) {
+      matrix |= (uint64_t)input[group * 8 + byte] << (8 * byte);
+    }
+    matrix = transposeBits(matrix);
+    /* Row r now holds bit r of each byte, and plane 0 is bit 7 */
+    for (byte = 0; byte < 8; byte++) {
+      output[(7 - byte) * planeSize + group] =
+        (unsigned char)(matrix >> (8 * byte));
+    }
+  }
+}
+
+/* unflipBitsGeneric()
+ *
+ * Put bit planes back together with the 64 bit word transpose.
+ */
+static void unflipBitsGeneric(const unsigned char* input,
+                              size_t planeSize,
+                              size_t groupCount,
+                              unsigned char* output) {
+  size_t group;
+  for (group = 0; group < groupCount; group++) {
+    uint64_t matrix = 0;
+    unsigned byte;
+    for (byte = 0; byte < 8; byte++) {
+      matrix |= (uint64_t)input[(7 - byte) * planeSize + group] <<
+        (8 * byte);
+    }
+    matrix = transposeBits(matrix);
+    for (byte = 0; byte < 8; byte++) {
+      output[group * 8 + byte] = (unsigned char)(matrix >> (8 * byte));
+    }
+  }
+}
+
+/* packCodesScalar()
+ *
+ * Write Huffman patterns a bit at a time. See PackCodesFunction in
+ * kernels.h.
+ */
+static unsigned long packCodesScalar(const unsigned char* input,
+                                     size_t size,
+                                     const unsigned long* patterns,
+                                     const unsigned char* lengths,
+                                     unsigned char* output,
+                                     unsigned bitOffset) {
+  unsigned long bit = bitOffset;
+  size_t offset;
+
+  output[0] &= (1 << bitOffset) - 1;
+  for (offset = 0; offset < size; offset++) {
+    unsigned char symbol = input[offset];
+    unsigned bitNumber;
+    for (bitNumber = 0; bitNumber < lengths[symbol]; bitNumber++) {
+      if ((bit % 8) == 0) {
+        output[bit / 8] = 0;
+      }
+      if ((patterns[symbol] >> bitNumber) & 1) {
+        output[bit / 8] |= 1 << (bit % 8);
+      }
+      bit++;
+    }
+  }
+  return bit - bitOffset;
+}
+
+/* shuffleBytesScalar()
+ *
+ * Byte shuffle a byte at a time.
+ *
+ * Parameters:
+ * input - the elements
+ * count - number of elements
+ * width - size of an element
+ * output - filled with width planes of count bytes
+ */
+static void shuffleBytesScalar(const unsigned char* input, size_t count,
+                               size_t width, unsigned char* output) {
+  size_t element;
+  size_t byte;
+  for (element = 0; element < count; element++) {
+    for (byte = 0; byte < width; byte++) {
+      output[byte * count + element] = input[element * width + byte];
+    }
+  }
+}
+
+/* unshuffleBytesScalar()
+ *
+ * Put byte shuffled elements back together a byte at a time.
+ *
+ * Parameters:
+ * input - width planes of count bytes
+ * count - number of elements
+ * width - size of an element
+ * output - filled with the elements
+ */
+static void unshuffleBytesScalar(const unsigned char* input, size_t count,
+                                 size_t width, unsigned char* output) {
+  size_t element;
+  size_t byte;
+  for (element = 0; element < count; element++) {
+    for (byte = 0; byte < width; byte++) {
+      output[element * width + byte] = input[byte * count + element];
+    }
+  }
+}
+
+/* deltaScalar()
+ *
+ * Parameters:
+ * input - bytes to filter
+ * size - number of bytes
+ * width - distance between the bytes subtracted
+ * exclusiveOr - exclusive or them instead
+ * output - filled with the differences
+ */
+static void deltaScalar(const unsigned char* input, size_t size,
+                        size_t width, int exclusiveOr,
+                        unsigned char* output) {
+  size_t offset;
+  for (offset = 0; (offset < size) && (offset < width); offset++) {
+    output[offset] = input[offset];
+  }
+  for (; offset < size; offset++) {
+    output[offset] = exclusiveOr ? input[offset] ^ input[offset - width] :
+      (unsigned char)(input[offset] - input[offset - width]);
+  }
+}
+
+/* undeltaScalar()
+ *
+ * Parameters:
+ * input - differences
+ * size - number of bytes
+ * width - distance between the bytes subtracted
+ * exclusiveOr - they were exclusive ored instead
+ * output - filled with the original bytes
+ */
+static void undeltaScalar(const unsigned char* input, size_t size,
+                          size_t width, int exclusiveOr,
+                          unsigned char* output) {
+  size_t offset;
+  for (offset = 0; (offset < size) && (offset < width); offset++) {
+    output[offset] = input[offset];
+  }
+  for (; offset < size; offset++) {
+    output[offset] = exclusiveOr ? input[offset] ^ output[offset - width] :
+      (unsigned char)(input[offset] + output[offset - width]);
+  }
+}
+
+/* packCodesGeneric()
+ *
+ * Write Huffman patterns into a 64 bit word, storing whole bytes from
+ * the bottom of it as they fill.
+ */
+static unsigned long packCodesGeneric(const unsigned char* input,
+                                      size_t size,
+                                      const unsigned long* patterns,
+                                      const unsigned char* lengths,
+                                      unsigned char* output,
+                                      unsigned bitOffset) {
+  uint64_t bits = output[0] & ((1 << bitOffset) - 1);
+  unsigned bitCount = bitOffset;
+  size_t byteIndex = 0;
+  size_t offset;
+
+  for (offset = 0; offset < size; offset++) {
+    unsigned char symbol = input[offset];
+    uint64_t pattern = patterns[symbol];
+    unsigned length = lengths[symbol];
+
+    /* Up to 7 bits are left over, so longer patterns go in two parts */
+    if (length > 56) {
+      bits |= (pattern & 0xffffffffULL) << bitCount;
+      bitCount += 32;
+      pattern >>= 32;
+      length -= 32;
+      while (bitCount >= 8) {
+        output[byteIndex++] = (unsigned char)bits;
+        bits >>= 8;
+        bitCount -= 8;
+      }
+    }
+    bits |= pattern << bitCount;
+    bitCount += length;
+    while (bitCount >= 8) {
+      output[byteIndex++] = (unsigned char)bits;
+      bits >>= 8;
+      bitCount -= 8;
+    }
+  }
+  if (bitCount) {
+    output[byteIndex] = (unsigned char)bits;
+  }
+  return byteIndex * 8 + bitCount - bitOffset;
+}
+
+#ifdef X86_KERNELS
+
+/* runLengthSse2()
+ *
+ * Compare 16 bytes at a time with the first.
+ */
+__attribute__((target("sse2")))
+static size_t runLengthSse2(const unsigned char* data, size_t size) {
+  size_t offset = 0;
+  __m128i first;
+
+  if (size == 0) {
+    return 0;
+  }
+  first = _mm_set1_epi8((char)data[0]);
+  for (; offset + 16 <= size; offset += 16) {
+    __m128i bytes = _mm_loadu_si128((const __m128i*)(data + offset));
+    unsigned same = _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, first));
+    if (same != 0xffff) {
+      return offset + __builtin_ctz(~same);
+    }
+  }
+  while ((offset < size) && (data[offset] == data[0])) {
+    offset++;
+  }
+  return offset;
+}
+
+/* periodLengthSse2()
+ *
+ * Compare 16 bytes at a time with the 16 bytes period before.
+ */
+__attribute__((target("sse2")))
+static size_t periodLengthSse2(const unsigned char* data, size_t size,
+                               size_t period) {
+  size_t offset = period;
+  if (size <= period) {
+    return size;
+  }
+  for (; offset + 16 <= size; offset += 16) {
+    __m128i bytes = _mm_loadu_si128((const __m128i*)(data + offset));
+    __m128i earlier =
+      _mm_loadu_si128((const __m128i*)(data + offset - period));
+    unsigned same = _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, earlier));
+    if (same != 0xffff) {
+      return offset + __builtin_ctz(~same);
+    }
+  }
+  while ((offset < size) && (data[offset] == data[offset - period])) {
+    offset++;
+  }
+  return offset;
+}
+
+/* periodLengthAvx2()
+ *
+ * Compare 32 bytes at a time with the 32 bytes period before.
+ */
+__attribute__((target("avx2")))
+static size_t periodLengthAvx2(const unsigned char* data, size_t size,
+                               size_t period) {
+  size_t offset = period;
+  if (size <= period) {
+    return size;
+  }
+  for (; offset + 32 <= size; offset += 32) {
+    __m256i bytes = _mm256_loadu_si256((const __m256i*)(data + offset));
+    __m256i earlier =
+      _mm256_loadu_si256((const __m256i*)(data + offset - period));
+    unsigned same = _mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, earlier));
+    if (same != 0xffffffffU) {
+      return offset + __builtin_ctz(~same);
+    }
+  }
+  while ((offset < size) && (data[offset] == data[offset - period])) {
+    offset++;
+  }
+  return offset;
+}
+
+/* runLengthAvx2()
+ *
+ * Compare 32 bytes at a time with the first.
+ */
+__attribute__((target("avx2")))
+static size_t runLengthAvx2(const unsigned char* data, size_t size) {
+  size_t offset = 0;
+  __m256i first;
+
+  if (size == 0) {
+    return 0;
+  }
+  first = _mm256_set1_epi8((char)data[0]);
+  for (; offset + 32 <= size; offset += 32) {
+    __m256i bytes = _mm256_loadu_si256((const __m256i*)(data + offset));
+    unsigned same = _mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, first));
+    if (same != 0xffffffffU) {
+      return offset + __builtin_ctz(~same);
+    }
+  }
+  while ((offset < size) && (data[offset] == data[0])) {
+    offset++;
+  }
+  return offset;
+}
+
+/* runLengthAvx512()
+ *
+ * Compare 64 bytes at a time with the first.
+ */
+__attribute__((target("avx512f,avx512bw")))
+static size_t runLengthAvx512(const unsigned char* data, size_t size) {
+  size_t offset = 0;
+  __m512i first;
+
+  if (size == 0) {
+    return 0;
+  }
+  first = _mm512_set1_epi8((char)data[0]);
+  for (; offset + 64 <= size; offset += 64) {
+    __m512i bytes = _mm512_loadu_si512((const void*)(data + offset));
+    uint64_t same = _mm512_cmpeq_epi8_mask(bytes, first);
+    if (same != ~0ULL) {
+      return offset + __builtin_ctzll(~same);
+    }
+  }
+  while ((offset < size) && (data[offset] == data[0])) {
+    offset++;
+  }
+  return offset;
+}
+
+/* literalLengthSse2()
+ *
+ * Look for the symbols 16 bytes at a time.
+ */
+__attribute__((target("sse2")))
+static size_t literalLengthSse2(const unsigned char* data, size_t size,
+                                unsigned char repeatSymbol,
+                                unsigned char escapeSymbol) {
+  __m128i repeat = _mm_set1_epi8((char)repeatSymbol);
+  __m128i escape = _mm_set1_epi8((char)escapeSymbol);
+  size_t offset = 0;
+
+  for (; offset + 16 <= size; offset += 16) {
+    __m128i bytes = _mm_loadu_si128((const __m128i*)(data + offset));
+    unsigned found = _mm_movemask_epi8(
+      _mm_or_si128(_mm_cmpeq_epi8(bytes, repeat),
+                   _mm_cmpeq_epi8(bytes, escape)));
+    if (found) {
+      return offset + __builtin_ctz(found);
+    }
+  }
+  return offset + literalLengthScalar(data + offset, size - offset,
+                                      repeatSymbol, escapeSymbol);
+}
+
+/* literalLengthAvx2()
+ *
+ * Look for the symbols 32 bytes at a time.
+ */
+__attribute__((target("avx2")))
+static size_t literalLengthAvx2(const unsigned char* data, size_t size,
+                                unsigned char repeatSymbol,
+                                unsigned char escapeSymbol) {
+  __m256i repeat = _mm256_set1_epi8((char)repeatSymbol);
+  __m256i escape = _mm256_set1_epi8((char)escapeSymbol);
+  size_t offset = 0;
+
+  for (; offset + 32 <= size; offset += 32) {
+    __m256i bytes = _mm256_loadu_si256((const __m256i*)(data + offset));
+    unsigned found = _mm256_movemask_epi8(
+      _mm256_or_si256(_mm256_cmpeq_epi8(bytes, repeat),
+                      _mm256_cmpeq_epi8(bytes, escape)));
+    if (found) {
+      return offset + __builtin_ctz(found);
+    }
+  }
+  return offset + literalLengthScalar(data + offset, size - offset,
+                                      repeatSymbol, escapeSymbol);
+}
+
+/* literalLengthAvx512()
+ *
+ * Look for the symbols 64 bytes at a time.
+ */
+__attribute__((target("avx512f,avx512bw")))
+static size_t literalLengthAvx512(const unsigned char* data, size_t size,
+                                  unsigned char repeatSymbol,
+                                  unsigned char escapeSymbol) {
+  __m512i repeat = _mm512_set1_epi8((char)repeatSymbol);
+  __m512i escape = _mm512_set1_epi8((char)escapeSymbol);
+  size_t offset = 0;
+
+  for (; offset + 64 <= size; offset += 64) {
+    __m512i bytes = _mm512_loadu_si512((const void*)(data + offset));
+    uint64_t found = _mm512_cmpeq_epi8_mask(bytes, repeat) |
+      _mm512_cmpeq_epi8_mask(bytes, escape);
+    if (found) {
+      return offset + __builtin_ctzll(found);
+    }
+  }
+  return offset + literalLengthScalar(data + offset, size - offset,
+                                      repeatSymbol, escapeSymbol);
+}
+
+/* flipBitsSse2()
+ *
+ * Split 16 bytes at a time into bit planes. movemask collects the top
+ * bit of every byte, and adding the bytes to themselves brings the next
+ * bit up to the top.
+ */
+__attribute__((target("sse2")))
+static void flipBitsSse2(const unsigned char* input,
+                         size_t groupCount,
+                         unsigned char* output,
+                         size_t planeSize) {
+  size_t group = 0;
+
+  for (; group + 2 <= groupCount; group += 2) {
+    __m128i bytes = _mm_loadu_si128((const __m128i*)(input + group * 8));
+    unsigned plane;
+    for (plane = 0; plane < 8; plane++) {
+      unsigned bits = _mm_movemask_epi8(bytes);
+      output[plane * planeSize + group] = (unsigned char)bits;
+      output[plane * planeSize + group + 1] = (unsigned char)(bits >> 8);
+      bytes = _mm_add_epi8(bytes, bytes);
+    }
+  }
+  flipBitsGeneric(input + group * 8, groupCount - group, output + group,
+                  planeSize);
+}
+
+/* flipBitsAvx2()
+ *
+ * Split 32 bytes at a time into bit planes, as flipBitsSse2() does.
+ */
+__attribute__((target("avx2")))
+static void flipBitsAvx2(const unsigned char* input,
+                         size_t groupCount,
+                         unsigned char* output,
+                         size_t planeSize) {
+  size_t group = 0;
+
+  for (; group + 4 <= groupCount; group += 4) {
+    __m256i bytes = _mm256_loadu_si256((const __m256i*)(input + group * 8));
+    unsigned plane;
+    for (plane = 0; plane < 8; plane++) {
+      uint32_t bits = _mm256_movemask_epi8(bytes);
+      memcpy(output + plane * planeSize + group, &bits, 4);
+      bytes = _mm256_add_epi8(bytes, bytes);
+    }
+  }
+  flipBitsGeneric(input + group * 8, groupCount - group, output + group,
+                  planeSize);
+}
+
+/* flipBitsAvx512()
+ *
+ * Split 64 bytes at a time into bit planes, as flipBitsSse2() does.
+ */
+__attribute__((target("avx512f,avx512bw")))
+static void flipBitsAvx512(const unsigned char* input,
+                           size_t groupCount,
+                           unsigned char* output,
+                           size_t planeSize) {
+  size_t group = 0;
+
+  for (; group + 8 <= groupCount; group += 8) {
+    __m512i bytes = _mm512_loadu_si512((const void*)(input + group * 8));
+    unsigned plane;
+    for (plane = 0; plane < 8; plane++) {
+      uint64_t bits = _mm512_movepi8_mask(bytes);
+      memcpy(output + plane * planeSize + group, &bits, 8);
+      bytes = _mm512_add_epi8(bytes, bytes);
+    }
+  }
+  flipBitsGeneric(input + group * 8, groupCount - group, output + group,
+                  planeSize);
+}
+
+/* flipBitsBmi2()
+ *
+ * Split each group into bit planes with pext, which gathers the bits
+ * of one plane from a 64 bit word in one instruction.
+ */
+__attribute__((target("bmi2")))
+static void flipBitsBmi2(const unsigned char* input,
+                         size_t groupCount,
+                         unsigned char* output,
+                         size_t planeSize) {
+  size_t group;
+  for (group = 0; group < groupCount; group++) {
+    uint64_t word;
+    unsigned plane;
+    memcpy(&word, input + group * 8, 8);
+    for (plane = 0; plane < 8; plane++) {
+      output[plane * planeSize + group] =
+        (unsigned char)_pext_u64(word, 0x8080808080808080ULL >> plane);
+    }
+  }
+}
+
+/* unflipBitsBmi2()
+ *
+ * Put each group back together with pdep, which spreads the bits of
+ * one plane out to their bytes in one instruction.
+ */
+__attribute__((target("bmi2")))
+static void unflipBitsBmi2(const unsigned char* input,
+                           size_t planeSize,
+                           size_t groupCount,
+                           unsigned char* output) {
+  size_t group;
+  for (group = 0; group < groupCount; group++) {
+    uint64_t word = 0;
+    unsigned plane;
+    for (plane = 0; plane < 8; plane++) {
+      word |= _pdep_u64(input[plane * planeSize + group],
+                        0x8080808080808080ULL >> plane);
+    }
+    memcpy(output + group * 8, &word, 8);
+  }
+}
+
+/* unflipBitsAvx2()
+ *
+ * Put 32 bytes at a time back together. Each plane's 4 bytes are
+ * spread so that every output byte holds the plane byte with its bit,
+ * which is tested and moved to the plane's bit position.
+ */
+__attribute__((target("avx2")))
+static void unflipBitsAvx2(const unsigned char* input,
+                           size_t planeSize,
+                           size_t groupCount,
+                           unsigned char* output) {
+  const __m256i spread = _mm256_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0,
+                                          1, 1, 1, 1, 1, 1, 1, 1,
+                                          2, 2, 2, 2, 2, 2, 2, 2,
+                                          3, 3, 3, 3, 3, 3, 3, 3);
+  const __m256i bitMasks = _mm256_set1_epi64x(0x8040201008040201LL);
+  size_t group = 0;
+
+  for (; group + 4 <= groupCount; group += 4) {
+    __m256i bytes = _mm256_setzero_si256();
+    unsigned plane;
+    for (plane = 0; plane < 8; plane++) {
+      uint32_t planeBits;
+      __m256i bits;
+      memcpy(&planeBits, input + plane * planeSize + group, 4);
+      bits = _mm256_shuffle_epi8(_mm256_set1_epi32((int)planeBits), spread);
+      bits = _mm256_cmpeq_epi8(_mm256_and_si256(bits, bitMasks), bitMasks);
+      bytes = _mm256_or_si256(bytes,
+                              _mm256_and_si256(bits,
+                                               _mm256_set1_epi8(
+                                                 (char)(0x80 >> plane))));
+    }
+    _mm256_storeu_si256((__m256i*)(output + group * 8), bytes);
+  }
+  unflipBitsGeneric(input + group, planeSize, groupCount - group,
+                    output + group * 8);
+}
+
+/* packCodesBmi2()
+ *
+ * packCodesGeneric() for processors with BMI2, whose shifts by a
+ * variable count and bzhi avoid the flag dependencies of the old ones.
+ */
+__attribute__((target("bmi2")))
+static unsigned long packCodesBmi2(const unsigned char* input,
+                                   size_t size,
+                                   const unsigned long* patterns,
+                                   const unsigned char* lengths,
+                                   unsigned char* output,
+                                   unsigned bitOffset) {
+  uint64_t bits = _bzhi_u64(output[0], bitOffset);
+  unsigned bitCount = bitOffset;
+  size_t byteIndex = 0;
+  size_t offset;
+
+  for (offset = 0; offset < size; offset++) {
+    unsigned char symbol = input[offset];
+    uint64_t pattern = patterns[symbol];
+    unsigned length = lengths[symbol];
+
+    if (length > 56) {
+      bits |= _bzhi_u64(pattern, 32) << bitCount;
+      bitCount += 32;
+      pattern >>= 32;
+      length -= 32;
+      while (bitCount >= 8) {
+        output[byteIndex++] = (unsigned char)bits;
+        bits >>= 8;
+        bitCount -= 8;
+      }
+    }
+    bits |= pattern << bitCount;
+    bitCount += length;
+    /* Store 4 bytes at once when there are that many */
+    if (bitCount >= 32) {
+      uint32_t word = (uint32_t)bits;
+      memcpy(output + byteIndex, &word, 4);
+      byteIndex += 4;
+      bits >>= 32;
+      bitCount -= 32;
+    }
+    while (bitCount >= 8) {
+      output[byteIndex++] = (unsigned char)bits;
+      bits >>= 8;
+      bitCount -= 8;
+    }
+  }
+  if (bitCount) {
+    output[byteIndex] = (unsigned char)bits;
+  }
+  return byteIndex * 8 + bitCount - bitOffset;
+}
+
+/* shuffleBytesSse2()
+ *
+ * Byte shuffle 16 elements at a time. The width vectors holding them
+ * are split into their even and odd bytes, evens first, once for each
+ * bit of the width, which leaves byte b of the 16 elements in vector b.
+ */
+__attribute__((target("sse2")))
+static void shuffleBytesSse2(const unsigned char* input, size_t count,
+                             size_t width, unsigned char* output) {
+  __m128i vectors[16];
+  __m128i split[16];
+  __m128i low = _mm_set1_epi16(0x00ff);
+  size_t element = 0;
+  size_t vector;
+  size_t round;
+
+  for (; element + 16 <= count; element += 16) {
+    for (vector = 0; vector < width; vector++) {
+      vectors[vector] = _mm_loadu_si128((const __m128i*)
+                                        (input + element * width +
+                                         vector * 16));
+    }
+    for (round = 1; round < width; round *= 2) {
+      for (vector = 0; vector < width / 2; vector++) {
+        __m128i first = vectors[2 * vector];
+        __m128i second = vectors[2 * vector + 1];
+        split[vector] = _mm_packus_epi16(_mm_and_si128(first, low),
+                                         _mm_and_si128(second, low));
+        split[width / 2 + vector] =
+          _mm_packus_epi16(_mm_srli_epi16(first, 8),
+                           _mm_srli_epi16(second, 8));
+      }
+      memcpy(vectors, split, width * sizeof(__m128i));
+    }
+    for (vector = 0; vector < width; vector++) {
+      _mm_storeu_si128((__m128i*)(output + vector * count + element),
+                       vectors[vector]);
+    }
+  }
+  for (; element < count; element++) {
+    for (vector = 0; vector < width; vector++) {
+      output[vector * count + element] = input[element * width + vector];
+    }
+  }
+}
+
+/* unshuffleBytesSse2()
+ *
+ * The reverse of shuffleBytesSse2(), interleaving the first and second
+ * halves of the vectors once for each bit of the width.
+ */
+__attribute__((target("sse2")))
+static void unshuffleBytesSse2(const unsigned char* input, size_t count,
+                               size_t width, unsigned char* output) {
+  __m128i vectors[16];
+  __m128i joined[16];
+  size_t element = 0;
+  size_t vector;
+  size_t round;
+
+  for (; element + 16 <= count; element += 16) {
+    for (vector = 0; vector < width; vector++) {
+      vectors[vector] = _mm_loadu_si128((const __m128i*)
+                                        (input + vector * count + element));
+    }
+    for (round = 1; round < width; round *= 2) {
+      for (vector = 0; vector < width / 2; vector++) {
+        __m128i evens = vectors[vector];
+        __m128i odds = vectors[width / 2 + vector];
+        joined[2 * vector] = _mm_unpacklo_epi8(evens, odds);
+        joined[2 * vector + 1] = _mm_unpackhi_epi8(evens, odds);
+      }
+      memcpy(vectors, joined, width * sizeof(__m128i));
+    }
+    for (vector = 0; vector < width; vector++) {
+      _mm_storeu_si128((__m128i*)(output + element * width + vector * 16),
+                       vectors[vector]);
+    }
+  }
+  for (; element < count; element++) {
+    for (vector = 0; vector < width; vector++) {
+      output[element * width + vector] = input[vector * count + element];
+    }
+  }
+}
+
+/* deltaSse2()
+ *
+ * Subtract 16 bytes at a time.
+ */
+__attribute__((target("sse2")))
+static void deltaSse2(const unsigned char* input, size_t size,
+                      size_t width, int exclusiveOr,
+                      unsigned char* output) {
+  size_t offset = width;
+
+  if (size <= width) {
+    deltaScalar(input, size, width, exclusiveOr, output);
+    return;
+  }
+  memcpy(output, input, width);
+  for (; offset + 16 <= size; offset += 16) {
+    __m128i bytes = _mm_loadu_si128((const __m128i*)(input + offset));
+    __m128i earlier =
+      _mm_loadu_si128((const __m128i*)(input + offset - width));
+    _mm_storeu_si128((__m128i*)(output + offset),
+                     exclusiveOr ? _mm_xor_si128(bytes, earlier) :
+                     _mm_sub_epi8(bytes, earlier));
+  }
+  for (; offset < size; offset++) {
+    output[offset] = exclusiveOr ? input[offset] ^ input[offset - width] :
+      (unsigned char)(input[offset] - input[offset - width]);
+  }
+}
+
+/* deltaAvx2()
+ *
+ * Subtract 32 bytes at a time.
+ */
+__attribute__((target("avx2")))
+static void deltaAvx2(const unsigned char* input, size_t size,
+                      size_t width, int exclusiveOr,
+                      unsigned char* output) {
+  size_t offset = width;
+
+  if (size <= width) {
+    deltaScalar(input, size, width, exclusiveOr, output);
+    return;
+  }
+  memcpy(output, input, width);
+  for (; offset + 32 <= size; offset += 32) {
+    __m256i bytes = _mm256_loadu_si256((const __m256i*)(input + offset));
+    __m256i earlier =
+      _mm256_loadu_si256((const __m256i*)(input + offset - width));
+    _mm256_storeu_si256((__m256i*)(output + offset),
+                        exclusiveOr ? _mm256_xor_si256(bytes, earlier) :
+                        _mm256_sub_epi8(bytes, earlier));
+  }
+  for (; offset < size; offset++) {
+    output[offset] = exclusiveOr ? input[offset] ^ input[offset - width] :
+      (unsigned char)(input[offset] - input[offset - width]);
+  }
+}
+
+/* undeltaSse2()
+ *
+ * Add up 16 bytes at a time. Within a vector each byte has the bytes a
+ * multiple of width before it added with shifted copies, width, then
+ * twice that and so on, and then the last width bytes of the vector
+ * before, repeated across the vector, are added to all of them.
+ */
+__attribute__((target("sse2")))
+static void undeltaSse2(const unsigned char* input, size_t size,
+                        size_t width, int exclusiveOr,
+                        unsigned char* output) {
+  size_t offset = 16;
+
+  if (size < 32) {
+    undeltaScalar(input, size, width, exclusiveOr, output);
+    return;
+  }
+  undeltaScalar(input, 16, width, exclusiveOr, output);
+  for (; offset + 16 <= size; offset += 16) {
+    __m128i bytes = _mm_loadu_si128((const __m128i*)(input + offset));
+    __m128i before = _mm_loadu_si128((const __m128i*)(output + offset - 16));
+    switch (width) {
+    case 2:
+      bytes = exclusiveOr ?
+        _mm_xor_si128(bytes, _mm_slli_si128(bytes, 2)) :
+        _mm_add_epi8(bytes, _mm_slli_si128(bytes, 2));
+      /* Fall through */
+    case 4:
+      bytes = exclusiveOr ?
+        _mm_xor_si128(bytes, _mm_slli_si128(bytes, 4)) :
+        _mm_add_epi8(bytes, _mm_slli_si128(bytes, 4));
+      /* Fall through */
+    case 8:
+      bytes = exclusiveOr ?
+        _mm_xor_si128(bytes, _mm_slli_si128(bytes, 8)) :
+        _mm_add_epi8(bytes, _mm_slli_si128(bytes, 8));
+      break;
+    default:
+      break;
+    }
+    switch (width) {
+    case 2:
+      before = _mm_shuffle_epi32(_mm_shufflehi_epi16(before, 0xff), 0xff);
+      break;
+    case 4:
+      before = _mm_shuffle_epi32(before, 0xff);
+      break;
+    case 8:
+      before = _mm_unpackhi_epi64(before, before);
+      break;
+    default:
+      break;
+    }
+    _mm_storeu_si128((__m128i*)(output + offset),
+                     exclusiveOr ? _mm_xor_si128(bytes, before) :
+                     _mm_add_epi8(bytes, before));
+  }
+  for (; offset < size; offset++) {
+    output[offset] = exclusiveOr ? input[offset] ^ output[offset - width] :
+      (unsigned char)(input[offset] + output[offset - width]);
+  }
+}
+
+#endif
+
+static const KernelVariant countBytesVariants[] = {
+  { "generic", 0, (KernelFunction)countBytesGeneric },
+  { "scalar", 0, (KernelFunction)countBytesScalar }
+};
+
+static const KernelVariant runLengthVariants[] = {
+#ifdef X86_KERNELS
+  { "avx512", FEATURE_AVX512, (KernelFunction)runLengthAvx512 },
+  { "avx2", FEATURE_AVX2, (KernelFunction)runLengthAvx2 },
+  { "sse2", FEATURE_SSE2, (KernelFunction)runLengthSse2 },
+#endif
+  { "scalar", 0, (KernelFunction)runLengthScalar }
+};
+
+static const KernelVariant literalLengthVariants[] = {
+#ifdef X86_KERNELS
+  { "avx512", FEATURE_AVX512, (KernelFunction)literalLengthAvx512 },
+  { "avx2", FEATURE_AVX2, (KernelFunction)literalLengthAvx2 },
+  { "sse2", FEATURE_SSE2, (KernelFunction)literalLengthSse2 },
+#endif
+  { "scalar", 0, (KernelFunction)literalLengthScalar }
+};
+
+static const KernelVariant periodLengthVariants[] = {
+#ifdef X86_KERNELS
+  { "avx2", FEATURE_AVX2, (KernelFunction)periodLengthAvx2 },
+  { "sse2", FEATURE_SSE2, (KernelFunction)periodLengthSse2 },
+#endif
+  { "generic", 0, (KernelFunction)periodLengthGeneric },
+  { "scalar", 0, (KernelFunction)periodLengthScalar }
+};
+
+static const KernelVariant flipBitsVariants[] = {
+#ifdef X86_KERNELS
+  { "avx512", FEATURE_AVX512, (KernelFunction)flipBitsAvx512 },
+  { "avx2", FEATURE_AVX2, (KernelFunction)flipBitsAvx2 },
+  { "sse2", FEATURE_SSE2, (KernelFunction)flipBitsSse2 },
+  { "bmi2", FEATURE_BMI2, (KernelFunction)flipBitsBmi2 },
+#endif
+  { "generic", 0, (KernelFunction)flipBitsGeneric },
+  { "scalar", 0, (KernelFunction)flipBitsScalar }
+};
+
+/* The AVX2 version is slower than even the generic one on every benchmark
+ * corpus (67-120 against 106-113 MB/s, with 218-322 MB/s for pdep), so it
+ * is only used where pdep is microcoded */
+static const KernelVariant unflipBitsVariants[] = {
+#ifdef X86_KERNELS
+  { "bmi2", FEATURE_FAST_PDEP, (KernelFunction)unflipBitsBmi2 },
+  { "avx2", FEATURE_AVX2, (KernelFunction)unflipBitsAvx2 },
+#endif
+  { "generic", 0, (KernelFunction)unflipBitsGeneric },
+  { "scalar", 0, (KernelFunction)unflipBitsScalar }
+};
+
+static const KernelVariant shuffleBytesVariants[] = {
+#ifdef X86_KERNELS
+  { "sse2", FEATURE_SSE2, (KernelFunction)shuffleBytesSse2 },
+#endif
+  { "scalar", 0, (KernelFunction)shuffleBytesScalar }
+};
+
+static const KernelVariant unshuffleBytesVariants[] = {
+#ifdef X86_KERNELS
+  { "sse2", FEATURE_SSE2, (KernelFunction)unshuffleBytesSse2 },
+#endif
+  { "scalar", 0, (KernelFunction)unshuffleBytesScalar }
+};
+
+static const KernelVariant deltaVariants[] = {
+#ifdef X86_KERNELS
+  { "avx2", FEATURE_AVX2, (KernelFunction)deltaAvx2 },
+  { "sse2", FEATURE_SSE2, (KernelFunction)deltaSse2 },
+#endif
+  { "scalar", 0, (KernelFunction)deltaScalar }
+};
+
+static const KernelVariant undeltaVariants[] = {
+#ifdef X86_KERNELS
+  { "sse2", FEATURE_SSE2, (KernelFunction)undeltaSse2 },
+#endif
+  { "scalar", 0, (KernelFunction)undeltaScalar }
+};
+
+/* The BMI2 version loses to the generic one by 1-8% on every benchmark
+ * corpus, so it is only there to be asked for */
+static const KernelVariant packCodesVariants[] = {
+  { "generic", 0, (KernelFunction)packCodesGeneric },
+#ifdef X86_KERNELS
+  { "bmi2", FEATURE_BMI2, (KernelFunction)packCodesBmi2 },
+#endif
+  { "scalar", 0, (KernelFunction)packCodesScalar }
+};
+
+static const KernelVariant crc32cVariants[] = {
+#ifdef X86_KERNELS
+  { "sse4.2", FEATURE_SSE42, (KernelFunction)crc32cHardware },
+#endif
+  { "scalar", 0, (KernelFunction)crc32cSoftware }
+};
+
+#define VARIANTS(variants) variants, sizeof(variants) / sizeof(KernelVariant)
+
+/* In the same order as the members of Kernels */
+enum {
+  KERNEL_COUNT_BYTES,
+  KERNEL_RUN_LENGTH,
+  KERNEL_LITERAL_LENGTH,
+  KERNEL_PERIOD_LENGTH,
+  KERNEL_FLIP_BITS,
+  KERNEL_UNFLIP_BITS,
+  KERNEL_SHUFFLE_BYTES,
+  KERNEL_UNSHUFFLE_BYTES,
+  KERNEL_DELTA,
+  KERNEL_UNDELTA,
+  KERNEL_PACK_CODES,
+  KERNEL_CRC32C,
+  KERNEL_COUNT
+};
+
+static const KernelDescription kernelDescriptions[KERNEL_COUNT] = {
+  { "histogram", VARIANTS(countBytesVariants) },
+  { "run-length", VARIANTS(runLengthVariants) },
+  { "literal-length", VARIANTS(literalLengthVariants) },
+  { "period-length", VARIANTS(periodLengthVariants) },
+  { "flip", VARIANTS(flipBitsVariants) },
+  { "unflip", VARIANTS(unflipBitsVariants) },
+  { "shuffle", VARIANTS(shuffleBytesVariants) },
+  { "unshuffle", VARIANTS(unshuffleBytesVariants) },
+  { "delta", VARIANTS(deltaVariants) },
+  { "undelta", VARIANTS(undeltaVariants) },
+  { "pack-codes", VARIANTS(packCodesVariants) },
+  { "crc32c", VARIANTS(crc32cVariants) }
+};
+
+static pthread_once_t kernelsOnce = PTHREAD_ONCE_INIT;
+static unsigned processorFeatures = 0;
+static const KernelVariant* chosenVariants[KERNEL_COUNT];
+static Kernels kernels;
+
+/* detectFeatures()
+ *
+ * Return value:
+ * The FEATURE_ flags of the processor running the program
+ */
+static unsigned detectFeatures(void) {
+  unsigned features = 0;
+#ifdef X86_KERNELS
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse2")) {
+    features |= FEATURE_SSE2;
+  }
+  if (__builtin_cpu_supports("sse4.2")) {
+    features |= FEATURE_SSE42;
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    features |= FEATURE_AVX2;
+  }
+  if (__builtin_cpu_supports("avx512f") &&
+      __builtin_cpu_supports("avx512bw")) {
+    features |= FEATURE_AVX512;
+  }
+  if (__builtin_cpu_supports("bmi2")) {
+    features |= FEATURE_BMI2;
+    /* AMD processors before Zen 3 take hundreds of cycles over them */
+    if (!__builtin_cpu_is("amd") || __builtin_cpu_is("amdfam19h")) {
+      features |= FEATURE_FAST_PDEP;
+    }
+  }
+#endif
+  return features;
+}
+
+/* isSupported()
+ *
+ * Parameters:
+ * variant - a version of a kernel
+ *
+ * Return value:
+ * True if the processor can run it
+ */
+static Boolean isSupported(const KernelVariant* variant) {
+  return ((variant->features & processorFeatures) == variant->features) ?
+    True : False;
+}
+
+/* Size of the data the versions are checked on */
+#define CHECK_SIZE (70000)
+
+/* Longest Huffman pattern, as the patterns are held in an unsigned long */
+#define CHECK_PATTERN_LENGTH (64)
+
+/* checkRandom()
+ *
+ * A simple pseudo random number generator, so that the check data is
+ * the same every time.
+ *
+ * Parameters:
+ * state - the generator's state
+ *
+ * Return value:
+ * The next number
+ */
+static unsigned long checkRandom(unsigned long* state) {
+  *state = (*state * 6364136223846793005ULL + 1442695040888963407ULL) &
+    0xffffffffffffffffULL;
+  return *state >> 33;
+}
+
+/* makeCheckData()
+ *
+ * Fill a buffer with runs of all lengths, repeated patterns of 2, 4 and
+ * 8 bytes, the run length encoding symbols and single bytes, for the
+ * versions to be checked on.
+ *
+ * Parameters:
+ * data - buffer to fill
+ * size - size of the buffer
+ */
+static void makeCheckData(unsigned char* data, size_t size) {
+  unsigned long state = 1;
+  size_t offset = 0;
+
+  while (offset < size) {
+    unsigned long choice = checkRandom(&state);
+    size_t length = 1;
+    unsigned char byte = (unsigned char)(choice >> 8);
+
+    switch (choice % 5) {
+    case 0:
+      length = checkRandom(&state) % 300;
+      break;
+    case 1:
+      byte = (choice & 16) ? REPEAT_SYMBOL : ESCAPE_SYMBOL;
+      break;
+    case 2: {
+      size_t period = (size_t)2 << (choice % 3);
+      length = checkRandom(&state) % 300;
+      if (offset >= period) {
+        for (; length && (offset < size); length--, offset++) {
+          data[offset] = data[offset - period];
+        }
+      }
+      break;
+    }
+    default:
+      break;
+    }
+    while (length-- && (offset < size)) {
+      data[offset++] = byte;
+    }
+  }
+}
+
+/* Size of the data the versions are timed on by --kernels */
+#define TIMING_SIZE (4096)
+
+/* Number of times each version is timed, the quickest being counted */
+#define TIMING_ROUNDS (25)
+
+/* Shortest run the run length version is timed on, as the encoder
+ * measures shorter runs itself
+ */
+#define TIMING_RUN_LENGTH (16)
+
+/* What the versions are timed on */
+typedef struct {
+  unsigned char data[TIMING_SIZE];
+  /* Runs of TIMING_RUN_LENGTH bytes or more */
+  unsigned char runs[TIMING_SIZE];
+  /* Room for the Huffman patterns of TIMING_SIZE bytes */
+  unsigned char output[2 * TIMING_SIZE + 64];
+  unsigned long patterns[256];
+  unsigned char lengths[256];
+} TimingData;
+
+/* makeTimingData()
+ *
+ * Fill in the data the versions are timed on: the check data, long
+ * runs, and Huffman patterns of 1 to 16 bits.
+ *
+ * Parameters:
+ * timing - filled in
+ */
+static void makeTimingData(TimingData* timing) {
+  unsigned long state = 1;
+  size_t offset = 0;
+  unsigned symbol;
+
+  makeCheckData(timing->data, TIMING_SIZE);
+  while (offset < TIMING_SIZE) {
+    size_t length = TIMING_RUN_LENGTH + checkRandom(&state) % 256;
+    unsigned char byte = (unsigned char)checkRandom(&state);
+    while (length-- && (offset < TIMING_SIZE)) {
+      timing->runs[offset++] = byte;
+    }
+  }
+  for (symbol = 0; symbol < 256; symbol++) {
+    timing->lengths[symbol] = 1 + checkRandom(&state) % 16;
+    timing->patterns[symbol] = checkRandom(&state) &
+      ((1UL << timing->lengths[symbol]) - 1);
+  }
+}
+
+/* runTimedCall()
+ *
+ * Use a version of a kernel once on the timing data, the way the
+ * programs use it: run-length on runs long enough to be handed to it,
+ * literal-length and period-length from one symbol or pattern to the
+ * next, and the others on the whole buffer.
+ *
+ * Parameters:
+ * kernel - number of the kernel
+ * function - the version
+ * timing - data to use
+ */
+static void runTimedCall(size_t kernel, KernelFunction function,
+                         TimingData* timing) {
+  const unsigned char* data = timing->data;
+  size_t offset;
+
+  switch (kernel) {
+  case KERNEL_COUNT_BYTES: {
+    unsigned long counts[256];
+    memset(counts, 0, sizeof(counts));
+    ((CountBytesFunction)function)(data, TIMING_SIZE, counts);
+    break;
+  }
+  case KERNEL_RUN_LENGTH:
+    for (offset = 0; offset < TIMING_SIZE;) {
+      offset += ((RunLengthFunction)function)(timing->runs + offset,
+                                              TIMING_SIZE - offset);
+    }
+    break;
+  case KERNEL_LITERAL_LENGTH:
+    for (offset = 0; offset < TIMING_SIZE;) {
+      offset += 1 +
+        ((LiteralLengthFunction)function)(data + offset,
+                                          TIMING_SIZE - offset,
+                                          REPEAT_SYMBOL, ESCAPE_SYMBOL);
+    }
+    break;
+  case KERNEL_PERIOD_LENGTH:
+    for (offset = 0; offset < TIMING_SIZE;) {
+      offset += ((PeriodLengthFunction)function)(data + offset,
+                                                 TIMING_SIZE - offset, 2);
+    }
+    break;
+  case KERNEL_FLIP_BITS:
+    ((FlipBitsFunction)function)(data, TIMING_SIZE / 8, timing->output,
+                                 TIMING_SIZE / 8);
+    break;
+  case KERNEL_UNFLIP_BITS:
+    ((UnflipBitsFunction)function)(data, TIMING_SIZE / 8, TIMING_SIZE / 8,
+                                   timing->output);
+    break;
+  case KERNEL_SHUFFLE_BYTES:
+    ((ShuffleBytesFunction)function)(data, TIMING_SIZE / 4, 4,
+                                     timing->output);
+    break;
+  case KERNEL_UNSHUFFLE_BYTES:
+    ((UnshuffleBytesFunction)function)(data, TIMING_SIZE / 4, 4,
+                                       timing->output);
+    break;
+  case KERNEL_DELTA:
+    ((DeltaFunction)function)(data, TIMING_SIZE, 4, 0, timing->output);
+    break;
+  case KERNEL_UNDELTA:
+    ((UndeltaFunction)function)(data, TIMING_SIZE, 4, 0, timing->output);
+    break;
+  case KERNEL_PACK_CODES:
+    ((PackCodesFunction)function)(data, TIMING_SIZE, timing->patterns,
+                                  timing->lengths, timing->output, 0);
+    break;
+  case KERNEL_CRC32C:
+    ((Crc32cFunction)function)(0xffffffffU, data, TIMING_SIZE);
+    break;
+  }
+}
+
+/* timeVariant()
+ *
+ * Parameters:
+ * kernel - number of the kernel
+ * variant - the version
+ * timing - data to time it on
+ *
+ * Return value:
+ * Quickest time of TIMING_ROUNDS uses, in nanoseconds
+ */
+static double timeVariant(size_t kernel, const KernelVariant* variant,
+                          TimingData* timing) {
+  double quickest = 0;
+  unsigned round;
+
+  for (round = 0; round < TIMING_ROUNDS; round++) {
+    struct timespec started;
+    struct timespec finished;
+    double taken;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    runTimedCall(kernel, variant->function, timing);
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    taken = (finished.tv_sec - started.tv_sec) * 1e9 +
+      (finished.tv_nsec - started.tv_nsec);
+    if ((round == 0) || (taken < quickest)) {
+      quickest = taken;
+    }
+  }
+  return quickest;
+}
+
+/* chooseVariant()
+ *
+ * Choose the version of a kernel to use, which is the one named by its
+ * environment variable if that is set, or else the first one in its
+ * table that the processor can run.
+ *
+ * Parameters:
+ * description - the kernel
+ *
+ * Return value:
+ * The version
+ */
+static const KernelVariant* chooseVariant(const KernelDescription*
+                                          description) {
+  char variableName[64];
+  const char* wanted = NULL;
+  char* letter = NULL;
+  size_t index;
+
+  snprintf(variableName, sizeof(variableName), "%s%s",
+           KERNEL_ENVIRONMENT_PREFIX, description->name);
+  for (letter = variableName; *letter; letter++) {
+    if (*letter == '-') {
+      *letter = '_';
+    }
+    else if ((*letter >= 'a') && (*letter <= 'z')) {
+      *letter += 'A' - 'a';
+    }
+  }
+
+  wanted = getenv(variableName);
+  for (index = 0; index < description->variantCount; index++) {
+    const KernelVariant* variant = &description->variants[index];
+    if (wanted == NULL) {
+      if (isSupported(variant)) {
+        return variant;
+      }
+    }
+    else if (!strcmp(wanted, variant->name)) {
+      if (!isSupported(variant)) {
+        error(False, "%s=%s but this processor can't run it",
+              variableName, wanted);
+      }
+      return variant;
+    }
+  }
+  error(False, "%s=%s isn't a version of the %s kernel", variableName,
+        wanted ? wanted : "", description->name);
+  return NULL;
+}
+
+/* initialiseKernels()
+ *
+ * Find out what the processor has and choose the kernels. Run once.
+ */
+static void initialiseKernels(void) {
+  size_t index;
+
+  processorFeatures = detectFeatures();
+  for (index = 0; index < KERNEL_COUNT; index++) {
+    chosenVariants[index] = chooseVariant(&kernelDescriptions[index]);
+  }
+
+  kernels.countBytes =
+    (CountBytesFunction)chosenVariants[KERNEL_COUNT_BYTES]->function;
+  kernels.runLength =
+    (RunLengthFunction)chosenVariants[KERNEL_RUN_LENGTH]->function;
+  kernels.literalLength =
+    (LiteralLengthFunction)chosenVariants[KERNEL_LITERAL_LENGTH]->function;
+  kernels.periodLength =
+    (PeriodLengthFunction)chosenVariants[KERNEL_PERIOD_LENGTH]->function;
+  kernels.flipBits =
+    (FlipBitsFunction)chosenVariants[KERNEL_FLIP_BITS]->function;
+  kernels.unflipBits =
+    (UnflipBitsFunction)chosenVariants[KERNEL_UNFLIP_BITS]->function;
+  kernels.shuffleBytes =
+    (ShuffleBytesFunction)chosenVariants[KERNEL_SHUFFLE_BYTES]->function;
+  kernels.unshuffleBytes =
+    (UnshuffleBytesFunction)chosenVariants[KERNEL_UNSHUFFLE_BYTES]->function;
+  kernels.delta = (DeltaFunction)chosenVariants[KERNEL_DELTA]->function;
+  kernels.undelta = (UndeltaFunction)chosenVariants[KERNEL_UNDELTA]->function;
+  kernels.packCodes =
+    (PackCodesFunction)chosenVariants[KERNEL_PACK_CODES]->function;
+  kernels.crc32c = (Crc32cFunction)chosenVariants[KERNEL_CRC32C]->function;
+}
+
+/* getKernels()
+ *
+ * Return value:
+ * The version of each kernel to use, chosen the first time this is
+ * called
+ */
+const Kernels* getKernels(void) {
+  pthread_once(&kernelsOnce, initialiseKernels);
+  return &kernels;
+}
+
+/* checkFailed()
+ *
+ * Report a version which doesn't agree with the scalar one and stop.
+ *
+ * Parameters:
+ * kernel - number of the kernel
+ * variant - the version
+ * size - size of data it differs on
+ */
+static void checkFailed(size_t kernel, const KernelVariant* variant,
+                        size_t size) {
+  error(False, "The %s version of the %s kernel differs from the scalar "
+        "version on %lu bytes", variant->name,
+        kernelDescriptions[kernel].name, (unsigned long)size);
+}
+
+/* checkVariant()
+ *
+ * Check a version of a kernel against the scalar version, on data of
+ * many sizes and alignments, stopping with an error if they differ.
+ *
+ * Parameters:
+ * kernel - number of the kernel
+ * variant - the version
+ * data - check data
+ * first - buffer for the scalar version's results
+ * second - buffer for the other version's results
+ */
+static void checkVariant(size_t kernel, const KernelVariant* variant,
+                         const unsigned char* data,
+                         unsigned char* first, unsigned char* second) {
+  const KernelDescription* description = &kernelDescriptions[kernel];
+  KernelFunction scalar =
+    description->variants[description->variantCount - 1].function;
+  static const size_t sizes[] = {
+    0, 1, 2, 7, 8, 9, 15, 16, 17, 31, 32, 33, 63, 64, 65, 127, 128, 129,
+    255, 256, 257, 1000, 4096, CHECK_SIZE - 8
+  };
+  size_t sizeIndex;
+
+  for (sizeIndex = 0; sizeIndex < sizeof(sizes) / sizeof(size_t);
+       sizeIndex++) {
+    size_t size = sizes[sizeIndex];
+    size_t start;
+    for (start = 0; start < 8; start++) {
+      const unsigned char* input = data + start;
+      switch (kernel) {
+      case KERNEL_COUNT_BYTES: {
+        unsigned long firstCounts[256];
+        unsigned long secondCounts[256];
+        memset(firstCounts, 0, sizeof(firstCounts));
+        memset(secondCounts, 0, sizeof(secondCounts));
+        ((CountBytesFunction)scalar)(input, size, firstCounts);
+        ((CountBytesFunction)variant->function)(input, size, secondCounts);
+        if (memcmp(firstCounts, secondCounts, sizeof(firstCounts))) {
+          checkFailed(kernel, variant, size);
+        }
+        break;
+      }
+      case KERNEL_RUN_LENGTH: {
+        size_t offset;
+        /* From the start of every run, and part way into some */
+        for (offset = 0; offset < size; offset += 1 + offset % 37) {
+          if (((RunLengthFunction)scalar)(input + offset, size - offset) !=
+              ((RunLengthFunction)variant->function)(input + offset,
+                                                    size - offset)) {
+            checkFailed(kernel, variant, size - offset);
+          }
+        }
+        if (((RunLengthFunction)scalar)(input, size) !=
+            ((RunLengthFunction)variant->function)(input, size)) {
+          checkFailed(kernel, variant, size);
+        }
+        break;
+      }
+      case KERNEL_LITERAL_LENGTH: {
+        size_t offset;
+        /* The fixed symbols, and a pair as chosen for version 2 */
+        for (offset = 0; offset <= size; offset += 1 + offset % 37) {
+          if ((((LiteralLengthFunction)scalar)(input + offset,
+                                               size - offset,
+                                               REPEAT_SYMBOL,
+                                               ESCAPE_SYMBOL) !=
+               ((LiteralLengthFunction)variant->function)(input + offset,
+                                                         size - offset,
+                                                         REPEAT_SYMBOL,
+                                                         ESCAPE_SYMBOL)) ||
+              (((LiteralLengthFunction)scalar)(input + offset,
+                                               size - offset,
+                                               input[0], 0xff) !=
+               ((LiteralLengthFunction)variant->function)(input + offset,
+                                                         size - offset,
+                                                         input[0], 0xff))) {
+            checkFailed(kernel, variant, size - offset);
+          }
+        }
+        break;
+      }
+      case KERNEL_PERIOD_LENGTH: {
+        size_t offset;
+        size_t period;
+        for (offset = 0; offset <= size; offset += 1 + offset % 37) {
+          for (period = 1; period <= 16; period++) {
+            if (((PeriodLengthFunction)scalar)(input + offset,
+                                               size - offset, period) !=
+                ((PeriodLengthFunction)variant->function)(input + offset,
+                                                         size - offset,
+                                                         period)) {
+              checkFailed(kernel, variant, size - offset);
+            }
+          }
+        }
+        break;
+      }
+      case KERNEL_FLIP_BITS: {
+        size_t groupCount = size / 8;
+        /* Planes further apart than they need to be, to check that
+         * nothing is written between them
+         */
+        size_t planeSize = groupCount + start;
+        memset(first, 0x5a, CHECK_SIZE + 64);
+        memset(second, 0x5a, CHECK_SIZE + 64);
+        ((FlipBitsFunction)scalar)(input, groupCount, first, planeSize);
+        ((FlipBitsFunction)variant->function)(input, groupCount, second,
+                                              planeSize);
+        if (memcmp(first, second, CHECK_SIZE + 64)) {
+          checkFailed(kernel, variant, size);
+        }
+        break;
+      }
+      case KERNEL_UNFLIP_BITS: {
+        size_t groupCount = size / 8 / (start + 1);
+        size_t planeSize = groupCount * (start + 1);
+        memset(first, 0x5a, CHECK_SIZE + 64);
+        memset(second, 0x5a, CHECK_SIZE + 64);
+        ((UnflipBitsFunction)scalar)(input, planeSize, groupCount, first);
+        ((UnflipBitsFunction)variant->function)(input, planeSize,
+                                                groupCount, second);
+        if (memcmp(first, second, CHECK_SIZE + 64)) {
+          checkFailed(kernel, variant, size);
+        }
+        break;
+      }
+      case KERNEL_SHUFFLE_BYTES:
+      case KERNEL_UNSHUFFLE_BYTES: {
+        size_t width;
+        for (width = 2; width <= 16; width *= 2) {
+          memset(first, 0x5a, CHECK_SIZE + 64);
+          memset(second, 0x5a, CHECK_SIZE + 64);
+          if (kernel == KERNEL_SHUFFLE_BYTES) {
+            ((ShuffleBytesFunction)scalar)(input, size / width, width, first);
+            ((ShuffleBytesFunction)variant->function)(input, size / width,
+                                                      width, second);
+          } else {
+            ((UnshuffleBytesFunction)scalar)(input, size / width, width,
+                                             first);
+            ((UnshuffleBytesFunction)variant->function)(input, size / width,
+                                                        width, second);
+          }
+          if (memcmp(first, second, CHECK_SIZE + 64)) {
+            checkFailed(kernel, variant, size);
+          }
+        }
+        break;
+      }
+      case KERNEL_DELTA:
+      case KERNEL_UNDELTA: {
+        size_t width;
+        int exclusiveOr;
+        for (width = 2; width <= 16; width *= 2) {
+          for (exclusiveOr = 0; exclusiveOr <= 1; exclusiveOr++) {
+            memset(first, 0x5a, CHECK_SIZE + 64);
+            memset(second, 0x5a, CHECK_SIZE + 64);
+            if (kernel == KERNEL_DELTA) {
+              ((DeltaFunction)scalar)(input, size, width, exclusiveOr, first);
+              ((DeltaFunction)variant->function)(input, size, width,
+                                                 exclusiveOr, second);
+            } else {
+              ((UndeltaFunction)scalar)(input, size, width, exclusiveOr,
+                                        first);
+              ((UndeltaFunction)variant->function)(input, size, width,
+                                                   exclusiveOr, second);
+            }
+            if (memcmp(first, second, CHECK_SIZE + 64)) {
+              checkFailed(kernel, variant, size);
+            }
+          }
+        }
+        break;
+      }
+      case KERNEL_PACK_CODES: {
+        unsigned long patterns[256];
+        unsigned char lengths[256];
+        unsigned long state = size + start;
+        unsigned long firstBits;
+        unsigned symbol;
+        for (symbol = 0; symbol < 256; symbol++) {
+          lengths[symbol] = 1 + (checkRandom(&state) % CHECK_PATTERN_LENGTH);
+          patterns[symbol] = ((unsigned long)checkRandom(&state) << 32) ^
+            checkRandom(&state);
+          if (lengths[symbol] < 64) {
+            patterns[symbol] &= (1UL << lengths[symbol]) - 1;
+          }
+        }
+        /* Keep the check inside the buffers, at up to 8 bytes a symbol */
+        if (size * 8 > CHECK_SIZE) {
+          size = CHECK_SIZE / 8;
+        }
+        memset(first, 0xa5, CHECK_SIZE + 64);
+        memset(second, 0xa5, CHECK_SIZE + 64);
+        firstBits = ((PackCodesFunction)scalar)(input, size, patterns,
+                                                lengths, first, start);
+        if ((firstBits !=
+             ((PackCodesFunction)variant->function)(input, size, patterns,
+                                                    lengths, second,
+                                                    start)) ||
+            memcmp(first, second, (start + firstBits + 7) / 8)) {
+          checkFailed(kernel, variant, size);
+        }
+        break;
+      }
+      case KERNEL_CRC32C:
+        if (((Crc32cFunction)scalar)(0xffffffffU, input, size) !=
+            ((Crc32cFunction)variant->function)(0xffffffffU, input, size)) {
+          checkFailed(kernel, variant, size);
+        }
+        break;
+      }
+    }
+  }
+}
+
+/* checkKernels()
+ *
+ * Check every version of every kernel the processor has against the
+ * scalar version, stopping with an error if any differ, and list them
+ * with the one in use starred. Then time each of them, so that the
+ * order of preference can be checked on this processor. The timings
+ * are only reported; they don't change the versions used.
+ */
+void checkKernels(void) {
+  unsigned char* data = malloc(CHECK_SIZE);
+  unsigned char* first = malloc(CHECK_SIZE + 64);
+  unsigned char* second = malloc(CHECK_SIZE + 64);
+  TimingData* timing = malloc(sizeof(TimingData));
+  size_t kernel;
+
+  if ((data == NULL) || (first == NULL) || (second == NULL) ||
+      (timing == NULL)) {
+    error(True, "malloc failed checking the kernels");
+  }
+  makeCheckData(data, CHECK_SIZE);
+  getKernels();
+
+  printf("Kernel versions on this processor, * is the one in use:\n");
+  for (kernel = 0; kernel < KERNEL_COUNT; kernel++) {
+    const KernelDescription* description = &kernelDescriptions[kernel];
+    size_t index;
+    printf("%-16s", description->name);
+    for (index = 0; index < description->variantCount; index++) {
+      const KernelVariant* variant = &description->variants[index];
+      if (!isSupported(variant)) {
+        continue;
+      }
+      if (index + 1 < description->variantCount) {
+        checkVariant(kernel, variant, data, first, second);
+      }
+      printf(" %s%s", variant->name,
+             (variant == chosenVariants[kernel]) ? "*" : "");
+    }
+    printf("\n");
+  }
+  printf("Every version agrees with the scalar version\n");
+
+  makeTimingData(timing);
+  printf("\nBest of %d times in microseconds on %d bytes:\n",
+         TIMING_ROUNDS, TIMING_SIZE);
+  for (kernel = 0; kernel < KERNEL_COUNT; kernel++) {
+    const KernelDescription* description = &kernelDescriptions[kernel];
+    size_t index;
+    printf("%-16s", description->name);
+    for (index = 0; index < description->variantCount; index++) {
+      const KernelVariant* variant = &description->variants[index];
+      if (isSupported(variant)) {
+        printf(" %s %.1f", variant->name,
+               timeVariant(kernel, variant, timing) / 1000);
+      }
+    }
+    printf("\n");
+  }
+
+  free(data);
+  free(first);
+  free(second);
+  free(timing);
+}
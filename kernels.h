@@ -0,0 +1,123 @@
+#ifndef KERNELS_H
+#define KERNELS_H
+
+/* Declarations for the inner loops which have versions for particular
+ * processors, and the choice between them, in kernels.c
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/* Prefix of the environment variables which choose a version by name,
+ * e.g. JLCOMPRESS_KERNEL_FLIP=scalar
+ */
+#define KERNEL_ENVIRONMENT_PREFIX "JLCOMPRESS_KERNEL_"
+
+/* Add the number of times each byte occurs in the data to counts */
+typedef void (*CountBytesFunction)(const unsigned char* data, size_t size,
+                                   unsigned long* counts);
+
+/* Number of bytes at the start of the data which are the same as the
+ * first one, or 0 if size is 0
+ */
+typedef size_t (*RunLengthFunction)(const unsigned char* data, size_t size);
+
+/* Number of bytes at the start of the data which are neither the run
+ * length repeat symbol nor the escape symbol given
+ */
+typedef size_t (*LiteralLengthFunction)(const unsigned char* data,
+                                        size_t size,
+                                        unsigned char repeatSymbol,
+                                        unsigned char escapeSymbol);
+
+/* Number of bytes at the start of the data which are the same as the
+ * byte period bytes before, counting the first period bytes, or size
+ * if that is less
+ */
+typedef size_t (*PeriodLengthFunction)(const unsigned char* data,
+                                       size_t size,
+                                       size_t period);
+
+/* Split groups of 8 bytes into bit planes. Byte n of plane 0 holds the
+ * most significant bits of input bytes 8n to 8n+7, the first in bit 0,
+ * plane 1 the next most significant bits and so on. Plane p starts at
+ * output + p * planeSize.
+ */
+typedef void (*FlipBitsFunction)(const unsigned char* input,
+                                 size_t groupCount,
+                                 unsigned char* output,
+                                 size_t planeSize);
+
+/* The reverse of FlipBitsFunction */
+typedef void (*UnflipBitsFunction)(const unsigned char* input,
+                                   size_t planeSize,
+                                   size_t groupCount,
+                                   unsigned char* output);
+
+/* Byte shuffle count elements of width bytes, so that byte b of every
+ * element is together in plane b, which starts at output + b * count
+ */
+typedef void (*ShuffleBytesFunction)(const unsigned char* input,
+                                     size_t count,
+                                     size_t width,
+                                     unsigned char* output);
+
+/* The reverse of ShuffleBytesFunction */
+typedef void (*UnshuffleBytesFunction)(const unsigned char* input,
+                                       size_t count,
+                                       size_t width,
+                                       unsigned char* output);
+
+/* Replace each byte after the first width bytes with its difference
+ * from the byte width before it, or with the two exclusive ored if
+ * exclusiveOr is set
+ */
+typedef void (*DeltaFunction)(const unsigned char* input,
+                              size_t size,
+                              size_t width,
+                              int exclusiveOr,
+                              unsigned char* output);
+
+/* The reverse of DeltaFunction */
+typedef void (*UndeltaFunction)(const unsigned char* input,
+                                size_t size,
+                                size_t width,
+                                int exclusiveOr,
+                                unsigned char* output);
+
+/* Write the Huffman patterns of the input bytes, bit reversed so that
+ * the first bit is bit 0, starting at bit bitOffset of output[0]. The
+ * bits below that in output[0] are kept and the last byte is padded
+ * with zeros. Returns the number of bits written.
+ */
+typedef unsigned long (*PackCodesFunction)(const unsigned char* input,
+                                           size_t size,
+                                           const unsigned long* patterns,
+                                           const unsigned char* lengths,
+                                           unsigned char* output,
+                                           unsigned bitOffset);
+
+/* Update a CRC32C, not inverted */
+typedef uint32_t (*Crc32cFunction)(uint32_t crc, const unsigned char* data,
+                                   size_t size);
+
+/* The version of each kernel in use */
+typedef struct {
+  CountBytesFunction countBytes;
+  RunLengthFunction runLength;
+  LiteralLengthFunction literalLength;
+  PeriodLengthFunction periodLength;
+  FlipBitsFunction flipBits;
+  UnflipBitsFunction unflipBits;
+  ShuffleBytesFunction shuffleBytes;
+  UnshuffleBytesFunction unshuffleBytes;
+  DeltaFunction delta;
+  UndeltaFunction undelta;
+  PackCodesFunction packCodes;
+  Crc32cFunction crc32c;
+} Kernels;
+
+const Kernels* getKernels(void);
+void checkKernels(void);
+
+#endif
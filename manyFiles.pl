@@ -0,0 +1,178 @@
+#!/usr/bin/env perl
+# This test makes a directory of many small files and compresses and
+# decompresses them in batch mode, once with blocking I/O and once with
+# io_uring (if the program was built with it and the kernel has it),
+# so that the files per second of the two can be compared. It also
+# times some of the files compressed the way they were before batch
+# mode, with one jlcompress process per file, for batch mode to be
+# compared with.
+
+use strict;
+use warnings;
+use Carp;
+use constant FILE_COUNT => 100000;
+use constant FILE_SIZE => 4096;
+# Number of files compressed one process per file. Fewer than all of
+# them, as this is so much slower.
+use constant SINGLE_FILE_COUNT => 10000;
+use constant DIRECTORY => "manyFiles";
+use Time::HiRes qw(time);
+
+# printAndUnderline
+# 
+# Print and underling message
+#
+sub printAndUnderline($) {
+    my $text = shift();
+    print "\n\n$text\n";
+
+    for (my $index = 0; $index < length($text); ++$index) {
+        print "=";
+    }
+    print "\n";
+}
+
+# Line
+#
+# Just print a line
+#
+sub line() {
+    print "\n--------------------------------------------------------\n";
+}
+
+# removeFiles
+#
+# Delete the files in the test directory with the specified suffix
+#
+sub removeFiles($) {
+    my $suffix = shift();
+    opendir(DIR, DIRECTORY) or croak($!);
+    foreach my $name (readdir(DIR)) {
+        if ($name =~ /\Q$suffix\E$/) {
+            unlink(DIRECTORY . "/$name") or croak($!);
+        }
+    }
+    closedir(DIR);
+}
+
+# moveFiles
+#
+# Move the files with the specified suffix from one directory to
+# another. There are too many of them to pass to mv.
+#
+sub moveFiles($$$) {
+    my $from = shift();
+    my $to = shift();
+    my $suffix = shift();
+    mkdir($to) or croak($!) unless -d $to;
+    opendir(DIR, $from) or croak($!);
+    foreach my $name (readdir(DIR)) {
+        if ($name =~ /\Q$suffix\E$/) {
+            rename("$from/$name", "$to/$name") or croak($!);
+        }
+    }
+    closedir(DIR);
+}
+
+# makeFiles
+#
+# Fill the test directory with FILE_COUNT files of FILE_SIZE bytes,
+# each one a different slice of the sample HTML page.
+#
+sub makeFiles() {
+    print "Making the files\n";
+    open(IN, "<Huffman_coding.html") or croak($!);
+    local $/;
+    my $page = <IN>;
+    close(IN);
+
+    mkdir(DIRECTORY) or croak($!) unless -d DIRECTORY;
+    for (my $fileNo = 0; $fileNo < FILE_COUNT; $fileNo++) {
+        my $start = ($fileNo * 37) % (length($page) - FILE_SIZE);
+        open(OUT, ">" . DIRECTORY . "/file$fileNo.html") or croak($!);
+        print OUT substr($page, $start, FILE_SIZE);
+        close(OUT) or croak($!);
+    }
+}
+
+# runBatch
+#
+# Run jlcompress in batch mode over the test directory, returning
+# the elapsed time
+#
+sub runBatch($) {
+    my $switches = shift();
+    my $command = "./jlcompress --batch $switches " . DIRECTORY;
+    print "$command\n";
+    my $startTime = time();
+    if (system($command) != 0) {
+        print("*** Error: $command failed\n");
+        exit(-1);
+    }
+    return time() - $startTime;
+}
+
+# runSingleFiles
+#
+# Compress the first SINGLE_FILE_COUNT files with a jlcompress process
+# for each, returning the files per second
+#
+sub runSingleFiles() {
+    print "./jlcompress on each of " . SINGLE_FILE_COUNT . " files\n";
+    my $startTime = time();
+    for (my $fileNo = 0; $fileNo < SINGLE_FILE_COUNT; $fileNo++) {
+        my $command = "./jlcompress " . DIRECTORY . "/file$fileNo.html";
+        if (system($command) != 0) {
+            print("*** Error: $command failed\n");
+            exit(-1);
+        }
+    }
+    my $elapsedTime = time() - $startTime;
+    removeFiles(".compressed");
+    return SINGLE_FILE_COUNT / $elapsedTime;
+}
+
+printAndUnderline("Test compressing and decompressing " . FILE_COUNT .
+                  " files of " . FILE_SIZE . " bytes");
+makeFiles();
+
+line();
+printAndUnderline("One process per file");
+my $singleFilesPerSecond = runSingleFiles();
+printf("Compressed at %.0f files/s\n", $singleFilesPerSecond);
+
+foreach my $switches ("--blocking-io", "--io-uring") {
+    line();
+    printAndUnderline("Batch mode with $switches");
+
+    my $elapsedTime = runBatch($switches);
+    printf("Compressed in %.1f seconds, %.0f files/s, %.1f times one process per file\n",
+           $elapsedTime, FILE_COUNT / $elapsedTime,
+           FILE_COUNT / $elapsedTime / $singleFilesPerSecond);
+
+    # Move the originals out of the way so that only the compressed
+    # files are decompressed
+    moveFiles(DIRECTORY, DIRECTORY . ".original", ".html");
+
+    $elapsedTime = runBatch($switches);
+    printf("Decompressed in %.1f seconds, %.0f files/s\n",
+           $elapsedTime, FILE_COUNT / $elapsedTime);
+
+    for (my $fileNo = 0; $fileNo < FILE_COUNT; $fileNo += 997) {
+        if (system("cmp -s " . DIRECTORY . ".original/file$fileNo.html " .
+                   DIRECTORY . "/file$fileNo.html.decompressed") != 0) {
+            print("*** Error: file$fileNo.html differs after compression/decompression\n");
+            exit(-1);
+        }
+    }
+
+    removeFiles(".compressed");
+    removeFiles(".decompressed");
+    moveFiles(DIRECTORY . ".original", DIRECTORY, ".html");
+    rmdir(DIRECTORY . ".original") or croak($!);
+}
+
+print "Deleting the files\n";
+system("rm -rf " . DIRECTORY) == 0 or croak("rm failed");
+
+print "\n\nAll tests passed\n\n";
@@ -0,0 +1,549 @@
+/* parallelHuffman.c
+ *
+ * Huffman decoding of one stream on several threads, for files written
+ * as a single stream, which have no index to say where any code but
+ * the first starts.
+ *
+ * The codes are split into pieces of equal numbers of bits, one for
+ * each thread, and every thread starts decoding at the start of its
+ * piece as if a code started there. Usually one doesn't, and the first
+ * few symbols decoded are wrong, but Huffman codes fall back into step
+ * with the real code boundaries within a few dozen bits, after which
+ * the thread is decoding exactly what a decoder started at the
+ * beginning would. Each thread carries on to the first code which
+ * starts at or after the end of its piece, and records where the first
+ * SYNC_WINDOW codes it decoded started.
+ *
+ * The pieces are then stitched together in order. The first piece
+ * started at a real code, so where it stopped is where the real codes
+ * of the second piece start. If that is one of the starts the second
+ * thread recorded, everything it decoded from there on is right, and
+ * where it stopped is right in turn. If not, the bits from there until
+ * the two are in step are decoded again, or the whole piece if they
+ * never get into step, so the output is always the same as decoding on
+ * one thread.
+ *
+ * Encoding is split the same way, but by input bytes, and needs no
+ * guessing. Each thread counts the bytes of its piece, and the counts
+ * are added up to build the one table used for the whole stream. Once
+ * the codes are known each thread adds up the lengths of the codes of
+ * its piece, and a running total of those gives the bit at which each
+ * piece's codes start. The threads then write their codes straight to
+ * their places in the output. A byte which holds the end of one piece
+ * and the start of the next is kept aside by both threads and the two
+ * halves put together afterwards, so the output is exactly what one
+ * thread writes.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "bufferPool.h"
+#include "dataBlocks.h"
+#include "kernels.h"
+#include "parallelHuffman.h"
+#include "statistics.h"
+#include "threadPool.h"
+
+/* Number of code starts recorded at the start of each piece */
+#define SYNC_WINDOW (4096)
+
+/* Pieces shorter than this aren't worth starting a thread for */
+#define MINIMUM_PIECE_BITS (256UL * 1024 * 8)
+#define MINIMUM_PIECE_SIZE (256UL * 1024)
+
+/* What one thread decoded */
+typedef struct {
+  unsigned long startBit;
+  unsigned long endBit;
+  /* Where the thread stopped, the first code start after endBit */
+  unsigned long finalBit;
+  unsigned char* address;
+  size_t capacity;
+  size_t count;
+  /* Where each of the first startCount symbols' codes started */
+  unsigned long starts[SYNC_WINDOW];
+  size_t startCount;
+} DecodePiece;
+
+/* Shared by the tasks decoding the pieces of one stream */
+typedef struct {
+  const unsigned char* address;
+  unsigned long totalBits;
+  const HuffmanNode* root;
+  /* Expected bytes of output for each bit, to size the buffers */
+  double bytesPerBit;
+  DecodePiece* pieces;
+} DecodeTasks;
+
+/* decodeSymbol()
+ *
+ * Decode one symbol by walking the tree.
+ *
+ * Parameters:
+ * address - the codes
+ * totalBits - number of bits of codes
+ * root - root of the tree
+ * bit - offset of the first bit of the code, moved on past it
+ * symbol - set to the symbol
+ *
+ * Return value:
+ * False if the bits ran out part way through the code
+ */
+static Boolean decodeSymbol(const unsigned char* address,
+                            unsigned long totalBits,
+                            const HuffmanNode* root,
+                            unsigned long* bit,
+                            unsigned char* symbol) {
+  const HuffmanNode* node = root;
+  unsigned long position = *bit;
+
+  while (node->left) {
+    if (position >= totalBits) {
+      return False;
+    }
+    node = getBit(position % 8, address[position / 8]) ?
+      node->right : node->left;
+    position++;
+  }
+  *symbol = node->symbol;
+  *bit = position;
+  return True;
+}
+
+/* decodeOnePiece()
+ *
+ * Decode from the start of a piece, as if a code started there, to the
+ * first code which starts after its end. Run by runTasks(), so pieces
+ * are decoded at the same time.
+ *
+ * Parameters:
+ * context - the DecodeTasks
+ * index - number of the piece
+ */
+static void decodeOnePiece(void* context, size_t index) {
+  DecodeTasks* tasks = context;
+  DecodePiece* piece = &tasks->pieces[index];
+  unsigned long bit = piece->startBit;
+  unsigned long start;
+  unsigned char symbol;
+
+  piece->address = allocateBuffer((size_t)((piece->endBit - piece->startBit) *
+                                           tasks->bytesPerBit) + 4096,
+                                  &piece->capacity);
+  piece->count = 0;
+  piece->startCount = 0;
+  while (bit < piece->endBit) {
+    start = bit;
+    if (!decodeSymbol(tasks->address, tasks->totalBits, tasks->root,
+                      &bit, &symbol)) {
+      break;
+    }
+    if (piece->startCount < SYNC_WINDOW) {
+      piece->starts[piece->startCount++] = start;
+    }
+    if (piece->count == piece->capacity) {
+      piece->address = resizeBuffer(piece->address, piece->capacity,
+                                    piece->capacity * 2, &piece->capacity);
+      countRealloc();
+    }
+    piece->address[piece->count++] = symbol;
+  }
+  piece->finalBit = bit;
+}
+
+/* canDecodeInParallel()
+ *
+ * Decide whether a stream is worth decoding on several threads.
+ *
+ * Parameters:
+ * huffmanNode - root of the tree
+ * bytesInFile - number of bytes the stream decodes to
+ *
+ * Return value:
+ * True if there are threads to spare and enough to decode
+ */
+Boolean canDecodeInParallel(const HuffmanNode* huffmanNode,
+                            unsigned long bytesInFile) {
+  return ((getThreadCount() > 1) && !isRunningTask() &&
+          (bytesInFile >= PARALLEL_HUFFMAN_MINIMUM_SIZE) &&
+          (huffmanNode->left != NULL)) ? True : False;
+}
+
+/* decodeInParallel()
+ *
+ * Decode the Huffman codes following the byte count on as many threads
+ * as setThreadCount() gave, as described above.
+ *
+ * Parameters:
+ * inputBlock - Descriptor of block to decode, positioned at the first
+ *              bit pattern
+ * huffmanNode - Root of the tree
+ * bytesInFile - number of bytes to decode
+ *
+ * Return value:
+ * Decoded block, the same as decoding on one thread gives
+ */
+BlockDescriptor* decodeInParallel(BlockDescriptor* inputBlock,
+                                  HuffmanNode* huffmanNode,
+                                  unsigned long bytesInFile) {
+  BlockDescriptor* outputBlock = makeMemoryBlock(bytesInFile ?
+                                                 bytesInFile : 1);
+  unsigned long firstBit = inputBlock->nextByteToRead * 8 +
+    inputBlock->nextBitToRead;
+  unsigned long bit = firstBit;
+  unsigned long codeBits = 0;
+  unsigned long syncBits = 0;
+  size_t pieceCount = getThreadCount();
+  size_t inStepCount = 0;
+  Boolean statistics;
+  DecodeTasks tasks;
+  size_t index;
+
+  tasks.address = inputBlock->address;
+  tasks.totalBits = inputBlock->usedSize * 8;
+  tasks.root = huffmanNode;
+  if (firstBit > tasks.totalBits) {
+    error(False, "Damaged input file - Huffman codes missing");
+  }
+  codeBits = tasks.totalBits - firstBit;
+  tasks.bytesPerBit = codeBits ? (double)bytesInFile / codeBits : 0;
+  if (pieceCount > codeBits / MINIMUM_PIECE_BITS) {
+    pieceCount = codeBits / MINIMUM_PIECE_BITS;
+  }
+  if (pieceCount == 0) {
+    pieceCount = 1;
+  }
+
+  tasks.pieces = malloc(pieceCount * sizeof(DecodePiece));
+  if (tasks.pieces == NULL) {
+    error(True, "malloc failed for %lu pieces", (unsigned long)pieceCount);
+  }
+  for (index = 0; index < pieceCount; index++) {
+    tasks.pieces[index].startBit = firstBit + codeBits / pieceCount * index;
+    tasks.pieces[index].endBit = (index + 1 == pieceCount) ? tasks.totalBits :
+      firstBit + codeBits / pieceCount * (index + 1);
+  }
+  runTasks(pieceCount, decodeOnePiece, &tasks);
+
+  /* bit is always the start of a real code from here on */
+  for (index = 0; index < pieceCount; index++) {
+    DecodePiece* piece = &tasks.pieces[index];
+    size_t next = 0;
+    Boolean inStep = False;
+
+    while (outputBlock->usedSize < bytesInFile) {
+      unsigned char symbol;
+      while ((next < piece->startCount) && (piece->starts[next] < bit)) {
+        next++;
+      }
+      if ((next < piece->startCount) && (piece->starts[next] == bit)) {
+        inStep = True;
+        break;
+      }
+      if (bit >= piece->endBit) {
+        break;
+      }
+      if (!decodeSymbol(tasks.address, tasks.totalBits, huffmanNode,
+                        &bit, &symbol)) {
+        error(False, "Damaged input file - Huffman codes end early");
+      }
+      outputBlock->address[outputBlock->usedSize++] = symbol;
+    }
+
+    if (inStep) {
+      size_t count = piece->count - next;
+      if (bit - piece->startBit > syncBits) {
+        syncBits = bit - piece->startBit;
+      }
+      inStepCount++;
+      if (count > bytesInFile - outputBlock->usedSize) {
+        count = bytesInFile - outputBlock->usedSize;
+      }
+      memcpy(outputBlock->address + outputBlock->usedSize,
+             piece->address + next, count);
+      countCopy(count);
+      outputBlock->usedSize += count;
+      bit = piece->finalBit;
+    }
+    releaseBuffer(piece->address, piece->capacity);
+  }
+  free(tasks.pieces);
+
+  if (outputBlock->usedSize < bytesInFile) {
+    error(False, "Damaged input file - Huffman codes end early");
+  }
+  outputBlock->nextFreeByte = outputBlock->usedSize;
+
+  statistics = enableStatistics(False);
+  if (statistics) {
+    printf("- Huffman decoding in %lu pieces - %lu fell into step, within %lu bits\n",
+           (unsigned long)pieceCount, (unsigned long)inStepCount, syncBits);
+  }
+  enableStatistics(statistics);
+  return outputBlock;
+}
+
+/* What one thread counted or encoded */
+typedef struct {
+  size_t startOffset;
+  size_t endOffset;
+  unsigned long counts[FREQUENCY_TABLE_SIZE];
+  unsigned long startBit;
+  unsigned long bitCount;
+  /* Partly filled bytes shared with the neighbouring pieces */
+  size_t headIndex;
+  size_t tailIndex;
+  unsigned char headByte;
+  unsigned char tailByte;
+  Boolean hasHead;
+  Boolean hasTail;
+} EncodePiece;
+
+/* Shared by the tasks counting or encoding the pieces of one block */
+typedef struct {
+  const unsigned char* input;
+  /* Each symbol's code with its bits in the order they are written */
+  unsigned long patterns[FREQUENCY_TABLE_SIZE];
+  unsigned char lengths[FREQUENCY_TABLE_SIZE];
+  unsigned char* output;
+  EncodePiece* pieces;
+} EncodeTasks;
+
+/* canEncodeInParallel()
+ *
+ * Decide whether a block is worth counting and encoding on several
+ * threads.
+ *
+ * Parameters:
+ * size - size of the block
+ *
+ * Return value:
+ * True if there are threads to spare and enough to encode
+ */
+Boolean canEncodeInParallel(size_t size) {
+  return ((getThreadCount() > 1) && !isRunningTask() &&
+          (size >= PARALLEL_HUFFMAN_MINIMUM_SIZE)) ? True : False;
+}
+
+/* makeEncodePieces()
+ *
+ * Split a block into a piece for each thread.
+ *
+ * Parameters:
+ * size - size of the block
+ * pieceCount - set to the number of pieces
+ *
+ * Return value:
+ * The pieces, to be freed with free()
+ */
+static EncodePiece* makeEncodePieces(size_t size, size_t* pieceCount) {
+  EncodePiece* pieces = NULL;
+  size_t index;
+
+  *pieceCount = getThreadCount();
+  if (*pieceCount > size / MINIMUM_PIECE_SIZE) {
+    *pieceCount = size / MINIMUM_PIECE_SIZE;
+  }
+  if (*pieceCount == 0) {
+    *pieceCount = 1;
+  }
+  pieces = calloc(*pieceCount, sizeof(EncodePiece));
+  if (pieces == NULL) {
+    error(True, "malloc failed for %lu pieces", (unsigned long)*pieceCount);
+  }
+  for (index = 0; index < *pieceCount; index++) {
+    pieces[index].startOffset = size / *pieceCount * index;
+    pieces[index].endOffset = (index + 1 == *pieceCount) ? size :
+      size / *pieceCount * (index + 1);
+  }
+  return pieces;
+}
+
+/* countOnePiece()
+ *
+ * Count how many times each byte occurs in one piece. Run by
+ * runTasks().
+ *
+ * Parameters:
+ * context - the EncodeTasks
+ * index - number of the piece
+ */
+static void countOnePiece(void* context, size_t index) {
+  EncodeTasks* tasks = context;
+  EncodePiece* piece = &tasks->pieces[index];
+
+  getKernels()->countBytes(tasks->input + piece->startOffset,
+                           piece->endOffset - piece->startOffset,
+                           piece->counts);
+}
+
+/* countInParallel()
+ *
+ * Add the number of times each byte occurs in a block to a frequency
+ * table, counting a piece of the block on each thread.
+ *
+ * Parameters:
+ * inputBlock - Descriptor of block to scan
+ * frequencyTable - Frequency table array to add to
+ */
+void countInParallel(BlockDescriptor* inputBlock,
+                     FrequencyTable frequencyTable) {
+  EncodeTasks tasks;
+  size_t pieceCount;
+  size_t index;
+  unsigned symbol;
+
+  tasks.input = inputBlock->address;
+  tasks.pieces = makeEncodePieces(inputBlock->usedSize, &pieceCount);
+  runTasks(pieceCount, countOnePiece, &tasks);
+  for (index = 0; index < pieceCount; index++) {
+    for (symbol = 0; symbol < FREQUENCY_TABLE_SIZE; symbol++) {
+      frequencyTable[symbol].frequency += tasks.pieces[index].counts[symbol];
+    }
+  }
+  free(tasks.pieces);
+}
+
+/* measureOnePiece()
+ *
+ * Add up the lengths of the codes of one piece. Run by runTasks().
+ *
+ * Parameters:
+ * context - the EncodeTasks
+ * index - number of the piece
+ */
+static void measureOnePiece(void* context, size_t index) {
+  EncodeTasks* tasks = context;
+  EncodePiece* piece = &tasks->pieces[index];
+  unsigned long bitCount = 0;
+  size_t offset;
+
+  for (offset = piece->startOffset; offset < piece->endOffset; offset++) {
+    unsigned char symbol = tasks->input[offset];
+    if (tasks->lengths[symbol] == 0) {
+      error(False, "Character %u has no Huffman code in the table", symbol);
+    }
+    bitCount += tasks->lengths[symbol];
+  }
+  piece->bitCount = bitCount;
+}
+
+/* encodeOnePiece()
+ *
+ * Write the codes of one piece at its place in the output, keeping
+ * back any partly filled byte at either end. Run by runTasks().
+ *
+ * Parameters:
+ * context - the EncodeTasks
+ * index - number of the piece
+ */
+static void encodeOnePiece(void* context, size_t index) {
+  EncodeTasks* tasks = context;
+  EncodePiece* piece = &tasks->pieces[index];
+  unsigned char* output = tasks->output;
+  size_t byteIndex = piece->startBit / 8;
+  unsigned long bits = 0;
+  unsigned bitCount = piece->startBit % 8;
+  Boolean partFilled = bitCount ? True : False;
+  size_t offset;
+
+  for (offset = piece->startOffset; offset < piece->endOffset; offset++) {
+    unsigned char symbol = tasks->input[offset];
+    bits |= tasks->patterns[symbol] << bitCount;
+    bitCount += tasks->lengths[symbol];
+    while (bitCount >= 8) {
+      if (partFilled) {
+        piece->headIndex = byteIndex;
+        piece->headByte = bits & 0xff;
+        piece->hasHead = True;
+        partFilled = False;
+      }
+      else {
+        output[byteIndex] = bits & 0xff;
+      }
+      byteIndex++;
+      bits >>= 8;
+      bitCount -= 8;
+    }
+  }
+  if (bitCount) {
+    piece->tailIndex = byteIndex;
+    piece->tailByte = bits & 0xff;
+    piece->hasTail = True;
+  }
+}
+
+/* isKeptByte()
+ *
+ * Parameters:
+ * byteIndex - offset of a byte in the output
+ * firstBit - bit the codes start at
+ *
+ * Return value:
+ * True if the byte already holds bits written before the codes
+ */
+static Boolean isKeptByte(size_t byteIndex, unsigned long firstBit) {
+  return ((byteIndex == firstBit / 8) && (firstBit % 8)) ? True : False;
+}
+
+/* encodeInParallel()
+ *
+ * Append the Huffman bit patterns of a block to the output block,
+ * encoding a piece of it on each thread as described above.
+ *
+ * Parameters:
+ * inputBlock - Descriptor of block to encode
+ * frequencyTable - Frequency table with bit patterns filled in
+ * outputBlock - Block to append to. It ends up exactly as if the
+ *               patterns had been written a bit at a time.
+ */
+void encodeInParallel(BlockDescriptor* inputBlock,
+                      FrequencyTable frequencyTable,
+                      BlockDescriptor* outputBlock) {
+  EncodeTasks tasks;
+  unsigned long bit = outputBlock->nextFreeByte * 8 + outputBlock->nextFreeBit;
+  unsigned long firstBit = bit;
+  size_t pieceCount;
+  size_t index;
+
+  makeReversedPatterns(frequencyTable, tasks.patterns, tasks.lengths);
+
+  tasks.input = inputBlock->address;
+  tasks.pieces = makeEncodePieces(inputBlock->usedSize, &pieceCount);
+  runTasks(pieceCount, measureOnePiece, &tasks);
+  for (index = 0; index < pieceCount; index++) {
+    tasks.pieces[index].startBit = bit;
+    bit += tasks.pieces[index].bitCount;
+  }
+
+  reserveBlockSpace(outputBlock, (bit + 7) / 8);
+  tasks.output = outputBlock->address;
+  runTasks(pieceCount, encodeOnePiece, &tasks);
+
+  /* Put the shared bytes together. The bits already in the first byte,
+   * if it was partly written, are kept.
+   */
+  for (index = 0; index < pieceCount; index++) {
+    EncodePiece* piece = &tasks.pieces[index];
+    if (piece->hasHead && !isKeptByte(piece->headIndex, firstBit)) {
+      tasks.output[piece->headIndex] = 0;
+    }
+    if (piece->hasTail && !isKeptByte(piece->tailIndex, firstBit)) {
+      tasks.output[piece->tailIndex] = 0;
+    }
+  }
+  for (index = 0; index < pieceCount; index++) {
+    EncodePiece* piece = &tasks.pieces[index];
+    if (piece->hasHead) {
+      tasks.output[piece->headIndex] |= piece->headByte;
+    }
+    if (piece->hasTail) {
+      tasks.output[piece->tailIndex] |= piece->tailByte;
+    }
+  }
+  free(tasks.pieces);
+
+  outputBlock->nextFreeByte = bit / 8;
+  outputBlock->nextFreeBit = bit % 8;
+  outputBlock->usedSize = (bit + 7) / 8;
+}
@@ -0,0 +1,29 @@
+#ifndef PARALLEL_HUFFMAN_H
+#define PARALLEL_HUFFMAN_H
+
+/* Declarations for Huffman coding one stream on several threads, in
+ * parallelHuffman.c
+ */
+
+#include "compression.h"
+#include "huffmanCompressor.h"
+
+/* Streams which decode to fewer bytes than this are left to one thread,
+ * both ways
+ */
+#define PARALLEL_HUFFMAN_MINIMUM_SIZE (1024 * 1024)
+
+Boolean canDecodeInParallel(const HuffmanNode* huffmanNode,
+                            unsigned long bytesInFile);
+BlockDescriptor* decodeInParallel(BlockDescriptor* inputBlock,
+                                  HuffmanNode* huffmanNode,
+                                  unsigned long bytesInFile);
+
+Boolean canEncodeInParallel(size_t size);
+void countInParallel(BlockDescriptor* inputBlock,
+                     FrequencyTable frequencyTable);
+void encodeInParallel(BlockDescriptor* inputBlock,
+                      FrequencyTable frequencyTable,
+                      BlockDescriptor* outputBlock);
+
+#endif
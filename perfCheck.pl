@@ -0,0 +1,300 @@
+#!/usr/bin/env perl
+# This checks for performance regressions. It runs jlbench on its
+# corpora several times, pinned to one CPU so that it isn't moved
+# about, takes the median throughput of each stage and how far the
+# runs spread around it, and compares the throughput and output size
+# of each stage with the checked in baseline, perfBaseline.json. It
+# fails if any stage's median has dropped by more than the noise in
+# the baseline's runs and its own could explain, or by more than the
+# speed tolerance if that is larger, or if any stage compresses worse
+# by more than the ratio tolerance.
+#
+# A busy machine can also be slower for the whole check, which shows
+# as every stage losing about the same. The median change over all the
+# stages is taken as that drift, if it is a loss, and each stage is
+# compared after allowing for it; the drift itself fails the check if
+# it is more than the drift tolerance, as a change which slows every
+# stage looks the same.
+#
+# perl perfCheck.pl [--update] [--runs n] [--cpu n]
+#                   [--speed-tolerance f] [--drift-tolerance f]
+#                   [--ratio-tolerance f] [--baseline file]
+#
+# --update writes the results to the baseline instead of checking
+# them. Timings depend on the machine, so the baseline should be made
+# on the machine which runs the check, and it should be made again
+# whenever a change makes a stage faster, so that the gain is kept.
+
+use strict;
+use warnings;
+use Carp;
+use Getopt::Long;
+use JSON::PP;
+
+my $baselineFilename = "perfBaseline.json";
+my $runs = 7;
+# CPU jlbench is pinned to, if taskset is there
+my $cpu = 0;
+# Fraction of the baseline speed a stage may always lose, however
+# steady its timings
+my $speedTolerance = 0.05;
+# Fraction of the baseline speed the stages may lose between them
+my $driftTolerance = 0.15;
+# Median change in speed over all the stages, if it is a loss
+my $drift = 0;
+# Fraction of the baseline output size a stage may gain
+my $ratioTolerance = 0.001;
+my $update = 0;
+
+# The corpora and sizes checked. Each run takes about 25 seconds.
+my $benchSwitches = "--sizes 256K --threads 1 --time 0.5";
+
+# readJson
+#
+# Read a JSON file written by jlbench
+#
+sub readJson($) {
+    my $filename = shift();
+    open(JSON, "<$filename") or croak("$filename: $!");
+    my $text = do { local $/; <JSON> };
+    close(JSON);
+    return decode_json($text);
+}
+
+# resultKey
+#
+# Key identifying a result, so that runs can be matched up
+#
+sub resultKey($) {
+    my $result = shift();
+    return join(" ", $result->{corpus}, $result->{size},
+                $result->{threads}, $result->{stage});
+}
+
+# speed
+#
+# Speed of a result: MB/s, or runs per second for stages such as
+# tree-build which don't have a size to divide by
+#
+sub speed($) {
+    my $result = shift();
+    return defined($result->{mb_per_s}) ? $result->{mb_per_s} :
+        1 / $result->{seconds_per_run};
+}
+
+# median
+#
+# Median of a list of numbers
+#
+sub median(@) {
+    my @sorted = sort { $a <=> $b } @_;
+    my $middle = int(@sorted / 2);
+    return (@sorted % 2) ? $sorted[$middle] :
+        ($sorted[$middle - 1] + $sorted[$middle]) / 2;
+}
+
+# pinCommand
+#
+# Start of the command line which runs a program on $cpu alone, or
+# nothing if it can't be done here
+#
+sub pinCommand() {
+    if (system("taskset -c $cpu true > /dev/null 2>&1") == 0) {
+        return "taskset -c $cpu ";
+    }
+    print "Can't pin jlbench to CPU $cpu with taskset, so timings will be noisier\n";
+    return "";
+}
+
+# runBenchmark
+#
+# Run jlbench the given number of times, and return a hash of results
+# by key. Each is the result of the run with the median throughput of
+# the stage, with speed_spread added: the median distance of the runs
+# from that, as a fraction of it.
+#
+sub runBenchmark($) {
+    my $runCount = shift();
+    my $pin = pinCommand();
+    my %runs;
+    for (my $run = 1; $run <= $runCount; ++$run) {
+        print "Benchmark run $run of $runCount\n";
+        system("${pin}./jlbench $benchSwitches --json perfcheck.json > /dev/null") == 0
+            or croak("jlbench failed");
+        foreach my $result (@{readJson("perfcheck.json")->{results}}) {
+            push(@{$runs{resultKey($result)}}, $result);
+        }
+    }
+    unlink("perfcheck.json");
+
+    my %medians;
+    foreach my $key (keys %runs) {
+        my @results = sort { speed($a) <=> speed($b) } @{$runs{$key}};
+        my $result = { %{$results[int(@results / 2)]} };
+        my $middle = speed($result);
+        $result->{speed_spread} = 0 + sprintf("%.4f",
+            median(map { abs(speed($_) - $middle) } @results) / $middle);
+        $medians{$key} = $result;
+    }
+    return \%medians;
+}
+
+# writeBaseline
+#
+# Write the results as the new baseline, in the same form as jlbench
+# writes them, one result per line so that changes show up in diffs
+#
+sub writeBaseline($) {
+    my $results = shift();
+    my $json = JSON::PP->new->canonical;
+    open(BASELINE, ">$baselineFilename") or croak("$baselineFilename: $!");
+    print BASELINE "{\"benchmark\":\"jlbench\",\"version\":1,\"switches\":\"$benchSwitches\",\"results\":[\n";
+    print BASELINE join(",\n", map { $json->encode($results->{$_}) }
+                        sort keys %$results);
+    print BASELINE "\n]}\n";
+    close(BASELINE) or croak($!);
+    print "Wrote ", scalar(keys %$results), " results to $baselineFilename\n";
+}
+
+# machineDrift
+#
+# Median fractional change in speed over all the stages measured, or 0
+# if they have got faster, which is left to each stage
+#
+sub machineDrift($$) {
+    my ($baseline, $current) = @_;
+    my @ratios = map { speed($current->{$_}) / speed($baseline->{$_}) }
+        grep { defined($current->{$_}) } keys %$baseline;
+    return 0 if !@ratios;
+    my $change = median(@ratios) - 1;
+    return ($change < 0) ? $change : 0;
+}
+
+# changes
+#
+# Fractional change in speed, after allowing for the drift, and in
+# output size of a result from its baseline
+#
+sub changes($$) {
+    my ($old, $new) = @_;
+    my $speedChange = speed($new) / (speed($old) * (1 + $drift)) - 1;
+    my $sizeChange = $old->{output_size} ?
+        ($new->{output_size} - $old->{output_size}) / $old->{output_size} : 0;
+    return ($speedChange, $sizeChange);
+}
+
+# allowedLoss
+#
+# Fraction of its baseline speed a stage may lose before it counts as
+# slower. The median distance of n runs from their median is about
+# 0.67 of their standard deviation, and the median of the runs has a
+# standard error of about 1.25 standard deviations over the square root
+# of n, so the difference of two medians is allowed three of its own
+# standard errors, or the speed tolerance if that is more.
+#
+sub allowedLoss($$) {
+    my ($old, $new) = @_;
+    my $spread = sqrt(($old->{speed_spread} || 0) ** 2 +
+                      ($new->{speed_spread} || 0) ** 2);
+    my $loss = 3 * 1.25 * 1.4826 * $spread / sqrt($runs);
+    return ($loss > $speedTolerance) ? $loss : $speedTolerance;
+}
+
+# compareResults
+#
+# Compare the results with the baseline, and return a reference to a
+# list of the regressions
+#
+sub compareResults($$) {
+    my ($baseline, $current) = @_;
+    my @failures;
+    if ($drift < -$driftTolerance) {
+        push(@failures, sprintf("every stage: median speed change %+.1f%%, -%.1f%% allowed",
+                                100 * $drift, 100 * $driftTolerance));
+    }
+    foreach my $key (sort keys %$baseline) {
+        my $old = $baseline->{$key};
+        my $new = $current->{$key};
+        if (!defined($new)) {
+            push(@failures, "$key: no longer measured");
+            next;
+        }
+
+        my ($speedChange, $sizeChange) = changes($old, $new);
+        my $allowed = allowedLoss($old, $new);
+        if ($speedChange < -$allowed) {
+            push(@failures, sprintf("%s: speed %.1f, was %.1f (%+.1f%%, -%.1f%% allowed)",
+                                    $key, speed($new), speed($old),
+                                    100 * $speedChange, 100 * $allowed));
+        }
+        if ($sizeChange > $ratioTolerance) {
+            push(@failures, sprintf("%s: output %d bytes, was %d bytes (%+.2f%%)",
+                                    $key, $new->{output_size}, $old->{output_size},
+                                    100 * $sizeChange));
+        }
+    }
+    return \@failures;
+}
+
+# printResults
+#
+# Print a table of the baseline and current figures
+#
+sub printResults($$) {
+    my ($baseline, $current) = @_;
+    print("\nSpeeds are medians in MB/s, or runs per second for tree-build\n");
+    if ($drift) {
+        printf("The stages are %.1f%% slower in the median, and the changes are after allowing for that\n",
+               -100 * $drift);
+    }
+    printf("\n%-32s %10s %10s %7s %7s %10s %10s %7s\n", "Corpus size threads stage",
+           "Base speed", "Speed", "Change", "Allowed", "Base size", "Size", "Change");
+    foreach my $key (sort keys %$baseline) {
+        my $old = $baseline->{$key};
+        my $new = $current->{$key};
+        next if !defined($new);
+
+        my ($speedChange, $sizeChange) = changes($old, $new);
+        my $allowed = allowedLoss($old, $new);
+        my $mark = "";
+        if ($speedChange < -$allowed) {
+            $mark = " <-- slower";
+        }
+        if ($sizeChange > $ratioTolerance) {
+            $mark .= " <-- bigger";
+        }
+        printf("%-32s %10.1f %10.1f %+6.1f%% %6.1f%% %10d %10d %+6.2f%%%s\n", $key,
+               speed($old), speed($new), 100 * $speedChange, -100 * $allowed,
+               $old->{output_size}, $new->{output_size}, 100 * $sizeChange, $mark);
+    }
+}
+
+GetOptions("update" => \$update,
+           "runs=i" => \$runs,
+           "cpu=i" => \$cpu,
+           "speed-tolerance=f" => \$speedTolerance,
+           "drift-tolerance=f" => \$driftTolerance,
+           "ratio-tolerance=f" => \$ratioTolerance,
+           "baseline=s" => \$baselineFilename)
+    or croak("Usage: perfCheck.pl [--update] [--runs n] [--cpu n] [--speed-tolerance f] [--drift-tolerance f] [--ratio-tolerance f] [--baseline file]");
+
+my $current = runBenchmark($runs);
+
+if ($update) {
+    writeBaseline($current);
+    exit(0);
+}
+
+my %baseline = map { resultKey($_) => $_ } @{readJson($baselineFilename)->{results}};
+$drift = machineDrift(\%baseline, $current);
+my $failures = compareResults(\%baseline, $current);
+printResults(\%baseline, $current);
+
+if (@$failures) {
+    print "\n*** Performance regressions against $baselineFilename:\n";
+    print map { "  $_\n" } @$failures;
+    print "\nIf a slowdown is intended, run \"make perfbaseline\" and commit $baselineFilename\n";
+    print "with the change which causes it, saying why\n";
+    exit(1);
+}
+print "\n\nNo performance regressions\n\n";
@@ -0,0 +1,217 @@
+/* perfCounters.c
+ *
+ * Hardware performance counters for the statistics report, read with
+ * perf_event_open() so that each stage's cycles, instructions, branch
+ * misses and cache and TLB misses can be recorded along with its time.
+ *
+ * Each thread opens its own counters the first time it reads them,
+ * counting only that thread in user space, which perf_event_paranoid
+ * allows by default. They are closed when the thread exits. Each
+ * counter is opened on its own, so a processor or virtual machine
+ * which lacks some of them still gives the rest, and if the kernel has
+ * no performance counters at all, or on a system other than Linux,
+ * every counter reads as COUNTER_UNAVAILABLE. When there are more
+ * counters than the hardware can count at once the kernel takes turns,
+ * and the values are scaled up by the fraction of the time each was
+ * counting.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+#include "compression.h"
+#include "perfCounters.h"
+
+/* True if the counters are to be read */
+static Boolean perfCountersEnabled = False;
+
+/* Counters of the calling thread, or NULL if not yet opened */
+static pthread_key_t counterKey;
+static pthread_once_t counterKeyOnce = PTHREAD_ONCE_INIT;
+
+static const char* counterNames[PERF_COUNTER_COUNT] = {
+  "cycles",
+  "instructions",
+  "branch_misses",
+  "l1d_misses",
+  "llc_misses",
+  "dtlb_misses"
+};
+
+/* getPerfCounterName()
+ *
+ * Parameters:
+ * counter - counter number
+ *
+ * Return value:
+ * Name of the counter in the statistics report
+ */
+const char* getPerfCounterName(PerfCounter counter) {
+  return counterNames[counter];
+}
+
+/* enablePerfCounters()
+ *
+ * Read the counters for every stage from now on.
+ */
+void enablePerfCounters(void) {
+  perfCountersEnabled = True;
+}
+
+/* arePerfCountersEnabled()
+ *
+ * Return value:
+ * True if the counters are being read
+ */
+Boolean arePerfCountersEnabled(void) {
+  return perfCountersEnabled;
+}
+
+#ifdef __linux__
+
+/* closeCounters()
+ *
+ * Close a thread's counters when it exits.
+ *
+ * Parameters:
+ * argument - the thread's array of counter file descriptors
+ */
+static void closeCounters(void* argument) {
+  int* fileDescriptors = argument;
+  unsigned counter;
+  for (counter = 0; counter < PERF_COUNTER_COUNT; counter++) {
+    if (fileDescriptors[counter] >= 0) {
+      close(fileDescriptors[counter]);
+    }
+  }
+  free(fileDescriptors);
+}
+
+/* makeCounterKey()
+ *
+ * Make the key for each thread's counters, once.
+ */
+static void makeCounterKey(void) {
+  if (pthread_key_create(&counterKey, closeCounters)) {
+    error(True, "Unable to make key for performance counters");
+  }
+}
+
+/* cacheMissEvent()
+ *
+ * Parameters:
+ * cache - PERF_COUNT_HW_CACHE_ value of the cache
+ *
+ * Return value:
+ * Configuration of the event counting read misses in the cache
+ */
+static unsigned long long cacheMissEvent(unsigned cache) {
+  return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+    ((unsigned long long)PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+}
+
+/* openCounter()
+ *
+ * Open one counter for the calling thread, in user space only.
+ *
+ * Parameters:
+ * type - PERF_TYPE_ value
+ * config - event within the type
+ *
+ * Return value:
+ * File descriptor of the counter, or -1 if it isn't available
+ */
+static int openCounter(unsigned type, unsigned long long config) {
+  struct perf_event_attr attributes;
+
+  memset(&attributes, 0, sizeof(attributes));
+  attributes.size = sizeof(attributes);
+  attributes.type = type;
+  attributes.config = config;
+  attributes.exclude_kernel = 1;
+  attributes.exclude_hv = 1;
+  attributes.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+    PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+  return syscall(SYS_perf_event_open, &attributes, 0, -1, -1, 0);
+}
+
+/* openCounters()
+ *
+ * Open all the counters for the calling thread.
+ *
+ * Return value:
+ * The file descriptors, -1 for those which aren't available
+ */
+static int* openCounters(void) {
+  int* fileDescriptors = malloc(PERF_COUNTER_COUNT * sizeof(int));
+  if (fileDescriptors == NULL) {
+    error(True, "malloc failed for performance counters");
+  }
+  fileDescriptors[COUNTER_CYCLES] =
+    openCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+  fileDescriptors[COUNTER_INSTRUCTIONS] =
+    openCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+  fileDescriptors[COUNTER_BRANCH_MISSES] =
+    openCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+  fileDescriptors[COUNTER_L1D_MISSES] =
+    openCounter(PERF_TYPE_HW_CACHE, cacheMissEvent(PERF_COUNT_HW_CACHE_L1D));
+  fileDescriptors[COUNTER_LLC_MISSES] =
+    openCounter(PERF_TYPE_HW_CACHE, cacheMissEvent(PERF_COUNT_HW_CACHE_LL));
+  fileDescriptors[COUNTER_DTLB_MISSES] =
+    openCounter(PERF_TYPE_HW_CACHE, cacheMissEvent(PERF_COUNT_HW_CACHE_DTLB));
+
+  if (pthread_setspecific(counterKey, fileDescriptors)) {
+    error(True, "Unable to keep performance counters");
+  }
+  return fileDescriptors;
+}
+
+/* readPerfCounters()
+ *
+ * Read the calling thread's counters, opening them if this is the
+ * thread's first read.
+ *
+ * Parameters:
+ * values - filled in with the counts so far, or COUNTER_UNAVAILABLE
+ */
+void readPerfCounters(unsigned long long values[PERF_COUNTER_COUNT]) {
+  int* fileDescriptors = NULL;
+  unsigned counter;
+
+  pthread_once(&counterKeyOnce, makeCounterKey);
+  fileDescriptors = pthread_getspecific(counterKey);
+  if (fileDescriptors == NULL) {
+    fileDescriptors = openCounters();
+  }
+
+  for (counter = 0; counter < PERF_COUNTER_COUNT; counter++) {
+    /* Count, time enabled and time running */
+    unsigned long long reading[3];
+
+    values[counter] = COUNTER_UNAVAILABLE;
+    if ((fileDescriptors[counter] >= 0) &&
+        (read(fileDescriptors[counter], reading, sizeof(reading)) ==
+         sizeof(reading)) && reading[2]) {
+      values[counter] = (reading[2] < reading[1]) ?
+        (unsigned long long)((double)reading[0] * reading[1] / reading[2]) :
+        reading[0];
+    }
+  }
+}
+
+#else
+
+void readPerfCounters(unsigned long long values[PERF_COUNTER_COUNT]) {
+  unsigned counter;
+  for (counter = 0; counter < PERF_COUNTER_COUNT; counter++) {
+    values[counter] = COUNTER_UNAVAILABLE;
+  }
+}
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+/* Declarations for the hardware performance counters recorded in the
+ * statistics report, in perfCounters.c
+ */
+
+#include "boolean.h"
+
+typedef enum { COUNTER_CYCLES = 0,
+               COUNTER_INSTRUCTIONS,
+               COUNTER_BRANCH_MISSES,
+               COUNTER_L1D_MISSES,
+               COUNTER_LLC_MISSES,
+               COUNTER_DTLB_MISSES,
+               PERF_COUNTER_COUNT } PerfCounter;
+
+/* Returned for a counter the system can't provide */
+#define COUNTER_UNAVAILABLE (~0ULL)
+
+void enablePerfCounters(void);
+Boolean arePerfCountersEnabled(void);
+void readPerfCounters(unsigned long long values[PERF_COUNTER_COUNT]);
+const char* getPerfCounterName(PerfCounter counter);
+
+#endif
@@ -0,0 +1,586 @@
+/* pipeline.c
+ *
+ * Compression of a stream, such as standard input, with each stage on
+ * its own thread. The data is read in blocks, and the blocks flow from
+ * a reader thread through a thread for each selected stage (filters
+ * and flip, run length encoding, Huffman) to a writer thread, so while
+ * one block is being Huffman encoded the next is being run length
+ * encoded and the one after that read. The throughput is then set by the slowest stage
+ * rather than by the sum of the stages, even for data which can't be
+ * mapped or split up in advance.
+ *
+ * The threads are linked by bounded single producer, single consumer
+ * queues. Each queue has one thread putting items in and one taking
+ * them out, so it needs no lock: the producer alone moves the head and
+ * the consumer alone moves the tail. A thread which finds its queue
+ * empty or full spins briefly, then sleeps on a futex until the other
+ * side moves, rather than burning a processor the other stages could
+ * use. The items, each with an input buffer of a block, are recycled
+ * from the writer back to the reader through another queue, so the
+ * number of blocks in flight, and the memory used, is fixed. The output
+ * of each stage comes from the buffer pool, and the stage frees its
+ * input back to it, so the buffers of large blocks pass back and forth
+ * between the stages rather than being mapped afresh for each block.
+ *
+ * The output is in the blocked format (see blockedFile.c), with the
+ * seek index written once the writer has seen every block, and it is
+ * byte for byte what compressBlocked() would make from the same data
+ * and block size. As the stages used by each block are only known at
+ * the end, the header records the stages selected, and is corrected
+ * afterwards if the output can be seeked.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+#include "blockedFile.h"
+#include "bufferPool.h"
+#include "crc32c.h"
+#include "dataBlocks.h"
+#include "dictionary.h"
+#include "header.h"
+#include "pipeline.h"
+#include "statistics.h"
+#include "trace.h"
+
+/* Slots in each queue, which must be a power of two. It is also the
+ * number of blocks in flight.
+ */
+#define QUEUE_SLOTS (8)
+/* Times to look at a queue before sleeping */
+#define SPIN_LIMIT (1000)
+/* Reader, flip, run length encoding, Huffman and writer */
+#define MAXIMUM_PIPELINE_THREADS (5)
+
+/* A block on its way through the pipeline */
+typedef struct {
+  /* Input buffer of the block size, kept for the life of the pipeline */
+  unsigned char* data;
+  size_t size;
+  size_t index;
+  unsigned long checksum;
+  /* Output of the latest stage */
+  BlockDescriptor* block;
+  /* True for the item following the last block */
+  Boolean last;
+} PipelineItem;
+
+/* Queue between two threads. head and tail count the items ever put in
+ * and taken out, and are on separate cache lines so that the two
+ * threads don't keep taking the line from each other.
+ */
+typedef struct {
+  PipelineItem* slots[QUEUE_SLOTS];
+  unsigned head __attribute__((aligned(64)));
+  int consumerWaiting;
+  unsigned tail __attribute__((aligned(64)));
+  int producerWaiting;
+} SpscQueue;
+
+typedef struct PipelineStruct Pipeline;
+
+/* One thread of the pipeline */
+typedef struct {
+  Pipeline* pipeline;
+  /* Name for the trace, a string constant */
+  const char* name;
+  /* The one stage this thread runs */
+  struct CompressionFlags stageFlags;
+  SpscQueue* input;
+  SpscQueue* output;
+  pthread_t thread;
+} PipelineThread;
+
+struct PipelineStruct {
+  const struct CompressionFlags* flags;
+  unsigned long blockSize;
+  int inputFileDescriptor;
+  const char* inputFilename;
+  FILE* outputFile;
+  const char* outputFilename;
+  /* queues[0] leads from the reader, and each stage's output is the
+   * next one. freeQueue takes items back from the writer to the reader.
+   */
+  SpscQueue queues[MAXIMUM_PIPELINE_THREADS - 1];
+  SpscQueue freeQueue;
+  PipelineItem items[QUEUE_SLOTS];
+  PipelineThread threads[MAXIMUM_PIPELINE_THREADS];
+  unsigned threadCount;
+  /* Kept by the writer */
+  SeekIndexEntry* entries;
+  size_t blockCount;
+  unsigned long bytesIn;
+  unsigned long bytesOut;
+  unsigned char encoding;
+};
+
+/* waitForChange()
+ *
+ * Sleep until a counter may have moved from a value.
+ *
+ * Parameters:
+ * counter - head or tail of a queue
+ * value - value it had
+ */
+static void waitForChange(unsigned* counter, unsigned value) {
+#ifdef __linux__
+  syscall(SYS_futex, counter, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+#else
+  (void)counter;
+  (void)value;
+  sched_yield();
+#endif
+}
+
+/* wakeWaiter()
+ *
+ * Wake the thread sleeping in waitForChange() on a counter.
+ *
+ * Parameters:
+ * counter - head or tail of a queue
+ */
+static void wakeWaiter(unsigned* counter) {
+#ifdef __linux__
+  syscall(SYS_futex, counter, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#else
+  (void)counter;
+#endif
+}
+
+/* pushItem()
+ *
+ * Put an item on a queue, waiting for space if it is full. Only one
+ * thread may push onto a queue.
+ *
+ * Parameters:
+ * queue - the queue
+ * item - item to add
+ */
+static void pushItem(SpscQueue* queue, PipelineItem* item) {
+  unsigned head = queue->head;
+  unsigned tail;
+  unsigned spins = 0;
+
+  while (head - (tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE)) ==
+         QUEUE_SLOTS) {
+    if (++spins < SPIN_LIMIT) {
+      continue;
+    }
+    /* Say we are waiting before looking again, so that either we see
+     * the consumer's move or it sees that we are waiting
+     */
+    __atomic_store_n(&queue->producerWaiting, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&queue->tail, __ATOMIC_SEQ_CST) == tail) {
+      waitForChange(&queue->tail, tail);
+    }
+    __atomic_store_n(&queue->producerWaiting, 0, __ATOMIC_RELAXED);
+  }
+  queue->slots[head % QUEUE_SLOTS] = item;
+  __atomic_store_n(&queue->head, head + 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&queue->consumerWaiting, __ATOMIC_SEQ_CST)) {
+    wakeWaiter(&queue->head);
+  }
+}
+
+/* popItem()
+ *
+ * Take the oldest item off a queue, waiting for one if it is empty.
+ * Only one thread may pop from a queue.
+ *
+ * Parameters:
+ * queue - the queue
+ *
+ * Return value:
+ * The item
+ */
+static PipelineItem* popItem(SpscQueue* queue) {
+  unsigned tail = queue->tail;
+  unsigned head;
+  unsigned spins = 0;
+  PipelineItem* item = NULL;
+
+  while ((head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE)) == tail) {
+    if (++spins < SPIN_LIMIT) {
+      continue;
+    }
+    __atomic_store_n(&queue->consumerWaiting, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&queue->head, __ATOMIC_SEQ_CST) == head) {
+      waitForChange(&queue->head, head);
+    }
+    __atomic_store_n(&queue->consumerWaiting, 0, __ATOMIC_RELAXED);
+  }
+  item = queue->slots[tail % QUEUE_SLOTS];
+  __atomic_store_n(&queue->tail, tail + 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&queue->producerWaiting, __ATOMIC_SEQ_CST)) {
+    wakeWaiter(&queue->tail);
+  }
+  return item;
+}
+
+/* readBlock()
+ *
+ * Read up to a block from the input, stopping short only at the end.
+ *
+ * Parameters:
+ * pipeline - the pipeline
+ * buffer - where to put the data
+ *
+ * Return value:
+ * Number of bytes read, less than the block size only at the end
+ */
+static size_t readBlock(Pipeline* pipeline, unsigned char* buffer) {
+  size_t size = 0;
+  while (size < pipeline->blockSize) {
+    ssize_t bytesRead = read(pipeline->inputFileDescriptor, buffer + size,
+                             pipeline->blockSize - size);
+    if (bytesRead < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      error(True, "Unable to read %s", pipeline->inputFilename);
+    }
+    if (bytesRead == 0) {
+      break;
+    }
+    size += bytesRead;
+  }
+  return size;
+}
+
+/* runReader()
+ *
+ * The reader thread. Fills recycled items with blocks of input and
+ * sends them down the pipeline, then sends the last item.
+ *
+ * Parameters:
+ * argument - the reader's PipelineThread
+ */
+static void* runReader(void* argument) {
+  PipelineThread* thread = argument;
+  Pipeline* pipeline = thread->pipeline;
+  size_t index = 0;
+  Boolean endOfInput = False;
+  Boolean last = False;
+
+  traceThreadName(thread->name);
+  while (!last) {
+    PipelineItem* item = popItem(&pipeline->freeQueue);
+    double start = traceClock();
+
+    item->size = endOfInput ? 0 : readBlock(pipeline, item->data);
+    traceEvent("read-block", "io", start);
+    item->index = index++;
+    item->block = NULL;
+    item->last = last = (item->size == 0) ? True : False;
+    if (!last) {
+      endOfInput = (item->size < pipeline->blockSize) ? True : False;
+      /* Checksum the block while it is in this processor's cache */
+      if (pipeline->flags->checksum) {
+        item->checksum = crc32c(0, item->data, item->size);
+      }
+      item->block = makeViewBlock(item->data, item->size, 0);
+    }
+    pushItem(thread->output, item);
+  }
+  return NULL;
+}
+
+/* runStage()
+ *
+ * A stage thread. Runs its stage over each block and passes it on.
+ *
+ * Parameters:
+ * argument - the stage's PipelineThread
+ */
+static void* runStage(void* argument) {
+  PipelineThread* thread = argument;
+  Boolean last = False;
+
+  traceThreadName(thread->name);
+  while (!last) {
+    PipelineItem* item = popItem(thread->input);
+    last = item->last;
+    /* As for a blocked file, Huffman needs two different symbols
+     * unless there is a dictionary
+     */
+    if (!last &&
+        (!thread->stageFlags.huffman || thread->stageFlags.dictionary ||
+         hasSeveralSymbols(item->block))) {
+      setStatisticsBlock(item->index);
+      item->block = compressBlock(&thread->stageFlags, item->block);
+      setStatisticsBlock(-1);
+    }
+    pushItem(thread->output, item);
+  }
+  return NULL;
+}
+
+/* writeOutput()
+ *
+ * Write to the output file.
+ *
+ * Parameters:
+ * pipeline - the pipeline
+ * address - data to write
+ * size - number of bytes
+ */
+static void writeOutput(Pipeline* pipeline, const unsigned char* address,
+                        size_t size) {
+  if (fwrite(address, 1, size, pipeline->outputFile) != size) {
+    error(True, "Unable to write to %s", pipeline->outputFilename);
+  }
+  pipeline->bytesOut += size;
+}
+
+/* runWriter()
+ *
+ * The writer thread. Writes each block as it comes out of the last
+ * stage, storing it as it was if the stages made it bigger, and
+ * recycles its item. Once the last block is written it writes the
+ * seek index.
+ *
+ * Parameters:
+ * argument - the writer's PipelineThread
+ */
+static void* runWriter(void* argument) {
+  PipelineThread* thread = argument;
+  Pipeline* pipeline = thread->pipeline;
+  size_t entriesAllocated = 0;
+  BlockDescriptor* block = NULL;
+  unsigned long offset;
+
+  traceThreadName(thread->name);
+
+  /* The header records the selected stages until the real ones are
+   * known
+   */
+  block = makeMemoryBlock(16);
+  block->encoding = ENCODING_BLOCKED |
+    (pipeline->flags->filters ? ENCODING_FILTERED : 0) |
+    (pipeline->flags->flip ? ENCODING_FLIPPED : 0) |
+    (pipeline->flags->rle ? ENCODING_RUN_LENGTH : 0) |
+    (pipeline->flags->rleVersion2 ? ENCODING_RLE_V2 : 0) |
+    (pipeline->flags->huffman ? ENCODING_HUFFMAN : 0) |
+    (pipeline->flags->checksum ? ENCODING_CHECKSUM : 0);
+  writeHeader(pipeline->outputFile, block);
+  pipeline->bytesOut += getHeaderSize();
+  writeBlockedPreamble(block, pipeline->blockSize);
+  writeOutput(pipeline, block->address, block->usedSize);
+  offset = block->usedSize;
+  freeBlock(block);
+
+  for (;;) {
+    PipelineItem* item = popItem(thread->input);
+    SeekIndexEntry* entry = NULL;
+    double start;
+
+    if (item->last) {
+      break;
+    }
+    block = item->block;
+    /* Store blocks which the stages made bigger as they are */
+    if (block->usedSize >= item->size) {
+      freeBlock(block);
+      block = makeViewBlock(item->data, item->size, 0);
+    }
+
+    if (pipeline->blockCount == entriesAllocated) {
+      entriesAllocated = entriesAllocated ? entriesAllocated * 2 : 64;
+      pipeline->entries = realloc(pipeline->entries,
+                                  entriesAllocated * sizeof(SeekIndexEntry));
+      if (pipeline->entries == NULL) {
+        error(True, "realloc failed for seek index of %lu blocks",
+              (unsigned long)entriesAllocated);
+      }
+    }
+    entry = &pipeline->entries[pipeline->blockCount++];
+    entry->uncompressedOffset = pipeline->bytesIn;
+    entry->uncompressedSize = item->size;
+    entry->compressedOffset = offset;
+    entry->compressedSize = block->usedSize;
+    entry->encoding = block->encoding;
+    entry->checksum = item->checksum;
+    pipeline->encoding |= block->encoding;
+
+    start = traceClock();
+    writeOutput(pipeline, block->address, block->usedSize);
+    traceEvent("write-block", "io", start);
+    offset += block->usedSize;
+    pipeline->bytesIn += item->size;
+    freeBlock(block);
+    item->block = NULL;
+    pushItem(&pipeline->freeQueue, item);
+  }
+
+  block = makeMemoryBlock(1024);
+  writeSeekIndex(block, offset, pipeline->entries, pipeline->blockCount,
+                 pipeline->bytesIn, pipeline->flags->checksum);
+  writeOutput(pipeline, block->address, block->usedSize);
+  freeBlock(block);
+  return NULL;
+}
+
+/* addThread()
+ *
+ * Add a thread to the pipeline, after the ones already added.
+ *
+ * Parameters:
+ * pipeline - the pipeline
+ * name - name for the trace, a string constant
+ * stageFlags - the stage it runs, or NULL for the reader and writer
+ *
+ * Return value:
+ * The thread, not yet started
+ */
+static PipelineThread* addThread(Pipeline* pipeline, const char* name,
+                                 const struct CompressionFlags* stageFlags) {
+  PipelineThread* thread = &pipeline->threads[pipeline->threadCount];
+  thread->pipeline = pipeline;
+  thread->name = name;
+  if (stageFlags) {
+    thread->stageFlags = *stageFlags;
+  }
+  thread->input = pipeline->threadCount ?
+    &pipeline->queues[pipeline->threadCount - 1] : NULL;
+  thread->output = &pipeline->queues[pipeline->threadCount];
+  pipeline->threadCount++;
+  return thread;
+}
+
+/* compressPipelined()
+ *
+ * Compress a file or standard input in the blocked format, with the
+ * reading, each selected stage and the writing on threads of their
+ * own.
+ *
+ * Parameters:
+ * flags - command line switches. With no block size,
+ *         PIPELINE_BLOCK_SIZE is used.
+ * inputFilename - file to compress, or "-" for standard input
+ * outputFilename - file to write, or "-" for standard output
+ */
+void compressPipelined(const struct CompressionFlags* flags,
+                       const char* inputFilename,
+                       const char* outputFilename) {
+  Pipeline* pipeline = calloc(1, sizeof(Pipeline));
+  struct CompressionFlags stageFlags;
+  BlockDescriptor* block = NULL;
+  Boolean toStandardOutput = !strcmp(outputFilename, "-") ? True : False;
+  Boolean statistics;
+  StageTimer timer;
+  unsigned index;
+
+  if (pipeline == NULL) {
+    error(True, "malloc failed for pipeline");
+  }
+  pipeline->flags = flags;
+  pipeline->blockSize = flags->blockSize ? flags->blockSize :
+    PIPELINE_BLOCK_SIZE;
+  if (pipeline->blockSize > 0xffffffffUL) {
+    error(False, "Block size must be between 1 and %lu bytes", 0xffffffffUL);
+  }
+  pipeline->inputFilename = inputFilename;
+  pipeline->inputFileDescriptor = !strcmp(inputFilename, "-") ?
+    STDIN_FILENO : open(inputFilename, O_RDONLY, 0);
+  if (pipeline->inputFileDescriptor < 0) {
+    error(True, "Unable to open file %s", inputFilename);
+  }
+  pipeline->outputFilename = outputFilename;
+  pipeline->outputFile = toStandardOutput ? stdout :
+    fopen(outputFilename, "wb");
+  if (pipeline->outputFile == NULL) {
+    error(True, "Unable to create %s", outputFilename);
+  }
+
+  for (index = 0; index < QUEUE_SLOTS; index++) {
+    pipeline->items[index].data = allocateBuffer(pipeline->blockSize, NULL);
+    pushItem(&pipeline->freeQueue, &pipeline->items[index]);
+  }
+
+  /* A thread for each stage, each running one stage on one block */
+  addThread(pipeline, "reader", NULL);
+  memset(&stageFlags, 0, sizeof(stageFlags));
+  /* The filters share the flip thread, as they share its slot in the
+   * stages
+   */
+  if (flags->flip || flags->filters) {
+    stageFlags.flip = flags->flip;
+    stageFlags.filters = flags->filters;
+    stageFlags.elementWidth = flags->elementWidth;
+    addThread(pipeline, flags->flip ? "flip" : "filter", &stageFlags);
+    stageFlags.flip = False;
+    stageFlags.filters = 0;
+  }
+  if (flags->rle) {
+    stageFlags.rle = True;
+    stageFlags.rleVersion2 = flags->rleVersion2;
+    addThread(pipeline, "rle", &stageFlags);
+    stageFlags.rle = False;
+    stageFlags.rleVersion2 = False;
+  }
+  if (flags->huffman) {
+    stageFlags.huffman = True;
+    stageFlags.dictionary = flags->dictionary;
+    addThread(pipeline, "huffman", &stageFlags);
+  }
+  addThread(pipeline, "writer", NULL);
+
+  statistics = enableStatistics(False);
+  startStage(&timer, "compress-file", 0);
+  for (index = 0; index < pipeline->threadCount; index++) {
+    PipelineThread* thread = &pipeline->threads[index];
+    void* (*function)(void*) = (index == 0) ? runReader :
+      (index + 1 == pipeline->threadCount) ? runWriter : runStage;
+    if (pthread_create(&thread->thread, NULL, function, thread)) {
+      error(True, "Unable to start pipeline thread");
+    }
+  }
+  for (index = 0; index < pipeline->threadCount; index++) {
+    pthread_join(pipeline->threads[index].thread, NULL);
+  }
+  timer.bytesIn = pipeline->bytesIn;
+  finishStage(&timer, pipeline->bytesOut);
+  enableStatistics(statistics);
+
+  /* Record the stages the blocks actually used, as compressBlocked()
+   * does, if the output is a file which can be rewritten
+   */
+  pipeline->encoding |= ENCODING_BLOCKED |
+    (flags->checksum ? ENCODING_CHECKSUM : 0);
+  if (!toStandardOutput) {
+    block = makeMemoryBlock(1);
+    block->encoding = pipeline->encoding;
+    if (fseek(pipeline->outputFile, 0, SEEK_SET)) {
+      error(True, "Unable to rewrite the header of %s", outputFilename);
+    }
+    writeHeader(pipeline->outputFile, block);
+    freeBlock(block);
+  }
+  if ((toStandardOutput ? fflush(pipeline->outputFile) :
+       fclose(pipeline->outputFile)) == EOF) {
+    error(True, "Unable to close %s", outputFilename);
+  }
+  if ((pipeline->inputFileDescriptor != STDIN_FILENO) &&
+      close(pipeline->inputFileDescriptor)) {
+    error(True, "Unable to close file %s", inputFilename);
+  }
+
+  if (statistics) {
+    printf("- %lu blocks of up to %lu bytes through %u threads\n",
+           (unsigned long)pipeline->blockCount, pipeline->blockSize,
+           pipeline->threadCount);
+  }
+  for (index = 0; index < QUEUE_SLOTS; index++) {
+    releaseBuffer(pipeline->items[index].data, pipeline->blockSize);
+  }
+  free(pipeline->entries);
+  free(pipeline);
+}
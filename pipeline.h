@@ -0,0 +1,17 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+/* Declarations for compressing a stream with each stage on its own
+ * thread, in pipeline.c
+ */
+
+#include "compression.h"
+
+/* Block size used for the pipeline if none was given */
+#define PIPELINE_BLOCK_SIZE (1024 * 1024)
+
+void compressPipelined(const struct CompressionFlags* flags,
+                       const char* inputFilename,
+                       const char* outputFilename);
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef PROBES_H
+#define PROBES_H
+
+/* Static tracepoints for bpftrace, perf probe and SystemTap.
+ *
+ * With <sys/sdt.h> (the Makefile defines HAVE_SYS_SDT_H when the
+ * systemtap-sdt-dev or systemtap-sdt-devel package has installed it)
+ * each probe is a single nop in the code and a note in the binary
+ * naming the probe and where its arguments are, so it costs nothing
+ * until a tracer attaches. Without it the probes compile to nothing.
+ * All the probes belong to the provider "jlcompress", e.g.
+ *
+ *   bpftrace -e 'usdt:./jlcompress:jlcompress:stage__done
+ *                { @[str(arg0)] = hist(arg2); }'
+ *
+ * compress__start(filename, bytesIn)
+ * compress__done(filename, bytesIn, bytesOut, encoding)
+ * decompress__start(filename, bytesIn, encoding)
+ * decompress__done(filename, bytesIn, bytesOut)
+ * stage__start(stage, bytesIn)
+ * stage__done(stage, bytesIn, bytesOut)
+ * block__compressed(block, bytesIn, bytesOut, encoding)
+ * block__decompressed(block, bytesIn, bytesOut, encoding)
+ * io__done(filename, bytes, storing)
+ *
+ * stage is the name used in the statistics report, e.g. "rle-encode",
+ * and covers whole files and blocks as well as the stages. storing is
+ * 1 for a file written by the I/O engine and 0 for one read.
+ */
+
+#ifdef HAVE_SYS_SDT_H
+
+#include <sys/sdt.h>
+
+#define PROBE2(name, a, b) DTRACE_PROBE2(jlcompress, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(jlcompress, name, a, b, c)
+#define PROBE4(name, a, b, c, d) DTRACE_PROBE4(jlcompress, name, a, b, c, d)
+
+#else
+
+#define PROBE2(name, a, b) ((void)0)
+#define PROBE3(name, a, b, c) ((void)0)
+#define PROBE4(name, a, b, c, d) ((void)0)
+
+#endif
+
+#endif
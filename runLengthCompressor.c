@@ -1,70 +1,646 @@
 /* runLengthCompressor.c
  *
  * This contains the code for run length encoding and decoding.
+ *
+ * Large blocks are encoded and decoded on several threads if there are
+ * several, giving exactly the same output as one thread. For encoding
+ * the block is split into pieces at the start of a run, where the
+ * encoder has nothing left over from before, so each piece encodes the
+ * same on its own as it does in the middle of the block. The pieces
+ * are encoded separately, then a running total of their sizes gives
+ * where each one goes in the output and they are copied there. For
+ * decoding a quick scan of the encoded data, which only looks at the
+ * symbols and counts, finds where each piece's output starts, so that
+ * the pieces can be decoded straight into their places at once.
+ *
+ * Version 1 uses the fixed REPEAT_SYMBOL and ESCAPE_SYMBOL, and writes
+ * a run as the repeat symbol, a count byte and the byte, so a run
+ * longer than 256 takes several. Version 2, with ENCODING_RLE_V2, is
+ * for data where those bytes are common or runs are long. The two
+ * bytes which occur least in each block are chosen as its symbols and
+ * written at its start,
+ *
+ * <repeat symbol [1]> <escape symbol [1]> <encoded data>
+ *
+ * and a run is the repeat symbol, a varint, seven bits a byte with the
+ * lowest first and the top bit set on all but the last byte, and the
+ * pattern repeated. The low 2 bits of the varint give the length of the
+ * pattern, 1, 2, 4 or 8 bytes, and the rest the number of times it
+ * repeats less 2. A 1MB run of one byte then takes 6 bytes, and fill
+ * patterns and padding of binary data, such as 0000ffff repeated, are
+ * runs too. Looking for patterns costs time, so it is only done for a
+ * block if a sample of it finds some.
+ *
+ * With patterns, a block is only split where a run of one byte of at
+ * least LONG_RUN_LENGTH ends. A pattern can't reach more than 7 bytes
+ * into the run, and the rest of the run is always written as a run, so
+ * encoding the whole block gives the same tokens after the run.
  */
 
+#include <string.h>
 #include "compression.h"
 #include "dataBlocks.h"
 #include "header.h"
+#include "kernels.h"
+#include "segmentedBuffer.h"
+#include "statistics.h"
+#include "threadPool.h"
+
+/* Blocks smaller than this are left to one thread */
+#define PARALLEL_RLE_MINIMUM_SIZE (1024 * 1024)
+
+/* Pieces shorter than this aren't worth starting a thread for */
+#define MINIMUM_PIECE_SIZE (256 * 1024)
+
+/* The symbols at the start of a version 2 block */
+#define VERSION_2_HEADER_SIZE (2)
+
+/* Shift of the last varint byte allowed in a version 2 run length, so
+ * that damaged data can't give a length which overflows
+ */
+#define MAXIMUM_COUNT_SHIFT (42)
 
-/* Use characters which don't often appear in text files, so that they
- * don't need to be escaped often.
+/* Longest repeated pattern in version 2, and the number of bits of the
+ * varint giving its length
  */
+#define MAXIMUM_PERIOD (8)
+#define PERIOD_BITS (2)
 
-#define REPEAT_SYMBOL (235)
-#define ESCAPE_SYMBOL (236)
+/* Run of one byte which a pattern can't reach the end of */
+#define LONG_RUN_LENGTH (MAXIMUM_PERIOD + 4)
+
+/* Runs are measured byte by byte up to this length, and only a run
+ * which reaches it is measured with the run length kernel. Most runs
+ * are of one byte, and a call for each would cost more than the kernel
+ * saves.
+ */
+#define SHORT_RUN_LENGTH (16)
+
+/* Number and size of the pieces of a block sampled for patterns */
+#define PERIOD_SAMPLE_COUNT (256)
+#define PERIOD_SAMPLE_SIZE (32)
+
+/* The format and symbols a block is run length encoded with */
+typedef struct {
+  Boolean version2;
+  unsigned char repeatSymbol;
+  unsigned char escapeSymbol;
+  /* Look for repeated patterns when encoding */
+  Boolean findPatterns;
+} RunLengthCode;
+
+/* One piece of a block encoded or decoded on its own thread */
+typedef struct {
+  size_t inputOffset;
+  size_t inputSize;
+  size_t outputOffset;
+  /* Encoded piece, until it is copied to the output */
+  BlockDescriptor* block;
+} RunLengthPiece;
+
+/* Shared by the tasks encoding or decoding the pieces of one block */
+typedef struct {
+  RunLengthCode code;
+  const unsigned char* input;
+  unsigned char* output;
+  RunLengthPiece* pieces;
+} RunLengthTasks;
+
+/* The fixed symbols of version 1 */
+static const RunLengthCode versionOneCode = {
+  False, REPEAT_SYMBOL, ESCAPE_SYMBOL, False
+};
 
 /* writeByte()
  *
  * Writes a single byte to the output file, escaping it if necessary.
  *
  * Parameters:
+ * code - symbols in use
  * outputBlock - descriptor of output block to write character to
  * character - byte to write
  */
-static void writeByte(BlockDescriptor* outputBlock,
+static void writeByte(const RunLengthCode* code,
+                      BlockDescriptor* outputBlock,
                       unsigned char character) {
-  if ((character == REPEAT_SYMBOL) || (character == ESCAPE_SYMBOL)) {
-    writeToBlock(outputBlock, ESCAPE_SYMBOL);
+  if ((character == code->repeatSymbol) ||
+      (character == code->escapeSymbol)) {
+    writeToBlock(outputBlock, code->escapeSymbol);
   }
   writeToBlock(outputBlock, character);
 }
 
-/* writeRepeat()
+/* writeLongRun()
  *
- * Writes a repeated byte to the output file.
+ * Writes a run of a byte or pattern of any length to the output file
+ * in the version 2 format. As in version 1 a run of fewer than 4 bytes
+ * is written as it is, unless the byte is a symbol, when a run of 2 is
+ * shorter than escaping both. A pattern is only given if it is worth
+ * writing as a run.
  *
  * Parameters:
- * outputBlock - descriptor of output block to write character to
- * repeatCount - number of times that the byte is repeated. 1 means that
- *               the character is repeated once - i.e. occurs twice
- * character - byte to write
+ * code - symbols in use
+ * outputBlock - descriptor of output block to write to
+ * pattern - the byte or pattern
+ * period - length of the pattern, a power of 2 up to MAXIMUM_PERIOD
+ * count - number of times it repeats
  */
-static void writeRepeat(BlockDescriptor* outputBlock,
-                        unsigned repeatCount,
-                        unsigned char character) {
-  /* repeatCount of 1 means that the character is repeated once -
-   * i.e. occurs twice.
-   */
-  if ((repeatCount < 3) &&
-      (character != ESCAPE_SYMBOL)
-      && (character != REPEAT_SYMBOL)) {
-    /* If repeat count is less than three (i.e. the character appears
-     * less than four times in succession) then this is the same
-     * length as the repeat encoding so don't bother encoding. If the
-     * characters would need escaping then use the repeat always
-     * since <ESC>X<ESC>X is longer than <RPT>2X.
-     */
-    writeByte(outputBlock, character);
-    while (repeatCount-- != 0) {
-      writeByte(outputBlock, character);
+static void writeLongRun(const RunLengthCode* code,
+                         BlockDescriptor* outputBlock,
+                         const unsigned char* pattern,
+                         size_t period,
+                         size_t count) {
+  Boolean isSymbol = ((pattern[0] == code->repeatSymbol) ||
+                      (pattern[0] == code->escapeSymbol)) ? True : False;
+
+  if ((period > 1) || (count >= 4) || (isSymbol && (count >= 2))) {
+    unsigned periodCode = 0;
+    size_t value;
+    while (((size_t)1 << periodCode) < period) {
+      periodCode++;
+    }
+    value = ((count - 2) << PERIOD_BITS) | periodCode;
+    writeToBlock(outputBlock, code->repeatSymbol);
+    while (value >= 0x80) {
+      writeToBlock(outputBlock, (unsigned char)(value | 0x80));
+      value >>= 7;
     }
+    writeToBlock(outputBlock, (unsigned char)value);
+    writeBytesToBlock(outputBlock, pattern, period);
   }
   else {
-      writeToBlock(outputBlock, REPEAT_SYMBOL);
-      writeToBlock(outputBlock, repeatCount);
-      writeToBlock(outputBlock, character);
+    while (count-- != 0) {
+      writeByte(code, outputBlock, pattern[0]);
+    }
+  }
+}
+
+/* writeLiterals()
+ *
+ * Write bytes which need no escaping and aren't part of a run, all at
+ * once rather than a byte at a time.
+ *
+ * Parameters:
+ * outputBlock - descriptor of output block to write to
+ * data - the bytes
+ * size - number of bytes, at least 1
+ */
+static void writeLiterals(BlockDescriptor* outputBlock,
+                          const unsigned char* data, size_t size) {
+  reserveBlockSpace(outputBlock, outputBlock->nextFreeByte + size +
+                    (outputBlock->nextFreeByte + size + 1) / 2);
+  memcpy(outputBlock->address + outputBlock->nextFreeByte, data, size);
+  outputBlock->nextFreeByte += size;
+  outputBlock->usedSize = outputBlock->nextFreeByte;
+}
+
+/* writeRun()
+ *
+ * Writes the bytes before a run, which need no escaping, and then the
+ * run in the version 1 format: the repeat symbol, a count byte and the
+ * byte for each 256 of it. A run of fewer than 4 bytes is written as it
+ * is, as that is no longer, unless the byte is a symbol, when <RPT>2X is
+ * shorter than <ESC>X<ESC>X. Most runs are one byte long, so room for
+ * everything is made at once and the bytes are stored straight into the
+ * block rather than written one at a time.
+ *
+ * Parameters:
+ * outputBlock - descriptor of output block to write to
+ * literals - the bytes before the run
+ * literalSize - number of them, which may be 0
+ * character - the byte which runs
+ * length - length of the run, at least 1
+ */
+static void writeRun(BlockDescriptor* outputBlock,
+                     const unsigned char* literals, size_t literalSize,
+                     unsigned char character, size_t length) {
+  Boolean isSymbol = ((character == REPEAT_SYMBOL) ||
+                      (character == ESCAPE_SYMBOL)) ? True : False;
+  size_t needed = outputBlock->nextFreeByte + literalSize +
+    3 * (length / 256 + 1);
+  unsigned char* output;
+
+  if (needed > outputBlock->allocatedSize) {
+    reserveBlockSpace(outputBlock, needed + (needed + 1) / 2);
+  }
+  output = outputBlock->address + outputBlock->nextFreeByte;
+  if (literalSize != 0) {
+    memcpy(output, literals, literalSize);
+    output += literalSize;
+  }
+
+  /* A count of 256 is stored as 0 */
+  for (; length > 256; length -= 256) {
+    *output++ = REPEAT_SYMBOL;
+    *output++ = 0;
+    *output++ = character;
+  }
+  if ((length >= 4) || (isSymbol && (length >= 2))) {
+    *output++ = REPEAT_SYMBOL;
+    *output++ = (unsigned char)(length - 1);
+    *output++ = character;
+  }
+  else {
+    for (; length != 0; length--) {
+      if (isSymbol) {
+        *output++ = ESCAPE_SYMBOL;
+      }
+      *output++ = character;
+    }
+  }
+  outputBlock->nextFreeByte = output - outputBlock->address;
+  outputBlock->usedSize = outputBlock->nextFreeByte;
+}
+
+/* measureRun()
+ *
+ * Measure the run at the start of some bytes, byte by byte up to
+ * SHORT_RUN_LENGTH and with the run length kernel after that.
+ *
+ * Parameters:
+ * runLength - the run length kernel
+ * data - bytes to look at
+ * size - number of bytes, at least 1
+ *
+ * Return value:
+ * Number of bytes at the start which are the same as the first
+ */
+static size_t measureRun(RunLengthFunction runLength,
+                         const unsigned char* data, size_t size) {
+  size_t length = 1;
+
+  while ((length < size) && (length < SHORT_RUN_LENGTH) &&
+         (data[length] == data[0])) {
+    length++;
+  }
+  if ((length == SHORT_RUN_LENGTH) && (length < size)) {
+    length += runLength(data + length - 1, size - length + 1) - 1;
+  }
+  return length;
+}
+
+/* findPattern()
+ *
+ * Find the repeated pattern of 2, 4 or 8 bytes which covers the most
+ * of the start of the data, if any is worth writing as a run, which
+ * is when it repeats at least twice and saves at least 2 bytes.
+ *
+ * Parameters:
+ * data - bytes to look at
+ * size - number of bytes
+ * count - set to the number of times the pattern repeats
+ *
+ * Return value:
+ * Length of the pattern, or 0 if there isn't one
+ */
+static size_t findPattern(const unsigned char* data, size_t size,
+                          size_t* count) {
+  PeriodLengthFunction periodLength = getKernels()->periodLength;
+  size_t bestPeriod = 0;
+  size_t bestLength = 0;
+  size_t period;
+
+  for (period = 2; period <= MAXIMUM_PERIOD; period *= 2) {
+    size_t length = periodLength(data, size, period) / period * period;
+    if ((length > bestLength) && (length >= 2 * period) &&
+        (length >= period + 4)) {
+      bestPeriod = period;
+      bestLength = length;
+    }
+  }
+  if (bestPeriod) {
+    *count = bestLength / bestPeriod;
+  }
+  return bestPeriod;
+}
+
+/* hasPatterns()
+ *
+ * Sample a block to see whether it is worth looking for repeated
+ * patterns in it. Some of the samples must be patterns of 2, 4 or 8
+ * bytes all the way through, but not runs of one byte.
+ *
+ * Parameters:
+ * data - the block
+ * size - size of the block
+ *
+ * Return value:
+ * True if the block has patterns
+ */
+static Boolean hasPatterns(const unsigned char* data, size_t size) {
+  const Kernels* kernels = getKernels();
+  size_t sampleCount = size / PERIOD_SAMPLE_SIZE;
+  size_t found = 0;
+  size_t index;
+
+  if (sampleCount > PERIOD_SAMPLE_COUNT) {
+    sampleCount = PERIOD_SAMPLE_COUNT;
+  }
+  for (index = 0; index < sampleCount; index++) {
+    const unsigned char* sample =
+      data + (size - PERIOD_SAMPLE_SIZE) / sampleCount * index;
+    size_t period;
+    if (kernels->runLength(sample, PERIOD_SAMPLE_SIZE) ==
+        PERIOD_SAMPLE_SIZE) {
+      continue;
+    }
+    for (period = 2; period <= MAXIMUM_PERIOD; period *= 2) {
+      if (kernels->periodLength(sample, PERIOD_SAMPLE_SIZE, period) ==
+          PERIOD_SAMPLE_SIZE) {
+        found++;
+        break;
+      }
+    }
+  }
+  /* At least 1 in 64 of the samples */
+  return ((found > 0) && (found * 64 >= sampleCount)) ? True : False;
+}
+
+/* chooseSymbols()
+ *
+ * Choose the version 2 symbols for a block, the two bytes which occur
+ * least in it, the lower byte first if several occur as often, and
+ * whether to look for patterns in it.
+ *
+ * Parameters:
+ * data - the block
+ * size - size of the block
+ * code - filled in
+ */
+static void chooseSymbols(const unsigned char* data, size_t size,
+                          RunLengthCode* code) {
+  unsigned long counts[256];
+  unsigned least = 0;
+  unsigned next = 1;
+  unsigned byte;
+
+  memset(counts, 0, sizeof(counts));
+  getKernels()->countBytes(data, size, counts);
+  if (counts[next] < counts[least]) {
+    least = 1;
+    next = 0;
+  }
+  for (byte = 2; byte < 256; byte++) {
+    if (counts[byte] < counts[least]) {
+      next = least;
+      least = byte;
+    }
+    else if (counts[byte] < counts[next]) {
+      next = byte;
+    }
+  }
+  code->version2 = True;
+  code->repeatSymbol = (unsigned char)least;
+  code->escapeSymbol = (unsigned char)next;
+  code->findPatterns = hasPatterns(data, size);
+}
+
+/* encodeBytes()
+ *
+ * Run length encode some bytes, appending them to the output block.
+ * Each run is measured as measureRun() does, with the byte by byte
+ * part written out here since nearly every run stops in it. Single
+ * bytes which need no escaping are gathered up and written together,
+ * with the run after them in version 1 by writeRun() and before it in
+ * version 2 by writeLiterals(). In version 2 a pattern is looked for
+ * where there is no run of one byte worth writing.
+ *
+ * Parameters:
+ * code - format and symbols to use
+ * charPointer - bytes to encode
+ * size - number of bytes
+ * outputBlock - descriptor of output block to write to
+ */
+static void encodeBytes(const RunLengthCode* code,
+                        const unsigned char* charPointer,
+                        size_t size,
+                        BlockDescriptor* outputBlock) {
+  RunLengthFunction runLength = getKernels()->runLength;
+  unsigned char repeatSymbol = code->repeatSymbol;
+  unsigned char escapeSymbol = code->escapeSymbol;
+  size_t literalStart = 0;
+  size_t offset = 0;
+
+  while (offset < size) {
+    unsigned char character = charPointer[offset];
+    size_t length = 1;
+    size_t count;
+    size_t period = 1;
+
+    while ((offset + length < size) && (length < SHORT_RUN_LENGTH) &&
+           (charPointer[offset + length] == character)) {
+      length++;
+    }
+    if ((length == SHORT_RUN_LENGTH) && (offset + length < size)) {
+      length += runLength(charPointer + offset + length - 1,
+                          size - offset - length + 1) - 1;
+    }
+
+    count = length;
+    if (code->version2 && code->findPatterns && (length < 4)) {
+      period = findPattern(charPointer + offset, size - offset, &count);
+      if (period == 0) {
+        period = 1;
+        count = length;
+      }
+    }
+    if ((period == 1) && (count == 1) && (character != repeatSymbol) &&
+        (character != escapeSymbol)) {
+      offset++;
+      continue;
+    }
+
+    if (code->version2) {
+      if (offset != literalStart) {
+        writeLiterals(outputBlock, charPointer + literalStart,
+                      offset - literalStart);
+      }
+      writeLongRun(code, outputBlock, charPointer + offset, period, count);
+      offset += period * count;
+    }
+    else {
+      writeRun(outputBlock, charPointer + literalStart,
+               offset - literalStart, character, length);
+      offset += length;
+    }
+    literalStart = offset;
+  }
+  if (offset != literalStart) {
+    writeLiterals(outputBlock, charPointer + literalStart,
+                  offset - literalStart);
+  }
+}
+
+/* canRunLengthCodeInParallel()
+ *
+ * Parameters:
+ * size - size of the block to encode or decode
+ *
+ * Return value:
+ * True if there are threads to spare and enough to work on
+ */
+static Boolean canRunLengthCodeInParallel(size_t size) {
+  return ((getThreadCount() > 1) && !isRunningTask() &&
+          (size >= PARALLEL_RLE_MINIMUM_SIZE)) ? True : False;
+}
+
+/* makePieces()
+ *
+ * Allocate a piece for each thread.
+ *
+ * Parameters:
+ * size - size of the block
+ * pieceCount - set to the number of pieces
+ *
+ * Return value:
+ * The pieces, zeroed, to be freed with free()
+ */
+static RunLengthPiece* makePieces(size_t size, size_t* pieceCount) {
+  RunLengthPiece* pieces = NULL;
+
+  *pieceCount = getThreadCount();
+  if (*pieceCount > size / MINIMUM_PIECE_SIZE) {
+    *pieceCount = size / MINIMUM_PIECE_SIZE;
+  }
+  if (*pieceCount == 0) {
+    *pieceCount = 1;
+  }
+  pieces = calloc(*pieceCount, sizeof(RunLengthPiece));
+  if (pieces == NULL) {
+    error(True, "malloc failed for %lu pieces", (unsigned long)*pieceCount);
+  }
+  return pieces;
+}
+
+/* encodeOnePiece()
+ *
+ * Encode one piece into a block of its own. Run by runTasks().
+ *
+ * Parameters:
+ * context - the RunLengthTasks
+ * index - number of the piece
+ */
+static void encodeOnePiece(void* context, size_t index) {
+  RunLengthTasks* tasks = context;
+  RunLengthPiece* piece = &tasks->pieces[index];
+
+  piece->block = makeMemoryBlock(piece->inputSize ? piece->inputSize : 1);
+  encodeBytes(&tasks->code, tasks->input + piece->inputOffset,
+              piece->inputSize, piece->block);
+}
+
+/* copyOnePiece()
+ *
+ * Copy an encoded piece to its place in the output and free it. Run by
+ * runTasks().
+ *
+ * Parameters:
+ * context - the RunLengthTasks
+ * index - number of the piece
+ */
+static void copyOnePiece(void* context, size_t index) {
+  RunLengthTasks* tasks = context;
+  RunLengthPiece* piece = &tasks->pieces[index];
+
+  memcpy(tasks->output + piece->outputOffset, piece->block->address,
+         piece->block->usedSize);
+  freeBlock(piece->block);
+  piece->block = NULL;
+}
+
+/* findLongRunEnd()
+ *
+ * Find where a block with patterns can be split, as described at the
+ * top of this file.
+ *
+ * Parameters:
+ * input - the block
+ * size - size of the block
+ * offset - where to start looking
+ *
+ * Return value:
+ * End of the next run of at least LONG_RUN_LENGTH, or size if there
+ * isn't one
+ */
+static size_t findLongRunEnd(const unsigned char* input, size_t size,
+                             size_t offset) {
+  RunLengthFunction runLength = getKernels()->runLength;
+
+  while (offset < size) {
+    size_t length = measureRun(runLength, input + offset, size - offset);
+    offset += length;
+    if (length >= LONG_RUN_LENGTH) {
+      break;
+    }
+  }
+  return offset;
+}
+
+/* encodeInPieces()
+ *
+ * Run length encode a block on several threads, as described at the
+ * top of this file.
+ *
+ * Parameters:
+ * inputBlock - Descriptor of input block to encode
+ * code - format and symbols to use
+ *
+ * Return value:
+ * Encoded block, the same as encoding on one thread gives
+ */
+static BlockDescriptor* encodeInPieces(BlockDescriptor* inputBlock,
+                                       const RunLengthCode* code) {
+  const unsigned char* input = inputBlock->address;
+  size_t size = inputBlock->usedSize;
+  BlockDescriptor* outputBlock = NULL;
+  RunLengthTasks tasks;
+  size_t pieceCount;
+  size_t outputSize = code->version2 ? VERSION_2_HEADER_SIZE : 0;
+  size_t start = 0;
+  size_t index;
+
+  tasks.code = *code;
+  tasks.input = input;
+  tasks.pieces = makePieces(size, &pieceCount);
+  for (index = 0; index < pieceCount; index++) {
+    size_t end = (index + 1 == pieceCount) ? size :
+      size / pieceCount * (index + 1);
+    /* Move the end to the start of the next run, or after the next
+     * long run if there are patterns
+     */
+    if (end < start) {
+      end = start;
+    }
+    if ((end < size) && (end > 0) && code->findPatterns) {
+      end = findLongRunEnd(input, size, end);
+    }
+    else if ((end < size) && (end > 0)) {
+      end += measureRun(getKernels()->runLength, input + end - 1,
+                        size - end + 1) - 1;
+    }
+    tasks.pieces[index].inputOffset = start;
+    tasks.pieces[index].inputSize = end - start;
+    start = end;
+  }
+  runTasks(pieceCount, encodeOnePiece, &tasks);
+
+  for (index = 0; index < pieceCount; index++) {
+    tasks.pieces[index].outputOffset = outputSize;
+    outputSize += tasks.pieces[index].block->usedSize;
+  }
+  outputBlock = makeMemoryBlock(outputSize ? outputSize : 1);
+  tasks.output = outputBlock->address;
+  if (code->version2) {
+    tasks.output[0] = code->repeatSymbol;
+    tasks.output[1] = code->escapeSymbol;
   }
+  runTasks(pieceCount, copyOnePiece, &tasks);
+  countCopy(outputSize);
+  outputBlock->usedSize = outputSize;
+  outputBlock->nextFreeByte = outputSize;
+
+  free(tasks.pieces);
+  return outputBlock;
 }
 
 /* runLengthCompress()
@@ -74,128 +650,440 @@ static void writeRepeat(BlockDescriptor* outputBlock,
  *
  * Parameters:
  * inputBlock - Descriptor of input block to encode
+ * version2 - True to use version 2, with symbols chosen for the block
  *
  * Return value:
  * Pointer to heap allocated output block descripor pointing to
  * heap allocated block which has been encoded.
  */
-BlockDescriptor* runLengthCompress(BlockDescriptor* inputBlock) {
-  BlockDescriptor* outputBlock = makeMemoryBlock(inputBlock->allocatedSize);
-  const unsigned char* charPointer = inputBlock->address;
-  int lastCharacter = -1;
-  unsigned char repeatCount = 0;
-  unsigned long offset;
+BlockDescriptor* runLengthCompress(BlockDescriptor* inputBlock,
+                                   Boolean version2) {
+  BlockDescriptor* outputBlock = NULL;
+  RunLengthCode code = versionOneCode;
 
   if (isRleCompressed(inputBlock)) {
     error(False, "File already run length encoded");
   }
 
-  outputBlock->encoding = inputBlock->encoding | ENCODING_RUN_LENGTH;
+  if (version2) {
+    chooseSymbols(inputBlock->address, inputBlock->usedSize, &code);
+  }
+  if (canRunLengthCodeInParallel(inputBlock->usedSize)) {
+    outputBlock = encodeInPieces(inputBlock, &code);
+  }
+  else if (version2) {
+    outputBlock = makeMemoryBlock(inputBlock->usedSize +
+                                  VERSION_2_HEADER_SIZE);
+    writeToBlock(outputBlock, code.repeatSymbol);
+    writeToBlock(outputBlock, code.escapeSymbol);
+    encodeBytes(&code, inputBlock->address, inputBlock->usedSize,
+                outputBlock);
+  }
+  else {
+    outputBlock = makeMemoryBlock(inputBlock->usedSize);
+    encodeBytes(&code, inputBlock->address, inputBlock->usedSize,
+                outputBlock);
+  }
+  outputBlock->encoding = inputBlock->encoding | ENCODING_RUN_LENGTH |
+    (version2 ? ENCODING_RLE_V2 : 0);
+
+  displayStatistics("Run length encoding", inputBlock, outputBlock);
+  return outputBlock;
+}
+
+/* readCode()
+ *
+ * Find the format and symbols a block was run length encoded with.
+ *
+ * Parameters:
+ * inputBlock - Descriptor of input block to decode
+ * code - filled in
+ *
+ * Return value:
+ * Offset of the encoded data in the block
+ */
+static size_t readCode(BlockDescriptor* inputBlock, RunLengthCode* code) {
+  const unsigned char* charPointer = inputBlock->address;
+
+  if (!(inputBlock->encoding & ENCODING_RLE_V2)) {
+    *code = versionOneCode;
+    return 0;
+  }
+  if (inputBlock->usedSize < VERSION_2_HEADER_SIZE) {
+    error(False, "Damaged input file - run length symbols missing");
+  }
+  if (charPointer[0] == charPointer[1]) {
+    error(False, "Damaged input file - run length symbols are the same");
+  }
+  code->version2 = True;
+  code->repeatSymbol = charPointer[0];
+  code->escapeSymbol = charPointer[1];
+  return VERSION_2_HEADER_SIZE;
+}
+
+/* readRun()
+ *
+ * Read a run, in either format, checking that it is all there.
+ *
+ * Parameters:
+ * code - format and symbols in use
+ * charPointer - encoded data
+ * size - size of the encoded data
+ * offset - offset of the repeat symbol starting the run
+ * length - set to the number of bytes in the run
+ * pattern - set to the byte or pattern repeated, in the encoded data
+ * period - set to the length of the pattern
+ *
+ * Return value:
+ * Offset of what follows the run
+ */
+static size_t readRun(const RunLengthCode* code,
+                      const unsigned char* charPointer,
+                      size_t size,
+                      size_t offset,
+                      size_t* length,
+                      const unsigned char** pattern,
+                      size_t* period) {
+  if (++offset >= size) {
+    error(False, "Damaged input file - ends with repeat symbol");
+  }
+  if (code->version2) {
+    size_t value = 0;
+    unsigned shift = 0;
+    while (charPointer[offset] & 0x80) {
+      value |= (size_t)(charPointer[offset] & 0x7f) << shift;
+      shift += 7;
+      if (shift > MAXIMUM_COUNT_SHIFT) {
+        error(False, "Damaged input file - repeat count too long");
+      }
+      if (++offset >= size) {
+        error(False, "Damaged input file - ends with repeat count");
+      }
+    }
+    value |= (size_t)charPointer[offset] << shift;
+    *period = (size_t)1 << (value & ((1 << PERIOD_BITS) - 1));
+    *length = ((value >> PERIOD_BITS) + 2) * *period;
+  }
+  else {
+    /* Repeat count means number of repeats of char - i.e. 1 means the
+     * char occurs twice. As a repeat count of 0 is pointless, 0 means
+     * the char repeats 255 times - i.e. there are 256 of them.
+     */
+    *period = 1;
+    *length = charPointer[offset] ? charPointer[offset] + 1 : 256;
+  }
+  if (++offset + *period > size) {
+    error(False, "Damaged input file - ends with repeat count");
+  }
+  *pattern = charPointer + offset;
+  return offset + *period;
+}
+
+/* fillPattern()
+ *
+ * Write a pattern repeated, copying what has been written so far so
+ * that each copy doubles it.
+ *
+ * Parameters:
+ * output - where to write it
+ * length - number of bytes to write, a multiple of period
+ * pattern - the pattern
+ * period - length of the pattern
+ */
+static void fillPattern(unsigned char* output, size_t length,
+                        const unsigned char* pattern, size_t period) {
+  size_t done = period;
+
+  if (period == 1) {
+    memset(output, pattern[0], length);
+    return;
+  }
+  memcpy(output, pattern, period);
+  while (done < length) {
+    size_t copy = (length - done < done) ? length - done : done;
+    memcpy(output + done, output, copy);
+    done += copy;
+  }
+}
+
+/* appendPatternToSegments()
+ *
+ * Append a pattern repeated to a segmented buffer.
+ *
+ * Parameters:
+ * segments - buffer to append to
+ * length - number of bytes to append, a multiple of period
+ * pattern - the pattern
+ * period - length of the pattern
+ */
+static void appendPatternToSegments(SegmentedBuffer* segments,
+                                    size_t length,
+                                    const unsigned char* pattern,
+                                    size_t period) {
+  unsigned char repeated[256];
+
+  if (period == 1) {
+    appendRunToSegments(segments, pattern[0], length);
+    return;
+  }
+  fillPattern(repeated, sizeof(repeated), pattern, period);
+  while (length > 0) {
+    size_t copy = (length < sizeof(repeated)) ? length : sizeof(repeated);
+    appendBytesToSegments(segments, repeated, copy);
+    length -= copy;
+  }
+}
+
+/* findDecodedPieces()
+ *
+ * Scan run length encoded data, without decoding it, to split it into
+ * pieces of about the same size which start with a symbol, and find
+ * where each piece's output starts.
+ *
+ * Parameters:
+ * inputBlock - Descriptor of input block to decode
+ * code - format and symbols in use
+ * start - offset of the encoded data
+ * pieces - filled in
+ * pieceCount - number of pieces
+ *
+ * Return value:
+ * Size of the decoded data
+ */
+static size_t findDecodedPieces(BlockDescriptor* inputBlock,
+                                const RunLengthCode* code,
+                                size_t start,
+                                RunLengthPiece* pieces,
+                                size_t pieceCount) {
+  const unsigned char* charPointer = inputBlock->address;
+  size_t size = inputBlock->usedSize;
+  size_t offset = start;
+  size_t outputSize = 0;
+  size_t index = 0;
+  LiteralLengthFunction literalLength = getKernels()->literalLength;
 
-  lastCharacter = -1;
-  for (offset = 0; offset < inputBlock->allocatedSize; offset++) {
-    if (*charPointer == lastCharacter) {
-      if (++repeatCount == 0x00)  {
-	/* Repeat count overflowed */
-	writeRepeat(outputBlock, 256, lastCharacter);
-	repeatCount = 0;
-	lastCharacter = -1;
+  while (offset < size) {
+    while ((index < pieceCount) && (offset >= size / pieceCount * index)) {
+      pieces[index].inputOffset = offset;
+      pieces[index].outputOffset = outputSize;
+      index++;
+    }
+    if (charPointer[offset] == code->escapeSymbol) {
+      if (offset + 1 >= size) {
+        error(False, "Damaged input file - ends with escape symbol");
       }
+      offset += 2;
+      outputSize++;
     }
-    else if (repeatCount) {
-      /* character changed */
-      writeRepeat(outputBlock, repeatCount, lastCharacter);
-      repeatCount = 0;
-      lastCharacter = -1;
+    else if (charPointer[offset] == code->repeatSymbol) {
+      size_t length;
+      const unsigned char* pattern;
+      size_t period;
+      offset = readRun(code, charPointer, size, offset, &length, &pattern,
+                       &period);
+      if (length > (size_t)-1 - outputSize) {
+        error(False, "Damaged input file - decodes to too many bytes");
+      }
+      outputSize += length;
     }
-    else if (lastCharacter != -1) {
-      writeByte(outputBlock, lastCharacter);
+    else {
+      /* Up to the next symbol, but stopping where a piece starts */
+      size_t end = (index < pieceCount) ? size / pieceCount * index : size;
+      size_t length = literalLength(charPointer + offset, end - offset,
+                                    code->repeatSymbol, code->escapeSymbol);
+      offset += length;
+      outputSize += length;
     }
-    lastCharacter = *charPointer++;
   }
-  
-  /* Handle last character in file */
-  if (*charPointer == lastCharacter) {
-    writeRepeat(outputBlock, repeatCount, lastCharacter);
-    repeatCount = 0;
+  for (; index < pieceCount; index++) {
+    pieces[index].inputOffset = size;
+    pieces[index].outputOffset = outputSize;
   }
-  else if (repeatCount) {
-    writeRepeat(outputBlock, repeatCount, lastCharacter);
-    repeatCount = 0;
+  for (index = 0; index < pieceCount; index++) {
+    pieces[index].inputSize = ((index + 1 < pieceCount) ?
+                               pieces[index + 1].inputOffset : size) -
+      pieces[index].inputOffset;
   }
-  else if (lastCharacter != -1) {
-    writeByte(outputBlock, lastCharacter);
+  return outputSize;
+}
+
+/* decodeOnePiece()
+ *
+ * Decode one piece straight into its place in the output. Run by
+ * runTasks(). The piece has already been checked by
+ * findDecodedPieces().
+ *
+ * Parameters:
+ * context - the RunLengthTasks
+ * index - number of the piece
+ */
+static void decodeOnePiece(void* context, size_t index) {
+  RunLengthTasks* tasks = context;
+  const RunLengthCode* code = &tasks->code;
+  const RunLengthPiece* piece = &tasks->pieces[index];
+  const unsigned char* charPointer = tasks->input + piece->inputOffset;
+  unsigned char* output = tasks->output + piece->outputOffset;
+  LiteralLengthFunction literalLength = getKernels()->literalLength;
+  size_t offset = 0;
+
+  while (offset < piece->inputSize) {
+    if (charPointer[offset] == code->escapeSymbol) {
+      *output++ = charPointer[offset + 1];
+      offset += 2;
+    }
+    else if (charPointer[offset] == code->repeatSymbol) {
+      size_t length;
+      const unsigned char* pattern;
+      size_t period;
+      offset = readRun(code, charPointer, piece->inputSize, offset,
+                       &length, &pattern, &period);
+      fillPattern(output, length, pattern, period);
+      output += length;
+    }
+    else {
+      size_t length = literalLength(charPointer + offset,
+                                    piece->inputSize - offset,
+                                    code->repeatSymbol, code->escapeSymbol);
+      memcpy(output, charPointer + offset, length);
+      output += length;
+      offset += length;
+    }
   }
+}
 
-  displayStatistics("Run length encoding", inputBlock, outputBlock);
+/* decodeInPieces()
+ *
+ * Run length decode a block on several threads, as described at the
+ * top of this file.
+ *
+ * Parameters:
+ * inputBlock - Descriptor of input block to decode
+ * code - format and symbols in use
+ * start - offset of the encoded data
+ *
+ * Return value:
+ * Decoded block, the same as decoding on one thread gives
+ */
+static BlockDescriptor* decodeInPieces(BlockDescriptor* inputBlock,
+                                       const RunLengthCode* code,
+                                       size_t start) {
+  BlockDescriptor* outputBlock = NULL;
+  RunLengthTasks tasks;
+  size_t pieceCount;
+  size_t outputSize;
+
+  tasks.code = *code;
+  tasks.input = inputBlock->address;
+  tasks.pieces = makePieces(inputBlock->usedSize, &pieceCount);
+  outputSize = findDecodedPieces(inputBlock, code, start, tasks.pieces,
+                                 pieceCount);
+  outputBlock = makeMemoryBlock(outputSize ? outputSize : 1);
+  tasks.output = outputBlock->address;
+  runTasks(pieceCount, decodeOnePiece, &tasks);
+  outputBlock->usedSize = outputSize;
+  outputBlock->nextFreeByte = outputSize;
+
+  free(tasks.pieces);
   return outputBlock;
 }
 
-/* runLengthDecompress()
+/* runLengthDecompressToSegments()
  *
- * Run length decode the input block, returning a new block containing
- * decoded data.
+ * Run length decode the input block into a segmented buffer. The size
+ * of the output isn't known until it has all been decoded, so it goes
+ * into chunks which are added as they fill rather than into one block
+ * which would have to be reallocated and copied as it grew.
  *
  * Parameters:
  * inputBlock - Descriptor of input block to decode
  *
  * Return value:
- * Pointer to heap allocated output block descriptor pointing to
- * heap allocated block which has been decoded.
+ * Segmented buffer holding the decoded data, or NULL if the block
+ * isn't run length encoded
  */
-BlockDescriptor* runLengthDecompress(BlockDescriptor* inputBlock) {
-  BlockDescriptor* outputBlock = makeMemoryBlock(inputBlock->usedSize);
+SegmentedBuffer* runLengthDecompressToSegments(BlockDescriptor* inputBlock) {
+  SegmentedBuffer* segments = NULL;
   const unsigned char* charPointer = NULL;
-
-  unsigned long offset = 0;
+  LiteralLengthFunction literalLength = getKernels()->literalLength;
+  RunLengthCode code;
+  unsigned char decodedEncoding;
+  size_t offset = 0;
 
   if (!isRleCompressed(inputBlock)) {
     return NULL;
   }
+  offset = readCode(inputBlock, &code);
+  decodedEncoding = inputBlock->encoding &
+    ~(ENCODING_RUN_LENGTH | ENCODING_RLE_V2);
 
-  outputBlock->encoding = inputBlock->encoding & ~ENCODING_RUN_LENGTH;
+  /* A large block is scanned to find the size of the output, so it can
+   * be decoded into one block
+   */
+  if (canRunLengthCodeInParallel(inputBlock->usedSize)) {
+    BlockDescriptor* outputBlock = decodeInPieces(inputBlock, &code, offset);
+    outputBlock->encoding = decodedEncoding;
+    segments = makeSegmentedBuffer(0);
+    attachBlockToSegments(segments, outputBlock);
+    segments->encoding = outputBlock->encoding;
+    displaySizeStatistics("Run length encoding", inputBlock->usedSize,
+                          segments->usedSize);
+    return segments;
+  }
+
+  /* Chunks about the size of the input, as the output is usually a
+   * little bigger
+   */
+  segments = makeSegmentedBuffer(inputBlock->usedSize < SEGMENT_CHUNK_SIZE ?
+                                 inputBlock->usedSize : SEGMENT_CHUNK_SIZE);
+  segments->encoding = decodedEncoding;
 
   charPointer = inputBlock->address;
-  offset = 0;
   while (offset < inputBlock->usedSize) {
-    if (charPointer[offset] == ESCAPE_SYMBOL) {
+    if (charPointer[offset] == code.escapeSymbol) {
       if (++offset >= inputBlock->usedSize) {
         error(False, "Damaged input file - ends with escape symbol");
       }
-      writeToBlock(outputBlock, charPointer[offset]);
+      appendByteToSegments(segments, charPointer[offset++]);
     }
-    else if (charPointer[offset] == REPEAT_SYMBOL) {
-      unsigned numberOfCharsToOutput = 0;
-      unsigned count = 0;
-      unsigned char repeatCount = 0;
-
-      if (++offset >= inputBlock->usedSize) {
-        error(False, "Damaged input file - ends with repeat symbol");
-      }
-      repeatCount = charPointer[offset];
-      /* Repeat count means number of repeats of char - i.e. 1 means the
-       * char occurs twice. As a repeat count of 0 is pointless, 0 means
-       * the char repeats 255 times - i.e. there are 256 of them.
-       */
-      numberOfCharsToOutput = repeatCount;
-      if (numberOfCharsToOutput == 0) {
-        numberOfCharsToOutput = 255;
-      }
-
-      if (++offset >= inputBlock->usedSize) {
-        error(False, "Damaged input file - ends with repeat count");
-      }
-      for (count = 0; count <= numberOfCharsToOutput; count++) {
-        writeToBlock(outputBlock, charPointer[offset]);
-      }
-
+    else if (charPointer[offset] == code.repeatSymbol) {
+      size_t length;
+      const unsigned char* pattern;
+      size_t period;
+      offset = readRun(&code, charPointer, inputBlock->usedSize, offset,
+                       &length, &pattern, &period);
+      appendPatternToSegments(segments, length, pattern, period);
     }
     else {
-      writeToBlock(outputBlock, charPointer[offset]);
+      /* Copy everything up to the next symbol at once */
+      size_t length = literalLength(charPointer + offset,
+                                    inputBlock->usedSize - offset,
+                                    code.repeatSymbol, code.escapeSymbol);
+      appendBytesToSegments(segments, charPointer + offset, length);
+      offset += length;
     }
-      offset++;
   }
 
-  displayStatistics("Run length encoding", inputBlock, outputBlock);
-  return outputBlock;
+  displaySizeStatistics("Run length encoding", inputBlock->usedSize,
+                        segments->usedSize);
+  return segments;
+}
+
+/* runLengthDecompress()
+ *
+ * Run length decode the input block, returning a new block containing
+ * decoded data.
+ *
+ * Parameters:
+ * inputBlock - Descriptor of input block to decode
+ *
+ * Return value:
+ * Pointer to heap allocated output block descriptor pointing to
+ * heap allocated block which has been decoded.
+ */
+BlockDescriptor* runLengthDecompress(BlockDescriptor* inputBlock) {
+  SegmentedBuffer* segments = runLengthDecompressToSegments(inputBlock);
+  if (segments == NULL) {
+    return NULL;
+  }
+  return flattenSegments(segments);
 }
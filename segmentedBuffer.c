@@ -0,0 +1,417 @@
+/* segmentedBuffer.c
+ *
+ * Segmented buffers, for output whose size isn't known in advance. A
+ * block descriptor holds its data in one piece of memory, so a block
+ * which outgrows its buffer has to be reallocated and everything
+ * written so far copied across, and while that happens both the old
+ * and the new buffer are held, two and a half times the data at the
+ * peak. A segmented buffer is a chain of pieces instead. Bytes are
+ * appended to fixed size chunks, and when the last chunk is full a new
+ * one is added to the chain, so nothing already written is ever moved.
+ * A block which is already in memory, such as a compressed block of a
+ * blocked file, can be attached to the chain as it is, without being
+ * copied at all.
+ *
+ * The pieces are read in order with an iterator, and written to a file
+ * with writev(), which hands the kernel all of them in one system call
+ * rather than gathering them into one buffer first. Code which needs
+ * the data in one piece, as most of the program still does, can have
+ * it with flattenSegments(), which copies it once into a block of
+ * exactly the right size.
+ *
+ * The chunks come from the buffer pool, so they are reused as blocks'
+ * buffers are.
+ */
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "bufferPool.h"
+#include "dataBlocks.h"
+#include "header.h"
+#include "segmentedBuffer.h"
+#include "statistics.h"
+#include "trace.h"
+
+#ifndef IOV_MAX
+#define IOV_MAX (1024)
+#endif
+
+/* Smallest chunk worth having */
+#define SEGMENT_MINIMUM_CHUNK_SIZE (4096)
+
+/* makeSegmentedBuffer()
+ *
+ * Constructs an empty segmented buffer.
+ *
+ * Parameters:
+ * chunkSize - size of the chunks appended bytes are copied into, or 0
+ *             for SEGMENT_CHUNK_SIZE
+ *
+ * Return value:
+ * The buffer, to be freed with freeSegmentedBuffer()
+ */
+SegmentedBuffer* makeSegmentedBuffer(size_t chunkSize) {
+  SegmentedBuffer* segments = malloc(sizeof(SegmentedBuffer));
+  if (segments == NULL) {
+    error(True, "malloc failed to make segmented buffer");
+  }
+  if (chunkSize == 0) {
+    chunkSize = SEGMENT_CHUNK_SIZE;
+  }
+  if (chunkSize < SEGMENT_MINIMUM_CHUNK_SIZE) {
+    chunkSize = SEGMENT_MINIMUM_CHUNK_SIZE;
+  }
+  segments->first = NULL;
+  segments->last = NULL;
+  segments->chunkSize = chunkSize;
+  segments->segmentCount = 0;
+  segments->usedSize = 0;
+  segments->encoding = 0;
+  return segments;
+}
+
+/* freeSegmentedBuffer()
+ *
+ * Free a segmented buffer, its chunks and the blocks attached to it.
+ *
+ * Parameters:
+ * segments - buffer to free, or NULL
+ */
+void freeSegmentedBuffer(SegmentedBuffer* segments) {
+  Segment* segment = NULL;
+
+  if (segments == NULL) {
+    return;
+  }
+  segment = segments->first;
+  while (segment) {
+    Segment* next = segment->next;
+    if (segment->block) {
+      freeBlock(segment->block);
+    }
+    else {
+      releaseBuffer(segment->address, segment->capacity);
+    }
+    free(segment);
+    segment = next;
+  }
+  free(segments);
+}
+
+/* addSegment()
+ *
+ * Add an empty segment to the end of the chain.
+ *
+ * Parameters:
+ * segments - buffer to add to
+ *
+ * Return value:
+ * The new segment
+ */
+static Segment* addSegment(SegmentedBuffer* segments) {
+  Segment* segment = malloc(sizeof(Segment));
+  if (segment == NULL) {
+    error(True, "malloc failed to add to segmented buffer");
+  }
+  segment->next = NULL;
+  segment->address = NULL;
+  segment->size = 0;
+  segment->capacity = 0;
+  segment->block = NULL;
+  if (segments->last) {
+    segments->last->next = segment;
+  }
+  else {
+    segments->first = segment;
+  }
+  segments->last = segment;
+  segments->segmentCount++;
+  return segment;
+}
+
+/* getChunkSpace()
+ *
+ * Find room in the last chunk, adding a new chunk if it is full or the
+ * last segment is an attached block.
+ *
+ * Parameters:
+ * segments - buffer to append to
+ *
+ * Return value:
+ * A chunk with at least one free byte
+ */
+static Segment* getChunkSpace(SegmentedBuffer* segments) {
+  Segment* segment = segments->last;
+  if ((segment == NULL) || segment->block ||
+      (segment->size >= segment->capacity)) {
+    segment = addSegment(segments);
+    segment->address = allocateBuffer(segments->chunkSize,
+                                      &segment->capacity);
+  }
+  return segment;
+}
+
+/* appendByteToSegments()
+ *
+ * Append a byte to a segmented buffer.
+ *
+ * Parameters:
+ * segments - buffer to append to
+ * byte - byte to append
+ */
+void appendByteToSegments(SegmentedBuffer* segments, unsigned char byte) {
+  Segment* segment = segments->last;
+  /* An attached block has no capacity, so this catches that too */
+  if ((segment == NULL) || (segment->size >= segment->capacity)) {
+    segment = getChunkSpace(segments);
+  }
+  segment->address[segment->size++] = byte;
+  segments->usedSize++;
+}
+
+/* appendRunToSegments()
+ *
+ * Append the same byte a number of times to a segmented buffer.
+ *
+ * Parameters:
+ * segments - buffer to append to
+ * byte - byte to append
+ * count - number of times to append it
+ */
+void appendRunToSegments(SegmentedBuffer* segments,
+                         unsigned char byte,
+                         size_t count) {
+  while (count) {
+    Segment* segment = getChunkSpace(segments);
+    size_t size = segment->capacity - segment->size;
+    if (size > count) {
+      size = count;
+    }
+    memset(segment->address + segment->size, byte, size);
+    segment->size += size;
+    segments->usedSize += size;
+    count -= size;
+  }
+}
+
+/* appendBytesToSegments()
+ *
+ * Copy bytes to the end of a segmented buffer.
+ *
+ * Parameters:
+ * segments - buffer to append to
+ * address - bytes to append
+ * size - number of bytes
+ */
+void appendBytesToSegments(SegmentedBuffer* segments,
+                           const unsigned char* address,
+                           size_t size) {
+  while (size) {
+    Segment* segment = getChunkSpace(segments);
+    size_t chunkSize = segment->capacity - segment->size;
+    if (chunkSize > size) {
+      chunkSize = size;
+    }
+    memcpy(segment->address + segment->size, address, chunkSize);
+    segment->size += chunkSize;
+    segments->usedSize += chunkSize;
+    address += chunkSize;
+    size -= chunkSize;
+  }
+}
+
+/* attachBlockToSegments()
+ *
+ * Add a block to the end of a segmented buffer without copying it.
+ * Bytes appended afterwards go in a new chunk after it.
+ *
+ * Parameters:
+ * segments - buffer to append to
+ * block - block to attach. The buffer takes ownership of it and frees
+ *         it in freeSegmentedBuffer(), so a view must be used for data
+ *         which belongs to something else.
+ */
+void attachBlockToSegments(SegmentedBuffer* segments,
+                           BlockDescriptor* block) {
+  Segment* segment = addSegment(segments);
+  segment->block = block;
+  segment->address = block->address;
+  segment->size = block->usedSize;
+  segments->usedSize += block->usedSize;
+}
+
+/* startSegmentIterator()
+ *
+ * Get ready to read a segmented buffer from the start.
+ *
+ * Parameters:
+ * segments - buffer to read
+ * iterator - set to the first segment
+ */
+void startSegmentIterator(const SegmentedBuffer* segments,
+                          SegmentIterator* iterator) {
+  iterator->segment = segments->first;
+}
+
+/* nextSegment()
+ *
+ * Get the next piece of a segmented buffer.
+ *
+ * Parameters:
+ * iterator - position in the buffer, moved on to the following piece
+ * address - set to the start of the piece
+ * size - set to the number of bytes in it
+ *
+ * Return value:
+ * False if there are no more pieces
+ */
+Boolean nextSegment(SegmentIterator* iterator,
+                    const unsigned char** address,
+                    size_t* size) {
+  if (iterator->segment == NULL) {
+    return False;
+  }
+  *address = iterator->segment->address;
+  *size = iterator->segment->size;
+  iterator->segment = iterator->segment->next;
+  return True;
+}
+
+/* flattenSegments()
+ *
+ * Turn a segmented buffer into a block. A buffer which is just one
+ * attached block gives that block back; otherwise the pieces are
+ * copied, once, into a new block of exactly the right size.
+ *
+ * Parameters:
+ * segments - buffer to flatten. It is freed by this function.
+ *
+ * Return value:
+ * Block holding the data, with the encoding of the buffer
+ */
+BlockDescriptor* flattenSegments(SegmentedBuffer* segments) {
+  BlockDescriptor* block = NULL;
+  SegmentIterator iterator;
+  const unsigned char* address = NULL;
+  size_t size = 0;
+
+  if ((segments->segmentCount == 1) && segments->first->block) {
+    block = segments->first->block;
+    segments->first->block = NULL;
+    segments->first->capacity = 0;
+    segments->first->address = NULL;
+  }
+  else {
+    block = makeMemoryBlock(segments->usedSize ? segments->usedSize : 1);
+    startSegmentIterator(segments, &iterator);
+    while (nextSegment(&iterator, &address, &size)) {
+      memcpy(block->address + block->usedSize, address, size);
+      block->usedSize += size;
+    }
+    block->nextFreeByte = block->usedSize;
+    countCopy(block->usedSize);
+  }
+  block->encoding = segments->encoding;
+  freeSegmentedBuffer(segments);
+  return block;
+}
+
+/* writeAll()
+ *
+ * Write a list of pieces of memory to a file with writev(), carrying
+ * on after short writes.
+ *
+ * Parameters:
+ * fileDescriptor - file to write to
+ * vectors - the pieces. They are changed as they are written.
+ * count - number of pieces
+ * filename - name of the file, for errors
+ */
+static void writeAll(int fileDescriptor, struct iovec* vectors, int count,
+                     const char* filename) {
+  while (count) {
+    ssize_t written = writev(fileDescriptor, vectors, count);
+    if (written < 0) {
+      error(True, "Unable to write to %s", filename);
+    }
+    while (count && ((size_t)written >= vectors->iov_len)) {
+      written -= vectors->iov_len;
+      vectors++;
+      count--;
+    }
+    if (count) {
+      vectors->iov_base = (char*)vectors->iov_base + written;
+      vectors->iov_len -= written;
+    }
+  }
+}
+
+/* createSegmentedFile()
+ *
+ * Create a file from a segmented buffer, writing the pieces with
+ * writev() a batch at a time. "-" writes to standard output.
+ *
+ * Parameters:
+ * filename - file to create, or "-"
+ * segments - data to write
+ * outputHeader - True to write the compressed file header first, with
+ *                the encoding of the buffer
+ */
+void createSegmentedFile(const char* filename,
+                         const SegmentedBuffer* segments,
+                         Boolean outputHeader) {
+  Boolean toStandardOutput = !strcmp(filename, "-") ? True : False;
+  struct iovec vectors[IOV_MAX];
+  unsigned char header[16];
+  BlockDescriptor headerBlock;
+  SegmentIterator iterator;
+  const unsigned char* address = NULL;
+  size_t size = 0;
+  int fileDescriptor;
+  int count = 0;
+  double start = traceClock();
+
+  if (toStandardOutput) {
+    /* Anything already printed has to come first */
+    fflush(stdout);
+    fileDescriptor = STDOUT_FILENO;
+  }
+  else {
+    fileDescriptor = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fileDescriptor < 0) {
+      error(True, "Unable to create %s", filename);
+    }
+  }
+
+  if (outputHeader) {
+    memset(&headerBlock, 0, sizeof(headerBlock));
+    headerBlock.encoding = segments->encoding;
+    fillHeader(header, &headerBlock);
+    vectors[count].iov_base = header;
+    vectors[count].iov_len = getHeaderSize();
+    count++;
+  }
+  startSegmentIterator(segments, &iterator);
+  while (nextSegment(&iterator, &address, &size)) {
+    if (size == 0) {
+      continue;
+    }
+    if (count == IOV_MAX) {
+      writeAll(fileDescriptor, vectors, count, filename);
+      count = 0;
+    }
+    vectors[count].iov_base = (void*)address;
+    vectors[count].iov_len = size;
+    count++;
+  }
+  writeAll(fileDescriptor, vectors, count, filename);
+
+  if (!toStandardOutput && close(fileDescriptor)) {
+    error(True, "Unable to close %s", filename);
+  }
+  traceEvent("write-file", "io", start);
+}
@@ -0,0 +1,66 @@
+#ifndef SEGMENTED_BUFFER_H
+#define SEGMENTED_BUFFER_H
+
+/* Declarations for buffers made of a chain of separate pieces of
+ * memory, in segmentedBuffer.c
+ */
+
+#include "compression.h"
+
+/* Size of the chunks appended data is copied into if no other size is
+ * given
+ */
+#define SEGMENT_CHUNK_SIZE (1024 * 1024)
+
+/* One piece of a segmented buffer: either a chunk of chunkSize bytes
+ * owned by the buffer, or a whole block attached to it
+ */
+typedef struct SegmentStruct {
+  struct SegmentStruct* next;
+  unsigned char* address;
+  size_t size;
+  /* Size of the chunk, or 0 for an attached block */
+  size_t capacity;
+  BlockDescriptor* block;
+} Segment;
+
+struct SegmentedBufferStruct {
+  Segment* first;
+  Segment* last;
+  size_t chunkSize;
+  size_t segmentCount;
+  /* Total number of bytes in all of the segments */
+  size_t usedSize;
+  unsigned char encoding;
+};
+
+/* Position in a segmented buffer, for reading it a segment at a time */
+typedef struct {
+  const Segment* segment;
+} SegmentIterator;
+
+SegmentedBuffer* makeSegmentedBuffer(size_t chunkSize);
+void freeSegmentedBuffer(SegmentedBuffer* segments);
+
+void appendByteToSegments(SegmentedBuffer* segments, unsigned char byte);
+void appendRunToSegments(SegmentedBuffer* segments,
+                         unsigned char byte,
+                         size_t count);
+void appendBytesToSegments(SegmentedBuffer* segments,
+                           const unsigned char* address,
+                           size_t size);
+void attachBlockToSegments(SegmentedBuffer* segments,
+                           BlockDescriptor* block);
+
+void startSegmentIterator(const SegmentedBuffer* segments,
+                          SegmentIterator* iterator);
+Boolean nextSegment(SegmentIterator* iterator,
+                    const unsigned char** address,
+                    size_t* size);
+
+BlockDescriptor* flattenSegments(SegmentedBuffer* segments);
+void createSegmentedFile(const char* filename,
+                         const SegmentedBuffer* segments,
+                         Boolean outputHeader);
+
+#endif
@@ -0,0 +1,873 @@
+/* sidecarIndex.c
+ *
+ * Seek indexes for single stream compressed files. A single stream file
+ * is one Huffman code stream over one run length encoded stream, so
+ * normally the only way to get at any of it is to decode it from the
+ * start, on one thread. The blocked format fixes that for new files,
+ * but files already written as a single stream can't be changed.
+ * Instead they can be scanned once and a small index written beside
+ * them, in a file of the same name with SIDECAR_SUFFIX added. The
+ * compressed file itself is only read.
+ *
+ * Every interval bytes of the run length decoded stream the index
+ * records everything needed to carry on decoding from there: the bit
+ * at which the next Huffman code starts, how much of the run length
+ * encoded stream has been read, and the rest of a run which was only
+ * partly output. Entries always fall between whole run length encoded
+ * symbols and whole Huffman codes, so there is never an escape or a
+ * repeat count half read. Decompression can then start a thread at
+ * each entry, and a range can be decoded from the entry before it.
+ *
+ * A flipped file's stream is the flipped data, whose bytes each hold
+ * one bit of eight different original bytes, so it is unflipped after
+ * it has been decoded in parallel, and a range needs eight pieces of
+ * it, one for each bit plane. Where those pieces are follows from the
+ * offset and the size of the data, so nothing more needs to be stored.
+ *
+ * The index has the following format. Numbers are little endian and
+ * [n] is the number of bytes.
+ *
+ * <"JLIX" [4]> <format version [1]> <compression flags [1]>
+ * <compressed size [8]> <fingerprint [4]>
+ * <interval [8]> <stream size [8]> <run length encoded size [8]>
+ * <entry count [8]>
+ * <stream offset [8]> <source bit [8]> <run length encoded offset [8]>
+ *     <run byte [1]> <run remaining [2]>            (once per entry)
+ * <index checksum [4]>
+ *
+ * The compressed size and flags and the fingerprint, the CRC32C of the
+ * first and last SIDECAR_FINGERPRINT_SIZE bytes of the compressed data,
+ * tie the index to the file it was made from, so that an index left
+ * behind when the file is replaced isn't used. The index checksum is
+ * the CRC32C of everything before it.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "batch.h"
+#include "crc32c.h"
+#include "dataBlocks.h"
+#include "header.h"
+#include "huffmanCompressor.h"
+#include "sidecarIndex.h"
+#include "statistics.h"
+#include "threadPool.h"
+
+#define SIDECAR_MAGIC "JLIX"
+#define SIDECAR_FORMAT_VERSION (1)
+#define SIDECAR_HEADER_SIZE (50)
+#define SIDECAR_ENTRY_SIZE (27)
+
+/* Bytes at each end of the compressed data covered by the fingerprint */
+#define SIDECAR_FINGERPRINT_SIZE (4096)
+
+/* The parts of a compressed file which don't change as it is decoded,
+ * shared by every decoder of the file
+ */
+typedef struct {
+  unsigned char* address;
+  /* Size of the data, without the checksum */
+  size_t dataSize;
+  unsigned char encoding;
+  Boolean hasChecksum;
+  unsigned long checksum;
+  /* Offset of the first Huffman code, after the frequency table */
+  size_t codeOffset;
+  HuffmanTree tree;
+  /* Root of the tree, or NULL if the file isn't Huffman compressed */
+  HuffmanNode* root;
+  /* Size of the run length encoded stream */
+  unsigned long rleSize;
+} StreamSource;
+
+/* Position of one decoder in the stream */
+typedef struct {
+  const StreamSource* source;
+  /* View of the data, whose read position is the next code or byte */
+  BlockDescriptor* view;
+  unsigned long rleOffset;
+  unsigned char runByte;
+  unsigned runRemaining;
+} StreamDecoder;
+
+/* openStream()
+ *
+ * Find the Huffman codes in a single stream file and build the tree
+ * to decode them with.
+ *
+ * Parameters:
+ * inputBlock - compressed data
+ * source - filled in
+ */
+static void openStream(BlockDescriptor* inputBlock, StreamSource* source) {
+  FrequencyTable frequencyTable;
+  BlockDescriptor* view = NULL;
+
+  if (inputBlock->encoding & ENCODING_BLOCKED) {
+    error(False, "File is in the blocked format, which has its own seek index");
+  }
+  if (inputBlock->encoding & ENCODING_SHARED_TABLE) {
+    error(False, "Files compressed with a dictionary can't be indexed");
+  }
+  /* A seek point records what is left of a run in two bytes, which
+   * isn't enough for version 2 runs
+   */
+  if (inputBlock->encoding & ENCODING_RLE_V2) {
+    error(False, "Files run length encoded with --rle2 can't be indexed");
+  }
+  /* Nor can a filtered stream be undone from a seek point, since each
+   * delta depends on the bytes before it and each shuffled plane spans
+   * the whole file
+   */
+  if (inputBlock->encoding & ENCODING_FILTERED) {
+    error(False, "Filtered files can't be indexed");
+  }
+
+  source->address = inputBlock->address;
+  source->dataSize = inputBlock->usedSize;
+  source->encoding = inputBlock->encoding;
+  source->hasChecksum = False;
+  source->checksum = 0;
+  source->codeOffset = 0;
+  source->root = NULL;
+
+  if (inputBlock->encoding & ENCODING_CHECKSUM) {
+    if (source->dataSize < CHECKSUM_SIZE) {
+      error(False, "Damaged input file - too small to hold its checksum");
+    }
+    source->dataSize -= CHECKSUM_SIZE;
+    view = makeViewBlock(source->address + source->dataSize, CHECKSUM_SIZE, 0);
+    source->checksum = readNumberFromBlock(view, CHECKSUM_SIZE);
+    freeBlock(view);
+    source->hasChecksum = True;
+  }
+
+  if (inputBlock->encoding & ENCODING_HUFFMAN) {
+    view = makeViewBlock(source->address, source->dataSize, 0);
+    source->rleSize = getHuffmanByteCount(view);
+    view->nextByteToRead = sizeof(unsigned long);
+    readFrequencyTableFromBlock(view, frequencyTable);
+    source->codeOffset = view->nextByteToRead;
+    freeBlock(view);
+    source->root = buildHuffmanTree(frequencyTable, &source->tree);
+  }
+  else {
+    source->rleSize = source->dataSize;
+  }
+}
+
+/* startDecoder()
+ *
+ * Get ready to decode from an index entry.
+ *
+ * Parameters:
+ * source - the file
+ * entry - where to start
+ * decoder - filled in. Its view must be freed with freeBlock().
+ */
+static void startDecoder(const StreamSource* source,
+                         const SidecarEntry* entry,
+                         StreamDecoder* decoder) {
+  decoder->source = source;
+  decoder->view = makeViewBlock(source->address, source->dataSize, 0);
+  decoder->view->nextByteToRead = entry->sourceBit / 8;
+  decoder->view->nextBitToRead = entry->sourceBit % 8;
+  decoder->rleOffset = entry->rleOffset;
+  decoder->runByte = entry->runByte;
+  decoder->runRemaining = entry->runRemaining;
+}
+
+/* recordDecoder()
+ *
+ * Fill in an index entry with where a decoder has reached.
+ *
+ * Parameters:
+ * decoder - the decoder
+ * outputOffset - number of bytes it has output
+ * entry - filled in
+ */
+static void recordDecoder(const StreamDecoder* decoder,
+                          unsigned long outputOffset,
+                          SidecarEntry* entry) {
+  entry->outputOffset = outputOffset;
+  entry->sourceBit = decoder->view->nextByteToRead * 8 +
+    decoder->view->nextBitToRead;
+  entry->rleOffset = decoder->rleOffset;
+  entry->runByte = decoder->runByte;
+  entry->runRemaining = decoder->runRemaining;
+}
+
+/* hasMoreStream()
+ *
+ * Return value:
+ * True if the decoder hasn't reached the end of the stream
+ */
+static Boolean hasMoreStream(const StreamDecoder* decoder) {
+  return (decoder->runRemaining ||
+          (decoder->rleOffset < decoder->source->rleSize)) ? True : False;
+}
+
+/* readSourceByte()
+ *
+ * Read the next byte of the run length encoded stream, Huffman decoding
+ * it if the file is Huffman compressed.
+ *
+ * Parameters:
+ * decoder - the decoder
+ *
+ * Return value:
+ * The byte
+ */
+static unsigned char readSourceByte(StreamDecoder* decoder) {
+  HuffmanNode* state = NULL;
+  unsigned char character = 0;
+
+  if (decoder->rleOffset >= decoder->source->rleSize) {
+    error(False, "Damaged input file - stream ends part way through a run");
+  }
+  decoder->rleOffset++;
+  if (decoder->source->root == NULL) {
+    return readFromBlock(decoder->view);
+  }
+  while (!getHuffmanChar(readBitFromBlock(decoder->view),
+                         decoder->source->root, &state, &character)) {
+  }
+  return character;
+}
+
+/* decodeStreamByte()
+ *
+ * Decode the next byte of the run length decoded stream.
+ *
+ * Parameters:
+ * decoder - the decoder
+ *
+ * Return value:
+ * The byte
+ */
+static unsigned char decodeStreamByte(StreamDecoder* decoder) {
+  unsigned char byte;
+  unsigned repeatCount;
+
+  if (decoder->runRemaining) {
+    decoder->runRemaining--;
+    return decoder->runByte;
+  }
+  byte = readSourceByte(decoder);
+  if (!(decoder->source->encoding & ENCODING_RUN_LENGTH)) {
+    return byte;
+  }
+  if (byte == ESCAPE_SYMBOL) {
+    return readSourceByte(decoder);
+  }
+  if (byte == REPEAT_SYMBOL) {
+    /* As in runLengthDecompressToSegments(), 0 stands for 255 */
+    repeatCount = readSourceByte(decoder);
+    if (repeatCount == 0) {
+      repeatCount = 255;
+    }
+    decoder->runByte = readSourceByte(decoder);
+    decoder->runRemaining = repeatCount;
+    return decoder->runByte;
+  }
+  return byte;
+}
+
+/* getFingerprint()
+ *
+ * Parameters:
+ * inputBlock - compressed data
+ *
+ * Return value:
+ * CRC32C of the start and end of the data
+ */
+static unsigned long getFingerprint(const BlockDescriptor* inputBlock) {
+  size_t size = inputBlock->usedSize < SIDECAR_FINGERPRINT_SIZE ?
+    inputBlock->usedSize : SIDECAR_FINGERPRINT_SIZE;
+  unsigned long fingerprint = crc32c(0, inputBlock->address, size);
+  return crc32c(fingerprint,
+                inputBlock->address + inputBlock->usedSize - size, size);
+}
+
+/* makeSidecarFilename()
+ *
+ * Parameters:
+ * filename - compressed file
+ *
+ * Return value:
+ * Name of its index, to be freed by the caller
+ */
+char* makeSidecarFilename(const char* filename) {
+  char* sidecarFilename = malloc(strlen(filename) +
+                                 strlen(SIDECAR_SUFFIX) + 1);
+  if (sidecarFilename == NULL) {
+    error(True, "unable to malloc space for filename");
+  }
+  strcpy(sidecarFilename, filename);
+  strcat(sidecarFilename, SIDECAR_SUFFIX);
+  return sidecarFilename;
+}
+
+/* buildSidecarIndex()
+ *
+ * Decode a single stream file from start to end, recording an index
+ * entry every interval bytes.
+ *
+ * Parameters:
+ * inputBlock - compressed data
+ * interval - bytes of the run length decoded stream between entries
+ *
+ * Return value:
+ * Index, to be freed with freeSidecarIndex()
+ */
+static SidecarIndex* buildSidecarIndex(BlockDescriptor* inputBlock,
+                                       unsigned long interval) {
+  SidecarIndex* index = malloc(sizeof(SidecarIndex));
+  StreamSource* source = malloc(sizeof(StreamSource));
+  StreamDecoder decoder;
+  SidecarEntry start;
+  size_t allocatedCount = 16;
+  unsigned long offset = 0;
+
+  if ((index == NULL) || (source == NULL)) {
+    error(True, "malloc failed for seek index");
+  }
+  openStream(inputBlock, source);
+  index->encoding = inputBlock->encoding;
+  index->interval = interval;
+  index->rleSize = source->rleSize;
+  index->entryCount = 0;
+  index->entries = malloc(allocatedCount * sizeof(SidecarEntry));
+  if (index->entries == NULL) {
+    error(True, "malloc failed for seek index");
+  }
+
+  memset(&start, 0, sizeof(start));
+  start.sourceBit = source->codeOffset * 8;
+  startDecoder(source, &start, &decoder);
+  while (hasMoreStream(&decoder)) {
+    if (offset % interval == 0) {
+      if (index->entryCount == allocatedCount) {
+        allocatedCount *= 2;
+        index->entries = realloc(index->entries,
+                                 allocatedCount * sizeof(SidecarEntry));
+        if (index->entries == NULL) {
+          error(True, "realloc failed for seek index of %lu entries",
+                (unsigned long)allocatedCount);
+        }
+      }
+      recordDecoder(&decoder, offset, &index->entries[index->entryCount++]);
+    }
+    decodeStreamByte(&decoder);
+    offset++;
+  }
+  index->streamSize = offset;
+
+  freeBlock(decoder.view);
+  free(source);
+  return index;
+}
+
+/* writeSidecarIndex()
+ *
+ * Write an index to its file, in the format described above.
+ *
+ * Parameters:
+ * filename - name of the index file
+ * index - the index
+ * inputBlock - compressed data it was made from
+ */
+static void writeSidecarIndex(const char* filename,
+                              const SidecarIndex* index,
+                              const BlockDescriptor* inputBlock) {
+  BlockDescriptor* block =
+    makeMemoryBlock(SIDECAR_HEADER_SIZE +
+                    index->entryCount * SIDECAR_ENTRY_SIZE + CHECKSUM_SIZE);
+  size_t entry;
+
+  writeBytesToBlock(block, (const unsigned char*)SIDECAR_MAGIC, 4);
+  writeNumberToBlock(block, SIDECAR_FORMAT_VERSION, 1);
+  writeNumberToBlock(block, index->encoding, 1);
+  writeNumberToBlock(block, inputBlock->usedSize, 8);
+  writeNumberToBlock(block, getFingerprint(inputBlock), 4);
+  writeNumberToBlock(block, index->interval, 8);
+  writeNumberToBlock(block, index->streamSize, 8);
+  writeNumberToBlock(block, index->rleSize, 8);
+  writeNumberToBlock(block, index->entryCount, 8);
+  for (entry = 0; entry < index->entryCount; entry++) {
+    writeNumberToBlock(block, index->entries[entry].outputOffset, 8);
+    writeNumberToBlock(block, index->entries[entry].sourceBit, 8);
+    writeNumberToBlock(block, index->entries[entry].rleOffset, 8);
+    writeNumberToBlock(block, index->entries[entry].runByte, 1);
+    writeNumberToBlock(block, index->entries[entry].runRemaining, 2);
+  }
+  writeNumberToBlock(block, crc32c(0, block->address, block->usedSize),
+                     CHECKSUM_SIZE);
+
+  createFile(filename, block, False);
+  freeBlock(block);
+}
+
+/* A file to index, and what happened */
+typedef struct {
+  const char* filename;
+  Boolean indexed;
+  unsigned long streamSize;
+  size_t entryCount;
+} IndexedFile;
+
+/* Shared by the tasks indexing a list of files */
+typedef struct {
+  IndexedFile* files;
+  unsigned long interval;
+} IndexTasks;
+
+/* indexOneFile()
+ *
+ * Make the index of one file. Run by runTasks(), so files may be
+ * indexed at the same time.
+ *
+ * Parameters:
+ * context - the IndexTasks
+ * fileIndex - number of the file
+ */
+static void indexOneFile(void* context, size_t fileIndex) {
+  IndexTasks* tasks = context;
+  IndexedFile* file = &tasks->files[fileIndex];
+  BlockDescriptor* inputBlock = NULL;
+  SidecarIndex* index = NULL;
+  char* sidecarFilename = NULL;
+  StageTimer timer;
+
+  if (!getCompressionFlags(file->filename, False)) {
+    return;
+  }
+  setErrorFilename(file->filename);
+  inputBlock = mapCompressedFile(file->filename);
+  if (!(inputBlock->encoding & (ENCODING_BLOCKED | ENCODING_SHARED_TABLE))) {
+    startStage(&timer, "make-index", inputBlock->usedSize);
+    index = buildSidecarIndex(inputBlock, tasks->interval);
+    sidecarFilename = makeSidecarFilename(file->filename);
+    writeSidecarIndex(sidecarFilename, index, inputBlock);
+    finishStage(&timer, index->entryCount * SIDECAR_ENTRY_SIZE);
+    file->indexed = True;
+    file->streamSize = index->streamSize;
+    file->entryCount = index->entryCount;
+    free(sidecarFilename);
+    freeSidecarIndex(index);
+  }
+  freeBlock(inputBlock);
+  setErrorFilename(NULL);
+}
+
+/* makeSidecarIndexes()
+ *
+ * Write an index beside each single stream file in a list. Blocked
+ * files, which have their own index, files compressed with a
+ * dictionary and files which aren't compressed are skipped.
+ *
+ * Parameters:
+ * names - files, or directories standing for the files in them
+ * nameCount - number of names
+ * interval - bytes of the decoded stream between entries, or 0 for
+ *            SIDECAR_INTERVAL
+ */
+void makeSidecarIndexes(char** names, size_t nameCount,
+                        unsigned long interval) {
+  size_t fileCount = 0;
+  char** filenames = makeFileList(names, nameCount, &fileCount);
+  Boolean statistics = enableStatistics(False);
+  IndexTasks tasks;
+  size_t indexedCount = 0;
+  size_t index;
+
+  tasks.interval = interval ? interval : SIDECAR_INTERVAL;
+  tasks.files = calloc(fileCount ? fileCount : 1, sizeof(IndexedFile));
+  if (tasks.files == NULL) {
+    error(True, "malloc failed for list of %lu files",
+          (unsigned long)fileCount);
+  }
+  for (index = 0; index < fileCount; index++) {
+    tasks.files[index].filename = filenames[index];
+  }
+
+  runTasks(fileCount, indexOneFile, &tasks);
+
+  for (index = 0; index < fileCount; index++) {
+    const IndexedFile* file = &tasks.files[index];
+    if (file->indexed) {
+      printf("%s: %lu bytes, %lu index entr%s written to %s%s\n",
+             file->filename, file->streamSize,
+             (unsigned long)file->entryCount,
+             (file->entryCount == 1) ? "y" : "ies",
+             file->filename, SIDECAR_SUFFIX);
+      indexedCount++;
+    }
+    else {
+      printf("%s: not a single stream compressed file, skipped\n",
+             file->filename);
+    }
+  }
+
+  enableStatistics(statistics);
+  printf("%lu of %lu files indexed\n",
+         (unsigned long)indexedCount, (unsigned long)fileCount);
+  free(tasks.files);
+  freeFileList(filenames, fileCount);
+}
+
+/* loadSidecarIndex()
+ *
+ * Read the index beside a compressed file, if it has one.
+ *
+ * Parameters:
+ * filename - compressed file
+ * inputBlock - its compressed data
+ *
+ * Return value:
+ * Index, to be freed with freeSidecarIndex(), or NULL if there isn't
+ * one
+ */
+SidecarIndex* loadSidecarIndex(const char* filename,
+                               const BlockDescriptor* inputBlock) {
+  char* sidecarFilename = makeSidecarFilename(filename);
+  SidecarIndex* index = NULL;
+  BlockDescriptor* block = NULL;
+  SidecarEntry* entry = NULL;
+  struct stat fileStat;
+  size_t dataSize = inputBlock->usedSize;
+  size_t entryNumber;
+
+  if (stat(sidecarFilename, &fileStat)) {
+    if (errno != ENOENT) {
+      error(True, "Unable to read index %s", sidecarFilename);
+    }
+    free(sidecarFilename);
+    return NULL;
+  }
+  if (fileStat.st_size < SIDECAR_HEADER_SIZE + CHECKSUM_SIZE) {
+    error(False, "Damaged index %s - too small", sidecarFilename);
+  }
+
+  block = mapUncompressedFile(sidecarFilename);
+  block->usedSize -= CHECKSUM_SIZE;
+  block->nextByteToRead = block->usedSize;
+  if (readNumberFromBlock(block, CHECKSUM_SIZE) !=
+      crc32c(0, block->address, block->usedSize)) {
+    error(False, "Damaged index %s - checksum doesn't match", sidecarFilename);
+  }
+  block->nextByteToRead = 0;
+  if (memcmp(block->address, SIDECAR_MAGIC, 4)) {
+    error(False, "%s is not an index", sidecarFilename);
+  }
+  block->nextByteToRead = 4;
+  if (readNumberFromBlock(block, 1) != SIDECAR_FORMAT_VERSION) {
+    error(False, "Index format version %u of %s is not supported",
+          block->address[4], sidecarFilename);
+  }
+
+  index = malloc(sizeof(SidecarIndex));
+  if (index == NULL) {
+    error(True, "malloc failed for seek index");
+  }
+  index->encoding = readNumberFromBlock(block, 1);
+  if ((index->encoding != inputBlock->encoding) ||
+      (readNumberFromBlock(block, 8) != inputBlock->usedSize) ||
+      (readNumberFromBlock(block, 4) != getFingerprint(inputBlock))) {
+    error(False, "Index %s was made from a different file - remake it with --index",
+          sidecarFilename);
+  }
+  index->interval = readNumberFromBlock(block, 8);
+  index->streamSize = readNumberFromBlock(block, 8);
+  index->rleSize = readNumberFromBlock(block, 8);
+  index->entryCount = readNumberFromBlock(block, 8);
+  if ((index->entryCount * SIDECAR_ENTRY_SIZE !=
+       block->usedSize - SIDECAR_HEADER_SIZE) ||
+      (index->interval == 0)) {
+    error(False, "Damaged index %s - bad size", sidecarFilename);
+  }
+
+  index->entries = calloc(index->entryCount ? index->entryCount : 1,
+                          sizeof(SidecarEntry));
+  if (index->entries == NULL) {
+    error(True, "malloc failed for seek index of %lu entries",
+          (unsigned long)index->entryCount);
+  }
+  if (inputBlock->encoding & ENCODING_CHECKSUM) {
+    dataSize -= (dataSize < CHECKSUM_SIZE) ? dataSize : CHECKSUM_SIZE;
+  }
+  for (entryNumber = 0; entryNumber < index->entryCount; entryNumber++) {
+    entry = &index->entries[entryNumber];
+    entry->outputOffset = readNumberFromBlock(block, 8);
+    entry->sourceBit = readNumberFromBlock(block, 8);
+    entry->rleOffset = readNumberFromBlock(block, 8);
+    entry->runByte = readNumberFromBlock(block, 1);
+    entry->runRemaining = readNumberFromBlock(block, 2);
+
+    /* Entries are in order and each is inside the data, so a decoder
+     * started from one can't go off the end
+     */
+    if ((entry->outputOffset !=
+         (unsigned long)entryNumber * index->interval) ||
+        (entry->outputOffset >= index->streamSize) ||
+        (entry->sourceBit > (unsigned long)dataSize * 8) ||
+        (entry->rleOffset > index->rleSize) ||
+        (entry->runRemaining > 255)) {
+      error(False, "Damaged index %s - bad entry %lu", sidecarFilename,
+            (unsigned long)entryNumber);
+    }
+  }
+  if (index->entryCount !=
+      (index->streamSize + index->interval - 1) / index->interval) {
+    error(False, "Damaged index %s - entries don't cover the data",
+          sidecarFilename);
+  }
+
+  freeBlock(block);
+  free(sidecarFilename);
+  return index;
+}
+
+/* freeSidecarIndex()
+ *
+ * Free an index made or loaded by this file.
+ */
+void freeSidecarIndex(SidecarIndex* index) {
+  if (index != NULL) {
+    free(index->entries);
+    free(index);
+  }
+}
+
+/* openIndexedStream()
+ *
+ * Open the stream of a file and check that it matches its index.
+ *
+ * Parameters:
+ * inputBlock - compressed data
+ * index - its index
+ *
+ * Return value:
+ * The stream, to be freed with free()
+ */
+static StreamSource* openIndexedStream(BlockDescriptor* inputBlock,
+                                       const SidecarIndex* index) {
+  StreamSource* source = malloc(sizeof(StreamSource));
+  if (source == NULL) {
+    error(True, "malloc failed for seek index");
+  }
+  openStream(inputBlock, source);
+  if (source->rleSize != index->rleSize) {
+    error(False, "Index doesn't match the file - remake it with --index");
+  }
+  return source;
+}
+
+/* decodeStreamRange()
+ *
+ * Decode part of the run length decoded stream, starting from the
+ * entry before it.
+ *
+ * Parameters:
+ * source - the file
+ * index - its index
+ * offset - offset of the part in the stream
+ * length - length of the part, which must end inside the stream
+ * address - where to put it
+ */
+static void decodeStreamRange(const StreamSource* source,
+                              const SidecarIndex* index,
+                              unsigned long offset,
+                              unsigned long length,
+                              unsigned char* address) {
+  StreamDecoder decoder;
+  unsigned long position;
+
+  if (length == 0) {
+    return;
+  }
+  startDecoder(source, &index->entries[offset / index->interval], &decoder);
+  for (position = offset - offset % index->interval; position < offset;
+       position++) {
+    decodeStreamByte(&decoder);
+  }
+  while (length--) {
+    *address++ = decodeStreamByte(&decoder);
+  }
+  freeBlock(decoder.view);
+}
+
+/* Shared by the tasks decoding the pieces of one file */
+typedef struct {
+  const StreamSource* source;
+  const SidecarIndex* index;
+  unsigned char* address;
+} SegmentTasks;
+
+/* decodeOneSegment()
+ *
+ * Decode the piece of the stream from one index entry to the next,
+ * straight into its place in the output, and check that it ends where
+ * the index says the next piece starts. Run by runTasks(), so pieces
+ * may be decoded at the same time.
+ *
+ * Parameters:
+ * context - the SegmentTasks
+ * entryNumber - number of the entry the piece starts at
+ */
+static void decodeOneSegment(void* context, size_t entryNumber) {
+  SegmentTasks* tasks = context;
+  const SidecarIndex* index = tasks->index;
+  const SidecarEntry* entry = &index->entries[entryNumber];
+  unsigned long end = (entryNumber + 1 < index->entryCount) ?
+    entry[1].outputOffset : index->streamSize;
+  unsigned char* address = tasks->address + entry->outputOffset;
+  StreamDecoder decoder;
+  SidecarEntry reached;
+  unsigned long offset;
+  StageTimer timer;
+
+  setStatisticsBlock(entryNumber);
+  startStage(&timer, "indexed-decode", end - entry->outputOffset);
+  startDecoder(tasks->source, entry, &decoder);
+  for (offset = entry->outputOffset; offset < end; offset++) {
+    *address++ = decodeStreamByte(&decoder);
+  }
+
+  recordDecoder(&decoder, end, &reached);
+  if ((entryNumber + 1 < index->entryCount) ?
+      ((reached.sourceBit != entry[1].sourceBit) ||
+       (reached.rleOffset != entry[1].rleOffset) ||
+       (reached.runRemaining != entry[1].runRemaining)) :
+      hasMoreStream(&decoder)) {
+    error(False, "Damaged input file - data at %lu doesn't match the index",
+          entry->outputOffset);
+  }
+  freeBlock(decoder.view);
+  finishStage(&timer, end - entry->outputOffset);
+  setStatisticsBlock(-1);
+}
+
+/* decompressWithSidecar()
+ *
+ * Decompress the whole of a single stream file, decoding the pieces
+ * between index entries on as many threads as setThreadCount() gave,
+ * then unflipping it and checking its checksum if it has them.
+ *
+ * Parameters:
+ * inputBlock - compressed data. It is not freed.
+ * index - its index
+ *
+ * Return value:
+ * Decompressed data
+ */
+BlockDescriptor* decompressWithSidecar(BlockDescriptor* inputBlock,
+                                       const SidecarIndex* index) {
+  StreamSource* source = openIndexedStream(inputBlock, index);
+  BlockDescriptor* outputBlock = makeMemoryBlock(index->streamSize ?
+                                                 index->streamSize : 1);
+  BlockDescriptor* unflippedBlock = NULL;
+  Boolean statistics = enableStatistics(False);
+  SegmentTasks tasks;
+  StageTimer timer;
+
+  tasks.source = source;
+  tasks.index = index;
+  tasks.address = outputBlock->address;
+  runTasks(index->entryCount, decodeOneSegment, &tasks);
+  outputBlock->usedSize = index->streamSize;
+  outputBlock->nextFreeByte = index->streamSize;
+  outputBlock->encoding = inputBlock->encoding &
+    ~(ENCODING_HUFFMAN | ENCODING_RUN_LENGTH | ENCODING_CHECKSUM);
+
+  if (isFlipped(outputBlock)) {
+    startStage(&timer, "unflip", outputBlock->usedSize);
+    unflippedBlock = unflipBitOrder(outputBlock);
+    finishStage(&timer, unflippedBlock->usedSize);
+    freeBlock(outputBlock);
+    outputBlock = unflippedBlock;
+  }
+
+  if (source->hasChecksum) {
+    startStage(&timer, "verify-checksum", outputBlock->usedSize);
+    if (crc32c(0, outputBlock->address, outputBlock->usedSize) !=
+        source->checksum) {
+      error(False, "Damaged input file - checksum doesn't match the data");
+    }
+    finishStage(&timer, outputBlock->usedSize);
+  }
+
+  free(source);
+  enableStatistics(statistics);
+  displayStatistics("Indexed decompressing", inputBlock, outputBlock);
+  return outputBlock;
+}
+
+/* decompressRangeWithSidecar()
+ *
+ * Decompress a range of a single stream file, decoding from the index
+ * entry before it. The checksum covers the whole file, so it can't be
+ * checked.
+ *
+ * Parameters:
+ * inputBlock - compressed data. It is not freed.
+ * index - its index
+ * offset - offset of the start of the range in the original data
+ * length - length of the range. It is cut short at the end of the data.
+ *
+ * Return value:
+ * Block holding the range
+ */
+BlockDescriptor* decompressRangeWithSidecar(BlockDescriptor* inputBlock,
+                                            const SidecarIndex* index,
+                                            unsigned long offset,
+                                            unsigned long length) {
+  StreamSource* source = openIndexedStream(inputBlock, index);
+  BlockDescriptor* outputBlock = NULL;
+  unsigned char* plane = NULL;
+  unsigned long size = index->streamSize;
+  unsigned long position;
+  unsigned bitNumber;
+
+  if (offset > size) {
+    error(False, "Range starts after the end of the %lu byte file", size);
+  }
+  if (length > size - offset) {
+    length = size - offset;
+  }
+  outputBlock = makeMemoryBlock(length ? length : 1);
+  outputBlock->usedSize = length;
+  outputBlock->nextFreeByte = length;
+
+  if (!(inputBlock->encoding & ENCODING_FLIPPED)) {
+    decodeStreamRange(source, index, offset, length, outputBlock->address);
+  }
+  else if (length) {
+    /* Bit bitNumber of the original bytes is bit plane 7 - bitNumber of
+     * the stream, which starts at bit (7 - bitNumber) * size
+     */
+    plane = malloc(length / 8 + 2);
+    if (plane == NULL) {
+      error(True, "malloc failed for bit plane");
+    }
+    for (bitNumber = 0; bitNumber < 8; bitNumber++) {
+      unsigned long firstBit = (7 - bitNumber) * size + offset;
+      unsigned long firstByte = firstBit / 8;
+      unsigned long lastByte = (firstBit + length - 1) / 8;
+
+      decodeStreamRange(source, index, firstByte, lastByte - firstByte + 1,
+                        plane);
+      for (position = 0; position < length; position++) {
+        unsigned long bit = firstBit % 8 + position;
+        setBit(bitNumber, outputBlock->address + position,
+               getBit(bit % 8, plane[bit / 8]));
+      }
+    }
+    free(plane);
+  }
+
+  free(source);
+  return outputBlock;
+}
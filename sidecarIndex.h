@@ -0,0 +1,60 @@
+#ifndef SIDECAR_INDEX_H
+#define SIDECAR_INDEX_H
+
+/* Declarations for the seek indexes kept beside single stream
+ * compressed files, in sidecarIndex.c
+ */
+
+#include "compression.h"
+
+/* Added to the name of a compressed file to name its index */
+#define SIDECAR_SUFFIX ".jlindex"
+
+/* Output bytes between index entries if no other interval is given */
+#define SIDECAR_INTERVAL (1024 * 1024)
+
+/* Everything needed to start decoding part way through the stream */
+typedef struct {
+  /* Offset of the next byte in the run length decoded stream, which is
+   * still flipped if the file is
+   */
+  unsigned long outputOffset;
+  /* Offset in bits of the next Huffman code, or of the next byte if
+   * the file isn't Huffman compressed, from the start of the data
+   */
+  unsigned long sourceBit;
+  /* Number of run length encoded bytes read so far */
+  unsigned long rleOffset;
+  /* A run which has only partly been output, if runRemaining isn't 0 */
+  unsigned char runByte;
+  unsigned runRemaining;
+} SidecarEntry;
+
+typedef struct {
+  unsigned char encoding;
+  unsigned long interval;
+  /* Size of the run length decoded stream, which is the size of the
+   * original data
+   */
+  unsigned long streamSize;
+  /* Size of the run length encoded stream */
+  unsigned long rleSize;
+  size_t entryCount;
+  SidecarEntry* entries;
+} SidecarIndex;
+
+char* makeSidecarFilename(const char* filename);
+void makeSidecarIndexes(char** names, size_t nameCount,
+                        unsigned long interval);
+SidecarIndex* loadSidecarIndex(const char* filename,
+                               const BlockDescriptor* inputBlock);
+void freeSidecarIndex(SidecarIndex* index);
+
+BlockDescriptor* decompressWithSidecar(BlockDescriptor* inputBlock,
+                                       const SidecarIndex* index);
+BlockDescriptor* decompressRangeWithSidecar(BlockDescriptor* inputBlock,
+                                            const SidecarIndex* index,
+                                            unsigned long offset,
+                                            unsigned long length);
+
+#endif
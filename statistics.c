@@ -0,0 +1,404 @@
+/* statistics.c
+ *
+ * The machine readable statistics report, for --stats=json. While the
+ * report is open each stage of compression or decompression, each block
+ * of a blocked file and each whole file is recorded with its wall and
+ * CPU time, bytes in and out, the reallocs and copies made by the data
+ * block code, the buffers it got from the buffer pool and those it had
+ * to map, page faults and the peak resident set size so far, and
+ * with the hardware performance counters if they were asked for. The
+ * records are written as one JSON document when the program finishes.
+ *
+ * The times and page faults are for the thread which ran the stage, so
+ * stages run on worker threads are measured properly. The realloc and
+ * copy counters are per thread too, so they need no locking; only
+ * adding a record takes the lock. When the report isn't open the only
+ * cost is incrementing those counters.
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdio.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+#include "bufferPool.h"
+#include "compression.h"
+#include "probes.h"
+#include "statistics.h"
+#include "trace.h"
+
+#define STATISTICS_REPORT_VERSION (1)
+
+/* Use the counts for the calling thread where the system has them */
+#ifdef RUSAGE_THREAD
+#define STAGE_RUSAGE RUSAGE_THREAD
+#else
+#define STAGE_RUSAGE RUSAGE_SELF
+#endif
+
+/* What one stage, block or file used */
+typedef struct {
+  const char* stage;
+  long block;
+  size_t bytesIn;
+  size_t bytesOut;
+  double wallSeconds;
+  double cpuSeconds;
+  unsigned long reallocs;
+  unsigned long copies;
+  unsigned long bytesCopied;
+  unsigned long poolHits;
+  unsigned long poolMisses;
+  long minorFaults;
+  long majorFaults;
+  long peakRssKilobytes;
+  unsigned long long counters[PERF_COUNTER_COUNT];
+} StageRecord;
+
+/* File descriptor the report is written to, or -1 if there isn't one */
+static int reportFileDescriptor = -1;
+static double reportStartSeconds = 0;
+
+static StageRecord* records = NULL;
+static size_t recordCount = 0;
+static size_t recordsAllocated = 0;
+static pthread_mutex_t recordMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Counters for the calling thread */
+static __thread unsigned long threadReallocs = 0;
+static __thread unsigned long threadCopies = 0;
+static __thread unsigned long threadBytesCopied = 0;
+static __thread unsigned long threadPoolHits = 0;
+static __thread unsigned long threadPoolMisses = 0;
+static __thread long threadBlock = -1;
+
+/* readClock()
+ *
+ * Parameters:
+ * clock - clock to read
+ *
+ * Return value:
+ * Clock reading in seconds
+ */
+static double readClock(clockid_t clock) {
+  struct timespec now;
+  clock_gettime(clock, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* openStatisticsReport()
+ *
+ * Start recording statistics, to be written as JSON to a file
+ * descriptor when writeStatisticsReport() is called.
+ *
+ * Parameters:
+ * fileDescriptor - where to write the report
+ */
+void openStatisticsReport(int fileDescriptor) {
+  if (fileDescriptor < 0) {
+    error(False, "Statistics file descriptor must not be negative");
+  }
+  reportFileDescriptor = fileDescriptor;
+  reportStartSeconds = readClock(CLOCK_MONOTONIC);
+}
+
+/* isStatisticsReportOpen()
+ *
+ * Return value:
+ * True if statistics are being recorded
+ */
+Boolean isStatisticsReportOpen(void) {
+  return (reportFileDescriptor >= 0) ? True : False;
+}
+
+/* startStage()
+ *
+ * Take the readings at the start of a stage. Only the trace clock is
+ * read if the report isn't open.
+ *
+ * Parameters:
+ * timer - filled in with the readings
+ * stage - name of the stage, which must be a string constant
+ * bytesIn - size of the stage's input
+ */
+void startStage(StageTimer* timer, const char* stage, size_t bytesIn) {
+  struct rusage usage;
+
+  PROBE2(stage__start, stage, bytesIn);
+  timer->stage = stage;
+  timer->bytesIn = bytesIn;
+  timer->traceStart = traceClock();
+  timer->running = isStatisticsReportOpen();
+  if (!timer->running) {
+    return;
+  }
+  getrusage(STAGE_RUSAGE, &usage);
+  timer->wallSeconds = readClock(CLOCK_MONOTONIC);
+  timer->cpuSeconds = readClock(CLOCK_THREAD_CPUTIME_ID);
+  timer->reallocs = threadReallocs;
+  timer->copies = threadCopies;
+  timer->bytesCopied = threadBytesCopied;
+  timer->poolHits = threadPoolHits;
+  timer->poolMisses = threadPoolMisses;
+  timer->minorFaults = usage.ru_minflt;
+  timer->majorFaults = usage.ru_majflt;
+  if (arePerfCountersEnabled()) {
+    readPerfCounters(timer->counters);
+  }
+}
+
+/* finishStage()
+ *
+ * Record what a stage used since startStage() was called on the same
+ * thread, and add it to the trace.
+ *
+ * Parameters:
+ * timer - readings from startStage()
+ * bytesOut - size of the stage's output
+ */
+void finishStage(const StageTimer* timer, size_t bytesOut) {
+  struct rusage threadUsage;
+  struct rusage processUsage;
+  StageRecord record;
+  unsigned counter;
+
+  PROBE3(stage__done, timer->stage, timer->bytesIn, bytesOut);
+  traceEvent(timer->stage, "stage", timer->traceStart);
+  if (!timer->running) {
+    return;
+  }
+  if (arePerfCountersEnabled()) {
+    readPerfCounters(record.counters);
+    for (counter = 0; counter < PERF_COUNTER_COUNT; counter++) {
+      if ((record.counters[counter] == COUNTER_UNAVAILABLE) ||
+          (timer->counters[counter] == COUNTER_UNAVAILABLE)) {
+        record.counters[counter] = COUNTER_UNAVAILABLE;
+      }
+      else {
+        record.counters[counter] -= timer->counters[counter];
+      }
+    }
+  }
+  getrusage(STAGE_RUSAGE, &threadUsage);
+  getrusage(RUSAGE_SELF, &processUsage);
+  record.stage = timer->stage;
+  record.block = threadBlock;
+  record.bytesIn = timer->bytesIn;
+  record.bytesOut = bytesOut;
+  record.wallSeconds = readClock(CLOCK_MONOTONIC) - timer->wallSeconds;
+  record.cpuSeconds = readClock(CLOCK_THREAD_CPUTIME_ID) - timer->cpuSeconds;
+  record.reallocs = threadReallocs - timer->reallocs;
+  record.copies = threadCopies - timer->copies;
+  record.bytesCopied = threadBytesCopied - timer->bytesCopied;
+  record.poolHits = threadPoolHits - timer->poolHits;
+  record.poolMisses = threadPoolMisses - timer->poolMisses;
+  record.minorFaults = threadUsage.ru_minflt - timer->minorFaults;
+  record.majorFaults = threadUsage.ru_majflt - timer->majorFaults;
+  record.peakRssKilobytes = processUsage.ru_maxrss;
+
+  pthread_mutex_lock(&recordMutex);
+  if (recordCount == recordsAllocated) {
+    recordsAllocated = recordsAllocated ? recordsAllocated * 2 : 64;
+    records = realloc(records, recordsAllocated * sizeof(StageRecord));
+    if (records == NULL) {
+      error(True, "realloc failed for %lu statistics records",
+            (unsigned long)recordsAllocated);
+    }
+  }
+  records[recordCount++] = record;
+  pthread_mutex_unlock(&recordMutex);
+}
+
+/* setStatisticsBlock()
+ *
+ * Set the number of the block of a blocked file the calling thread is
+ * working on, which is recorded with each stage it finishes.
+ *
+ * Parameters:
+ * blockNumber - block number, or -1 when not working on a block
+ */
+void setStatisticsBlock(long blockNumber) {
+  threadBlock = blockNumber;
+}
+
+/* countRealloc()
+ *
+ * Count a block being reallocated to make it bigger.
+ */
+void countRealloc(void) {
+  threadReallocs++;
+}
+
+/* countCopy()
+ *
+ * Count data being copied from one block to another.
+ *
+ * Parameters:
+ * bytes - number of bytes copied
+ */
+void countCopy(size_t bytes) {
+  threadCopies++;
+  threadBytesCopied += bytes;
+}
+
+/* countPoolAllocation()
+ *
+ * Count a large buffer being allocated.
+ *
+ * Parameters:
+ * hit - True if the buffer pool had one free
+ */
+void countPoolAllocation(Boolean hit) {
+  if (hit) {
+    threadPoolHits++;
+  }
+  else {
+    threadPoolMisses++;
+  }
+}
+
+/* writeRatio()
+ *
+ * Write a ratio of two counts to the report, or null if it can't be
+ * worked out.
+ *
+ * Parameters:
+ * file - the report
+ * name - name of the field
+ * numerator, denominator - the counts, either of which may be
+ *                          COUNTER_UNAVAILABLE
+ */
+static void writeRatio(FILE* file,
+                       const char* name,
+                       unsigned long long numerator,
+                       unsigned long long denominator) {
+  if ((numerator == COUNTER_UNAVAILABLE) ||
+      (denominator == COUNTER_UNAVAILABLE) || (denominator == 0)) {
+    fprintf(file, ",\"%s\":null", name);
+  }
+  else {
+    fprintf(file, ",\"%s\":%.4f", name, (double)numerator / denominator);
+  }
+}
+
+/* writeCounters()
+ *
+ * Write the hardware performance counters of a record, with the
+ * instructions per cycle and the cycles and misses per byte of input.
+ * Counters which aren't available are null.
+ *
+ * Parameters:
+ * file - the report
+ * record - record to write the counters of
+ */
+static void writeCounters(FILE* file, const StageRecord* record) {
+  char name[32];
+  unsigned counter;
+
+  fprintf(file, ",\"counters\":{");
+  for (counter = 0; counter < PERF_COUNTER_COUNT; counter++) {
+    fprintf(file, "%s\"%s\":", counter ? "," : "",
+            getPerfCounterName(counter));
+    if (record->counters[counter] == COUNTER_UNAVAILABLE) {
+      fprintf(file, "null");
+    }
+    else {
+      fprintf(file, "%llu", record->counters[counter]);
+    }
+  }
+  writeRatio(file, "ipc", record->counters[COUNTER_INSTRUCTIONS],
+             record->counters[COUNTER_CYCLES]);
+  for (counter = 0; counter < PERF_COUNTER_COUNT; counter++) {
+    if (counter != COUNTER_INSTRUCTIONS) {
+      snprintf(name, sizeof(name), "%s_per_byte",
+               getPerfCounterName(counter));
+      writeRatio(file, name, record->counters[counter], record->bytesIn);
+    }
+  }
+  fprintf(file, "}");
+}
+
+/* writeStatisticsReport()
+ *
+ * Write the records and the totals for the whole run as JSON, if the
+ * report is open.
+ *
+ * Parameters:
+ * programName - name of the program, for the report
+ */
+void writeStatisticsReport(const char* programName) {
+  struct rusage usage;
+  BufferPoolCounts poolCounts;
+  FILE* file = NULL;
+  size_t index;
+
+  if (!isStatisticsReportOpen()) {
+    return;
+  }
+  if (reportFileDescriptor == STDOUT_FILENO) {
+    file = stdout;
+  }
+  else if (reportFileDescriptor == STDERR_FILENO) {
+    file = stderr;
+  }
+  else {
+    file = fdopen(reportFileDescriptor, "w");
+    if (file == NULL) {
+      error(True, "Unable to write statistics to file descriptor %d",
+            reportFileDescriptor);
+    }
+  }
+
+  fprintf(file, "{\"program\":\"%s\",\"version\":%d,\"stages\":[\n",
+          programName, STATISTICS_REPORT_VERSION);
+  for (index = 0; index < recordCount; index++) {
+    const StageRecord* record = &records[index];
+    fprintf(file, "{\"stage\":\"%s\",", record->stage);
+    if (record->block >= 0) {
+      fprintf(file, "\"block\":%ld,", record->block);
+    }
+    fprintf(file, "\"bytes_in\":%lu,\"bytes_out\":%lu,"
+            "\"wall_seconds\":%.6f,\"cpu_seconds\":%.6f,"
+            "\"reallocs\":%lu,\"copies\":%lu,\"bytes_copied\":%lu,"
+            "\"pool_hits\":%lu,\"pool_misses\":%lu,"
+            "\"minor_faults\":%ld,\"major_faults\":%ld,"
+            "\"peak_rss_kb\":%ld",
+            (unsigned long)record->bytesIn, (unsigned long)record->bytesOut,
+            record->wallSeconds, record->cpuSeconds,
+            record->reallocs, record->copies, record->bytesCopied,
+            record->poolHits, record->poolMisses,
+            record->minorFaults, record->majorFaults,
+            record->peakRssKilobytes);
+    if (arePerfCountersEnabled()) {
+      writeCounters(file, record);
+    }
+    fprintf(file, "}%s\n", (index + 1 < recordCount) ? "," : "");
+  }
+
+  getrusage(RUSAGE_SELF, &usage);
+  getBufferPoolCounts(&poolCounts);
+  fprintf(file, "],\"total\":{\"wall_seconds\":%.6f,\"cpu_seconds\":%.6f,"
+          "\"minor_faults\":%ld,\"major_faults\":%ld,\"peak_rss_kb\":%ld,",
+          readClock(CLOCK_MONOTONIC) - reportStartSeconds,
+          readClock(CLOCK_PROCESS_CPUTIME_ID),
+          usage.ru_minflt, usage.ru_majflt, usage.ru_maxrss);
+  fprintf(file, "\"buffer_pool\":{\"hits\":%lu,\"misses\":%lu",
+          poolCounts.hits, poolCounts.misses);
+  writeRatio(file, "hit_rate", poolCounts.hits,
+             poolCounts.hits + poolCounts.misses);
+  fprintf(file, ",\"huge_tlb_buffers\":%lu,"
+          "\"transparent_huge_page_buffers\":%lu,"
+          "\"released_buffers\":%lu,\"cached_bytes\":%lu}}}\n",
+          poolCounts.hugeTlbBuffers, poolCounts.transparentHugeBuffers,
+          poolCounts.releasedBuffers, (unsigned long)poolCounts.cachedBytes);
+
+  if (fflush(file) == EOF) {
+    error(True, "Unable to write statistics");
+  }
+  free(records);
+  records = NULL;
+  recordCount = 0;
+  recordsAllocated = 0;
+  reportFileDescriptor = -1;
+}
@@ -0,0 +1,44 @@
+#ifndef STATISTICS_H
+#define STATISTICS_H
+
+/* Declarations for the machine readable statistics report, in
+ * statistics.c
+ */
+
+#include <stdlib.h>
+#include "boolean.h"
+#include "perfCounters.h"
+
+/* Readings taken when a stage starts, so that finishStage() can record
+ * what the stage used
+ */
+typedef struct {
+  const char* stage;
+  size_t bytesIn;
+  double traceStart;
+  Boolean running;
+  double wallSeconds;
+  double cpuSeconds;
+  unsigned long reallocs;
+  unsigned long copies;
+  unsigned long bytesCopied;
+  unsigned long poolHits;
+  unsigned long poolMisses;
+  long minorFaults;
+  long majorFaults;
+  unsigned long long counters[PERF_COUNTER_COUNT];
+} StageTimer;
+
+void openStatisticsReport(int fileDescriptor);
+Boolean isStatisticsReportOpen(void);
+void writeStatisticsReport(const char* programName);
+
+void startStage(StageTimer* timer, const char* stage, size_t bytesIn);
+void finishStage(const StageTimer* timer, size_t bytesOut);
+void setStatisticsBlock(long blockNumber);
+
+void countRealloc(void);
+void countCopy(size_t bytes);
+void countPoolAllocation(Boolean hit);
+
+#endif
@@ -0,0 +1,157 @@
+/* threadPool.c
+ *
+ * Runs a number of independent tasks, such as compressing the blocks of
+ * a blocked file, on several threads. Each thread takes the next task
+ * not yet started until there are none left, so threads which get
+ * quick tasks take more of them. The number of threads is set once
+ * from the command line.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include "compression.h"
+#include "threadPool.h"
+#include "trace.h"
+
+#define MAXIMUM_THREADS (256)
+
+/* Number of threads to run tasks on, including the calling thread */
+static unsigned configuredThreadCount = 1;
+
+/* True while the calling thread is running a task, so that work which
+ * could itself be split between threads isn't split again
+ */
+static __thread Boolean runningTask = False;
+
+/* State shared by the threads running one set of tasks */
+typedef struct {
+  pthread_mutex_t mutex;
+  size_t nextTask;
+  size_t taskCount;
+  TaskFunction function;
+  void* context;
+} TaskQueue;
+
+/* setThreadCount()
+ *
+ * Set the number of threads tasks are run on.
+ *
+ * Parameters:
+ * threadCount - number of threads, from 1 to 256
+ */
+void setThreadCount(unsigned threadCount) {
+  if ((threadCount == 0) || (threadCount > MAXIMUM_THREADS)) {
+    error(False, "Number of threads must be between 1 and %u",
+          MAXIMUM_THREADS);
+  }
+  configuredThreadCount = threadCount;
+}
+
+/* getThreadCount()
+ *
+ * Return the number of threads tasks are run on.
+ */
+unsigned getThreadCount(void) {
+  return configuredThreadCount;
+}
+
+/* isRunningTask()
+ *
+ * Return value:
+ * True if the calling thread is running one of the tasks given to
+ * runTasks()
+ */
+Boolean isRunningTask(void) {
+  return runningTask;
+}
+
+/* runQueuedTasks()
+ *
+ * Run tasks from the queue until there are none left.
+ *
+ * Parameters:
+ * argument - the TaskQueue
+ */
+static void* runQueuedTasks(void* argument) {
+  TaskQueue* queue = argument;
+  for (;;) {
+    size_t taskIndex;
+    double start;
+    Boolean previous;
+    pthread_mutex_lock(&queue->mutex);
+    taskIndex = queue->nextTask;
+    if (taskIndex < queue->taskCount) {
+      queue->nextTask++;
+    }
+    pthread_mutex_unlock(&queue->mutex);
+
+    if (taskIndex >= queue->taskCount) {
+      return NULL;
+    }
+    start = traceClock();
+    previous = runningTask;
+    runningTask = True;
+    queue->function(queue->context, taskIndex);
+    runningTask = previous;
+    traceEvent("task", "worker", start);
+  }
+}
+
+/* runWorker()
+ *
+ * Body of each extra thread, which runs tasks until there are none
+ * left.
+ *
+ * Parameters:
+ * argument - the TaskQueue
+ */
+static void* runWorker(void* argument) {
+  double start = traceClock();
+  traceThreadName("worker");
+  runQueuedTasks(argument);
+  traceEvent("worker", "worker", start);
+  return NULL;
+}
+
+/* runTasks()
+ *
+ * Run tasks 0 to taskCount - 1 and wait for them all to finish. With
+ * one thread, or one task, they are run in order on the calling thread.
+ *
+ * Parameters:
+ * taskCount - number of tasks
+ * function - runs one task. Tasks may run at the same time, so it must
+ *            only change data belonging to its own task.
+ * context - passed to function
+ */
+void runTasks(size_t taskCount, TaskFunction function, void* context) {
+  pthread_t threads[MAXIMUM_THREADS];
+  TaskQueue queue;
+  unsigned extraThreads = configuredThreadCount - 1;
+  unsigned index;
+
+  if (extraThreads >= taskCount) {
+    extraThreads = taskCount ? taskCount - 1 : 0;
+  }
+
+  pthread_mutex_init(&queue.mutex, NULL);
+  queue.nextTask = 0;
+  queue.taskCount = taskCount;
+  queue.function = function;
+  queue.context = context;
+
+  for (index = 0; index < extraThreads; index++) {
+    errno = pthread_create(&threads[index], NULL, runWorker, &queue);
+    if (errno) {
+      error(True, "Unable to create thread");
+    }
+  }
+
+  /* This thread takes tasks as well */
+  runQueuedTasks(&queue);
+
+  for (index = 0; index < extraThreads; index++) {
+    pthread_join(threads[index], NULL);
+  }
+  pthread_mutex_destroy(&queue.mutex);
+}
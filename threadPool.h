@@ -0,0 +1,20 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+/* Declarations for running independent tasks on several threads, in
+ * threadPool.c
+ */
+
+#include <stdlib.h>
+#include "boolean.h"
+
+/* Runs task number taskIndex. context is passed through from runTasks() */
+typedef void (*TaskFunction)(void* context, size_t taskIndex);
+
+void setThreadCount(unsigned threadCount);
+unsigned getThreadCount(void);
+Boolean isRunningTask(void);
+
+void runTasks(size_t taskCount, TaskFunction function, void* context);
+
+#endif
@@ -0,0 +1,214 @@
+/* trace.c
+ *
+ * The timeline trace written by --trace, for seeing where the time goes
+ * when files are compressed in several stages on several threads: which
+ * stage or block each thread was running, when worker threads were
+ * idle, and how long was spent waiting for I/O. It is written in the
+ * Chrome trace event format, which chrome://tracing and Perfetto load.
+ *
+ * Each event is a span with a start and a duration, recorded when it
+ * ends, so an event is only ever written by one call. Each thread
+ * records into its own buffer, which it alone writes to, so recording
+ * takes no lock. A thread's buffer is put on the list of buffers with
+ * an atomic compare and swap the first time it records anything, and
+ * the buffers are kept after the thread exits until the trace is
+ * written, which happens when there are no other threads left. When
+ * tracing is off traceClock() returns -1 without reading the clock and
+ * traceEvent() returns at once, so the cost is a call and a test.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "compression.h"
+#include "trace.h"
+
+/* One span of time on one thread */
+typedef struct {
+  const char* name;
+  const char* category;
+  double start;
+  double duration;
+} TraceEvent;
+
+/* The events recorded by one thread */
+typedef struct TraceBufferStruct {
+  TraceEvent* events;
+  size_t eventCount;
+  size_t eventsAllocated;
+  unsigned threadId;
+  const char* threadName;
+  struct TraceBufferStruct* next;
+} TraceBuffer;
+
+/* File the trace is written to, or NULL if not tracing */
+static const char* traceFilename = NULL;
+static double traceStartSeconds = 0;
+
+/* Every thread's buffer, newest first */
+static TraceBuffer* traceBuffers = NULL;
+static unsigned nextThreadId = 1;
+
+static __thread TraceBuffer* threadBuffer = NULL;
+
+/* readMonotonicClock()
+ *
+ * Return value:
+ * Monotonic clock reading in seconds
+ */
+static double readMonotonicClock(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* openTrace()
+ *
+ * Start tracing. Nothing is written until writeTrace() is called.
+ *
+ * Parameters:
+ * filename - file to write the trace to
+ */
+void openTrace(const char* filename) {
+  traceStartSeconds = readMonotonicClock();
+  traceFilename = filename;
+}
+
+/* traceClock()
+ *
+ * Read the clock at the start of a span.
+ *
+ * Return value:
+ * Microseconds since tracing started, or -1 if not tracing
+ */
+double traceClock(void) {
+  if (traceFilename == NULL) {
+    return -1;
+  }
+  return (readMonotonicClock() - traceStartSeconds) * 1e6;
+}
+
+/* getThreadBuffer()
+ *
+ * Return value:
+ * The calling thread's buffer, made and put on the list the first time
+ */
+static TraceBuffer* getThreadBuffer(void) {
+  if (threadBuffer == NULL) {
+    threadBuffer = calloc(1, sizeof(TraceBuffer));
+    if (threadBuffer == NULL) {
+      error(True, "malloc failed for trace buffer");
+    }
+    threadBuffer->threadId = __atomic_fetch_add(&nextThreadId, 1,
+                                                __ATOMIC_RELAXED);
+    threadBuffer->next = __atomic_load_n(&traceBuffers, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&traceBuffers, &threadBuffer->next,
+                                        threadBuffer, True,
+                                        __ATOMIC_RELEASE,
+                                        __ATOMIC_RELAXED)) {
+      /* threadBuffer->next now holds the new head; try again */
+    }
+  }
+  return threadBuffer;
+}
+
+/* traceEvent()
+ *
+ * Record a span which started at start and ends now, on the calling
+ * thread.
+ *
+ * Parameters:
+ * name - what was being done, which must be a string constant
+ * category - kind of span, e.g. "stage" or "io", also a constant
+ * start - value returned by traceClock() at the start of the span
+ */
+void traceEvent(const char* name, const char* category, double start) {
+  TraceBuffer* buffer = NULL;
+  TraceEvent* event = NULL;
+
+  if ((traceFilename == NULL) || (start < 0)) {
+    return;
+  }
+  buffer = getThreadBuffer();
+  if (buffer->eventCount == buffer->eventsAllocated) {
+    buffer->eventsAllocated = buffer->eventsAllocated ?
+      buffer->eventsAllocated * 2 : 256;
+    buffer->events = realloc(buffer->events,
+                             buffer->eventsAllocated * sizeof(TraceEvent));
+    if (buffer->events == NULL) {
+      error(True, "realloc failed for %lu trace events",
+            (unsigned long)buffer->eventsAllocated);
+    }
+  }
+  event = &buffer->events[buffer->eventCount++];
+  event->name = name;
+  event->category = category;
+  event->start = start;
+  event->duration = traceClock() - start;
+}
+
+/* traceThreadName()
+ *
+ * Name the calling thread in the trace.
+ *
+ * Parameters:
+ * name - name of the thread, which must be a string constant
+ */
+void traceThreadName(const char* name) {
+  if (traceFilename != NULL) {
+    getThreadBuffer()->threadName = name;
+  }
+}
+
+/* writeTrace()
+ *
+ * Write the trace, if tracing, and free the buffers. Must only be
+ * called when no other threads are recording.
+ */
+void writeTrace(void) {
+  FILE* file = NULL;
+  TraceBuffer* buffer = NULL;
+  long processId = getpid();
+  const char* separator = "";
+
+  if (traceFilename == NULL) {
+    return;
+  }
+  file = fopen(traceFilename, "w");
+  if (file == NULL) {
+    error(True, "Unable to create trace file %s", traceFilename);
+  }
+
+  fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+  buffer = __atomic_load_n(&traceBuffers, __ATOMIC_ACQUIRE);
+  while (buffer != NULL) {
+    TraceBuffer* next = buffer->next;
+    size_t index;
+
+    fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%ld,"
+            "\"tid\":%u,\"args\":{\"name\":\"%s %u\"}}",
+            separator, processId, buffer->threadId,
+            buffer->threadName ? buffer->threadName : "thread",
+            buffer->threadId);
+    separator = ",\n";
+    for (index = 0; index < buffer->eventCount; index++) {
+      const TraceEvent* event = &buffer->events[index];
+      fprintf(file, "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\","
+              "\"ts\":%.3f,\"dur\":%.3f,\"pid\":%ld,\"tid\":%u}",
+              separator, event->name, event->category,
+              event->start, event->duration, processId, buffer->threadId);
+    }
+    free(buffer->events);
+    free(buffer);
+    buffer = next;
+  }
+  fprintf(file, "\n]}\n");
+
+  if (fclose(file) == EOF) {
+    error(True, "Unable to write trace file %s", traceFilename);
+  }
+  traceBuffers = NULL;
+  threadBuffer = NULL;
+  traceFilename = NULL;
+}
@@ -0,0 +1,15 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+/* Declarations for the timeline trace written by --trace, in trace.c */
+
+#include "boolean.h"
+
+void openTrace(const char* filename);
+void writeTrace(void);
+
+double traceClock(void);
+void traceEvent(const char* name, const char* category, double start);
+void traceThreadName(const char* name);
+
+#endif